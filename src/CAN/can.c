@@ -19,118 +19,398 @@
 #include <libopencm3/stm32/can.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
 
 #include <string.h>
 
 #include "config.h"
 #include "can.h"
+#include "ring.h"
 
 #if CAN_RX_AVAILABLE
 
-#define IS_POW_OF_TWO(X) (((X) & ((X)-1)) == 0)
-_Static_assert(IS_POW_OF_TWO(CAN_RX_BUFFER_SIZE),
-               "Unmasked circular buffer size must be a power of two");
-_Static_assert(CAN_RX_BUFFER_SIZE <= UINT8_MAX/2,
-               "Buffer size too big for unmasked circular buffer");
+_Static_assert(RING_CAPACITY_VALID(CAN_RX_BUFFER_SIZE),
+               "CAN RX buffer size must be a power of two <= UINT16_MAX/2");
 
-static volatile CAN_Message can_rx_buffer[CAN_RX_BUFFER_SIZE];
-static volatile uint8_t can_rx_head = 0;
-static volatile uint8_t can_rx_tail = 0;
+_Static_assert(RING_CAPACITY_VALID(CAN_TX_BUFFER_SIZE),
+               "CAN TX buffer size must be a power of two <= UINT16_MAX/2");
+
+_Static_assert(RING_CAPACITY_VALID(CAN_TX_PRIORITY_BUFFER_SIZE),
+               "CAN TX priority buffer size must be a power of two <= UINT16_MAX/2");
+
+static CAN_Message can_rx_buffer[CAN_RX_BUFFER_SIZE];
+static struct ring can_rx_ring = RING_INITIALIZER(can_rx_buffer);
+
+/*
+ * Frames waiting for a transmit mailbox. The main loop queues them and
+ * the CAN interrupt moves them into the mailboxes, so each side of the
+ * ring only ever has one user.
+ */
+static CanTxEntry can_tx_buffer[CAN_TX_BUFFER_SIZE];
+static struct ring can_tx_ring = RING_INITIALIZER(can_tx_buffer);
+
+/*
+ * Time-critical frames, such as those of the cyclic scheduler. They go
+ * out ahead of the main queue and are not reported to the completion
+ * callback.
+ */
+static CAN_Message can_tx_priority_buffer[CAN_TX_PRIORITY_BUFFER_SIZE];
+static struct ring can_tx_priority_ring = RING_INITIALIZER(can_tx_priority_buffer);
+
+#define CAN_NUM_TX_MAILBOXES 3
+static uint32_t can_tx_mailbox_tags[CAN_NUM_TX_MAILBOXES];
+static CanTxCompleteCallback can_tx_complete_callback = NULL;
+
+#define CAN_NUM_RX_FIFOS 2
+
+static CanErrorCounts can_error_counts;
+
+void can_get_error_counts(CanErrorCounts* counts) {
+    // Each counter is a single word, so reading them without locking
+    // can't tear
+    *counts = can_error_counts;
+}
 
 bool can_rx_buffer_empty(void) {
-    return can_rx_head == can_rx_tail;
+    return ring_empty(&can_rx_ring);
 }
 
 bool can_rx_buffer_full(void) {
-    return (uint8_t)(can_rx_tail - can_rx_head) == CAN_RX_BUFFER_SIZE;
+    return ring_full(&can_rx_ring);
 }
 
 CAN_Message* can_rx_buffer_peek(void) {
-    if (!can_rx_buffer_empty()) {
-        return (CAN_Message*)(&can_rx_buffer[(can_rx_head % CAN_RX_BUFFER_SIZE)]);
+    void* msg;
+    if (ring_read_span(&can_rx_ring, &msg) > 0) {
+        return (CAN_Message*)msg;
     } else {
         return NULL;
     }
 }
 
 void can_rx_buffer_pop(void) {
-    can_rx_head++;
+    ring_consume(&can_rx_ring, 1);
 
-    // Re-enable the ISR since we made space
-    nvic_enable_irq(CAN_NVIC_LINE);
+    // Re-enable the FIFO interrupts since we made space
+    can_enable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FMPIE1);
 }
 
-static CAN_Message* can_rx_buffer_tail(void) {
-    return (CAN_Message*)&can_rx_buffer[(can_rx_tail % CAN_RX_BUFFER_SIZE)];
+void can_rx_buffer_put(const CAN_Message* msg) {
+    ring_put(&can_rx_ring, msg);
 }
 
-static void can_rx_buffer_extend(void) {
-    can_rx_tail++;
+void can_rx_buffer_get(CAN_Message* msg) {
+    ring_get(&can_rx_ring, msg);
+
+    // Re-enable the FIFO interrupts since we made space
+    can_enable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FMPIE1);
 }
 
-void can_rx_buffer_put(const CAN_Message* msg) {
-    memcpy((void*)&can_rx_buffer[(can_rx_tail % CAN_RX_BUFFER_SIZE)], (const void*)msg, sizeof(CAN_Message));
-    can_rx_tail++;
+/*
+ * Filter entries keep their flags in the top bits of the ID. The mask
+ * has a bit set for every ID bit that must match.
+ */
+#define CAN_FILTER_EXT  (1UL << 31)
+#define CAN_FILTER_LIST (1UL << 30)
+
+typedef struct {
+    uint32_t id;
+    uint32_t mask;
+} CanFilter;
+
+static CanFilter can_filters[CAN_MAX_FILTERS];
+static uint8_t can_num_filters = 0;
+static bool can_software_filtering = false;
+
+void can_filter_clear(void) {
+    can_num_filters = 0;
 }
 
-void can_rx_buffer_get(CAN_Message* msg) {
-    memcpy((void*)msg, (const void*)&can_rx_buffer[(can_rx_head % CAN_RX_BUFFER_SIZE)], sizeof(CAN_Message));
-    can_rx_head++;
+bool can_filter_add_mask(uint32_t id, uint32_t mask, CANFormat format) {
+    if (can_num_filters >= CAN_MAX_FILTERS) {
+        return false;
+    }
 
-    // Re-enable the ISR since we made space
-    nvic_enable_irq(CAN_NVIC_LINE);
+    CanFilter* filter = &can_filters[can_num_filters];
+    if (format == CANExtended) {
+        filter->id = (id & mask & CAN_EXT_ID_MASK) | CAN_FILTER_EXT;
+        filter->mask = mask & CAN_EXT_ID_MASK;
+    } else if (format == CANStandard) {
+        filter->id = id & mask & CAN_STD_ID_MASK;
+        filter->mask = mask & CAN_STD_ID_MASK;
+    } else {
+        return false;
+    }
+
+    can_num_filters++;
+    return true;
+}
+
+/*
+ * Exact IDs go into the list mode banks, which also compare the RTR
+ * bit, so they only match data frames. Add a mask filter with all ID
+ * bits set to accept remote frames as well.
+ */
+bool can_filter_add_id(uint32_t id, CANFormat format) {
+    uint32_t mask = (format == CANExtended) ? CAN_EXT_ID_MASK : CAN_STD_ID_MASK;
+    if (!can_filter_add_mask(id, mask, format)) {
+        return false;
+    }
+
+    can_filters[can_num_filters-1].id |= CAN_FILTER_LIST;
+    return true;
+}
+
+bool can_filter_in_hardware(void) {
+    return !can_software_filtering;
+}
+
+static bool can_filter_is_ext(const CanFilter* filter) {
+    return (filter->id & CAN_FILTER_EXT) != 0;
+}
+
+static bool can_filter_is_list(const CanFilter* filter) {
+    return (filter->id & CAN_FILTER_LIST) != 0;
+}
+
+static bool can_filter_accept(const CAN_Message* msg) {
+    if (!can_software_filtering) {
+        return true;
+    }
+
+    bool ext = (msg->format == CANExtended);
+    uint8_t i;
+    for (i=0; i < can_num_filters; i++) {
+        const CanFilter* filter = &can_filters[i];
+        if (can_filter_is_ext(filter) != ext) {
+            continue;
+        }
+        if (can_filter_is_list(filter) && msg->type != CANData) {
+            continue;
+        }
+        if ((msg->id & filter->mask) == (filter->id & CAN_EXT_ID_MASK)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Filter register layouts, from the bxCAN section of the reference manual */
+#define CAN_FILTER32_IDE (1UL << 2)
+#define CAN_FILTER16_IDE (1U << 3)
+
+static uint32_t can_filter32_id(const CanFilter* filter) {
+    if (can_filter_is_ext(filter)) {
+        return ((filter->id & CAN_EXT_ID_MASK) << 3) | CAN_FILTER32_IDE;
+    } else {
+        return (filter->id & CAN_STD_ID_MASK) << 21;
+    }
+}
+
+static uint32_t can_filter32_mask(const CanFilter* filter) {
+    if (can_filter_is_ext(filter)) {
+        return (filter->mask << 3) | CAN_FILTER32_IDE;
+    } else {
+        return (filter->mask << 21) | CAN_FILTER32_IDE;
+    }
+}
+
+static uint16_t can_filter16_id(const CanFilter* filter) {
+    return (uint16_t)((filter->id & CAN_STD_ID_MASK) << 5);
+}
+
+static uint16_t can_filter16_mask(const CanFilter* filter) {
+    return (uint16_t)((filter->mask << 5) | CAN_FILTER16_IDE);
+}
+
+/*
+ * Filter classes, in the number of filters that share one bank:
+ * standard IDs in 16-bit list mode (4) or mask mode (2), and extended
+ * IDs in 32-bit list mode (2) or mask mode (1).
+ */
+enum {
+    CAN_FILTER_STD_LIST,
+    CAN_FILTER_STD_MASK,
+    CAN_FILTER_EXT_LIST,
+    CAN_FILTER_EXT_MASK,
+    CAN_FILTER_NUM_CLASSES
+};
+
+static const uint8_t can_filters_per_bank[CAN_FILTER_NUM_CLASSES] = {4, 2, 2, 1};
+
+static uint8_t can_filter_class(const CanFilter* filter) {
+    if (can_filter_is_ext(filter)) {
+        return can_filter_is_list(filter) ? CAN_FILTER_EXT_LIST : CAN_FILTER_EXT_MASK;
+    } else {
+        return can_filter_is_list(filter) ? CAN_FILTER_STD_LIST : CAN_FILTER_STD_MASK;
+    }
+}
+
+/*
+ * Program up to 4 filters of one class into a bank. Unused slots
+ * repeat the first filter so that they can't match anything extra.
+ * Banks alternate between the two receive FIFOs to spread the load.
+ */
+static void can_filter_program_bank(uint8_t bank, uint8_t filter_class,
+                                    const CanFilter* bank_filters[4],
+                                    uint8_t count) {
+    uint32_t fifo = bank & 1;
+    uint8_t i;
+    for (i=count; i < 4; i++) {
+        bank_filters[i] = bank_filters[0];
+    }
+
+    switch (filter_class) {
+        case CAN_FILTER_STD_LIST:
+            can_filter_id_list_16bit_init(bank,
+                                          can_filter16_id(bank_filters[0]),
+                                          can_filter16_id(bank_filters[1]),
+                                          can_filter16_id(bank_filters[2]),
+                                          can_filter16_id(bank_filters[3]),
+                                          fifo, true);
+            break;
+        case CAN_FILTER_STD_MASK:
+            can_filter_id_mask_16bit_init(bank,
+                                          can_filter16_id(bank_filters[0]),
+                                          can_filter16_mask(bank_filters[0]),
+                                          can_filter16_id(bank_filters[1]),
+                                          can_filter16_mask(bank_filters[1]),
+                                          fifo, true);
+            break;
+        case CAN_FILTER_EXT_LIST:
+            can_filter_id_list_32bit_init(bank,
+                                          can_filter32_id(bank_filters[0]),
+                                          can_filter32_id(bank_filters[1]),
+                                          fifo, true);
+            break;
+        case CAN_FILTER_EXT_MASK:
+        default:
+            can_filter_id_mask_32bit_init(bank,
+                                          can_filter32_id(bank_filters[0]),
+                                          can_filter32_mask(bank_filters[0]),
+                                          fifo, true);
+            break;
+    }
+}
+
+/*
+ * Accept everything, split across both FIFOs by the least significant
+ * ID bit so that back-to-back messages alternate between them.
+ */
+static void can_filter_accept_all(void) {
+    uint32_t std_lsb = (1UL << 21);
+    uint32_t ext_lsb = (1UL << 3);
+
+    can_filter_id_mask_32bit_init(0, 0, std_lsb | CAN_FILTER32_IDE, 0, true);
+    can_filter_id_mask_32bit_init(1, std_lsb, std_lsb | CAN_FILTER32_IDE, 1, true);
+    can_filter_id_mask_32bit_init(2, CAN_FILTER32_IDE, ext_lsb | CAN_FILTER32_IDE, 0, true);
+    can_filter_id_mask_32bit_init(3, ext_lsb | CAN_FILTER32_IDE,
+                                  ext_lsb | CAN_FILTER32_IDE, 1, true);
+}
+
+static void can_filter_apply(void) {
+    uint8_t counts[CAN_FILTER_NUM_CLASSES] = {0};
+    uint8_t banks_needed = 0;
+    uint8_t i;
+
+    for (i=0; i < can_num_filters; i++) {
+        counts[can_filter_class(&can_filters[i])]++;
+    }
+
+    uint8_t filter_class;
+    for (filter_class=0; filter_class < CAN_FILTER_NUM_CLASSES; filter_class++) {
+        uint8_t per_bank = can_filters_per_bank[filter_class];
+        banks_needed += (counts[filter_class] + per_bank - 1) / per_bank;
+    }
+
+    if (can_num_filters == 0 || banks_needed > CAN_FILTER_BANKS) {
+        // Accept everything and sort it out in the ISR if needed
+        can_software_filtering = (can_num_filters > 0);
+        can_filter_accept_all();
+        return;
+    }
+
+    can_software_filtering = false;
+
+    uint8_t bank = 0;
+    for (filter_class=0; filter_class < CAN_FILTER_NUM_CLASSES; filter_class++) {
+        const CanFilter* bank_filters[4];
+        uint8_t count = 0;
+        for (i=0; i < can_num_filters; i++) {
+            if (can_filter_class(&can_filters[i]) != filter_class) {
+                continue;
+            }
+            bank_filters[count++] = &can_filters[i];
+            if (count == can_filters_per_bank[filter_class]) {
+                can_filter_program_bank(bank++, filter_class, bank_filters, count);
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            can_filter_program_bank(bank++, filter_class, bank_filters, count);
+        }
+    }
+}
+
+uint32_t can_get_clock(void) {
+    return rcc_apb1_frequency;
 }
 
 bool can_reconfigure(uint32_t baudrate, CanMode mode) {
+    CanBitTiming timing = {0, 0, 0, 0};
+    uint32_t error_ppm = 0;
+
+    if (mode != MODE_RESET) {
+        if (!can_calc_bit_timing(can_get_clock(), baudrate,
+                                 CAN_DEFAULT_SAMPLE_POINT, &timing, &error_ppm)
+            || error_ppm > CAN_MAX_BITRATE_ERROR_PPM) {
+            return false;
+        }
+    }
+
+    return can_reconfigure_timing(&timing, mode);
+}
+
+bool can_reconfigure_timing(const CanBitTiming* timing, CanMode mode) {
     nvic_disable_irq(CAN_NVIC_LINE);
-    can_disable_irq(CAN1, CAN_IER_FMPIE0);
+    can_disable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FMPIE1 | CAN_IER_TMEIE);
     can_reset(CAN1);
 
+    // Anything still queued for transmission is dropped silently. The
+    // priority queue's producer may still be running, so only drain
+    // it from the consumer side, which is ours while the IRQ is off.
+    ring_clear(&can_tx_ring);
+    ring_consume(&can_tx_priority_ring, ring_used(&can_tx_priority_ring));
+
     if (mode == MODE_RESET) {
         // Just stop after resetting the CAN controller.
         return true;
     }
 
-    /* Set appropriate bit timing */
-    uint32_t sjw = CAN_BTR_SJW_1TQ;
-    uint32_t ts1;
-    uint32_t ts2;
-    uint32_t brp;
-
-    if (baudrate == 1000000) {
-        brp = 3;
-        ts1 = CAN_BTR_TS1_11TQ;
-        ts2 = CAN_BTR_TS2_4TQ;
-    } else if (baudrate == 500000) {
-        brp = 6;
-        ts1 = CAN_BTR_TS1_11TQ;
-        ts2 = CAN_BTR_TS2_4TQ;
-    } else if (baudrate == 250000) {
-        brp = 12;
-        ts1 = CAN_BTR_TS1_11TQ;
-        ts2 = CAN_BTR_TS2_4TQ;
-    } else if (baudrate == 125000) {
-        brp = 24;
-        ts1 = CAN_BTR_TS1_11TQ;
-        ts2 = CAN_BTR_TS2_4TQ;
-    } else if (baudrate == 100000) {
-        brp = 30;
-        ts1 = CAN_BTR_TS1_11TQ;
-        ts2 = CAN_BTR_TS2_4TQ;
-    } else {
+    if (timing->brp < 1 || timing->brp > CAN_BRP_MAX
+        || timing->ts1 < 1 || timing->ts1 > CAN_TS1_MAX
+        || timing->ts2 < 1 || timing->ts2 > CAN_TS2_MAX
+        || timing->sjw < 1 || timing->sjw > CAN_SJW_MAX) {
         return false;
     }
 
+    /* Set appropriate bit timing */
+    uint32_t sjw = ((uint32_t)(timing->sjw - 1) << CAN_BTR_SJW_SHIFT) & CAN_BTR_SJW_MASK;
+    uint32_t ts1 = ((uint32_t)(timing->ts1 - 1) << CAN_BTR_TS1_SHIFT) & CAN_BTR_TS1_MASK;
+    uint32_t ts2 = ((uint32_t)(timing->ts2 - 1) << CAN_BTR_TS2_SHIFT) & CAN_BTR_TS2_MASK;
+    uint32_t brp = timing->brp;
+
     bool loopback = (mode == MODE_TEST_LOCAL || mode == MODE_TEST_SILENT);
     bool silent = (mode == MODE_SILENT || mode == MODE_TEST_SILENT);
 
-    bool TTCM = false; /* TTCM: Time triggered comm mode? */
+    bool TTCM = true;  /* TTCM: Time triggered comm mode? */
     bool ABOM = true;  /* ABOM: Automatic bus-off management? */
     bool AWUM = false; /* AWUM: Automatic wakeup mode? */
     bool NART = false; /* NART: No automatic retransmission? */
     bool RFLM = true;  /* RFLM: Receive FIFO locked mode? */
-    bool TXFP = false; /* TXFP: Transmit FIFO priority? */
+    bool TXFP = true;  /* TXFP: Transmit FIFO priority? */
 
     /* CAN cell init. */
     if (can_init(CAN1, TTCM, ABOM, AWUM, NART, RFLM, TXFP,
@@ -140,18 +420,62 @@ bool can_reconfigure(uint32_t baudrate, CanMode mode) {
                  silent) != 0) {
         return false;
     } else {
-        can_filter_id_mask_32bit_init(0,     /* Filter ID */
-                                      0,     /* CAN ID */
-                                      0,     /* CAN ID mask */
-                                      0,     /* FIFO assignment (here: FIFO0) */
-                                      true); /* Enable the filter. */
+        can_filter_apply();
     }
 
-    can_enable_irq(CAN1, CAN_IER_FMPIE0);
+    can_enable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FMPIE1
+                         | CAN_IER_FOVIE0 | CAN_IER_FOVIE1
+                         | CAN_IER_TMEIE
+                         | CAN_IER_ERRIE | CAN_IER_LECIE);
     nvic_enable_irq(CAN_NVIC_LINE);
     return true;
 }
 
+/*
+ * gs_usb, SLCAN Z and the cyclic scheduler take their deadlines from
+ * this counter. On STM32F1 TIM2 is only 16 bits wide and runs at twice
+ * the APB1 clock whenever APB1 is prescaled, so it needs its own setup.
+ */
+#if !defined(STM32F0)
+#error "CAN timestamps assume a 32-bit TIM2 clocked at the APB1 frequency (STM32F0)"
+#endif
+
+/*
+ * Free-running 1MHz counter used to timestamp received messages.
+ * TIM2 is 32 bits wide, so it wraps about every 71 minutes.
+ */
+static void can_timestamp_setup(void) {
+    rcc_periph_clock_enable(RCC_TIM2);
+    timer_set_prescaler(TIM2, (rcc_apb1_frequency / 1000000) - 1);
+    timer_set_period(TIM2, 0xFFFFFFFF);
+    timer_generate_event(TIM2, TIM_EGR_UG);
+    timer_enable_counter(TIM2);
+}
+
+uint32_t can_get_timestamp_us(void) {
+    return timer_get_counter(TIM2);
+}
+
+CanBusState can_get_bus_state(uint8_t* tec, uint8_t* rec) {
+    uint32_t esr = CAN_ESR(CAN1);
+    if (tec) {
+        *tec = (uint8_t)((esr & CAN_ESR_TEC_MASK) >> CAN_ESR_TEC_SHIFT);
+    }
+    if (rec) {
+        *rec = (uint8_t)((esr & CAN_ESR_REC_MASK) >> CAN_ESR_REC_SHIFT);
+    }
+
+    if (esr & CAN_ESR_BOFF) {
+        return CAN_BUS_OFF;
+    } else if (esr & CAN_ESR_EPVF) {
+        return CAN_BUS_ERROR_PASSIVE;
+    } else if (esr & CAN_ESR_EWGF) {
+        return CAN_BUS_ERROR_WARNING;
+    } else {
+        return CAN_BUS_ERROR_ACTIVE;
+    }
+}
+
 bool can_setup(uint32_t baudrate, CanMode mode) {
     /* Enable CAN clock */
     rcc_periph_clock_enable(RCC_CAN);
@@ -165,35 +489,77 @@ bool can_setup(uint32_t baudrate, CanMode mode) {
     gpio_set_af(GPIOB, GPIO_AF4, GPIO9);
 #endif
 
+    can_timestamp_setup();
+
     return can_reconfigure(baudrate, mode);
 }
 
-static uint8_t can_fifo_depth(void) {
-    uint8_t fifo_depth = (CAN_RF0R(CAN1) & CAN_RF0R_FMP0_MASK);
+static volatile uint32_t* const can_rfr[CAN_NUM_RX_FIFOS] = {
+    &CAN_RF0R(CAN1), &CAN_RF1R(CAN1)
+};
+
+static volatile uint32_t* const can_rdtr[CAN_NUM_RX_FIFOS] = {
+    &CAN_RDT0R(CAN1), &CAN_RDT1R(CAN1)
+};
+
+static uint8_t can_fifo_depth(uint8_t fifo) {
+    uint32_t rfr = *can_rfr[fifo];
+    // FMP0/RFOM0 and FMP1/RFOM1 share the same bit positions
+    uint8_t fifo_depth = (rfr & CAN_RF0R_FMP0_MASK);
     // Account for one fifo entry possibly going away
-    if (CAN_RF0R(CAN1) & CAN_RF0R_RFOM0) {
+    if (rfr & CAN_RF0R_RFOM0) {
         fifo_depth = fifo_depth > 0 ? (fifo_depth - 1) : 0;
     }
 
     return fifo_depth;
 }
 
-bool can_read(CAN_Message* msg) {
-    bool success = false;
+/*
+ * Pick the FIFO whose oldest message arrived first. With TTCM enabled
+ * every message carries the 16-bit bit-time counter value captured at
+ * its start of frame, which orders messages across the two FIFOs.
+ */
+static bool can_next_fifo(uint8_t* fifo) {
+    bool pending0 = can_fifo_depth(0) > 0;
+    bool pending1 = can_fifo_depth(1) > 0;
 
-    if (can_fifo_depth() > 0) {
-        // Wait for the previous message to be released
+    if (pending0 && pending1) {
+        // Wait for any released messages to leave the output mailboxes
         while (CAN_RF0R(CAN1) & CAN_RF0R_RFOM0);
+        while (CAN_RF1R(CAN1) & CAN_RF1R_RFOM1);
+        uint16_t time0 = (uint16_t)((CAN_RDT0R(CAN1) & CAN_RDTxR_TIME_MASK) >> CAN_RDTxR_TIME_SHIFT);
+        uint16_t time1 = (uint16_t)((CAN_RDT1R(CAN1) & CAN_RDTxR_TIME_MASK) >> CAN_RDTxR_TIME_SHIFT);
+        *fifo = ((int16_t)(time1 - time0) < 0) ? 1 : 0;
+    } else if (pending0) {
+        *fifo = 0;
+    } else if (pending1) {
+        *fifo = 1;
+    } else {
+        return false;
+    }
 
-        uint8_t fmi;
-        bool ext, rtr;
-        can_receive(CAN1, 0, true, &msg->id, &ext, &rtr, &fmi, &msg->len, msg->data, NULL);
-        msg->format = ext ? CANExtended : CANStandard;
-        msg->type = rtr ? CANRemote : CANData;
-        success = true;
+    return true;
+}
+
+static void can_read_fifo(uint8_t fifo, CAN_Message* msg) {
+    // Wait for the previous message to be released
+    while (*can_rfr[fifo] & CAN_RF0R_RFOM0);
+
+    uint8_t fmi;
+    bool ext, rtr;
+    can_receive(CAN1, fifo, true, &msg->id, &ext, &rtr, &fmi, &msg->len, msg->data, NULL);
+    msg->format = ext ? CANExtended : CANStandard;
+    msg->type = rtr ? CANRemote : CANData;
+}
+
+bool can_read(CAN_Message* msg) {
+    uint8_t fifo;
+    if (!can_next_fifo(&fifo)) {
+        return false;
     }
 
-    return success;
+    can_read_fifo(fifo, msg);
+    return true;
 }
 
 bool can_read_buffer(CAN_Message* msg) {
@@ -207,29 +573,158 @@ bool can_read_buffer(CAN_Message* msg) {
 }
 
 bool can_write(CAN_Message* msg) {
+    return can_write_tagged(msg, 0);
+}
+
+bool can_write_tagged(const CAN_Message* msg, uint32_t tag) {
+    void* slot;
+    if (ring_reserve(&can_tx_ring, &slot) == 0) {
+        return false;
+    }
+
+    CanTxEntry* entry = (CanTxEntry*)slot;
+    entry->msg = *msg;
+    entry->tag = tag;
+    ring_commit(&can_tx_ring, 1);
+
+    // Let the interrupt handler load it into a free mailbox
+    nvic_set_pending_irq(CAN_NVIC_LINE);
+    return true;
+}
+
+/*
+ * Queue a frame ahead of everything written with can_write(). Only one
+ * context may be queueing frames this way at any time, since the queue
+ * has a single producer side.
+ */
+bool can_write_priority(const CAN_Message* msg) {
+    if (!ring_put(&can_tx_priority_ring, msg)) {
+        return false;
+    }
+
+    nvic_set_pending_irq(CAN_NVIC_LINE);
+    return true;
+}
+
+bool can_tx_queue_full(void) {
+    return ring_full(&can_tx_ring);
+}
+
+void can_set_tx_complete_callback(CanTxCompleteCallback callback) {
+    can_tx_complete_callback = callback;
+}
+
+static const uint32_t can_tsr_rqcp[CAN_NUM_TX_MAILBOXES] = {
+    CAN_TSR_RQCP0, CAN_TSR_RQCP1, CAN_TSR_RQCP2
+};
+
+static const uint32_t can_tsr_txok[CAN_NUM_TX_MAILBOXES] = {
+    CAN_TSR_TXOK0, CAN_TSR_TXOK1, CAN_TSR_TXOK2
+};
+
+/* Load a frame into a free mailbox, remembering its tag */
+static bool can_tx_load(const CAN_Message* msg, uint32_t tag) {
     bool ext = msg->format == CANExtended;
     bool rtr = msg->type == CANRemote;
-    return (can_transmit(CAN1, msg->id, ext, rtr, msg->len, msg->data) != -1);
+    int result = can_transmit(CAN1, msg->id, ext, rtr, msg->len, (uint8_t*)msg->data);
+    if (result < 0) {
+        return false;
+    }
+    can_tx_mailbox_tags[result] = tag;
+    return true;
 }
 
-void cec_can_isr(void) {
-    uint8_t messages_queued = 0;
-    uint8_t fifo_depth = can_fifo_depth();
-    while (!can_rx_buffer_full() && messages_queued < fifo_depth) {
-        CAN_Message* msg = can_rx_buffer_tail();
-        if (can_read(msg)) {
-            can_rx_buffer_extend();
-            messages_queued++;
-        } else {
+/* Report finished mailboxes and refill them from the transmit queues */
+static void can_tx_service(void) {
+    uint32_t tsr = CAN_TSR(CAN1);
+    uint8_t mailbox;
+    for (mailbox=0; mailbox < CAN_NUM_TX_MAILBOXES; mailbox++) {
+        if (tsr & can_tsr_rqcp[mailbox]) {
+            // Writing RQCP clears the status bits for this mailbox
+            CAN_TSR(CAN1) = can_tsr_rqcp[mailbox];
+            if (can_tx_complete_callback != NULL
+                && can_tx_mailbox_tags[mailbox] != CAN_TX_TAG_UNREPORTED) {
+                bool success = (tsr & can_tsr_txok[mailbox]) != 0;
+                can_tx_complete_callback(can_tx_mailbox_tags[mailbox], success);
+            }
+        }
+    }
+
+    void* slot;
+    while ((CAN_TSR(CAN1) & CAN_TSR_TME) && ring_read_span(&can_tx_priority_ring, &slot) > 0) {
+        if (!can_tx_load((const CAN_Message*)slot, CAN_TX_TAG_UNREPORTED)) {
+            return;
+        }
+        ring_consume(&can_tx_priority_ring, 1);
+    }
+
+    while ((CAN_TSR(CAN1) & CAN_TSR_TME) && ring_read_span(&can_tx_ring, &slot) > 0) {
+        const CanTxEntry* entry = (const CanTxEntry*)slot;
+        if (!can_tx_load(&entry->msg, entry->tag)) {
             break;
         }
+        ring_consume(&can_tx_ring, 1);
     }
+}
 
-    // If the software buffer is full, disable the ISR so that
-    // the main loop can drain the buffer over USB.
-    if (messages_queued == 0) {
-        nvic_disable_irq(CAN_NVIC_LINE);
+/* Count overruns of the hardware FIFOs and bus errors */
+static void can_error_service(void) {
+    if (CAN_RF0R(CAN1) & CAN_RF0R_FOVR0) {
+        CAN_RF0R(CAN1) = CAN_RF0R_FOVR0;
+        can_error_counts.fifo_overruns++;
     }
+    if (CAN_RF1R(CAN1) & CAN_RF1R_FOVR1) {
+        CAN_RF1R(CAN1) = CAN_RF1R_FOVR1;
+        can_error_counts.fifo_overruns++;
+    }
+
+    if (CAN_MSR(CAN1) & CAN_MSR_ERRI) {
+        uint32_t lec = (CAN_ESR(CAN1) & CAN_ESR_LEC_MASK) >> CAN_ESR_LEC_SHIFT;
+        // LEC 7 is the value software sets to detect a new error code
+        if (lec != 0 && lec != 7) {
+            can_error_counts.bus_errors++;
+        }
+        CAN_ESR(CAN1) |= CAN_ESR_LEC_MASK;
+        CAN_MSR(CAN1) = CAN_MSR_ERRI;
+    }
+}
+
+static void can_rx_service(void) {
+    if (!(CAN_IER(CAN1) & CAN_IER_FMPIE0)) {
+        // Still waiting for the main loop to make room
+        return;
+    }
+
+    // Stamp everything read in this pass with the time of the interrupt
+    uint32_t timestamp = can_get_timestamp_us();
+    uint8_t fifo;
+    void* slot;
+    while (can_next_fifo(&fifo)) {
+        if (ring_reserve(&can_rx_ring, &slot) == 0) {
+            // Mask the FIFO interrupts so that the main loop can drain
+            // the buffer over USB. The hardware FIFOs hold on to three
+            // more messages each; anything past that counts as an
+            // overrun. The interrupt line itself stays enabled for the
+            // transmit side.
+            can_error_counts.rx_buffer_overflows++;
+            can_disable_irq(CAN1, CAN_IER_FMPIE0 | CAN_IER_FMPIE1);
+            break;
+        }
+        // Read straight into the ring slot to avoid an extra copy
+        CAN_Message* msg = (CAN_Message*)slot;
+        can_read_fifo(fifo, msg);
+        msg->timestamp = timestamp;
+        // Rejected messages just leave the slot to be overwritten
+        if (can_filter_accept(msg)) {
+            ring_commit(&can_rx_ring, 1);
+        }
+    }
+}
+
+void cec_can_isr(void) {
+    can_tx_service();
+    can_error_service();
+    can_rx_service();
 }
 
 
@@ -19,16 +19,104 @@
 #ifndef CAN_H
 #define CAN_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "can_helper.h"
 
 #define CAN_RX_BUFFER_SIZE 16
+#define CAN_TX_BUFFER_SIZE 8
+#define CAN_TX_PRIORITY_BUFFER_SIZE 4
+
+/* Bit timing in time quanta of the prescaled CAN clock */
+typedef struct {
+    uint16_t brp;   // Baudrate prescaler, 1-1024
+    uint8_t ts1;    // Propagation + phase segment 1, 1-16
+    uint8_t ts2;    // Phase segment 2, 1-8
+    uint8_t sjw;    // Resynchronization jump width, 1-4
+} CanBitTiming;
+
+#define CAN_BRP_MAX 1024
+#define CAN_TS1_MAX 16
+#define CAN_TS2_MAX 8
+#define CAN_SJW_MAX 4
+
+/* Sample point in tenths of a percent */
+#define CAN_DEFAULT_SAMPLE_POINT 750
+
+/* Largest bitrate error accepted for a requested bitrate: 0.5% */
+#define CAN_MAX_BITRATE_ERROR_PPM 5000
+
+/*
+ * Acceptance filters, applied on the next can_reconfigure(). With no
+ * filters configured every frame is accepted. Filters are packed into
+ * the bxCAN filter banks using the densest scale and mode that fits;
+ * if they don't fit, the banks accept everything and the ISR filters
+ * in software instead.
+ */
+#define CAN_MAX_FILTERS 16
+#define CAN_FILTER_BANKS 14
+
+#define CAN_STD_ID_MASK 0x000007FFUL
+#define CAN_EXT_ID_MASK 0x1FFFFFFFUL
+
+/* Transmit queue entry; the tag is handed back when it completes */
+typedef struct {
+    CAN_Message msg;
+    uint32_t tag;
+} CanTxEntry;
+
+/*
+ * Called from the CAN interrupt when a queued frame has either been
+ * sent or failed to be sent.
+ */
+typedef void (*CanTxCompleteCallback)(uint32_t tag, bool success);
+
+/* Tag for frames that the completion callback doesn't hear about */
+#define CAN_TX_TAG_UNREPORTED UINT32_MAX
+
+/* Cumulative receive and bus error counts since startup */
+typedef struct {
+    uint32_t fifo_overruns;         // Messages lost by a full hardware FIFO
+    uint32_t rx_buffer_overflows;   // Times the software RX buffer filled up
+    uint32_t bus_errors;            // Error frames seen on the bus
+} CanErrorCounts;
+
+#define CAN_RAM_USAGE (CAN_RX_BUFFER_SIZE * sizeof(CAN_Message) \
+                       + CAN_TX_BUFFER_SIZE * sizeof(CanTxEntry) \
+                       + CAN_TX_PRIORITY_BUFFER_SIZE * sizeof(CAN_Message))
+
+typedef enum {
+    CAN_BUS_ERROR_ACTIVE,
+    CAN_BUS_ERROR_WARNING,
+    CAN_BUS_ERROR_PASSIVE,
+    CAN_BUS_OFF
+} CanBusState;
+
+extern bool can_calc_bit_timing(uint32_t clock, uint32_t bitrate,
+                                uint16_t sample_point, CanBitTiming* timing,
+                                uint32_t* error_ppm);
+extern uint32_t can_bit_timing_bitrate(uint32_t clock, const CanBitTiming* timing);
 
 extern bool can_setup(uint32_t baudrate, CanMode mode);
 extern bool can_reconfigure(uint32_t baudrate, CanMode mode);
+extern bool can_reconfigure_timing(const CanBitTiming* timing, CanMode mode);
+extern uint32_t can_get_clock(void);
+extern uint32_t can_get_timestamp_us(void);
+extern CanBusState can_get_bus_state(uint8_t* tec, uint8_t* rec);
+extern void can_get_error_counts(CanErrorCounts* counts);
+extern void can_filter_clear(void);
+extern bool can_filter_add_id(uint32_t id, CANFormat format);
+extern bool can_filter_add_mask(uint32_t id, uint32_t mask, CANFormat format);
+extern bool can_filter_in_hardware(void);
 extern bool can_read(CAN_Message* msg);
 extern bool can_read_buffer(CAN_Message* msg);
 
 extern bool can_write(CAN_Message* msg);
+extern bool can_write_tagged(const CAN_Message* msg, uint32_t tag);
+extern bool can_write_priority(const CAN_Message* msg);
+extern bool can_tx_queue_full(void);
+extern void can_set_tx_complete_callback(CanTxCompleteCallback callback);
 
 extern bool can_rx_buffer_empty(void);
 extern bool can_rx_buffer_full(void);
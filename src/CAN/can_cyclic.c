@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/nvic.h>
+
+#include <string.h>
+
+#include "config.h"
+#include "can_cyclic.h"
+
+#if CAN_CYCLIC_AVAILABLE
+
+_Static_assert(CAN_RX_AVAILABLE && CAN_TX_AVAILABLE,
+               "Cyclic CAN transmission needs CAN transmit and receive");
+
+/*
+ * The TIM2 CC1 interrupt sends whatever is due and moves the compare
+ * value on to the earliest next deadline. Due frames are handed to the
+ * CAN interrupt through can_write_priority(), which puts them ahead of
+ * the regular transmit queue. The main loop only edits the table with
+ * the TIM2 interrupt masked.
+ */
+
+static CanCyclicEntry can_cyclic_table[CAN_CYCLIC_SLOTS];
+
+/* Phases are counted from the time the first slot started */
+static uint32_t can_cyclic_epoch;
+
+/* Frames skipped because the priority queue was full or we fell behind */
+static volatile uint32_t can_cyclic_missed_count = 0;
+
+static bool can_cyclic_any_active(void) {
+    uint8_t slot;
+    for (slot=0; slot < CAN_CYCLIC_SLOTS; slot++) {
+        if (can_cyclic_table[slot].active) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void can_cyclic_send(CanCyclicEntry* entry) {
+    CAN_Message* msg = &entry->msg;
+    if (entry->checksum_byte != CAN_CYCLIC_NO_BYTE) {
+        uint8_t checksum = 0;
+        uint8_t i;
+        for (i=0; i < msg->len; i++) {
+            if (i != entry->checksum_byte) {
+                checksum ^= msg->data[i];
+            }
+        }
+        msg->data[entry->checksum_byte] = checksum;
+    }
+
+    if (!can_write_priority(msg)) {
+        can_cyclic_missed_count++;
+    }
+
+    if (entry->counter_byte != CAN_CYCLIC_NO_BYTE) {
+        msg->data[entry->counter_byte]++;
+    }
+}
+
+/*
+ * Send every due frame and arm the compare for the next deadline. If
+ * that deadline passes while we're arming it the compare would not
+ * fire until the counter wraps, so go around again instead.
+ */
+static void can_cyclic_service(void) {
+    while (true) {
+        uint32_t now = timer_get_counter(TIM2);
+        uint32_t next_due = 0;
+        bool any_active = false;
+
+        uint8_t slot;
+        for (slot=0; slot < CAN_CYCLIC_SLOTS; slot++) {
+            CanCyclicEntry* entry = &can_cyclic_table[slot];
+            if (!entry->active) {
+                continue;
+            }
+            if ((int32_t)(now - entry->next_due) >= 0) {
+                can_cyclic_send(entry);
+                entry->next_due += entry->period_us;
+                if ((int32_t)(now - entry->next_due) >= 0) {
+                    // More than a period late; skip ahead rather than burst
+                    can_cyclic_missed_count++;
+                    entry->next_due = now + entry->period_us;
+                }
+            }
+            if (!any_active || (int32_t)(entry->next_due - next_due) < 0) {
+                next_due = entry->next_due;
+            }
+            any_active = true;
+        }
+
+        if (!any_active) {
+            timer_disable_irq(TIM2, TIM_DIER_CC1IE);
+            return;
+        }
+
+        timer_set_oc_value(TIM2, TIM_OC1, next_due);
+        timer_enable_irq(TIM2, TIM_DIER_CC1IE);
+        if ((int32_t)(timer_get_counter(TIM2) - next_due) < 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * Runs at the same priority as the CAN interrupt, so the two never
+ * preempt each other.
+ */
+void tim2_isr(void) {
+    if (timer_get_flag(TIM2, TIM_SR_CC1IF)) {
+        timer_clear_flag(TIM2, TIM_SR_CC1IF);
+        can_cyclic_service();
+    }
+}
+
+static void can_cyclic_lock(void) {
+    nvic_disable_irq(NVIC_TIM2_IRQ);
+}
+
+static void can_cyclic_unlock(void) {
+    nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+/* Replace a slot's frame; a running slot keeps its schedule */
+bool can_cyclic_set_frame(uint8_t slot, const CAN_Message* msg) {
+    if (slot >= CAN_CYCLIC_SLOTS || msg->len > 8) {
+        return false;
+    }
+
+    can_cyclic_lock();
+    can_cyclic_table[slot].msg = *msg;
+    can_cyclic_unlock();
+    return true;
+}
+
+/*
+ * Start sending a slot's frame every period_us, offset by phase_us
+ * from the other slots.
+ */
+bool can_cyclic_start(uint8_t slot, uint32_t period_us, uint32_t phase_us,
+                      uint8_t counter_byte, uint8_t checksum_byte) {
+    if (slot >= CAN_CYCLIC_SLOTS || period_us < CAN_CYCLIC_MIN_PERIOD_US
+        || period_us > INT32_MAX || phase_us > INT32_MAX) {
+        return false;
+    }
+
+    CanCyclicEntry* entry = &can_cyclic_table[slot];
+    if ((counter_byte != CAN_CYCLIC_NO_BYTE && counter_byte >= entry->msg.len)
+        || (checksum_byte != CAN_CYCLIC_NO_BYTE && checksum_byte >= entry->msg.len)
+        || (counter_byte != CAN_CYCLIC_NO_BYTE && counter_byte == checksum_byte)) {
+        return false;
+    }
+
+    can_cyclic_lock();
+
+    uint32_t now = can_get_timestamp_us();
+    if (!can_cyclic_any_active()) {
+        can_cyclic_epoch = now;
+    }
+
+    // First deadline on this slot's grid that hasn't passed yet
+    uint32_t first_due = can_cyclic_epoch + phase_us;
+    if ((int32_t)(now - first_due) >= 0) {
+        uint32_t periods = (now - first_due) / period_us + 1;
+        first_due += periods * period_us;
+    }
+
+    entry->period_us = period_us;
+    entry->next_due = first_due;
+    entry->counter_byte = counter_byte;
+    entry->checksum_byte = checksum_byte;
+    entry->active = true;
+
+    can_cyclic_service();
+    can_cyclic_unlock();
+    return true;
+}
+
+bool can_cyclic_stop(uint8_t slot) {
+    if (slot >= CAN_CYCLIC_SLOTS) {
+        return false;
+    }
+
+    can_cyclic_lock();
+    can_cyclic_table[slot].active = false;
+    can_cyclic_service();
+    can_cyclic_unlock();
+    return true;
+}
+
+void can_cyclic_stop_all(void) {
+    can_cyclic_lock();
+    uint8_t slot;
+    for (slot=0; slot < CAN_CYCLIC_SLOTS; slot++) {
+        can_cyclic_table[slot].active = false;
+    }
+    timer_disable_irq(TIM2, TIM_DIER_CC1IE);
+    can_cyclic_unlock();
+}
+
+uint32_t can_cyclic_missed(void) {
+    return can_cyclic_missed_count;
+}
+
+#endif
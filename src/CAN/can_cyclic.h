@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CAN_CYCLIC_H_INCLUDED
+#define CAN_CYCLIC_H_INCLUDED
+
+#include "can.h"
+
+/*
+ * Periodic transmission of up to CAN_CYCLIC_SLOTS frames, timed by a
+ * compare channel of the 1MHz timestamp timer so that the period
+ * doesn't pick up USB or host scheduling jitter.
+ */
+
+#define CAN_CYCLIC_SLOTS 4
+
+/* Shortest period accepted, to bound the interrupt load */
+#define CAN_CYCLIC_MIN_PERIOD_US 100
+
+/* Byte index meaning no counter or checksum byte */
+#define CAN_CYCLIC_NO_BYTE 0xFF
+
+typedef struct {
+    CAN_Message msg;
+    uint32_t period_us;
+    uint32_t next_due;          // Timestamp at which the next frame is due
+    uint8_t counter_byte;       // Data byte incremented after each frame
+    uint8_t checksum_byte;      // Data byte set to the XOR of the others
+    bool active;
+} CanCyclicEntry;
+
+#define CAN_CYCLIC_RAM_USAGE (CAN_CYCLIC_SLOTS * sizeof(CanCyclicEntry))
+
+extern bool can_cyclic_set_frame(uint8_t slot, const CAN_Message* msg);
+extern bool can_cyclic_start(uint8_t slot, uint32_t period_us, uint32_t phase_us,
+                             uint8_t counter_byte, uint8_t checksum_byte);
+extern bool can_cyclic_stop(uint8_t slot);
+extern void can_cyclic_stop_all(void);
+extern uint32_t can_cyclic_missed(void);
+
+#endif
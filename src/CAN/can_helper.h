@@ -41,6 +41,7 @@ struct CAN_Message {
     uint8_t   len;                // Length of data field in bytes
     CANFormat format;             // 0 - STANDARD, 1- EXTENDED IDENTIFIER
     CANType   type;               // 0 - DATA FRAME, 1 - REMOTE FRAME
+    uint32_t  timestamp;          // Reception time in microseconds
 };
 typedef struct CAN_Message CAN_Message;
 
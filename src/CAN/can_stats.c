@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "can_stats.h"
+
+#if CAN_STATS_AVAILABLE
+
+_Static_assert(CAN_RX_AVAILABLE, "CAN statistics need CAN receive");
+
+_Static_assert((CAN_STATS_TABLE_SIZE & (CAN_STATS_TABLE_SIZE - 1)) == 0
+               && CAN_STATS_TABLE_SIZE <= 256,
+               "CAN stats table size must be a power of two <= 256");
+
+#define CAN_STATS_INDEX_MASK (CAN_STATS_TABLE_SIZE - 1)
+
+/* Entry flags */
+#define CAN_STATS_USED  (1 << 0)    // Slot holds an ID
+#define CAN_STATS_TIMED (1 << 1)    // last_timestamp is valid
+#define CAN_STATS_IDLE  (1 << 2)    // No frames in the last full interval
+
+static CanStatsEntry can_stats_table[CAN_STATS_TABLE_SIZE];
+static CanStatsTotals can_stats_totals;
+
+static uint8_t can_stats_hash(uint32_t key) {
+    // Fibonacci hashing; the top bits of the product are the best mixed
+    return (uint8_t)((key * 2654435761UL) >> 24) & CAN_STATS_INDEX_MASK;
+}
+
+/* Frame length on the wire, ignoring stuff bits */
+static uint32_t can_stats_frame_bits(const CAN_Message* msg) {
+    // SOF, arbitration, control, CRC, ACK, EOF and interframe space
+    uint32_t bits = (msg->format == CANExtended) ? 67 : 47;
+    if (msg->type == CANData) {
+        bits += 8 * msg->len;
+    }
+    return bits;
+}
+
+static void can_stats_restart_entry(CanStatsEntry* entry) {
+    entry->count = 0;
+    entry->min_period = UINT32_MAX;
+    entry->max_period = 0;
+    entry->dlc_changes = 0;
+}
+
+void can_stats_clear(void) {
+    memset(can_stats_table, 0, sizeof(can_stats_table));
+    memset(&can_stats_totals, 0, sizeof(can_stats_totals));
+}
+
+/*
+ * Find the slot for key, or the empty slot where it would go. Returns
+ * NULL if the key is absent and the table is full.
+ */
+static CanStatsEntry* can_stats_lookup(uint32_t key) {
+    uint8_t index = can_stats_hash(key);
+    uint8_t probes;
+    for (probes=0; probes < CAN_STATS_TABLE_SIZE; probes++) {
+        CanStatsEntry* entry = &can_stats_table[index];
+        if (!(entry->flags & CAN_STATS_USED) || entry->key == key) {
+            return entry;
+        }
+        index = (index + 1) & CAN_STATS_INDEX_MASK;
+    }
+    return NULL;
+}
+
+/* Returns false if the frame's ID couldn't be given a slot */
+bool can_stats_add(const CAN_Message* msg) {
+    can_stats_totals.frames++;
+    can_stats_totals.bits += can_stats_frame_bits(msg);
+
+    uint32_t key = msg->id;
+    if (msg->format == CANExtended) {
+        key |= CAN_STATS_EXTENDED;
+    }
+
+    CanStatsEntry* entry = can_stats_lookup(key);
+    if (entry == NULL) {
+        can_stats_totals.untracked++;
+        return false;
+    }
+
+    if (!(entry->flags & CAN_STATS_USED)) {
+        entry->key = key;
+        entry->flags = CAN_STATS_USED;
+        entry->len = msg->len;
+        can_stats_restart_entry(entry);
+    }
+
+    if (entry->flags & CAN_STATS_TIMED) {
+        uint32_t period = msg->timestamp - entry->last_timestamp;
+        if (period < entry->min_period) {
+            entry->min_period = period;
+        }
+        if (period > entry->max_period) {
+            entry->max_period = period;
+        }
+    }
+
+    if (msg->len != entry->len && entry->dlc_changes < UINT8_MAX) {
+        entry->dlc_changes++;
+    }
+
+    entry->count++;
+    entry->last_timestamp = msg->timestamp;
+    entry->len = msg->len;
+    if (msg->type == CANData) {
+        memcpy(entry->data, msg->data, sizeof(entry->data));
+    }
+    entry->flags = (uint8_t)((entry->flags | CAN_STATS_TIMED) & ~CAN_STATS_IDLE);
+    return true;
+}
+
+/* Returns the entry in slot index, or NULL if the slot is empty */
+const CanStatsEntry* can_stats_get(uint8_t index) {
+    const CanStatsEntry* entry = &can_stats_table[index & CAN_STATS_INDEX_MASK];
+    return (entry->flags & CAN_STATS_USED) ? entry : NULL;
+}
+
+/*
+ * Start a new interval for one entry once it has been reported. An
+ * entry that saw nothing over a whole interval is marked idle and is
+ * dropped when the interval finishes, unless it hears from its ID
+ * again before can_stats_evict_idle() runs.
+ */
+void can_stats_restart(uint8_t index) {
+    CanStatsEntry* entry = &can_stats_table[index & CAN_STATS_INDEX_MASK];
+    if (entry->count == 0) {
+        entry->flags |= CAN_STATS_IDLE;
+    }
+    can_stats_restart_entry(entry);
+}
+
+/*
+ * Remove an entry by shifting later entries of the same probe chain
+ * back into the hole, so that lookups never need tombstones.
+ */
+static void can_stats_remove(uint8_t index) {
+    uint8_t hole = index;
+    uint8_t next = (hole + 1) & CAN_STATS_INDEX_MASK;
+    uint8_t probes;
+    for (probes=1; probes < CAN_STATS_TABLE_SIZE; probes++) {
+        CanStatsEntry* entry = &can_stats_table[next];
+        if (!(entry->flags & CAN_STATS_USED)) {
+            break;
+        }
+        // Move the entry unless its home slot lies between the hole
+        // and where it sits now
+        uint8_t home = can_stats_hash(entry->key);
+        if (((next - home) & CAN_STATS_INDEX_MASK) >= ((next - hole) & CAN_STATS_INDEX_MASK)) {
+            can_stats_table[hole] = *entry;
+            hole = next;
+        }
+        next = (next + 1) & CAN_STATS_INDEX_MASK;
+    }
+    memset(&can_stats_table[hole], 0, sizeof(can_stats_table[hole]));
+}
+
+/* Hand back the bus totals for the interval and start over */
+void can_stats_take_totals(CanStatsTotals* totals) {
+    *totals = can_stats_totals;
+    memset(&can_stats_totals, 0, sizeof(can_stats_totals));
+}
+
+/* Drop entries that stayed idle since their last restart */
+void can_stats_evict_idle(void) {
+    uint8_t index = 0;
+    while (index < CAN_STATS_TABLE_SIZE) {
+        const CanStatsEntry* entry = &can_stats_table[index];
+        if ((entry->flags & CAN_STATS_IDLE) && entry->count == 0) {
+            // Re-examine this slot, another entry may have moved in
+            can_stats_remove(index);
+        } else {
+            index++;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CAN_STATS_H_INCLUDED
+#define CAN_STATS_H_INCLUDED
+
+#include "can.h"
+
+/*
+ * Per-ID receive statistics, kept in a small open-addressed hash table
+ * so that a busy bus can be summarized instead of streamed.
+ */
+
+#define CAN_STATS_TABLE_SIZE 16
+
+#define CAN_STATS_EXTENDED  (1UL << 31)
+
+typedef struct {
+    uint32_t key;               // CAN ID, with CAN_STATS_EXTENDED set for extended IDs
+    uint32_t count;             // Frames seen this interval
+    uint32_t last_timestamp;    // Reception time of the last frame
+    uint32_t min_period;        // Shortest gap between frames this interval
+    uint32_t max_period;        // Longest gap between frames this interval
+    uint8_t data[8];            // Payload of the last frame
+    uint8_t len;                // DLC of the last frame
+    uint8_t dlc_changes;        // DLC changes this interval, saturating
+    uint8_t flags;
+} CanStatsEntry;
+
+/* Totals over the whole bus for one interval */
+typedef struct {
+    uint32_t frames;            // Frames seen
+    uint32_t untracked;         // Frames whose ID didn't fit in the table
+    uint32_t bits;              // Bus bits used, not counting bit stuffing
+} CanStatsTotals;
+
+#define CAN_STATS_RAM_USAGE (CAN_STATS_TABLE_SIZE * sizeof(CanStatsEntry) \
+                             + sizeof(CanStatsTotals))
+
+extern void can_stats_clear(void);
+extern bool can_stats_add(const CAN_Message* msg);
+extern const CanStatsEntry* can_stats_get(uint8_t index);
+extern void can_stats_restart(uint8_t index);
+extern void can_stats_take_totals(CanStatsTotals* totals);
+extern void can_stats_evict_idle(void);
+
+#endif
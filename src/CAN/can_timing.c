@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "can.h"
+
+/*
+ * Bit timing solver, independent of the hardware so it can be reused
+ * for any CAN clock. Every number of time quanta per bit is tried; the
+ * candidate with the lowest bitrate error wins, and among those the
+ * one that lands closest to the requested sample point.
+ */
+
+#define CAN_TQ_PER_BIT_MIN 8
+#define CAN_TQ_PER_BIT_MAX (1 + CAN_TS1_MAX + CAN_TS2_MAX)
+
+static uint32_t can_abs_diff(uint32_t a, uint32_t b) {
+    return (a > b) ? (a - b) : (b - a);
+}
+
+/* Split a bit of tq time quanta around the sample point */
+static void can_split_bit(uint32_t tq, uint16_t sample_point,
+                          uint32_t* ts1_out, uint32_t* ts2_out) {
+    uint32_t ts2 = (tq * (1000 - sample_point) + 500) / 1000;
+    if (ts2 < 1) {
+        ts2 = 1;
+    } else if (ts2 > CAN_TS2_MAX) {
+        ts2 = CAN_TS2_MAX;
+    }
+    uint32_t ts1 = tq - 1 - ts2;
+    if (ts1 > CAN_TS1_MAX) {
+        ts1 = CAN_TS1_MAX;
+        ts2 = tq - 1 - ts1;
+    }
+
+    *ts1_out = ts1;
+    *ts2_out = ts2;
+}
+
+bool can_calc_bit_timing(uint32_t clock, uint32_t bitrate,
+                         uint16_t sample_point, CanBitTiming* timing,
+                         uint32_t* error_ppm) {
+    if (bitrate == 0 || clock == 0) {
+        return false;
+    }
+
+    if (sample_point == 0) {
+        sample_point = CAN_DEFAULT_SAMPLE_POINT;
+    } else if (sample_point >= 1000) {
+        return false;
+    }
+
+    bool found = false;
+    uint32_t best_error = 0;
+    uint32_t best_sp_error = 0;
+
+    uint32_t tq;
+    for (tq=CAN_TQ_PER_BIT_MAX; tq >= CAN_TQ_PER_BIT_MIN; tq--) {
+        uint64_t tq_rate = (uint64_t)bitrate * tq;
+        uint32_t brp = (uint32_t)((clock + tq_rate / 2) / tq_rate);
+        if (brp < 1 || brp > CAN_BRP_MAX) {
+            continue;
+        }
+
+        uint32_t error = can_abs_diff(clock / (brp * tq), bitrate);
+
+        uint32_t ts1, ts2;
+        can_split_bit(tq, sample_point, &ts1, &ts2);
+        uint32_t sp_error = can_abs_diff((1 + ts1) * 1000 / tq, sample_point);
+
+        if (!found || error < best_error
+            || (error == best_error && sp_error < best_sp_error)) {
+            found = true;
+            best_error = error;
+            best_sp_error = sp_error;
+            timing->brp = (uint16_t)brp;
+            timing->ts1 = (uint8_t)ts1;
+            timing->ts2 = (uint8_t)ts2;
+            timing->sjw = 1;
+        }
+    }
+
+    if (found && error_ppm) {
+        *error_ppm = (uint32_t)(((uint64_t)best_error * 1000000 + bitrate / 2) / bitrate);
+    }
+
+    return found;
+}
+
+uint32_t can_bit_timing_bitrate(uint32_t clock, const CanBitTiming* timing) {
+    uint32_t tq = 1 + timing->ts1 + timing->ts2;
+    return clock / ((uint32_t)timing->brp * tq);
+}
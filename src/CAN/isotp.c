@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "isotp.h"
+
+#if ISOTP_AVAILABLE
+
+_Static_assert(CAN_RX_AVAILABLE && CAN_TX_AVAILABLE,
+               "ISO-TP needs CAN transmit and receive");
+
+/* Protocol control information, in the high nibble of the first byte */
+#define ISOTP_PCI_SINGLE        0x00
+#define ISOTP_PCI_FIRST         0x10
+#define ISOTP_PCI_CONSECUTIVE   0x20
+#define ISOTP_PCI_FLOW_CONTROL  0x30
+
+#define ISOTP_FC_CONTINUE   0x0
+#define ISOTP_FC_WAIT       0x1
+#define ISOTP_FC_OVERFLOW   0x2
+
+#define ISOTP_SF_MAX_DATA   7
+#define ISOTP_FF_DATA       6
+#define ISOTP_CF_DATA       7
+
+#define ISOTP_PADDING_BYTE  0xCC
+
+typedef enum {
+    ISOTP_TX_IDLE,
+    ISOTP_TX_SEND_SINGLE,
+    ISOTP_TX_SEND_FIRST,
+    ISOTP_TX_WAIT_FC,
+    ISOTP_TX_SEND_CONSECUTIVE,
+} IsotpTxState;
+
+typedef enum {
+    ISOTP_RX_IDLE,
+    ISOTP_RX_RECEIVING,
+    ISOTP_RX_COMPLETE,
+} IsotpRxState;
+
+static IsotpConfig isotp_config;
+static bool isotp_active = false;
+static uint8_t isotp_events = 0;
+
+static uint8_t isotp_tx_buffer[ISOTP_MAX_PDU_LEN];
+static uint16_t isotp_tx_len;
+static uint16_t isotp_tx_offset;
+static uint8_t isotp_tx_sn;
+static uint8_t isotp_tx_block_remaining;
+static uint8_t isotp_tx_block_size;
+static uint32_t isotp_tx_st_min_us;
+static uint32_t isotp_tx_time;
+static uint8_t isotp_tx_wait_frames;
+static IsotpTxState isotp_tx_state = ISOTP_TX_IDLE;
+
+static uint8_t isotp_rx_buffer[ISOTP_MAX_PDU_LEN];
+static uint16_t isotp_rx_len;
+static uint16_t isotp_rx_offset;
+static uint8_t isotp_rx_sn;
+static uint8_t isotp_rx_block_remaining;
+static uint32_t isotp_rx_time;
+static IsotpRxState isotp_rx_state = ISOTP_RX_IDLE;
+
+/* Flow control status still to be sent, or -1 for none */
+static int8_t isotp_fc_pending = -1;
+
+static void isotp_reset(void) {
+    isotp_tx_state = ISOTP_TX_IDLE;
+    isotp_tx_len = 0;
+    isotp_rx_state = ISOTP_RX_IDLE;
+    isotp_fc_pending = -1;
+    isotp_events = 0;
+}
+
+void isotp_configure(const IsotpConfig* config) {
+    isotp_config = *config;
+    isotp_active = true;
+    isotp_reset();
+}
+
+void isotp_disable(void) {
+    isotp_active = false;
+    isotp_reset();
+}
+
+bool isotp_enabled(void) {
+    return isotp_active;
+}
+
+uint8_t isotp_take_events(void) {
+    uint8_t events = isotp_events;
+    isotp_events = 0;
+    return events;
+}
+
+/* STmin is in milliseconds up to 0x7F, or 100-900us for 0xF1-0xF9 */
+static uint32_t isotp_st_min_us(uint8_t st_min) {
+    if (st_min <= 0x7F) {
+        return st_min * 1000UL;
+    } else if (st_min >= 0xF1 && st_min <= 0xF9) {
+        return (st_min - 0xF0) * 100UL;
+    } else {
+        // Reserved values mean the longest delay
+        return 0x7F * 1000UL;
+    }
+}
+
+static bool isotp_send_frame(const uint8_t* data, uint8_t len) {
+    CAN_Message msg;
+    msg.id = isotp_config.tx_id;
+    msg.format = isotp_config.tx_format;
+    msg.type = CANData;
+    memcpy(msg.data, data, len);
+    if (isotp_config.padding) {
+        memset(&msg.data[len], ISOTP_PADDING_BYTE, sizeof(msg.data) - len);
+        len = sizeof(msg.data);
+    }
+    msg.len = len;
+    return can_write(&msg);
+}
+
+static void isotp_send_flow_control(void) {
+    if (isotp_fc_pending < 0) {
+        return;
+    }
+
+    uint8_t frame[3] = {
+        (uint8_t)(ISOTP_PCI_FLOW_CONTROL | isotp_fc_pending),
+        isotp_config.block_size,
+        isotp_config.st_min
+    };
+    if (isotp_send_frame(frame, sizeof(frame))) {
+        isotp_fc_pending = -1;
+    }
+}
+
+static void isotp_receive_single(const CAN_Message* msg) {
+    uint8_t len = msg->data[0] & 0x0F;
+    if (len == 0 || len > ISOTP_SF_MAX_DATA || len > msg->len - 1) {
+        return;
+    }
+
+    if (isotp_rx_state == ISOTP_RX_COMPLETE) {
+        isotp_events |= ISOTP_EVENT_RX_DROPPED;
+        return;
+    }
+
+    // A new PDU replaces any reception in progress
+    memcpy(isotp_rx_buffer, &msg->data[1], len);
+    isotp_rx_len = len;
+    isotp_rx_state = ISOTP_RX_COMPLETE;
+}
+
+static void isotp_receive_first(const CAN_Message* msg) {
+    if (msg->len < 8) {
+        return;
+    }
+
+    uint16_t len = (uint16_t)(((msg->data[0] & 0x0F) << 8) | msg->data[1]);
+    if (len <= ISOTP_SF_MAX_DATA) {
+        return;
+    }
+
+    if (isotp_rx_state == ISOTP_RX_COMPLETE || len > ISOTP_MAX_PDU_LEN) {
+        if (isotp_rx_state == ISOTP_RX_COMPLETE) {
+            isotp_events |= ISOTP_EVENT_RX_DROPPED;
+        }
+        isotp_fc_pending = ISOTP_FC_OVERFLOW;
+        isotp_send_flow_control();
+        return;
+    }
+
+    memcpy(isotp_rx_buffer, &msg->data[2], ISOTP_FF_DATA);
+    isotp_rx_len = len;
+    isotp_rx_offset = ISOTP_FF_DATA;
+    isotp_rx_sn = 1;
+    isotp_rx_block_remaining = isotp_config.block_size;
+    isotp_rx_time = can_get_timestamp_us();
+    isotp_rx_state = ISOTP_RX_RECEIVING;
+
+    isotp_fc_pending = ISOTP_FC_CONTINUE;
+    isotp_send_flow_control();
+}
+
+static void isotp_receive_consecutive(const CAN_Message* msg) {
+    if (isotp_rx_state != ISOTP_RX_RECEIVING || msg->len < 1) {
+        return;
+    }
+
+    if ((msg->data[0] & 0x0F) != isotp_rx_sn) {
+        isotp_rx_state = ISOTP_RX_IDLE;
+        isotp_events |= ISOTP_EVENT_RX_ERROR;
+        return;
+    }
+
+    uint16_t remaining = isotp_rx_len - isotp_rx_offset;
+    uint8_t len = (remaining < ISOTP_CF_DATA) ? (uint8_t)remaining : ISOTP_CF_DATA;
+    if (len > msg->len - 1) {
+        len = msg->len - 1;
+    }
+    memcpy(&isotp_rx_buffer[isotp_rx_offset], &msg->data[1], len);
+    isotp_rx_offset += len;
+    isotp_rx_sn = (isotp_rx_sn + 1) & 0x0F;
+    isotp_rx_time = can_get_timestamp_us();
+
+    if (isotp_rx_offset >= isotp_rx_len) {
+        isotp_rx_state = ISOTP_RX_COMPLETE;
+    } else if (isotp_config.block_size != 0 && --isotp_rx_block_remaining == 0) {
+        isotp_rx_block_remaining = isotp_config.block_size;
+        isotp_fc_pending = ISOTP_FC_CONTINUE;
+        isotp_send_flow_control();
+    }
+}
+
+static void isotp_receive_flow_control(const CAN_Message* msg) {
+    if (isotp_tx_state != ISOTP_TX_WAIT_FC || msg->len < 3) {
+        return;
+    }
+
+    switch (msg->data[0] & 0x0F) {
+        case ISOTP_FC_CONTINUE: {
+            isotp_tx_block_size = msg->data[1];
+            isotp_tx_block_remaining = isotp_tx_block_size;
+            isotp_tx_st_min_us = isotp_st_min_us(msg->data[2]);
+            // The first consecutive frame may go right away
+            isotp_tx_time = can_get_timestamp_us() - isotp_tx_st_min_us;
+            isotp_tx_state = ISOTP_TX_SEND_CONSECUTIVE;
+            break;
+        }
+        case ISOTP_FC_WAIT: {
+            // Each WAIT restarts N_Bs, so limit how many in a row we take
+            if (++isotp_tx_wait_frames > ISOTP_MAX_WAIT_FRAMES) {
+                isotp_tx_state = ISOTP_TX_IDLE;
+                isotp_tx_len = 0;
+                isotp_events |= ISOTP_EVENT_TX_STALLED;
+            } else {
+                isotp_tx_time = can_get_timestamp_us();
+            }
+            break;
+        }
+        case ISOTP_FC_OVERFLOW:
+        default: {
+            isotp_tx_state = ISOTP_TX_IDLE;
+            isotp_tx_len = 0;
+            isotp_events |= ISOTP_EVENT_TX_REFUSED;
+            break;
+        }
+    }
+}
+
+/* Returns true if the frame belonged to the ISO-TP channel */
+bool isotp_handle_frame(const CAN_Message* msg) {
+    if (!isotp_active || msg->type != CANData || msg->len < 1
+        || msg->id != isotp_config.rx_id || msg->format != isotp_config.rx_format) {
+        return false;
+    }
+
+    switch (msg->data[0] & 0xF0) {
+        case ISOTP_PCI_SINGLE:
+            isotp_receive_single(msg);
+            break;
+        case ISOTP_PCI_FIRST:
+            isotp_receive_first(msg);
+            break;
+        case ISOTP_PCI_CONSECUTIVE:
+            isotp_receive_consecutive(msg);
+            break;
+        case ISOTP_PCI_FLOW_CONTROL:
+            isotp_receive_flow_control(msg);
+            break;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+static void isotp_tx_finish(uint8_t event) {
+    isotp_tx_state = ISOTP_TX_IDLE;
+    isotp_tx_len = 0;
+    isotp_events |= event;
+}
+
+/* Send whatever frames are due and check for timeouts */
+void isotp_update(void) {
+    if (!isotp_active) {
+        return;
+    }
+
+    uint32_t now = can_get_timestamp_us();
+    isotp_send_flow_control();
+
+    if (isotp_rx_state == ISOTP_RX_RECEIVING && (now - isotp_rx_time) > ISOTP_TIMEOUT_US) {
+        isotp_rx_state = ISOTP_RX_IDLE;
+        isotp_events |= ISOTP_EVENT_RX_TIMEOUT;
+    }
+
+    uint8_t frame[8];
+    switch (isotp_tx_state) {
+        case ISOTP_TX_SEND_SINGLE: {
+            frame[0] = (uint8_t)(ISOTP_PCI_SINGLE | isotp_tx_len);
+            memcpy(&frame[1], isotp_tx_buffer, isotp_tx_len);
+            if (isotp_send_frame(frame, (uint8_t)(1 + isotp_tx_len))) {
+                isotp_tx_finish(ISOTP_EVENT_TX_DONE);
+            }
+            break;
+        }
+        case ISOTP_TX_SEND_FIRST: {
+            frame[0] = (uint8_t)(ISOTP_PCI_FIRST | (isotp_tx_len >> 8));
+            frame[1] = (uint8_t)(isotp_tx_len & 0xFF);
+            memcpy(&frame[2], isotp_tx_buffer, ISOTP_FF_DATA);
+            if (isotp_send_frame(frame, sizeof(frame))) {
+                isotp_tx_offset = ISOTP_FF_DATA;
+                isotp_tx_sn = 1;
+                isotp_tx_time = now;
+                isotp_tx_wait_frames = 0;
+                isotp_tx_state = ISOTP_TX_WAIT_FC;
+            }
+            break;
+        }
+        case ISOTP_TX_WAIT_FC: {
+            if ((now - isotp_tx_time) > ISOTP_TIMEOUT_US) {
+                isotp_tx_finish(ISOTP_EVENT_TX_TIMEOUT);
+            }
+            break;
+        }
+        case ISOTP_TX_SEND_CONSECUTIVE: {
+            // Send as many frames as STmin allows, normally one
+            while (isotp_tx_state == ISOTP_TX_SEND_CONSECUTIVE
+                   && (now - isotp_tx_time) >= isotp_tx_st_min_us) {
+                uint16_t remaining = isotp_tx_len - isotp_tx_offset;
+                uint8_t len = (remaining < ISOTP_CF_DATA) ? (uint8_t)remaining : ISOTP_CF_DATA;
+                frame[0] = (uint8_t)(ISOTP_PCI_CONSECUTIVE | isotp_tx_sn);
+                memcpy(&frame[1], &isotp_tx_buffer[isotp_tx_offset], len);
+                if (!isotp_send_frame(frame, (uint8_t)(1 + len))) {
+                    break;
+                }
+                isotp_tx_offset += len;
+                isotp_tx_sn = (isotp_tx_sn + 1) & 0x0F;
+                isotp_tx_time = now;
+                if (isotp_tx_offset >= isotp_tx_len) {
+                    isotp_tx_finish(ISOTP_EVENT_TX_DONE);
+                } else if (isotp_tx_block_size != 0 && --isotp_tx_block_remaining == 0) {
+                    isotp_tx_wait_frames = 0;
+                    isotp_tx_state = ISOTP_TX_WAIT_FC;
+                } else if (isotp_tx_st_min_us != 0) {
+                    break;
+                }
+            }
+            break;
+        }
+        case ISOTP_TX_IDLE:
+        default:
+            break;
+    }
+}
+
+/* Add data to the next outgoing PDU */
+bool isotp_tx_append(const uint8_t* data, uint16_t len) {
+    if (!isotp_active || isotp_tx_state != ISOTP_TX_IDLE
+        || len > ISOTP_MAX_PDU_LEN - isotp_tx_len) {
+        return false;
+    }
+
+    memcpy(&isotp_tx_buffer[isotp_tx_len], data, len);
+    isotp_tx_len += len;
+    return true;
+}
+
+bool isotp_tx_start(void) {
+    if (!isotp_active || isotp_tx_state != ISOTP_TX_IDLE || isotp_tx_len == 0) {
+        return false;
+    }
+
+    if (isotp_tx_len <= ISOTP_SF_MAX_DATA) {
+        isotp_tx_state = ISOTP_TX_SEND_SINGLE;
+    } else {
+        isotp_tx_state = ISOTP_TX_SEND_FIRST;
+    }
+    isotp_update();
+    return true;
+}
+
+/* Returns the length of a complete received PDU, or 0 if there's none */
+uint16_t isotp_rx_pdu(const uint8_t** data) {
+    if (isotp_rx_state != ISOTP_RX_COMPLETE) {
+        return 0;
+    }
+    *data = isotp_rx_buffer;
+    return isotp_rx_len;
+}
+
+void isotp_rx_release(void) {
+    if (isotp_rx_state == ISOTP_RX_COMPLETE) {
+        isotp_rx_state = ISOTP_RX_IDLE;
+    }
+}
+
+#endif
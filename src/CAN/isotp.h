@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ISOTP_H_INCLUDED
+#define ISOTP_H_INCLUDED
+
+#include "can.h"
+
+/*
+ * ISO 15765-2 transport for one pair of CAN IDs, so that flow control
+ * is answered on the probe instead of waiting on a round trip through
+ * the host. Only classic CAN frames are supported.
+ */
+
+#define ISOTP_MAX_PDU_LEN 256
+
+/* How long to wait for the peer's next flow control or consecutive frame */
+#define ISOTP_TIMEOUT_US 1000000
+
+/* Consecutive flow control WAITs accepted before giving up (N_WFTmax) */
+#define ISOTP_MAX_WAIT_FRAMES 10
+
+typedef struct {
+    uint32_t tx_id;
+    uint32_t rx_id;
+    CANFormat tx_format;
+    CANFormat rx_format;
+    uint8_t block_size;         // Sent in our flow control frames
+    uint8_t st_min;             // Sent in our flow control frames
+    bool padding;               // Pad every frame to 8 bytes
+} IsotpConfig;
+
+/* Events reported by isotp_take_events() */
+#define ISOTP_EVENT_TX_DONE     (1 << 0)    // PDU fully queued for transmission
+#define ISOTP_EVENT_TX_TIMEOUT  (1 << 1)    // No flow control from the peer
+#define ISOTP_EVENT_TX_REFUSED  (1 << 2)    // Peer reported an overflow
+#define ISOTP_EVENT_RX_TIMEOUT  (1 << 3)    // Peer stopped mid-PDU
+#define ISOTP_EVENT_RX_ERROR    (1 << 4)    // Out of sequence consecutive frame
+#define ISOTP_EVENT_RX_DROPPED  (1 << 5)    // Previous PDU not yet collected
+#define ISOTP_EVENT_TX_STALLED  (1 << 6)    // Peer kept answering WAIT
+
+#define ISOTP_RAM_USAGE (2 * ISOTP_MAX_PDU_LEN + 64)
+
+extern void isotp_configure(const IsotpConfig* config);
+extern void isotp_disable(void);
+extern bool isotp_enabled(void);
+extern bool isotp_handle_frame(const CAN_Message* msg);
+extern void isotp_update(void);
+extern uint8_t isotp_take_events(void);
+
+extern bool isotp_tx_append(const uint8_t* data, uint16_t len);
+extern bool isotp_tx_start(void);
+
+extern uint16_t isotp_rx_pdu(const uint8_t** data);
+extern void isotp_rx_release(void);
+
+#endif
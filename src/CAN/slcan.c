@@ -21,54 +21,189 @@
 
 #include "USB/vcdc.h"
 #include "retarget.h"
+#include "config.h"
 #include "slcan.h"
+#include "can_stats.h"
+#include "can_cyclic.h"
+#include "isotp.h"
 
 CanMode slcan_mode;
-uint32_t slcan_baudrate;
+CanBitTiming slcan_timing;
+
+/* Standard bitrates for S0-S8 */
+static const uint32_t slcan_bitrates[] = {
+    10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000
+};
+
+#define SLCAN_NUM_BITRATES (sizeof(slcan_bitrates)/sizeof(slcan_bitrates[0]))
+
+/* SJA1000 clock assumed by the sxxyy BTR0/BTR1 command */
+#define SLCAN_SJA1000_CLOCK 16000000
+
+/* SJA1000 acceptance code and mask; mask bits set are don't-care */
+static uint32_t slcan_acceptance_code = 0x00000000;
+static uint32_t slcan_acceptance_mask = 0xFFFFFFFF;
+
+/* Append a millisecond timestamp to received frames */
+static bool slcan_timestamping = false;
+
+#define SLCAN_TIMESTAMP_PERIOD_MS 60000
+
+/*
+ * Statistics mode: with a non-zero interval, received frames are
+ * summarized per ID instead of forwarded. Each interval ends with one
+ * line per active ID, written out as TX buffer space allows, followed
+ * by a bus summary line.
+ */
+#define SLCAN_STATS_IDLE -1
+
+static uint16_t slcan_stats_interval_ms = 0;
+static uint32_t slcan_stats_start_us;
+static uint32_t slcan_stats_elapsed_us;
+static int16_t slcan_stats_cursor = SLCAN_STATS_IDLE;
+
+/*
+ * Convert a microsecond frame timestamp into the 0-59999ms SLCAN
+ * timestamp. The elapsed time between frames is accumulated so that
+ * the microsecond counter wrapping doesn't disturb the millisecond
+ * count.
+ */
+static uint32_t slcan_last_timestamp_us;
+static uint32_t slcan_timestamp_remainder_us;
+static uint16_t slcan_timestamp_ms;
+
+static void slcan_reset_timestamp(void) {
+    slcan_last_timestamp_us = can_get_timestamp_us();
+    slcan_timestamp_remainder_us = 0;
+    slcan_timestamp_ms = 0;
+}
+
+static uint16_t slcan_convert_timestamp(uint32_t timestamp_us) {
+    uint32_t elapsed_us = timestamp_us - slcan_last_timestamp_us;
+    slcan_last_timestamp_us = timestamp_us;
+
+    uint32_t elapsed_ms = elapsed_us / 1000;
+    slcan_timestamp_remainder_us += elapsed_us % 1000;
+    if (slcan_timestamp_remainder_us >= 1000) {
+        slcan_timestamp_remainder_us -= 1000;
+        elapsed_ms++;
+    }
+
+    slcan_timestamp_ms = (uint16_t)((slcan_timestamp_ms + elapsed_ms % SLCAN_TIMESTAMP_PERIOD_MS)
+                                    % SLCAN_TIMESTAMP_PERIOD_MS);
+    return slcan_timestamp_ms;
+}
+
+/* Lawicel status flags reported by the F command */
+#define SLCAN_STATUS_RX_FULL        (1 << 0)
+#define SLCAN_STATUS_TX_FULL        (1 << 1)
+#define SLCAN_STATUS_ERROR_WARNING  (1 << 2)
+#define SLCAN_STATUS_DATA_OVERRUN   (1 << 3)
+#define SLCAN_STATUS_ERROR_PASSIVE  (1 << 5)
+#define SLCAN_STATUS_BUS_ERROR      (1 << 7)
+
+/* Error counts as of the last F command, so that F reports new events */
+static CanErrorCounts slcan_reported_errors;
+
+static uint8_t slcan_read_status(void) {
+    uint8_t status = 0;
+    if (can_rx_buffer_full()) {
+        status |= SLCAN_STATUS_RX_FULL;
+    }
+    if (can_tx_queue_full()) {
+        status |= SLCAN_STATUS_TX_FULL;
+    }
+
+    uint8_t tec, rec;
+    CanBusState state = can_get_bus_state(&tec, &rec);
+    if (state == CAN_BUS_ERROR_WARNING) {
+        status |= SLCAN_STATUS_ERROR_WARNING;
+    } else if (state == CAN_BUS_ERROR_PASSIVE || state == CAN_BUS_OFF) {
+        status |= SLCAN_STATUS_ERROR_WARNING | SLCAN_STATUS_ERROR_PASSIVE;
+    }
+
+    CanErrorCounts counts;
+    can_get_error_counts(&counts);
+    if (counts.fifo_overruns != slcan_reported_errors.fifo_overruns
+        || counts.rx_buffer_overflows != slcan_reported_errors.rx_buffer_overflows) {
+        status |= SLCAN_STATUS_DATA_OVERRUN;
+    }
+    if (counts.bus_errors != slcan_reported_errors.bus_errors) {
+        status |= SLCAN_STATUS_BUS_ERROR;
+    }
+    slcan_reported_errors = counts;
+
+    return status;
+}
+
+/*
+ * Hex digit values indexed from '0' through 'f'; anything else in that
+ * range maps to SLCAN_HEX_INVALID.
+ */
+#define SLCAN_HEX_INVALID 0xFF
+#define X SLCAN_HEX_INVALID
+
+static const uint8_t slcan_hex_values['f' - '0' + 1] = {
+    0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9,   // 0-9
+    X, X, X, X, X, X, X,                                // :;<=>?@
+    0xA, 0xB, 0xC, 0xD, 0xE, 0xF,                       // A-F
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,     // G-V
+    X, X, X, X, X, X, X, X, X, X,                       // W-`
+    0xA, 0xB, 0xC, 0xD, 0xE, 0xF,                       // a-f
+};
+
+#undef X
+
+static const char slcan_hex_digits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+static inline uint8_t parse_hex_nibble(char c) {
+    uint8_t index = (uint8_t)(c - '0');
+    if (index >= sizeof(slcan_hex_values)) {
+        return SLCAN_HEX_INVALID;
+    }
+    return slcan_hex_values[index];
+}
 
 static bool parse_hex_digits(const char* input, uint8_t num_digits, uint32_t* value_out) {
-    bool success = true;
     uint32_t value = 0;
 
     uint8_t i;
     for (i=0; i < num_digits; i++) {
-        uint32_t nibble = 0;
-        if (input[i] >= '0' && input[i] <= '9') {
-            nibble = 0x0 + (input[i] - '0');
-        } else if (input[i] >= 'a' && input[i] <= 'f') {
-            nibble = 0xA + (input[i] - 'a');
-        } else if (input[i] >= 'A' && input[i] <= 'F') {
-            nibble = 0xA + (input[i] - 'A');
-        } else {
-            success = false;
-            break;
+        uint8_t nibble = parse_hex_nibble(input[i]);
+        if (nibble == SLCAN_HEX_INVALID) {
+            return false;
         }
-        uint8_t offset = 4*(num_digits-i-1);
-        value |= (nibble << offset);
+        value = (value << 4) | nibble;
     }
 
-    if (success) {
-        *value_out = value;
-    }
-
-    return success;
+    *value_out = value;
+    return true;
 }
 
 static bool parse_hex_values(const char* input, uint8_t num_values, uint8_t* values_out) {
     uint8_t i;
     for (i=0; i < num_values; i++) {
-        uint32_t value;
-        if (parse_hex_digits(input, 2, &value)) {
-            values_out[i] = (uint8_t)value;
-        } else {
+        uint8_t high = parse_hex_nibble(input[0]);
+        uint8_t low = parse_hex_nibble(input[1]);
+        if (high == SLCAN_HEX_INVALID || low == SLCAN_HEX_INVALID) {
             return false;
         }
+        values_out[i] = (uint8_t)((high << 4) | low);
         input += 2;
     }
 
     return true;
 }
 
+static inline char* format_hex_byte(char* output, uint8_t value) {
+    output[0] = slcan_hex_digits[value >> 4];
+    output[1] = slcan_hex_digits[value & 0xF];
+    return output + 2;
+}
+
 static bool parse_dec_digit(const char* input, uint8_t* value_out) {
     if (input[0] >= '0' && input[0] <= '9') {
         *value_out = 0 + (input[0] - '0');
@@ -78,6 +213,103 @@ static bool parse_dec_digit(const char* input, uint8_t* value_out) {
     }
 }
 
+/*
+ * Map the SJA1000 single filter onto the CAN acceptance filters. The
+ * code and mask are read as an 11-bit ID in the top bits for standard
+ * frames and as a 29-bit ID in the top bits for extended frames. The
+ * RTR and data byte bits of the filter are not matched, so the result
+ * may let through more frames than an SJA1000 would.
+ */
+static void slcan_apply_filter(void) {
+    can_filter_clear();
+    if (slcan_acceptance_mask == 0xFFFFFFFF) {
+        return;
+    }
+
+    uint32_t match = ~slcan_acceptance_mask;
+    can_filter_add_mask(slcan_acceptance_code >> 21, match >> 21, CANStandard);
+    can_filter_add_mask(slcan_acceptance_code >> 3, match >> 3, CANExtended);
+}
+
+static bool slcan_open(CanMode mode) {
+    slcan_mode = mode;
+    slcan_apply_filter();
+    slcan_reset_timestamp();
+    return can_reconfigure_timing(&slcan_timing, slcan_mode);
+}
+
+static bool slcan_set_bitrate(uint32_t bitrate) {
+    CanBitTiming timing;
+    uint32_t error_ppm;
+    if (!can_calc_bit_timing(can_get_clock(), bitrate, CAN_DEFAULT_SAMPLE_POINT,
+                             &timing, &error_ppm)
+        || error_ppm > CAN_MAX_BITRATE_ERROR_PPM) {
+        return false;
+    }
+
+    slcan_timing = timing;
+    return true;
+}
+
+/*
+ * Translate SJA1000 BTR0/BTR1 values, which count time quanta of a
+ * 16MHz clock. When our CAN clock is a multiple of 8MHz the quantum
+ * can be reproduced exactly; otherwise fall back to solving for the
+ * same bitrate and sample point.
+ */
+static bool slcan_set_sja1000_btr(uint8_t btr0, uint8_t btr1) {
+    uint32_t sja_brp = 2 * ((btr0 & 0x3Fu) + 1);
+    uint32_t sjw = ((btr0 >> 6) & 0x3u) + 1;
+    uint32_t ts1 = (btr1 & 0xFu) + 1;
+    uint32_t ts2 = ((btr1 >> 4) & 0x7u) + 1;
+    uint32_t tq = 1 + ts1 + ts2;
+    uint32_t clock = can_get_clock();
+
+    if (clock % (SLCAN_SJA1000_CLOCK / 2) == 0) {
+        uint32_t brp = sja_brp * (clock / (SLCAN_SJA1000_CLOCK / 2)) / 2;
+        if (brp > CAN_BRP_MAX) {
+            return false;
+        }
+        slcan_timing.brp = (uint16_t)brp;
+        slcan_timing.ts1 = (uint8_t)ts1;
+        slcan_timing.ts2 = (uint8_t)ts2;
+        slcan_timing.sjw = (uint8_t)sjw;
+        return true;
+    }
+
+    CanBitTiming timing;
+    uint32_t error_ppm;
+    uint32_t bitrate = SLCAN_SJA1000_CLOCK / (sja_brp * tq);
+    uint16_t sample_point = (uint16_t)((1 + ts1) * 1000 / tq);
+    if (!can_calc_bit_timing(clock, bitrate, sample_point, &timing, &error_ppm)
+        || error_ppm > CAN_MAX_BITRATE_ERROR_PPM) {
+        return false;
+    }
+    timing.sjw = (uint8_t)((sjw < timing.ts2) ? sjw : timing.ts2);
+    slcan_timing = timing;
+    return true;
+}
+
+/*
+ * Direct bxCAN timing as sBBBxyz: BBB is the prescaler minus one,
+ * x, y and z are TS1, TS2 and SJW minus one.
+ */
+static bool slcan_set_raw_timing(uint32_t value) {
+    CanBitTiming timing = {
+        .brp = (uint16_t)(((value >> 12) & 0x3FF) + 1),
+        .ts1 = (uint8_t)(((value >> 8) & 0xF) + 1),
+        .ts2 = (uint8_t)(((value >> 4) & 0xF) + 1),
+        .sjw = (uint8_t)((value & 0xF) + 1),
+    };
+
+    if ((value >> 22) != 0 || timing.ts2 > CAN_TS2_MAX || timing.sjw > CAN_SJW_MAX) {
+        return false;
+    }
+
+    slcan_timing = timing;
+    return true;
+}
+
 static bool slcan_process_config_command(const char* command, size_t len) {
     bool success = false;
 
@@ -106,68 +338,55 @@ static bool slcan_process_config_command(const char* command, size_t len) {
 
     switch (command[0]) {
         case 'S': {
-            switch (command[1]) {
-                case '3':
-                    slcan_baudrate = 100000;
-                    success = true;
-                    break;
-                case '4':
-                    slcan_baudrate = 125000;
-                    success = true;
-                    break;
-                case '5':
-                    slcan_baudrate = 250000;
-                    success = true;
-                    break;
-                case '6':
-                    slcan_baudrate = 500000;
-                    success = true;
-                    break;
-                case '8':
-                    slcan_baudrate = 1000000;
-                    success = true;
-                    break;
-                default:
-                    success = false;
-                    break;
+            uint8_t index;
+            if (parse_dec_digit(&command[1], &index) && index < SLCAN_NUM_BITRATES) {
+                success = slcan_set_bitrate(slcan_bitrates[index]);
             }
             break;
         }
         case 'O': {
-            slcan_mode = MODE_NORMAL;
-            success = can_reconfigure(slcan_baudrate, slcan_mode);
+            success = slcan_open(MODE_NORMAL);
             break;
         }
         case 'L': {
-            slcan_mode = MODE_SILENT;
-            success = can_reconfigure(slcan_baudrate, slcan_mode);
+            success = slcan_open(MODE_SILENT);
             break;
         }
         case 'l': {
-            slcan_mode = MODE_TEST_SILENT;
-            success = can_reconfigure(slcan_baudrate, slcan_mode);
+            success = slcan_open(MODE_TEST_SILENT);
             break;
         }
         case 'C': {
+            if (CAN_CYCLIC_AVAILABLE) {
+                can_cyclic_stop_all();
+            }
             slcan_mode = MODE_RESET;
-            success = can_reconfigure(slcan_baudrate, slcan_mode);
+            success = can_reconfigure_timing(&slcan_timing, slcan_mode);
             break;
         }
-        // Dummy commands for compatibility
-        case 's': {
-            // TODO: implement direct BTR control
-            success = true;
+        // Acceptance filter, applied when the channel is opened
+        case 'M': {
+            success = parse_hex_digits(&command[1], 8, &slcan_acceptance_code);
             break;
         }
-        case 'M':
         case 'm': {
-            // TODO: implement filtering
-            success = true;
+            success = parse_hex_digits(&command[1], 8, &slcan_acceptance_mask);
+            break;
+        }
+        case 's': {
+            uint32_t value;
+            if (len == 5 && parse_hex_digits(&command[1], 4, &value)) {
+                success = slcan_set_sja1000_btr((uint8_t)(value >> 8), (uint8_t)value);
+            } else if (len == 7 && parse_hex_digits(&command[1], 6, &value)) {
+                success = slcan_set_raw_timing(value);
+            }
             break;
         }
         case 'Z': {
-            // TODO: implement timestamping
-            success = true;
+            if (command[1] == '0' || command[1] == '1') {
+                slcan_timestamping = (command[1] == '1');
+                success = true;
+            }
             break;
         }
         default: {
@@ -179,42 +398,47 @@ static bool slcan_process_config_command(const char* command, size_t len) {
     return success;
 }
 
-static bool slcan_process_transmit_command(const char* command, size_t len) {
-    bool success = false;
-
-    if (slcan_mode == MODE_RESET || slcan_mode == MODE_SILENT) {
-        return false;
-    }
-
+/* Parse a frame in t, T, r or R command syntax */
+static bool slcan_parse_frame(const char* command, size_t len, CAN_Message* msg) {
     bool valid_message = false;
-    CAN_Message msg;
     if (command[0] == 't' || command[0] == 'T') {
-        msg.type = CANData;
-        msg.format = (command[0] == 't') ? CANStandard : CANExtended;
-        size_t id_len = msg.format == CANStandard ? 3 : 8;
+        msg->type = CANData;
+        msg->format = (command[0] == 't') ? CANStandard : CANExtended;
+        size_t id_len = msg->format == CANStandard ? 3 : 8;
         if ((len >= id_len + 2) &&
-            parse_hex_digits(&command[1], id_len, &msg.id) &&
-            parse_dec_digit(&command[id_len + 1], &msg.len)) {
-            if ((len == id_len + 2 + 2*msg.len) &&
-                (msg.len <= 8) &&
-                parse_hex_values(&command[id_len + 2], msg.len, msg.data)) {
+            parse_hex_digits(&command[1], id_len, &msg->id) &&
+            parse_dec_digit(&command[id_len + 1], &msg->len)) {
+            if ((len == id_len + 2 + 2*msg->len) &&
+                (msg->len <= 8) &&
+                parse_hex_values(&command[id_len + 2], msg->len, msg->data)) {
                 valid_message = true;
             }
         }
     } else if (command[0] == 'r' || command[0] == 'R') {
-        msg.type = CANRemote;
-        msg.format = (command[0] == 'r') ? CANStandard : CANExtended;
-        size_t id_len = msg.format == CANStandard ? 3 : 8;
+        msg->type = CANRemote;
+        msg->format = (command[0] == 'r') ? CANStandard : CANExtended;
+        size_t id_len = msg->format == CANStandard ? 3 : 8;
         if ((len == id_len + 2) &&
-            parse_hex_digits(&command[1], id_len, &msg.id) &&
-            parse_dec_digit(&command[id_len + 1], &msg.len)) {
-            if (msg.len <= 8) {
+            parse_hex_digits(&command[1], id_len, &msg->id) &&
+            parse_dec_digit(&command[id_len + 1], &msg->len)) {
+            if (msg->len <= 8) {
                 valid_message = true;
             }
         }
     }
 
-    if (valid_message) {
+    return valid_message;
+}
+
+static bool slcan_process_transmit_command(const char* command, size_t len) {
+    bool success = false;
+
+    if (slcan_mode == MODE_RESET || slcan_mode == MODE_SILENT) {
+        return false;
+    }
+
+    CAN_Message msg;
+    if (slcan_parse_frame(command, len, &msg)) {
         if (command[0] == 'r' || command[0] == 't') {
             vcdc_putchar('z');
         } else {
@@ -226,6 +450,59 @@ static bool slcan_process_transmit_command(const char* command, size_t len) {
     return success;
 }
 
+/*
+ * Cyclic transmission, with n the slot number:
+ *   Jn<frame>                  set the frame, in t/T/r/R syntax
+ *   jnPPPPPPPPHHHHHHHHccss     send it every P us at phase H us,
+ *                              incrementing data byte cc and setting
+ *                              byte ss to the XOR of the others (FF
+ *                              for neither)
+ *   kn                         stop sending it
+ */
+static bool slcan_process_cyclic_command(const char* command, size_t len) {
+    uint8_t slot;
+    if (len < 2 || !parse_dec_digit(&command[1], &slot)) {
+        return false;
+    }
+
+    bool success = false;
+    switch (command[0]) {
+        case 'J': {
+            CAN_Message msg;
+            if (slcan_parse_frame(&command[2], len - 2, &msg)) {
+                success = can_cyclic_set_frame(slot, &msg);
+            }
+            break;
+        }
+        case 'j': {
+            uint32_t period_us, phase_us;
+            uint8_t bytes[2];
+            if (slcan_mode == MODE_RESET || slcan_mode == MODE_SILENT) {
+                return false;
+            }
+            if (len == 22
+                && parse_hex_digits(&command[2], 8, &period_us)
+                && parse_hex_digits(&command[10], 8, &phase_us)
+                && parse_hex_values(&command[18], 2, bytes)) {
+                success = can_cyclic_start(slot, period_us, phase_us, bytes[0], bytes[1]);
+            }
+            break;
+        }
+        case 'k': {
+            if (len == 2) {
+                success = can_cyclic_stop(slot);
+            }
+            break;
+        }
+        default: {
+            success = false;
+            break;
+        }
+    }
+
+    return success;
+}
+
 static bool slcan_process_diagnostic_command(const char* command, size_t len) {
     bool success = false;
 
@@ -260,9 +537,26 @@ static bool slcan_process_diagnostic_command(const char* command, size_t len) {
             break;
         }
         case 'F': {
-            // Internal status register
+            // Internal status register; event flags clear on read
             success = true;
-            vcdc_print("F00");
+            vcdc_putchar('F');
+            vcdc_print_hex_byte(slcan_read_status());
+            break;
+        }
+        case 'e': {
+            // Extension: cumulative FIFO overruns, RX buffer overflows,
+            // bus errors, then the transmit and receive error counters
+            CanErrorCounts counts;
+            uint8_t tec, rec;
+            can_get_error_counts(&counts);
+            (void)can_get_bus_state(&tec, &rec);
+            success = true;
+            vcdc_putchar('e');
+            vcdc_print_hex(counts.fifo_overruns);
+            vcdc_print_hex(counts.rx_buffer_overflows);
+            vcdc_print_hex(counts.bus_errors);
+            vcdc_print_hex_byte(tec);
+            vcdc_print_hex_byte(rec);
             break;
         }
         case 'W': {
@@ -279,6 +573,69 @@ static bool slcan_process_diagnostic_command(const char* command, size_t len) {
     return success;
 }
 
+/* Yxxxx: summarize frames every xxxx milliseconds, or stream them if 0 */
+static bool slcan_process_stats_command(const char* command, size_t len) {
+    uint32_t interval_ms;
+    if (len != 5 || !parse_hex_digits(&command[1], 4, &interval_ms)) {
+        return false;
+    }
+
+    slcan_stats_interval_ms = (uint16_t)interval_ms;
+    slcan_stats_start_us = can_get_timestamp_us();
+    slcan_stats_cursor = SLCAN_STATS_IDLE;
+    can_stats_clear();
+    return true;
+}
+
+/*
+ * ISO-TP channel:
+ *   I                          disable it
+ *   ITTTTTTTTRRRRRRRRbbssff    use transmit ID T and receive ID R, with
+ *                              bit 31 set for extended IDs, and answer
+ *                              with block size b and STmin s; flag 01
+ *                              in f pads frames to 8 bytes
+ *   i<hex>                     add up to 15 bytes to the outgoing PDU
+ *   i                          send the PDU
+ */
+#define SLCAN_ISOTP_EXTENDED (1UL << 31)
+
+static bool slcan_process_isotp_command(const char* command, size_t len) {
+    bool success = false;
+    if (command[0] == 'I') {
+        uint32_t tx_id, rx_id;
+        uint8_t params[3];
+        if (len == 1) {
+            isotp_disable();
+            success = true;
+        } else if (len == 23
+                   && parse_hex_digits(&command[1], 8, &tx_id)
+                   && parse_hex_digits(&command[9], 8, &rx_id)
+                   && parse_hex_values(&command[17], 3, params)) {
+            IsotpConfig config = {
+                .tx_id = tx_id & CAN_EXT_ID_MASK,
+                .rx_id = rx_id & CAN_EXT_ID_MASK,
+                .tx_format = (tx_id & SLCAN_ISOTP_EXTENDED) ? CANExtended : CANStandard,
+                .rx_format = (rx_id & SLCAN_ISOTP_EXTENDED) ? CANExtended : CANStandard,
+                .block_size = params[0],
+                .st_min = params[1],
+                .padding = (params[2] & 0x01) != 0,
+            };
+            isotp_configure(&config);
+            success = true;
+        }
+    } else if (len == 1) {
+        success = isotp_tx_start();
+    } else if ((len % 2) == 1) {
+        uint8_t data[(SLCAN_MAX_MESSAGE_LEN - 1) / 2];
+        uint8_t num_bytes = (uint8_t)((len - 1) / 2);
+        if (parse_hex_values(&command[1], num_bytes, data)) {
+            success = isotp_tx_append(data, num_bytes);
+        }
+    }
+
+    return success;
+}
+
 bool slcan_exec_command(const char* command, size_t len) {
     bool success = false;
 
@@ -296,6 +653,17 @@ bool slcan_exec_command(const char* command, size_t len) {
             success = slcan_process_config_command(command, len);
             break;
         }
+        // ISO-TP commands
+        case 'I':
+        case 'i': {
+            success = ISOTP_AVAILABLE && slcan_process_isotp_command(command, len);
+            break;
+        }
+        // Statistics mode
+        case 'Y': {
+            success = CAN_STATS_AVAILABLE && slcan_process_stats_command(command, len);
+            break;
+        }
         // Transmission commands
         case 't':
         case 'T':
@@ -304,11 +672,19 @@ bool slcan_exec_command(const char* command, size_t len) {
             success = slcan_process_transmit_command(command, len);
             break;
         }
+        // Cyclic transmission commands
+        case 'J':
+        case 'j':
+        case 'k': {
+            success = CAN_CYCLIC_AVAILABLE && slcan_process_cyclic_command(command, len);
+            break;
+        }
         // Diagnostic commands
         case 'V':
         case 'v':
         case 'N':
         case 'F':
+        case 'e':
         case 'W': {
             success = slcan_process_diagnostic_command(command, len);
             break;
@@ -325,48 +701,212 @@ bool slcan_exec_command(const char* command, size_t len) {
 static size_t slcan_calc_message_length(const CAN_Message* msg) {
     size_t len;
     if (msg->format == CANStandard) {
-        len = 1 + 3 + 1 + (2 * msg->len) + 1;
+        len = 1 + 3 + 1 + 1;
     } else {
-        len = 1 + 8 + 1 + (2 * msg->len) + 1;
+        len = 1 + 8 + 1 + 1;
+    }
+
+    // Remote frames only carry the DLC
+    if (msg->type == CANData) {
+        len += 2 * msg->len;
+    }
+
+    if (slcan_timestamping) {
+        len += 4;
     }
 
     return len;
 }
 
+/* Format a received message into output, returning the length used */
+static size_t slcan_format_message(const CAN_Message* msg, char* output) {
+    char* p = output;
+    if (msg->format == CANStandard) {
+        *p++ = (msg->type == CANData) ? 't' : 'r';
+        *p++ = slcan_hex_digits[(msg->id >> 8) & 0x7];
+        p = format_hex_byte(p, (uint8_t)(msg->id & 0xFF));
+    } else {
+        *p++ = (msg->type == CANData) ? 'T' : 'R';
+        p = format_hex_byte(p, (uint8_t)(msg->id >> 24));
+        p = format_hex_byte(p, (uint8_t)(msg->id >> 16));
+        p = format_hex_byte(p, (uint8_t)(msg->id >> 8));
+        p = format_hex_byte(p, (uint8_t)(msg->id & 0xFF));
+    }
+    *p++ = (char)('0' + msg->len);
+
+    if (msg->type == CANData) {
+        uint8_t i;
+        for (i=0; i < msg->len; i++) {
+            p = format_hex_byte(p, msg->data[i]);
+        }
+    }
+
+    if (slcan_timestamping) {
+        uint16_t timestamp = slcan_convert_timestamp(msg->timestamp);
+        p = format_hex_byte(p, (uint8_t)(timestamp >> 8));
+        p = format_hex_byte(p, (uint8_t)(timestamp & 0xFF));
+    }
+    *p++ = '\r';
+
+    return (size_t)(p - output);
+}
+
+static inline char* format_hex_word(char* output, uint32_t value) {
+    output = format_hex_byte(output, (uint8_t)(value >> 24));
+    output = format_hex_byte(output, (uint8_t)(value >> 16));
+    output = format_hex_byte(output, (uint8_t)(value >> 8));
+    return format_hex_byte(output, (uint8_t)(value & 0xFF));
+}
+
+/* Longest statistics line: an extended ID with 8 data bytes */
+#define SLCAN_STATS_MAX_LINE_LEN (1 + 8 + 1 + 8 + 8 + 8 + 2 + 16 + 1)
+
+/*
+ * Format one ID's statistics as y/Y, the ID and last DLC as in t/T,
+ * then the frame count, the shortest and longest period in
+ * microseconds (FFFFFFFF and 0 without a second frame), the number of
+ * DLC changes and the last payload.
+ */
+static size_t slcan_format_stats_entry(const CanStatsEntry* entry, char* output) {
+    char* p = output;
+    if (entry->key & CAN_STATS_EXTENDED) {
+        *p++ = 'Y';
+        p = format_hex_word(p, entry->key & CAN_EXT_ID_MASK);
+    } else {
+        *p++ = 'y';
+        *p++ = slcan_hex_digits[(entry->key >> 8) & 0x7];
+        p = format_hex_byte(p, (uint8_t)(entry->key & 0xFF));
+    }
+    *p++ = (char)('0' + entry->len);
+    p = format_hex_word(p, entry->count);
+    p = format_hex_word(p, entry->min_period);
+    p = format_hex_word(p, entry->max_period);
+    p = format_hex_byte(p, entry->dlc_changes);
+
+    uint8_t i;
+    for (i=0; i < entry->len; i++) {
+        p = format_hex_byte(p, entry->data[i]);
+    }
+    *p++ = '\r';
+
+    return (size_t)(p - output);
+}
+
+#define SLCAN_STATS_SUMMARY_LEN (1 + 4 + 8 + 8 + 1)
+
+/*
+ * Format the bus summary as u, the bus load in tenths of a percent,
+ * the total frame count and the count of frames whose IDs didn't fit
+ * in the table.
+ */
+static size_t slcan_format_stats_summary(const CanStatsTotals* totals,
+                                         uint32_t elapsed_us, char* output) {
+    // Bits the bus could have carried, computed without overflowing
+    uint32_t bitrate = can_bit_timing_bitrate(can_get_clock(), &slcan_timing);
+    uint32_t capacity = (bitrate / 1000) * (elapsed_us / 1000);
+    uint32_t load = 0;
+    if (capacity >= 1000) {
+        load = totals->bits / (capacity / 1000);
+    } else if (capacity > 0) {
+        load = (totals->bits * 1000) / capacity;
+    }
+    if (load > 0xFFFF) {
+        load = 0xFFFF;
+    }
+
+    char* p = output;
+    *p++ = 'u';
+    p = format_hex_byte(p, (uint8_t)(load >> 8));
+    p = format_hex_byte(p, (uint8_t)(load & 0xFF));
+    p = format_hex_word(p, totals->frames);
+    p = format_hex_word(p, totals->untracked);
+    *p++ = '\r';
+
+    return (size_t)(p - output);
+}
+
+static bool slcan_output_stats(void) {
+    bool active = false;
+
+    // Take in everything received so far
+    while (!can_rx_buffer_empty()) {
+        const CAN_Message* msg = can_rx_buffer_peek();
+        if (!(ISOTP_AVAILABLE && isotp_handle_frame(msg))) {
+            can_stats_add(msg);
+        }
+        can_rx_buffer_pop();
+        active = true;
+    }
+
+    if (slcan_stats_cursor == SLCAN_STATS_IDLE) {
+        uint32_t now = can_get_timestamp_us();
+        if ((now - slcan_stats_start_us) < (uint32_t)slcan_stats_interval_ms * 1000) {
+            return active;
+        }
+        slcan_stats_elapsed_us = now - slcan_stats_start_us;
+        slcan_stats_start_us = now;
+        slcan_stats_cursor = 0;
+    }
+
+    char output[SLCAN_STATS_MAX_LINE_LEN];
+    while (slcan_stats_cursor < CAN_STATS_TABLE_SIZE) {
+        const CanStatsEntry* entry = can_stats_get((uint8_t)slcan_stats_cursor);
+        if (entry != NULL && entry->count > 0) {
+            if (vcdc_send_buffer_space() < SLCAN_STATS_MAX_LINE_LEN) {
+                return active;
+            }
+            vcdc_send_buffered((const uint8_t*)output,
+                               slcan_format_stats_entry(entry, output));
+            active = true;
+        }
+        if (entry != NULL) {
+            can_stats_restart((uint8_t)slcan_stats_cursor);
+        }
+        slcan_stats_cursor++;
+    }
+
+    if (vcdc_send_buffer_space() < SLCAN_STATS_SUMMARY_LEN) {
+        return active;
+    }
+    CanStatsTotals totals;
+    can_stats_take_totals(&totals);
+    vcdc_send_buffered((const uint8_t*)output,
+                       slcan_format_stats_summary(&totals, slcan_stats_elapsed_us, output));
+    can_stats_evict_idle();
+    slcan_stats_cursor = SLCAN_STATS_IDLE;
+    return true;
+}
+
 bool slcan_output_messages(void) {
     if (slcan_mode == MODE_RESET) {
         return false;
     }
+    if (CAN_STATS_AVAILABLE && slcan_stats_interval_ms != 0) {
+        return slcan_output_stats();
+    }
     bool read = false;
 
+    char output[SLCAN_MAX_MESSAGE_LEN+1];
     size_t avail_buf_len = vcdc_send_buffer_space();
     while (!can_rx_buffer_empty()) {
         // Examine the current message without dequeuing it
         CAN_Message* msg = can_rx_buffer_peek();
 
+        // Frames for the ISO-TP channel are handled on the probe
+        if (ISOTP_AVAILABLE && isotp_handle_frame(msg)) {
+            can_rx_buffer_pop();
+            read = true;
+            continue;
+        }
+
         // Stop processing messages if there's no more room
         size_t msg_len = slcan_calc_message_length(msg);
         if (msg_len > avail_buf_len) {
             break;
         }
-        
-        read = true;
-        if (msg->format == CANStandard) {
-            vcdc_print(msg->type == CANData ? "t" : "r");
-            vcdc_print_hex_nibble((uint8_t)(msg->id >> 8));
-            vcdc_print_hex_byte((uint8_t)(msg->id & 0xFF));
-            vcdc_putchar('0' + msg->len);
-        } else {
-            vcdc_print(msg->type == CANData ? "T" : "R");
-            vcdc_print_hex(msg->id);
-            vcdc_putchar('0' + msg->len);
-        }
-        uint8_t i = 0;
-        for (i=0; i < msg->len; i++) {
-            vcdc_print_hex_byte(msg->data[i]);
-        }
-        vcdc_putchar('\r');
 
+        read = true;
+        vcdc_send_buffered((const uint8_t*)output, slcan_format_message(msg, output));
         avail_buf_len -= msg_len;
 
         // Release the message now that it's been processed
@@ -378,63 +918,147 @@ bool slcan_output_messages(void) {
 
 void slcan_app_setup(uint32_t baudrate, CanMode mode) {
     slcan_mode = mode;
-    slcan_baudrate = baudrate;
+    slcan_set_bitrate(baudrate);
     can_setup(baudrate, mode);
 }
 
+/*
+ * Transmit commands wait while the CAN transmit queue is full. No more
+ * input is read in the meantime, so VCDC ends up throttling the host.
+ */
+static bool slcan_command_blocked(const char* command) {
+    bool transmit = (command[0] == 't' || command[0] == 'T'
+                     || command[0] == 'r' || command[0] == 'R');
+    return transmit && can_tx_queue_full();
+}
+
+/* Received ISO-TP PDUs go to the host in lines of up to 32 bytes */
+#define SLCAN_ISOTP_LINE_BYTES 32
+
+/*
+ * Report ISO-TP events as Ixx lines and pass received PDUs on as i<hex>
+ * lines, with an empty i line marking the end of each PDU.
+ */
+static bool slcan_output_isotp(void) {
+    static uint16_t rx_offset = 0;
+    bool active = false;
+
+    isotp_update();
+
+    uint8_t events = isotp_take_events();
+    if (events != 0) {
+        char output[4] = { 'I' };
+        format_hex_byte(&output[1], events);
+        output[3] = '\r';
+        vcdc_send_buffered((const uint8_t*)output, sizeof(output));
+        active = true;
+    }
+
+    const uint8_t* pdu;
+    uint16_t pdu_len = isotp_rx_pdu(&pdu);
+    char output[1 + 2 * SLCAN_ISOTP_LINE_BYTES + 1];
+    while (pdu_len > 0 && vcdc_send_buffer_space() >= sizeof(output)) {
+        char* p = output;
+        *p++ = 'i';
+        uint16_t i;
+        for (i=0; i < SLCAN_ISOTP_LINE_BYTES && rx_offset < pdu_len; i++) {
+            p = format_hex_byte(p, pdu[rx_offset++]);
+        }
+        *p++ = '\r';
+        vcdc_send_buffered((const uint8_t*)output, (size_t)(p - output));
+        active = true;
+
+        if (i == 0) {
+            // That was the end marker
+            rx_offset = 0;
+            isotp_rx_release();
+            break;
+        }
+    }
+
+    return active;
+}
+
+/* Room to leave in the VCDC transmit buffer for each command's reply */
+#define SLCAN_MAX_REPLY_LEN 32
+
 bool slcan_app_update(void) {
     bool active = false;
 
     static char command_buffer[SLCAN_MAX_MESSAGE_LEN+1];
     static size_t command_len = 0;
     static bool overflow = false;
+    static bool command_deferred = false;
 
-    while (command_len < sizeof(command_buffer)) {
-        if (vcdc_recv_buffered((uint8_t*)&command_buffer[command_len], 1)) {
-            if (command_buffer[command_len] == '\r') {
-                if (overflow) {
-                    // Reject the command and exit overflow
-                    command_len = 0;
-                    overflow = false;
-                    vcdc_putchar(SLCAN_ERROR);
-                    active = true;
-                } else {
-                    // Process the command
-                    command_buffer[command_len] = '\0';
-                    bool success = slcan_exec_command(command_buffer, command_len);
-                    command_len = 0;
-                    if (success) {
-                        vcdc_putchar(SLCAN_OK);
-                    } else {
-                        vcdc_putchar(SLCAN_ERROR);
-                    }
-                    active = true;
-                }
-                break;
-            } else if (command_buffer[command_len] == '\n' && command_len == 0) {
-                // Ignore line-feed after carriage-return
-                continue;
-            } else if (overflow) {
-                // Ignore everything until the end of the command
-                continue;
+    if (command_deferred && !slcan_command_blocked(command_buffer)) {
+        bool success = slcan_exec_command(command_buffer, command_len);
+        command_len = 0;
+        command_deferred = false;
+        vcdc_putchar(success ? SLCAN_OK : SLCAN_ERROR);
+        active = true;
+    }
+
+    // Parse commands straight out of the receive buffer, a contiguous
+    // span at a time, for as long as there's room to reply
+    const uint8_t* span;
+    size_t span_len;
+    while (!command_deferred && vcdc_send_buffer_space() >= SLCAN_MAX_REPLY_LEN
+           && (span_len = vcdc_recv_span(&span)) > 0) {
+        const uint8_t* end = memchr(span, '\r', span_len);
+        size_t chunk_len = (end != NULL) ? (size_t)(end - span) : span_len;
+
+        // Ignore line-feed after carriage-return
+        size_t start = 0;
+        if (command_len == 0) {
+            while (start < chunk_len && span[start] == '\n') {
+                start++;
+            }
+        }
+
+        // Ignore everything until the end of an overlong command
+        if (!overflow) {
+            size_t copy_len = chunk_len - start;
+            if (copy_len > SLCAN_MAX_MESSAGE_LEN - command_len) {
+                overflow = true;
+                command_len = 0;
             } else {
-                // Add a character to the command
-                command_len++;
+                memcpy(&command_buffer[command_len], &span[start], copy_len);
+                command_len += copy_len;
             }
-        } else {
-            break;
         }
-    }
 
-    if (command_len >= sizeof(command_buffer)) {
-        overflow = true;
-        command_len = 0;
+        if (end == NULL) {
+            vcdc_recv_consume(chunk_len);
+            continue;
+        }
+        vcdc_recv_consume(chunk_len + 1);
+
+        command_buffer[command_len] = '\0';
+        active = true;
+        if (overflow) {
+            // Reject the command and exit overflow
+            command_len = 0;
+            overflow = false;
+            vcdc_putchar(SLCAN_ERROR);
+        } else if (slcan_command_blocked(command_buffer)) {
+            // Hold on to the command until there's room to send it
+            command_deferred = true;
+        } else {
+            // Process the command
+            bool success = slcan_exec_command(command_buffer, command_len);
+            command_len = 0;
+            vcdc_putchar(success ? SLCAN_OK : SLCAN_ERROR);
+        }
     }
 
     if (slcan_output_messages()) {
         active = true;
     }
 
+    if (ISOTP_AVAILABLE && slcan_mode != MODE_RESET && isotp_enabled()
+        && slcan_output_isotp()) {
+        active = true;
+    }
 
     return active;
 }
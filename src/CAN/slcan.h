@@ -21,7 +21,7 @@
 
 #include "can.h"
 
-#define SLCAN_MAX_MESSAGE_LEN 27
+#define SLCAN_MAX_MESSAGE_LEN 32
 
 #define SLCAN_OK    '\r'
 #define SLCAN_ERROR '\a'
@@ -30,6 +30,10 @@
 #include <string.h>
 #include "DAP/CMSIS_DAP_hal.h"
 #include "DAP/CMSIS_DAP.h"
+#include "DAP/profile.h"
+#include "DAP/read_cache.h"
+#include "DAP/swd_health.h"
+#include "DAP/swd_shadow.h"
 
 #ifndef __weak
 #define __weak __attribute__ ((weak))
@@ -207,6 +211,8 @@ static uint32_t DAP_HostStatus(const uint8_t *request, uint8_t *response) {
 static uint32_t DAP_Connect(const uint8_t *request, uint8_t *response) {
   uint32_t port;
 
+  SWD_shadow_invalidate();
+
   if (*request == DAP_PORT_AUTODETECT) {
     port = DAP_DEFAULT_PORT;
   } else {
@@ -241,6 +247,7 @@ static uint32_t DAP_Connect(const uint8_t *request, uint8_t *response) {
 //   return:   number of bytes in response
 static uint32_t DAP_Disconnect(uint8_t *response) {
 
+  SWD_shadow_invalidate();
   DAP_Data.debug_port = DAP_PORT_DISABLED;
   PORT_OFF();
 
@@ -254,6 +261,7 @@ static uint32_t DAP_Disconnect(uint8_t *response) {
 //   return:   number of bytes in response
 static uint32_t DAP_ResetTarget(uint8_t *response) {
 
+  SWD_shadow_invalidate();
   *(response+1) = RESET_TARGET();
   *(response+0) = DAP_OK;
   return (2U);
@@ -272,6 +280,8 @@ static uint32_t DAP_SWJ_Pins(const uint8_t *request, uint8_t *response) {
   uint32_t wait;
   uint32_t timestamp;
 
+  SWD_shadow_invalidate();
+
   value  = (uint32_t) *(request+0);
   select = (uint32_t) *(request+1);
   wait   = (uint32_t)(*(request+2) <<  0) |
@@ -674,6 +684,9 @@ static uint32_t DAP_SWD_Transfer(const uint8_t *request, uint8_t *response) {
   uint32_t  match_retry;
   uint32_t  retry;
   uint32_t  data;
+  uint8_t  *fault_response;
+  uint32_t  fault_count;
+  uint32_t  fault_mask;
 #if (TIMESTAMP_CLOCK != 0U)
   uint32_t  timestamp;
 #endif
@@ -694,7 +707,19 @@ static uint32_t DAP_SWD_Transfer(const uint8_t *request, uint8_t *response) {
 
   request_count = *request++;
 
+  SWD_shadow_plan(request, request_count);
+
+  fault_response = response;
+  fault_count    = response_count;
+  fault_mask     = DAP_Data.transfer.match_mask;
+
   for (; request_count != 0U; request_count--) {
+    if (!SWD_shadow_skipped()) {
+      // Where a FAULT belongs if the next write is skipped and would have got it
+      fault_response = response;
+      fault_count    = response_count;
+      fault_mask     = DAP_Data.transfer.match_mask;
+    }
     request_value = *request++;
     if ((request_value & DAP_TRANSFER_RnW) != 0U) {
       // Read register
@@ -763,6 +788,9 @@ static uint32_t DAP_SWD_Transfer(const uint8_t *request, uint8_t *response) {
           }
         } while (((data & DAP_Data.transfer.match_mask) != match_value) && match_retry-- && !DAP_TransferAbort);
         if ((data & DAP_Data.transfer.match_mask) != match_value) {
+          if (response_value == DAP_TRANSFER_OK) {
+            SWD_health_match_exhausted();
+          }
           response_value |= DAP_TRANSFER_MISMATCH;
         }
         if (response_value != DAP_TRANSFER_OK) {
@@ -821,8 +849,9 @@ static uint32_t DAP_SWD_Transfer(const uint8_t *request, uint8_t *response) {
       check_write = 0U;
     } else {
       // Write register
-      if (post_read) {
-        // Read previous data
+      if (post_read && (((request_value & DAP_TRANSFER_TIMESTAMP) != 0U)
+                        || !SWD_shadow_write_redundant(request_value, request))) {
+        // Read previous data, unless the write is going to be skipped
         retry = DAP_Data.transfer.retry_count;
         do {
           response_value = SWD_Transfer(DP_RDBUFF | DAP_TRANSFER_RnW, &data);
@@ -915,6 +944,17 @@ static uint32_t DAP_SWD_Transfer(const uint8_t *request, uint8_t *response) {
   }
 
 end:
+  if ((response_value & DAP_TRANSFER_FAULT) && SWD_shadow_fault_skipped()) {
+    // Report the FAULT on the skipped write, as if it had been sent
+    response       = fault_response;
+    response_count = fault_count;
+    response_value = DAP_TRANSFER_FAULT;
+    DAP_Data.transfer.match_mask = fault_mask;
+  }
+
+  // Hand any auto-increment run started for this request on to the next one
+  SWD_shadow_finish();
+
   *(response_head+0) = (uint8_t)response_count;
   *(response_head+1) = (uint8_t)response_value;
 
@@ -1278,9 +1318,11 @@ static uint32_t DAP_SWD_TransferBlock(const uint8_t *request, uint8_t *response)
   uint8_t  *response_head;
   uint32_t  retry;
   uint32_t  data;
+  uint32_t  fault_count;
 
   response_count = 0U;
   response_value = 0U;
+  fault_count    = 0U;
   response_head  = response;
   response      += 3;
 
@@ -1298,6 +1340,16 @@ static uint32_t DAP_SWD_TransferBlock(const uint8_t *request, uint8_t *response)
   request_value = *request++;
   if ((request_value & DAP_TRANSFER_RnW) != 0U) {
     // Read register block
+    if (DAP_READ_CACHE &&
+        ((request_value & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)) ==
+         (DAP_TRANSFER_APnDP | AP_DRW)) &&
+        DAP_cache_read(request_count, response)) {
+      // Memory read served from the read cache
+      response      += 4U * request_count;
+      response_count = request_count;
+      response_value = DAP_TRANSFER_OK;
+      goto end;
+    }
     if ((request_value & DAP_TRANSFER_APnDP) != 0U) {
       // Post AP read
       retry = DAP_Data.transfer.retry_count;
@@ -1331,6 +1383,10 @@ static uint32_t DAP_SWD_TransferBlock(const uint8_t *request, uint8_t *response)
   } else {
     // Write register block
     while (request_count--) {
+      if (!SWD_shadow_skipped()) {
+        // Where a FAULT belongs if this write is skipped and would have got it
+        fault_count = response_count;
+      }
       // Load data
       data = (uint32_t)(*(request+0) <<  0) |
              (uint32_t)(*(request+1) <<  8) |
@@ -1355,6 +1411,11 @@ static uint32_t DAP_SWD_TransferBlock(const uint8_t *request, uint8_t *response)
   }
 
 end:
+  if ((response_value & DAP_TRANSFER_FAULT) && SWD_shadow_fault_skipped()) {
+    // Report the FAULT on the skipped write, as if it had been sent
+    response_count = fault_count;
+  }
+
   *(response_head+0) = (uint8_t)(response_count >> 0);
   *(response_head+1) = (uint8_t)(response_count >> 8);
   *(response_head+2) = (uint8_t) response_value;
@@ -1726,6 +1787,19 @@ uint32_t DAP_ProcessCommand(const uint8_t *request, uint8_t *response) {
 }
 
 
+#if DAP_PROFILING
+// Process DAP command request and record its execution time
+static uint32_t DAP_ProcessCommandProfiled(const uint8_t *request, uint8_t *response) {
+  uint32_t start = get_cycles();
+  uint32_t num = DAP_ProcessCommand(request, response);
+  DAP_profile_command(*request, get_cycles() - start);
+  return num;
+}
+#else
+#define DAP_ProcessCommandProfiled DAP_ProcessCommand
+#endif
+
+
 // Execute DAP command (process request and prepare response)
 //   request:  pointer to request data
 //   response: pointer to response data
@@ -1740,7 +1814,7 @@ uint32_t DAP_ExecuteCommand(const uint8_t *request, uint8_t *response) {
     *response++ = (uint8_t)cnt;
     num = (2U << 16) | 2U;
     while (cnt--) {
-      n = DAP_ProcessCommand(request, response);
+      n = DAP_ProcessCommandProfiled(request, response);
       num += n;
       request  += (uint16_t)(n >> 16);
       response += (uint16_t) n;
@@ -1748,7 +1822,7 @@ uint32_t DAP_ExecuteCommand(const uint8_t *request, uint8_t *response) {
     return (num);
   }
 
-  return DAP_ProcessCommand(request, response);
+  return DAP_ProcessCommandProfiled(request, response);
 }
 
 
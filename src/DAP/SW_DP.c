@@ -16,6 +16,8 @@
 
 #include "DAP/CMSIS_DAP_hal.h"
 #include "DAP/CMSIS_DAP.h"
+#include "DAP/swd_health.h"
+#include "DAP/swd_shadow.h"
 
 
 // SW Macros
@@ -55,6 +57,8 @@ void SWJ_Sequence (uint32_t count, const uint8_t *data) {
   uint32_t val;
   uint32_t n;
 
+  SWD_shadow_invalidate();
+
   val = 0U;
   n = 0U;
   while (count--) {
@@ -86,6 +90,8 @@ void SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
   uint32_t bit;
   uint32_t n, k;
 
+  SWD_shadow_invalidate();
+
   n = info & SWD_SEQUENCE_CLK;
   if (n == 0U) {
     n = 64U;
@@ -259,16 +265,30 @@ SWD_TransferFunction(Fast)
 SWD_TransferFunction(Slow)
 
 
-// SWD Transfer I/O
+// SWD Transfer I/O on the wire
 //   request: A[3:2] RnW APnDP
 //   data:    DATA[31:0]
 //   return:  ACK[2:0]
-uint8_t  SWD_Transfer(uint32_t request, uint32_t *data) {
+uint8_t  SWD_TransferRaw(uint32_t request, uint32_t *data) {
+  uint8_t ack;
   if (DAP_Data.fast_clock) {
-    return SWD_TransferFast(request, data);
+    ack = SWD_TransferFast(request, data);
   } else {
-    return SWD_TransferSlow(request, data);
+    ack = SWD_TransferSlow(request, data);
   }
+  SWD_shadow_update(request, data, ack);
+  SWD_health_record(request, ack);
+  return ack;
+}
+
+
+// SWD Transfer I/O, skipping or coalescing transfers where the
+// register shadows allow it
+//   request: A[3:2] RnW APnDP
+//   data:    DATA[31:0]
+//   return:  ACK[2:0]
+uint8_t  SWD_Transfer(uint32_t request, uint32_t *data) {
+  return SWD_shadow_transfer(request, data);
 }
 
 
@@ -25,6 +25,14 @@
 #include "USB/composite_usb_conf.h"
 #include "USB/hid.h"
 #include "DAP/app.h"
+#include "DAP/core_regs.h"
+#include "DAP/pc_sampler.h"
+#include "DAP/profile.h"
+#include "DAP/read_cache.h"
+#include "DAP/recorder.h"
+#include "DAP/sequencer.h"
+#include "DAP/swd_health.h"
+#include "DAP/swd_shadow.h"
 
 static uint8_t request_buffers[DAP_PACKET_SIZE][DAP_PACKET_QUEUE_SIZE];
 static uint8_t response_buffers[DAP_PACKET_SIZE][DAP_PACKET_QUEUE_SIZE];
@@ -34,8 +42,22 @@ static uint8_t process_head;
 static uint8_t outbox_head;
 
 static GenericCallback dfu_request_callback = NULL;
+static usbd_device* app_usbd_dev;
+
+/* A USB reset seen through the poll callback waits for the command */
+static bool command_running;
+static bool reset_deferred;
 
 static bool on_receive_report(uint8_t* data, uint16_t len) {
+    if (data[0] == ID_DAP_TransferAbort) {
+        /* Stops the running or next queued transfer; it has no response,
+           so it isn't queued itself */
+        DAP_TransferAbort = 1U;
+        return ((inbox_tail + 1) % DAP_PACKET_QUEUE_SIZE) != outbox_head;
+    }
+    if (DAP_PROFILING) {
+        DAP_profile_received(inbox_tail);
+    }
     memcpy((void*)request_buffers[inbox_tail], (const void*)data, len);
     inbox_tail = (inbox_tail + 1) % DAP_PACKET_QUEUE_SIZE;
 
@@ -48,6 +70,9 @@ static void on_send_report(uint8_t* data, uint16_t* len) {
                DAP_PACKET_SIZE);
         *len = DAP_PACKET_SIZE;
 
+        if (DAP_PROFILING) {
+            DAP_profile_sent(outbox_head);
+        }
         outbox_head = (outbox_head + 1) % DAP_PACKET_QUEUE_SIZE;
     } else {
         *len = 0;
@@ -55,6 +80,38 @@ static void on_send_report(uint8_t* data, uint16_t* len) {
 }
 
 uint32_t DAP_ProcessVendorCommand(const uint8_t* request, uint8_t* response) {
+    if (DAP_PROFILING && request[0] == ID_DAP_Profile) {
+        return DAP_profile_vendor_command(request, response);
+    }
+
+    if (request[0] == ID_DAP_SWDHealth) {
+        return SWD_health_vendor_command(request, response);
+    }
+
+    if (request[0] == ID_DAP_SWDShadow) {
+        return SWD_shadow_vendor_command(request, response);
+    }
+
+    if (DAP_RECORDER && request[0] == ID_DAP_Recorder) {
+        return DAP_recorder_vendor_command(request, response);
+    }
+
+    if (DAP_READ_CACHE && request[0] == ID_DAP_ReadCache) {
+        return DAP_cache_vendor_command(request, response);
+    }
+
+    if (DAP_SEQUENCER && request[0] == ID_DAP_Sequencer) {
+        return DAP_sequencer_vendor_command(request, response);
+    }
+
+    if (request[0] == ID_DAP_CoreRegs) {
+        return DAP_core_regs_vendor_command(request, response);
+    }
+
+    if (PC_SAMPLER && request[0] == ID_DAP_PCSampler) {
+        return DAP_sampler_vendor_command(request, response);
+    }
+
     if (request[0] == ID_DAP_Vendor31) {
         if (request[1] == 'D' && request[2] == 'F' && request[3] == 'U') {
             response[0] = request[0];
@@ -78,23 +135,60 @@ uint32_t DAP_ProcessVendorCommand(const uint8_t* request, uint8_t* response) {
 }
 
 static void DAP_app_reset(void) {
+    if (command_running) {
+        DAP_TransferAbort = 1U;
+        reset_deferred = true;
+        return;
+    }
     inbox_tail = process_head = outbox_head = 0;
     DAP_Setup();
+    if (DAP_PROFILING) {
+        DAP_profile_reset();
+    }
 }
 
 bool DAP_app_update(void) {
     bool active = false;
 
+    SWD_health_update();
+
     if (process_head != inbox_tail) {
+        if (DAP_PROFILING) {
+            DAP_profile_started(process_head);
+        }
         memset(response_buffers[process_head], 0, DAP_PACKET_SIZE);
+        command_running = true;
         DAP_ExecuteCommand(request_buffers[process_head],
                            response_buffers[process_head]);
+        command_running = false;
+        if (DAP_PROFILING) {
+            DAP_profile_finished(process_head);
+        }
+        if (DAP_RECORDER) {
+            DAP_recorder_record(request_buffers[process_head],
+                                response_buffers[process_head]);
+        }
         process_head = (process_head + 1) % DAP_PACKET_QUEUE_SIZE;
         active = true;
+        if (reset_deferred) {
+            reset_deferred = false;
+            DAP_app_reset();
+        }
+    } else {
+        /* Nothing queued, so the SWD port is free for read-ahead or
+           sampling, and there is nothing left for an abort to stop */
+        DAP_TransferAbort = 0U;
+        bool prefetched = DAP_READ_CACHE && DAP_cache_prefetch();
+        if (PC_SAMPLER && !prefetched) {
+            DAP_sampler_update();
+        }
     }
 
     if (outbox_head != process_head) {
         if (hid_send_report(response_buffers[outbox_head], DAP_PACKET_SIZE)) {
+            if (DAP_PROFILING) {
+                DAP_profile_sent(outbox_head);
+            }
             outbox_head = (outbox_head + 1) % DAP_PACKET_QUEUE_SIZE;
         }
         active = true;
@@ -103,10 +197,22 @@ bool DAP_app_update(void) {
     return active;
 }
 
+/* Called by long running commands, so that USB requests still get in */
+static void DAP_app_poll(void) {
+    usbd_poll(app_usbd_dev);
+}
+
 void DAP_app_setup(usbd_device* usbd_dev, GenericCallback on_dfu_request) {
     DAP_Setup();
+    if (DAP_RECORDER) {
+        DAP_recorder_setup();
+    }
     hid_setup(usbd_dev, &on_send_report, &on_receive_report);
     dfu_request_callback = on_dfu_request;
+    app_usbd_dev = usbd_dev;
+    if (DAP_SEQUENCER) {
+        DAP_sequencer_register_poll_callback(&DAP_app_poll);
+    }
 
     cmp_usb_register_reset_callback(DAP_app_reset);
 }
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/core_regs.h"
+#include "DAP/swd_shadow.h"
+
+/* Response: ID, DAP status, outcome, register count */
+#define CORE_REGS_RESPONSE_HEADER   4U
+#define CORE_REGS_MAX_READ          ((DAP_PACKET_SIZE - CORE_REGS_RESPONSE_HEADER) / 4U)
+
+/* Request: ID, sub-command, apsel, base, mask */
+#define CORE_REGS_REQUEST_HEADER    8U
+#define CORE_REGS_MAX_WRITE         ((DAP_PACKET_SIZE - CORE_REGS_REQUEST_HEADER) / 4U)
+
+#define DCRSR_REGSEL_MAX            0x7FU
+#define DCRSR_REGWnR                (1UL << 16)
+
+#define DHCSR                       0xE000EDF0UL
+#define DHCSR_S_REGRDY              (1UL << 16)
+#define DHCSR_S_HALT                (1UL << 17)
+
+/* With TAR on DHCSR, bank 1 maps DHCSR, DCRSR and DCRDR */
+#define SELECT_APSEL_SHIFT          24
+#define SELECT_BANK_BD              0x10UL
+#define AP_BD_DHCSR                 (DAP_TRANSFER_APnDP)
+#define AP_BD_DCRSR                 (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2)
+#define AP_BD_DCRDR                 (DAP_TRANSFER_APnDP | DAP_TRANSFER_A3)
+
+#define CSW_SIZE_ADDRINC_MASK       0x37UL
+#define CSW_SIZE_WORD               0x02UL
+
+#define ABORT_CLEAR_ERRORS          0x1EUL
+
+#define REGRDY_RETRIES              16U
+
+static uint8_t DAP_core_transfer(uint32_t request, uint32_t* data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+    do {
+        ack = SWD_Transfer(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry--);
+    return ack;
+}
+
+static uint8_t DAP_core_select(uint8_t apsel, uint32_t bank) {
+    uint32_t data = ((uint32_t)apsel << SELECT_APSEL_SHIFT) | bank;
+    return DAP_core_transfer(DP_SELECT, &data);
+}
+
+/* Save CSW and TAR, point TAR at DHCSR and switch to the banked registers */
+static uint8_t DAP_core_open(uint8_t apsel, uint32_t* csw, uint32_t* tar) {
+    uint8_t ack = DAP_core_select(apsel, 0);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_CSW, NULL);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_TAR, csw);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, tar);
+    }
+
+    uint32_t data = (*csw & ~CSW_SIZE_ADDRINC_MASK) | CSW_SIZE_WORD;
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DAP_TRANSFER_APnDP | AP_CSW, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        data = DHCSR;
+        ack = DAP_core_transfer(DAP_TRANSFER_APnDP | AP_TAR, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_select(apsel, SELECT_BANK_BD);
+    }
+    return ack;
+}
+
+static uint8_t DAP_core_close(uint8_t apsel, uint32_t csw, uint32_t tar) {
+    uint8_t ack = DAP_core_select(apsel, 0);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DAP_TRANSFER_APnDP | AP_CSW, &csw);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DAP_TRANSFER_APnDP | AP_TAR, &tar);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        /* Check the posted TAR write went through */
+        ack = DAP_core_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, NULL);
+    }
+    return ack;
+}
+
+/*
+ * Poll DHCSR until S_REGRDY. Each round posts a DCRDR read behind the
+ * DHCSR read, so once the core is ready its DCRDR is waiting in RDBUFF.
+ */
+static uint8_t DAP_core_wait_regrdy(bool* ready) {
+    uint8_t ack = DAP_TRANSFER_OK;
+    *ready = false;
+    for (uint8_t i = 0; i < REGRDY_RETRIES && ack == DAP_TRANSFER_OK && !*ready; i++) {
+        uint32_t dhcsr = 0;
+        ack = DAP_core_transfer(AP_BD_DHCSR | DAP_TRANSFER_RnW, NULL);
+        if (ack == DAP_TRANSFER_OK) {
+            ack = DAP_core_transfer(AP_BD_DCRDR | DAP_TRANSFER_RnW, &dhcsr);
+        }
+        *ready = (dhcsr & DHCSR_S_REGRDY) != 0;
+    }
+    return ack;
+}
+
+static uint8_t DAP_core_outcome(uint8_t ack) {
+    switch (ack) {
+        case DAP_TRANSFER_OK:
+            return DAP_CORE_REGS_OK;
+        case DAP_TRANSFER_WAIT:
+            return DAP_CORE_REGS_ERR_WAIT;
+        case DAP_TRANSFER_FAULT:
+            return DAP_CORE_REGS_ERR_FAULT;
+        default:
+            return DAP_CORE_REGS_ERR_NO_ACK;
+    }
+}
+
+/* Writes the registers from `in` if given, otherwise reads them into `out` */
+static uint8_t DAP_core_access(uint8_t apsel, uint8_t base, uint32_t mask,
+                               const uint32_t* in, uint32_t* out, uint8_t* count) {
+    bool write = (in != NULL);
+    *count = 0;
+    if (DAP_Data.debug_port != DAP_PORT_SWD) {
+        return DAP_CORE_REGS_ERR_PORT;
+    } else if (mask == 0U || base + (31U - (uint32_t)__builtin_clz(mask)) > DCRSR_REGSEL_MAX) {
+        return DAP_CORE_REGS_ERR_REQUEST;
+    }
+
+    uint8_t outcome = DAP_CORE_REGS_OK;
+    uint32_t csw = 0;
+    uint32_t tar = 0;
+    uint32_t data = 0;
+    uint8_t ack = DAP_core_open(apsel, &csw, &tar);
+    bool opened = (ack == DAP_TRANSFER_OK);
+
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(AP_BD_DHCSR | DAP_TRANSFER_RnW, NULL);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_core_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, &data);
+    }
+    if (ack == DAP_TRANSFER_OK && !(data & DHCSR_S_HALT)) {
+        outcome = DAP_CORE_REGS_ERR_NOT_HALTED;
+    }
+
+    for (uint32_t bit = 0; bit < 32U && ack == DAP_TRANSFER_OK
+                           && outcome == DAP_CORE_REGS_OK; bit++) {
+        if (!(mask & (1UL << bit))) {
+            continue;
+        }
+
+        bool ready;
+        data = base + bit;
+        if (write) {
+            uint32_t value = in[*count];
+            ack = DAP_core_transfer(AP_BD_DCRDR, &value);
+            data |= DCRSR_REGWnR;
+        }
+        if (ack == DAP_TRANSFER_OK) {
+            ack = DAP_core_transfer(AP_BD_DCRSR, &data);
+        }
+        if (ack == DAP_TRANSFER_OK) {
+            ack = DAP_core_wait_regrdy(&ready);
+        }
+        if (ack == DAP_TRANSFER_OK && !ready) {
+            outcome = DAP_CORE_REGS_ERR_REGRDY;
+        } else if (ack == DAP_TRANSFER_OK && !write) {
+            ack = DAP_core_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, &out[*count]);
+        }
+        if (ack == DAP_TRANSFER_OK && outcome == DAP_CORE_REGS_OK) {
+            (*count)++;
+        }
+    }
+
+    if (ack == DAP_TRANSFER_FAULT) {
+        /* Don't leave the host a sticky error from our own accesses */
+        data = ABORT_CLEAR_ERRORS;
+        DAP_core_transfer(DP_ABORT, &data);
+    }
+    if (opened) {
+        uint8_t close_ack = DAP_core_close(apsel, csw, tar);
+        if (ack == DAP_TRANSFER_OK) {
+            ack = close_ack;
+        }
+    }
+
+    if (ack != DAP_TRANSFER_OK) {
+        outcome = DAP_core_outcome(ack);
+    }
+    return outcome;
+}
+
+uint8_t DAP_core_read_registers(uint8_t apsel, uint8_t base, uint32_t mask,
+                                uint32_t* values, uint8_t* count) {
+    return DAP_core_access(apsel, base, mask, NULL, values, count);
+}
+
+uint8_t DAP_core_write_registers(uint8_t apsel, uint8_t base, uint32_t mask,
+                                 const uint32_t* values, uint8_t* count) {
+    return DAP_core_access(apsel, base, mask, values, NULL, count);
+}
+
+static uint32_t DAP_core_mask_count(uint32_t mask) {
+    uint32_t count = 0;
+    while (mask) {
+        mask &= mask - 1U;
+        count++;
+    }
+    return count;
+}
+
+uint32_t DAP_core_regs_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num = 1;
+    response[0] = DAP_OK;
+    switch (request[0]) {
+        case DAP_CORE_REGS_READ:
+        case DAP_CORE_REGS_WRITE: {
+            uint32_t values[CORE_REGS_MAX_READ];
+            uint32_t mask;
+            memcpy(&mask, &request[3], sizeof(mask));
+            uint32_t total = DAP_core_mask_count(mask);
+            bool write = (request[0] == DAP_CORE_REGS_WRITE);
+
+            uint8_t count = 0;
+            uint8_t outcome;
+            request_len = CORE_REGS_REQUEST_HEADER;
+            if (total > (write ? CORE_REGS_MAX_WRITE : CORE_REGS_MAX_READ)) {
+                outcome = DAP_CORE_REGS_ERR_REQUEST;
+            } else if (write) {
+                request_len += 4U * total;
+                memcpy(values, &request[7], 4U * total);
+                outcome = DAP_core_write_registers(request[1], request[2], mask,
+                                                   values, &count);
+            } else {
+                outcome = DAP_core_read_registers(request[1], request[2], mask,
+                                                  values, &count);
+                memcpy(&response[3], values, 4U * count);
+                num += 4U * count;
+            }
+
+            response[1] = outcome;
+            response[2] = count;
+            num += 2;
+            break;
+        }
+        default:
+            response[0] = DAP_ERROR;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DAP_CORE_REGS_H_INCLUDED
+#define DAP_CORE_REGS_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Bulk Cortex-M core register access. The DCRSR/S_REGRDY/DCRDR
+ * handshake runs on the probe through the MEM-AP banked data
+ * registers, about four SWD packets per register, so a debugger can
+ * fetch or load a register set in one command.
+ *
+ * Registers are chosen by DCRSR selector: bit n of the mask selects
+ * register base + n, and values are in ascending selector order. The
+ * commands leave SELECT on bank 0 of the AP and put back its CSW and
+ * TAR, so a host that caches them stays in step.
+ */
+
+#define ID_DAP_CoreRegs             0x87U
+
+/* ID_DAP_CoreRegs sub-commands */
+#define DAP_CORE_REGS_READ          0x00U   // <apsel> <base> <u32 mask>
+#define DAP_CORE_REGS_WRITE         0x01U   // <apsel> <base> <u32 mask> <u32 values...>
+
+/* DCRSR register selectors */
+#define DAP_CORE_REG_SP             13U
+#define DAP_CORE_REG_LR             14U
+#define DAP_CORE_REG_PC             15U     // DebugReturnAddress
+#define DAP_CORE_REG_XPSR           16U
+#define DAP_CORE_REG_MSP            17U
+#define DAP_CORE_REG_PSP            18U
+#define DAP_CORE_REG_CONTROL        20U     // CONTROL, FAULTMASK, BASEPRI, PRIMASK
+#define DAP_CORE_REG_FPSCR          33U
+#define DAP_CORE_REG_S0             64U
+
+/* Outcome of a bulk access */
+enum {
+    DAP_CORE_REGS_OK,
+    DAP_CORE_REGS_ERR_WAIT,         // Still WAIT after the configured retries
+    DAP_CORE_REGS_ERR_FAULT,
+    DAP_CORE_REGS_ERR_NO_ACK,
+    DAP_CORE_REGS_ERR_NOT_HALTED,
+    DAP_CORE_REGS_ERR_REGRDY,       // The core never signalled S_REGRDY
+    DAP_CORE_REGS_ERR_REQUEST,      // Bad mask, or too many registers
+    DAP_CORE_REGS_ERR_PORT,         // Not connected with SWD
+};
+
+extern uint8_t DAP_core_read_registers(uint8_t apsel, uint8_t base, uint32_t mask,
+                                       uint32_t* values, uint8_t* count);
+extern uint8_t DAP_core_write_registers(uint8_t apsel, uint8_t base, uint32_t mask,
+                                        const uint32_t* values, uint8_t* count);
+
+extern uint32_t DAP_core_regs_vendor_command(const uint8_t* request,
+                                             uint8_t* response);
+
+#endif
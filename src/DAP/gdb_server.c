@@ -0,0 +1,1135 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/core_regs.h"
+#include "DAP/gdb_server.h"
+#include "DAP/swd_shadow.h"
+
+#include "USB/vcdc.h"
+
+#include "tick.h"
+
+#if GDB_SERVER && VCDC_AVAILABLE
+
+/* '$', payload, '#' and two checksum digits, plus the ack for the request */
+#define GDB_FRAMING_SIZE        5U
+
+_Static_assert(GDB_PACKET_SIZE + GDB_FRAMING_SIZE < VCDC_TX_BUFFER_SIZE,
+               "A GDB reply must fit in the VCDC TX buffer");
+
+#define GDB_INTERRUPT           0x03U
+
+#define GDB_ATTACH_TIMEOUT_MS   100U
+#define GDB_HALT_TIMEOUT_MS     100U
+#define GDB_STEP_TIMEOUT_MS     10U
+
+/* Word reads needed for the largest 'm' reply, plus the unaligned ends */
+#define GDB_READ_WORDS          (GDB_PACKET_SIZE / 8U + 2U)
+
+/* AHB-AP CSW: privileged debug access, single auto-increment */
+#define CSW_WORD_INC            0x23000012UL
+#define CSW_BYTE_INC            0x23000010UL
+
+/* Auto-increment is only guaranteed within a 1KB block */
+#define TAR_AUTOINC_BLOCK_MASK  0x3FFUL
+
+#define ABORT_CLEAR_ERRORS      0x1EUL
+#define CTRL_STAT_PWRUPREQ      0x50000000UL
+#define CTRL_STAT_PWRUPACK      0xA0000000UL
+
+#define AIRCR                   0xE000ED0CUL
+#define AIRCR_SYSRESETREQ       0x05FA0004UL
+
+#define DFSR                    0xE000ED30UL
+#define DFSR_DWTTRAP            (1UL << 2)
+#define DFSR_ALL                0x1FUL
+
+#define DHCSR                   0xE000EDF0UL
+#define DHCSR_DBGKEY            0xA05F0000UL
+#define DHCSR_C_DEBUGEN         (1UL << 0)
+#define DHCSR_C_HALT            (1UL << 1)
+#define DHCSR_C_STEP            (1UL << 2)
+#define DHCSR_C_MASKINTS        (1UL << 3)
+#define DHCSR_S_HALT            (1UL << 17)
+
+#define DEMCR                   0xE000EDFCUL
+#define DEMCR_VC_CORERESET      (1UL << 0)
+#define DEMCR_TRCENA            (1UL << 24)
+
+#define FP_CTRL                 0xE0002000UL
+#define FP_CTRL_KEY             (1UL << 1)
+#define FP_CTRL_ENABLE          (1UL << 0)
+#define FP_COMP(n)              (0xE0002008UL + 4U * (n))
+#define FP_COMP_ENABLE          (1UL << 0)
+#define FP_COMP_REPLACE_LOWER   (1UL << 30)
+#define FP_COMP_REPLACE_UPPER   (1UL << 31)
+#define FP_COMP_REPLACE_MASK    (FP_COMP_REPLACE_LOWER | FP_COMP_REPLACE_UPPER)
+#define FP_REV1_ADDRESS_MASK    0x1FFFFFFCUL
+#define FP_REV1_LIMIT           0x20000000UL
+
+#define DWT_CTRL                0xE0001000UL
+#define DWT_COMP(n)             (0xE0001020UL + 16U * (n))
+#define DWT_MASK(n)             (DWT_COMP(n) + 4U)
+#define DWT_FUNCTION(n)         (DWT_COMP(n) + 8U)
+#define DWT_FUNCTION_READ       5U
+#define DWT_FUNCTION_WRITE      6U
+#define DWT_FUNCTION_ACCESS     7U
+#define DWT_FUNCTION_MATCHED    (1UL << 24)
+
+/* r0-r15 and xPSR, in 'g' packet order */
+#define GDB_CORE_REGISTERS      17U
+#define GDB_CORE_REGISTER_MASK  ((1UL << GDB_CORE_REGISTERS) - 1U)
+/* xPSR as numbered in the target description */
+#define GDB_XPSR_REGNUM         0x19U
+
+#define GDB_REG(name) "<reg name=\"" name "\" bitsize=\"32\"/>"
+
+static const char gdb_target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target><architecture>arm</architecture>"
+    "<feature name=\"org.gnu.gdb.arm.m-profile\">"
+    GDB_REG("r0") GDB_REG("r1") GDB_REG("r2") GDB_REG("r3")
+    GDB_REG("r4") GDB_REG("r5") GDB_REG("r6") GDB_REG("r7")
+    GDB_REG("r8") GDB_REG("r9") GDB_REG("r10") GDB_REG("r11")
+    GDB_REG("r12")
+    "<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    GDB_REG("lr")
+    "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+    "<reg name=\"xpsr\" bitsize=\"32\" regnum=\"25\"/>"
+    "</feature></target>";
+
+/* JTAG-to-SWD switch between two line resets, then idle cycles */
+static const uint8_t gdb_swd_wakeup[] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x9E, 0xE7,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00,
+};
+
+static const char gdb_hex_digits[] = "0123456789abcdef";
+
+enum {
+    GDB_RX_IDLE,
+    GDB_RX_DATA,
+    GDB_RX_CHECKSUM_HIGH,
+    GDB_RX_CHECKSUM_LOW,
+};
+
+/* Holds the request being received, then the reply built from it */
+static char gdb_packet[GDB_PACKET_SIZE];
+static uint16_t gdb_packet_len;
+static uint16_t gdb_reply_len;
+static uint8_t gdb_rx_state;
+static uint8_t gdb_checksum;
+static uint8_t gdb_rx_checksum;
+static bool gdb_escape;
+static bool gdb_overflow;
+static bool gdb_no_ack;
+/* The packet buffer still holds the last reply, to resend on a NAK */
+static bool gdb_reply_valid;
+
+static bool gdb_attached;
+static bool gdb_owns_port;
+static bool gdb_running;
+static bool gdb_interrupted;
+static uint32_t gdb_poll_start;
+
+static uint8_t gdb_fpb_count;
+static bool gdb_fpb_rev2;
+static uint8_t gdb_dwt_count;
+
+/* FP_COMP values in use, zero when free */
+static uint32_t gdb_breakpoints[GDB_MAX_BREAKPOINTS];
+/* DWT comparator address and function, function zero when free */
+static uint32_t gdb_watch_address[GDB_MAX_WATCHPOINTS];
+static uint32_t gdb_watch_function[GDB_MAX_WATCHPOINTS];
+
+static uint8_t gdb_transfer(uint32_t request, uint32_t* data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+    do {
+        ack = SWD_Transfer(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry--);
+    return ack;
+}
+
+/* Clear the sticky errors left behind by a failed access */
+static void gdb_clear_errors(void) {
+    uint32_t data = ABORT_CLEAR_ERRORS;
+    gdb_transfer(DP_ABORT, &data);
+}
+
+/* Select AP 0 bank 0 and set up CSW and TAR for a run of DRW accesses */
+static uint8_t gdb_mem_setup(uint32_t csw, uint32_t address) {
+    uint32_t data = 0;
+    uint8_t ack = gdb_transfer(DP_SELECT, &data);
+    if (ack == DAP_TRANSFER_OK) {
+        data = csw;
+        ack = gdb_transfer(DAP_TRANSFER_APnDP | AP_CSW, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        data = address;
+        ack = gdb_transfer(DAP_TRANSFER_APnDP | AP_TAR, &data);
+    }
+    return ack;
+}
+
+/* Collect the last posted read, or confirm the last posted write */
+static bool gdb_mem_finish(uint8_t ack, uint32_t* data) {
+    if (ack == DAP_TRANSFER_OK) {
+        ack = gdb_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, data);
+    }
+    if (ack != DAP_TRANSFER_OK) {
+        gdb_clear_errors();
+        return false;
+    }
+    return true;
+}
+
+/* Read words that all lie within one 1KB block */
+static bool gdb_read_words(uint32_t address, uint32_t* words, uint32_t count) {
+    uint8_t ack = gdb_mem_setup(CSW_WORD_INC, address);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = gdb_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, NULL);
+    }
+    for (uint32_t i = 1; i < count && ack == DAP_TRANSFER_OK; i++) {
+        ack = gdb_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, &words[i - 1U]);
+    }
+    return gdb_mem_finish(ack, &words[count - 1U]);
+}
+
+static bool gdb_read32(uint32_t address, uint32_t* value) {
+    return gdb_read_words(address, value, 1);
+}
+
+static bool gdb_write32(uint32_t address, uint32_t value) {
+    uint8_t ack = gdb_mem_setup(CSW_WORD_INC, address);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = gdb_transfer(DAP_TRANSFER_APnDP | AP_DRW, &value);
+    }
+    return gdb_mem_finish(ack, NULL);
+}
+
+/*
+ * Read with word accesses only, a 1KB block at a time. Unaligned ends
+ * are read as whole words and trimmed.
+ */
+static bool gdb_mem_read(uint32_t address, uint8_t* buffer, uint32_t length) {
+    uint32_t words[GDB_READ_WORDS];
+    while (length > 0U) {
+        uint32_t base = address & ~3UL;
+        uint32_t offset = address & 3U;
+        uint32_t count = (offset + length + 3U) / 4U;
+        uint32_t room = (TAR_AUTOINC_BLOCK_MASK + 1U - (base & TAR_AUTOINC_BLOCK_MASK)) / 4U;
+        if (count > room) {
+            count = room;
+        }
+        if (count > GDB_READ_WORDS) {
+            count = GDB_READ_WORDS;
+        }
+        if (!gdb_read_words(base, words, count)) {
+            return false;
+        }
+
+        uint32_t num = 4U * count - offset;
+        if (num > length) {
+            num = length;
+        }
+        memcpy(buffer, (const uint8_t*)words + offset, num);
+        buffer += num;
+        address += num;
+        length -= num;
+    }
+    return true;
+}
+
+/* Write aligned words as words and anything else a byte at a time */
+static bool gdb_mem_write(uint32_t address, const uint8_t* buffer, uint32_t length) {
+    uint32_t csw = 0;
+    uint8_t ack = DAP_TRANSFER_OK;
+    while (length > 0U && ack == DAP_TRANSFER_OK) {
+        uint32_t data;
+        uint32_t size;
+        uint32_t next_csw;
+        if ((address & 3U) == 0U && length >= 4U) {
+            memcpy(&data, buffer, sizeof(data));
+            size = 4;
+            next_csw = CSW_WORD_INC;
+        } else {
+            data = (uint32_t)buffer[0] << (8U * (address & 3U));
+            size = 1;
+            next_csw = CSW_BYTE_INC;
+        }
+
+        if (next_csw != csw || (address & TAR_AUTOINC_BLOCK_MASK) == 0U) {
+            csw = next_csw;
+            ack = gdb_mem_setup(csw, address);
+        }
+        if (ack == DAP_TRANSFER_OK) {
+            ack = gdb_transfer(DAP_TRANSFER_APnDP | AP_DRW, &data);
+        }
+        buffer += size;
+        address += size;
+        length -= size;
+    }
+    return gdb_mem_finish(ack, NULL);
+}
+
+/* Poll until the core halts. Reads may fail for a while around a reset. */
+static bool gdb_wait_halt(uint32_t timeout_ms) {
+    uint32_t start = get_ticks();
+    do {
+        uint32_t dhcsr;
+        if (gdb_read32(DHCSR, &dhcsr) && (dhcsr & DHCSR_S_HALT)) {
+            return true;
+        }
+    } while ((get_ticks() - start) < timeout_ms);
+    return false;
+}
+
+/* Core registers by mask, bit n being DCRSR selector first + n */
+static bool gdb_read_registers(uint8_t first, uint32_t mask, uint32_t* values) {
+    uint8_t count;
+    return !gdb_running
+        && DAP_core_read_registers(0, first, mask, values, &count) == DAP_CORE_REGS_OK;
+}
+
+static bool gdb_write_registers(uint8_t first, uint32_t mask, const uint32_t* values) {
+    uint8_t count;
+    return !gdb_running
+        && DAP_core_write_registers(0, first, mask, values, &count) == DAP_CORE_REGS_OK;
+}
+
+/* DCRSR register selector for a target description register number */
+static int32_t gdb_regsel(uint32_t regnum) {
+    if (regnum < DAP_CORE_REG_XPSR) {
+        return (int32_t)regnum;
+    } else if (regnum == GDB_XPSR_REGNUM) {
+        return DAP_CORE_REG_XPSR;
+    }
+    return -1;
+}
+
+/* Forget the FPB and DWT comparators GDB had set */
+static void gdb_clear_comparators(void) {
+    for (uint8_t i = 0; i < gdb_fpb_count; i++) {
+        gdb_breakpoints[i] = 0;
+        gdb_write32(FP_COMP(i), 0);
+    }
+    for (uint8_t i = 0; i < gdb_dwt_count; i++) {
+        gdb_watch_function[i] = 0;
+        gdb_write32(DWT_FUNCTION(i), 0);
+    }
+}
+
+/*
+ * Bring up the SWD port if the DAP host has not, power up the debug
+ * domain, halt the core and take stock of the FPB and DWT.
+ */
+static bool gdb_attach(void) {
+    if (gdb_attached && DAP_Data.debug_port == DAP_PORT_SWD) {
+        return true;
+    }
+
+    gdb_attached = false;
+    gdb_running = false;
+    if (DAP_Data.debug_port == DAP_PORT_JTAG) {
+        return false;
+    } else if (DAP_Data.debug_port != DAP_PORT_SWD) {
+        DAP_Data.debug_port = DAP_PORT_SWD;
+        PORT_SWD_SETUP();
+        gdb_owns_port = true;
+    }
+
+    uint32_t data;
+    if (gdb_transfer(DP_IDCODE | DAP_TRANSFER_RnW, &data) != DAP_TRANSFER_OK) {
+        SWJ_Sequence(8U * sizeof(gdb_swd_wakeup), gdb_swd_wakeup);
+        if (gdb_transfer(DP_IDCODE | DAP_TRANSFER_RnW, &data) != DAP_TRANSFER_OK) {
+            return false;
+        }
+    }
+
+    gdb_clear_errors();
+    data = CTRL_STAT_PWRUPREQ;
+    if (gdb_transfer(DP_CTRL_STAT, &data) != DAP_TRANSFER_OK) {
+        return false;
+    }
+    uint32_t start = get_ticks();
+    do {
+        if (gdb_transfer(DP_CTRL_STAT | DAP_TRANSFER_RnW, &data) != DAP_TRANSFER_OK) {
+            return false;
+        }
+    } while ((data & CTRL_STAT_PWRUPACK) != CTRL_STAT_PWRUPACK
+             && (get_ticks() - start) < GDB_ATTACH_TIMEOUT_MS);
+
+    uint32_t demcr;
+    if ((data & CTRL_STAT_PWRUPACK) != CTRL_STAT_PWRUPACK
+        || !gdb_write32(DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT)
+        || !gdb_wait_halt(GDB_HALT_TIMEOUT_MS)
+        || !gdb_read32(DEMCR, &demcr)
+        || !gdb_write32(DEMCR, demcr | DEMCR_TRCENA)) {
+        return false;
+    }
+
+    uint32_t fp_ctrl;
+    uint32_t dwt_ctrl;
+    if (!gdb_read32(FP_CTRL, &fp_ctrl) || !gdb_read32(DWT_CTRL, &dwt_ctrl)) {
+        return false;
+    }
+    gdb_fpb_count = (uint8_t)(((fp_ctrl >> 8) & 0x70U) | ((fp_ctrl >> 4) & 0x0FU));
+    if (gdb_fpb_count > GDB_MAX_BREAKPOINTS) {
+        gdb_fpb_count = GDB_MAX_BREAKPOINTS;
+    }
+    gdb_fpb_rev2 = ((fp_ctrl >> 28) == 1U);
+    gdb_dwt_count = (uint8_t)(dwt_ctrl >> 28);
+    if (gdb_dwt_count > GDB_MAX_WATCHPOINTS) {
+        gdb_dwt_count = GDB_MAX_WATCHPOINTS;
+    }
+
+    gdb_clear_comparators();
+    gdb_write32(FP_CTRL, FP_CTRL_KEY | FP_CTRL_ENABLE);
+    gdb_write32(DFSR, DFSR_ALL);
+
+    gdb_attached = true;
+    return true;
+}
+
+/* Remove breakpoints and watchpoints, let the core run and release the port */
+static void gdb_detach(void) {
+    if (gdb_attached && DAP_Data.debug_port == DAP_PORT_SWD) {
+        gdb_clear_comparators();
+        gdb_write32(FP_CTRL, FP_CTRL_KEY);
+        gdb_write32(DHCSR, DHCSR_DBGKEY);
+    }
+
+    if (gdb_owns_port) {
+        SWD_shadow_invalidate();
+        DAP_Data.debug_port = DAP_PORT_DISABLED;
+        PORT_OFF();
+        gdb_owns_port = false;
+    }
+
+    gdb_attached = false;
+    gdb_running = false;
+    gdb_interrupted = false;
+}
+
+/* Reset through AIRCR and halt on the first instruction */
+static bool gdb_reset_halt(void) {
+    uint32_t demcr;
+    if (gdb_running || !gdb_read32(DEMCR, &demcr)
+        || !gdb_write32(DEMCR, demcr | DEMCR_VC_CORERESET)) {
+        return false;
+    }
+
+    /* The write may not be acknowledged while the reset takes hold */
+    gdb_write32(AIRCR, AIRCR_SYSRESETREQ);
+    bool halted = gdb_wait_halt(GDB_HALT_TIMEOUT_MS);
+
+    gdb_write32(DEMCR, demcr & ~DEMCR_VC_CORERESET);
+    gdb_write32(DFSR, DFSR_ALL);
+    return halted;
+}
+
+static bool gdb_resume(bool step) {
+    gdb_write32(DFSR, DFSR_ALL);
+
+    if (!step) {
+        if (!gdb_write32(DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN)) {
+            return false;
+        }
+        gdb_running = true;
+        gdb_poll_start = get_ticks();
+        return true;
+    }
+
+    /* Step over the instruction, not into a pending interrupt handler */
+    if (!gdb_write32(DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT
+                            | DHCSR_C_MASKINTS)
+        || !gdb_write32(DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN | DHCSR_C_MASKINTS
+                               | DHCSR_C_STEP)) {
+        return false;
+    }
+
+    if (gdb_wait_halt(GDB_STEP_TIMEOUT_MS)) {
+        gdb_write32(DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT);
+    } else {
+        /* Report the halt whenever the poll sees it */
+        gdb_running = true;
+        gdb_poll_start = get_ticks();
+    }
+    return true;
+}
+
+static uint8_t gdb_find_breakpoint(uint32_t comp, uint32_t ignore) {
+    uint8_t i;
+    for (i = 0; i < gdb_fpb_count; i++) {
+        if ((gdb_breakpoints[i] & ~ignore) == comp) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Hardware breakpoint through the FPB. A revision 1 comparator matches
+ * a word below 0x20000000 and replaces either halfword, so two
+ * breakpoints in the same word share a comparator.
+ */
+static bool gdb_breakpoint(uint32_t address, bool insert) {
+    uint32_t comp;
+    uint32_t replace = 0;
+    uint32_t ignore = 0;
+    if (gdb_fpb_rev2) {
+        comp = (address & ~1UL) | FP_COMP_ENABLE;
+    } else if (address < FP_REV1_LIMIT) {
+        comp = (address & FP_REV1_ADDRESS_MASK) | FP_COMP_ENABLE;
+        replace = (address & 2U) ? FP_COMP_REPLACE_UPPER : FP_COMP_REPLACE_LOWER;
+        ignore = FP_COMP_REPLACE_MASK;
+    } else {
+        return false;
+    }
+
+    uint32_t value;
+    uint8_t slot = gdb_find_breakpoint(comp, ignore);
+    if (slot < gdb_fpb_count) {
+        value = insert ? (gdb_breakpoints[slot] | replace)
+                       : (gdb_breakpoints[slot] & ~replace);
+        if (!insert && !(value & ignore)) {
+            value = 0;
+        }
+    } else if (!insert) {
+        return true;
+    } else {
+        slot = gdb_find_breakpoint(0U, 0U);
+        if (slot >= gdb_fpb_count) {
+            return false;
+        }
+        value = comp | replace;
+    }
+
+    if (!gdb_write32(FP_COMP(slot), value)) {
+        return false;
+    }
+    gdb_breakpoints[slot] = value;
+    return true;
+}
+
+/* Watchpoint through a DWT comparator, for naturally aligned power of two sizes */
+static bool gdb_watchpoint(uint32_t function, uint32_t address, uint32_t length, bool insert) {
+    if (length == 0U || (length & (length - 1U)) || (address & (length - 1U))) {
+        return false;
+    }
+
+    uint8_t slot;
+    for (slot = 0; slot < gdb_dwt_count; slot++) {
+        if (insert ? (gdb_watch_function[slot] == 0U)
+                   : (gdb_watch_function[slot] == function
+                      && gdb_watch_address[slot] == address)) {
+            break;
+        }
+    }
+    if (slot >= gdb_dwt_count) {
+        return !insert;
+    } else if (!insert) {
+        gdb_watch_function[slot] = 0;
+        return gdb_write32(DWT_FUNCTION(slot), 0);
+    }
+
+    uint32_t mask = 0;
+    while ((1UL << mask) < length) {
+        mask++;
+    }
+
+    /* MASK reads back smaller than written if the range is too large */
+    uint32_t readback;
+    if (!gdb_write32(DWT_COMP(slot), address)
+        || !gdb_write32(DWT_MASK(slot), mask)
+        || !gdb_read32(DWT_MASK(slot), &readback) || readback != mask
+        || !gdb_write32(DWT_FUNCTION(slot), function)) {
+        return false;
+    }
+    gdb_watch_address[slot] = address;
+    gdb_watch_function[slot] = function;
+    return true;
+}
+
+static void gdb_put_char(char c) {
+    if (gdb_reply_len < GDB_PACKET_SIZE) {
+        gdb_packet[gdb_reply_len++] = c;
+    }
+}
+
+static void gdb_put_str(const char* s) {
+    while (*s) {
+        gdb_put_char(*s++);
+    }
+}
+
+static void gdb_put_hex_byte(uint8_t x) {
+    gdb_put_char(gdb_hex_digits[x >> 4]);
+    gdb_put_char(gdb_hex_digits[x & 0xF]);
+}
+
+/* Register contents, in target byte order */
+static void gdb_put_hex_word(uint32_t x) {
+    for (uint8_t i = 0; i < 4; i++) {
+        gdb_put_hex_byte((uint8_t)(x >> (8U * i)));
+    }
+}
+
+/* A number, most significant digit first */
+static void gdb_put_hex_number(uint32_t x) {
+    for (int8_t i = 3; i >= 0; i--) {
+        gdb_put_hex_byte((uint8_t)(x >> (8U * (uint8_t)i)));
+    }
+}
+
+static void gdb_reply(const char* s) {
+    gdb_reply_len = 0;
+    gdb_put_str(s);
+}
+
+static void gdb_reply_ok(bool ok) {
+    gdb_reply(ok ? "OK" : "E01");
+}
+
+/*
+ * Stop reply for a halted core. Reading a DWT FUNCTION register clears
+ * its MATCHED bit, so this is only done once per halt.
+ */
+static void gdb_reply_stop(void) {
+    uint32_t dfsr = 0;
+    gdb_read32(DFSR, &dfsr);
+    gdb_write32(DFSR, dfsr);
+
+    if (gdb_interrupted) {
+        gdb_reply("T02");
+        return;
+    }
+
+    gdb_reply("T05");
+    if (!(dfsr & DFSR_DWTTRAP)) {
+        return;
+    }
+
+    for (uint8_t i = 0; i < gdb_dwt_count; i++) {
+        uint32_t function;
+        if (gdb_watch_function[i] == 0U || !gdb_read32(DWT_FUNCTION(i), &function)
+            || !(function & DWT_FUNCTION_MATCHED)) {
+            continue;
+        }
+        if (gdb_watch_function[i] == DWT_FUNCTION_READ) {
+            gdb_put_str("rwatch:");
+        } else if (gdb_watch_function[i] == DWT_FUNCTION_ACCESS) {
+            gdb_put_str("awatch:");
+        } else {
+            gdb_put_str("watch:");
+        }
+        gdb_put_hex_number(gdb_watch_address[i]);
+        gdb_put_char(';');
+        break;
+    }
+}
+
+/* The payload never needs escaping: it is hex digits and plain text */
+static void gdb_send_reply(void) {
+    uint8_t checksum = 0;
+    for (uint16_t i = 0; i < gdb_reply_len; i++) {
+        checksum += (uint8_t)gdb_packet[i];
+    }
+
+    vcdc_putchar('$');
+    vcdc_send_buffered((const uint8_t*)gdb_packet, gdb_reply_len);
+    vcdc_putchar('#');
+    vcdc_print_hex_byte(checksum);
+    gdb_reply_valid = true;
+}
+
+static uint8_t gdb_hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return (uint8_t)(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+        return (uint8_t)(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+        return (uint8_t)(c - 'A' + 10);
+    }
+    return 0xFF;
+}
+
+static uint32_t gdb_parse_hex(const char** p) {
+    uint32_t value = 0;
+    uint8_t digit;
+    while ((digit = gdb_hex_value(**p)) <= 0xF) {
+        value = (value << 4) | digit;
+        (*p)++;
+    }
+    return value;
+}
+
+/* "<address>,<length>" */
+static bool gdb_parse_range(const char** p, uint32_t* address, uint32_t* length) {
+    *address = gdb_parse_hex(p);
+    if (**p != ',') {
+        return false;
+    }
+    (*p)++;
+    *length = gdb_parse_hex(p);
+    return true;
+}
+
+/* Decode hex pairs. Safe in place, since the output trails the input. */
+static bool gdb_decode_hex(const char* hex, uint8_t* out, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t high = gdb_hex_value(hex[2 * i]);
+        if (high > 0xF) {
+            return false;
+        }
+        uint8_t low = gdb_hex_value(hex[2 * i + 1]);
+        if (low > 0xF) {
+            return false;
+        }
+        out[i] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+}
+
+static void gdb_cmd_read_registers(void) {
+    uint32_t values[GDB_CORE_REGISTERS];
+    if (!gdb_read_registers(0, GDB_CORE_REGISTER_MASK, values)) {
+        gdb_reply("E01");
+        return;
+    }
+
+    gdb_reply_len = 0;
+    for (uint8_t i = 0; i < GDB_CORE_REGISTERS; i++) {
+        gdb_put_hex_word(values[i]);
+    }
+}
+
+static void gdb_cmd_write_registers(const char* hex, uint16_t len) {
+    uint32_t values[GDB_CORE_REGISTERS];
+    bool ok = (len >= 8U * GDB_CORE_REGISTERS)
+           && gdb_decode_hex(hex, (uint8_t*)values, sizeof(values))
+           && gdb_write_registers(0, GDB_CORE_REGISTER_MASK, values);
+    gdb_reply_ok(ok);
+}
+
+static void gdb_cmd_read_register(const char* args) {
+    int32_t regsel = gdb_regsel(gdb_parse_hex(&args));
+    uint32_t value;
+    if (regsel < 0 || !gdb_read_registers((uint8_t)regsel, 1, &value)) {
+        gdb_reply("E01");
+        return;
+    }
+    gdb_reply_len = 0;
+    gdb_put_hex_word(value);
+}
+
+static void gdb_cmd_write_register(const char* args) {
+    int32_t regsel = gdb_regsel(gdb_parse_hex(&args));
+    uint32_t value;
+    bool ok = (regsel >= 0) && (*args++ == '=')
+           && gdb_decode_hex(args, (uint8_t*)&value, sizeof(value))
+           && gdb_write_registers((uint8_t)regsel, 1, &value);
+    gdb_reply_ok(ok);
+}
+
+/*
+ * The target bytes are read into the tail of the packet buffer and
+ * expanded to hex from the front. Byte i is consumed before its digits
+ * land at 2i and 2i+1, which never reaches byte i+1.
+ */
+static void gdb_cmd_read_memory(const char* args) {
+    uint32_t address;
+    uint32_t length;
+    if (!gdb_parse_range(&args, &address, &length)) {
+        gdb_reply("E01");
+        return;
+    }
+    if (length > GDB_PACKET_SIZE / 2U) {
+        length = GDB_PACKET_SIZE / 2U;
+    }
+
+    uint8_t* bytes = (uint8_t*)&gdb_packet[GDB_PACKET_SIZE - length];
+    if (!gdb_mem_read(address, bytes, length)) {
+        gdb_reply("E01");
+        return;
+    }
+
+    gdb_reply_len = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        gdb_put_hex_byte(bytes[i]);
+    }
+}
+
+static void gdb_cmd_write_memory(const char* args, const char* end) {
+    uint32_t address;
+    uint32_t length;
+    bool ok = gdb_parse_range(&args, &address, &length) && (*args++ == ':')
+           && ((uint32_t)(end - args) == 2U * length);
+    if (ok) {
+        uint8_t* bytes = (uint8_t*)gdb_packet;
+        ok = gdb_decode_hex(args, bytes, length)
+          && gdb_mem_write(address, bytes, length);
+    }
+    gdb_reply_ok(ok);
+}
+
+static bool gdb_set_pc(uint32_t pc) {
+    return gdb_write_registers(DAP_CORE_REG_PC, 1, &pc);
+}
+
+/* c/s [address]. Returns whether the stop reply is ready to send. */
+static bool gdb_cmd_resume(const char* args, bool step) {
+    if (gdb_running
+        || (*args && !gdb_set_pc(gdb_parse_hex(&args)))
+        || !gdb_resume(step)) {
+        gdb_reply("E01");
+        return true;
+    } else if (gdb_running) {
+        return false;
+    }
+    gdb_reply_stop();
+    return true;
+}
+
+/* Z/z <type>,<address>,<kind> */
+static void gdb_cmd_point(const char* args, bool insert) {
+    static const uint8_t functions[] = {
+        DWT_FUNCTION_WRITE, DWT_FUNCTION_READ, DWT_FUNCTION_ACCESS,
+    };
+
+    char type = *args++;
+    uint32_t address;
+    uint32_t kind;
+    if (*args++ != ',' || !gdb_parse_range(&args, &address, &kind)) {
+        gdb_reply("E01");
+    } else if (type == '0' || type == '1') {
+        gdb_reply_ok(gdb_breakpoint(address, insert));
+    } else if (type >= '2' && type <= '4') {
+        gdb_reply_ok(gdb_watchpoint(functions[type - '2'], address, kind, insert));
+    } else {
+        gdb_reply("");
+    }
+}
+
+/* qXfer:features:read:target.xml:<offset>,<length> */
+static void gdb_cmd_read_features(const char* args) {
+    static const char annex[] = "target.xml:";
+    uint32_t offset;
+    uint32_t length;
+    if (strncmp(args, annex, sizeof(annex) - 1U) != 0) {
+        gdb_reply("E00");
+        return;
+    }
+    args += sizeof(annex) - 1U;
+    if (!gdb_parse_range(&args, &offset, &length)) {
+        gdb_reply("E01");
+        return;
+    }
+
+    uint32_t size = sizeof(gdb_target_xml) - 1U;
+    if (offset > size) {
+        offset = size;
+    }
+    if (length > GDB_PACKET_SIZE - 1U) {
+        length = GDB_PACKET_SIZE - 1U;
+    }
+
+    bool last = (size - offset) <= length;
+    if (last) {
+        length = size - offset;
+    }
+    gdb_reply_len = 0;
+    gdb_put_char(last ? 'l' : 'm');
+    memcpy(&gdb_packet[1], &gdb_target_xml[offset], length);
+    gdb_reply_len = (uint16_t)(1U + length);
+}
+
+/* qRcmd,<hex>: GDB's `monitor` command. Only `monitor reset` is known. */
+static void gdb_cmd_monitor(const char* hex, const char* end) {
+    uint32_t length = (uint32_t)(end - hex) / 2U;
+    char* command = gdb_packet;
+    if (!gdb_decode_hex(hex, (uint8_t*)command, length)) {
+        gdb_reply("E01");
+        return;
+    }
+    command[length] = '\0';
+
+    if (strcmp(command, "reset") == 0) {
+        gdb_reply_ok(gdb_attach() && gdb_reset_halt());
+    } else {
+        gdb_reply("");
+    }
+}
+
+static void gdb_cmd_query(const char* packet, const char* end) {
+    static const char xfer[] = "qXfer:features:read:";
+    static const char rcmd[] = "qRcmd,";
+
+    if (strncmp(packet, "qSupported", 10) == 0) {
+        gdb_reply("PacketSize=");
+        gdb_put_hex_number(GDB_PACKET_SIZE - 1U);
+        gdb_put_str(";qXfer:features:read+;QStartNoAckMode+");
+    } else if (strcmp(packet, "qAttached") == 0) {
+        gdb_reply("1");
+    } else if (strncmp(packet, xfer, sizeof(xfer) - 1U) == 0) {
+        gdb_cmd_read_features(packet + sizeof(xfer) - 1U);
+    } else if (strncmp(packet, rcmd, sizeof(rcmd) - 1U) == 0) {
+        gdb_cmd_monitor(packet + sizeof(rcmd) - 1U, end);
+    } else {
+        gdb_reply("");
+    }
+}
+
+/* Handle a complete request. Returns whether a reply is to be sent now. */
+static bool gdb_process_packet(uint16_t len) {
+    const char* args = &gdb_packet[1];
+    const char* end = &gdb_packet[len];
+    char command = gdb_packet[0];
+
+    switch (command) {
+        case 'q':
+            gdb_cmd_query(gdb_packet, end);
+            return true;
+        case 'Q':
+            if (strcmp(gdb_packet, "QStartNoAckMode") == 0) {
+                gdb_reply("OK");
+                gdb_no_ack = true;
+            } else {
+                gdb_reply("");
+            }
+            return true;
+        case '!':
+        case 'H':
+        case 'T':
+            gdb_reply("OK");
+            return true;
+        case 'D':
+            gdb_detach();
+            gdb_reply("OK");
+            return true;
+        case 'k':
+            gdb_detach();
+            return false;
+        case 'g':
+        case 'G':
+        case 'p':
+        case 'P':
+        case 'm':
+        case 'M':
+        case 'c':
+        case 's':
+        case 'Z':
+        case 'z':
+        case '?':
+            break;
+        default:
+            gdb_reply("");
+            return true;
+    }
+
+    if (!gdb_attach()) {
+        gdb_reply("E01");
+        return true;
+    }
+
+    switch (command) {
+        case '?':
+            /* Attaching halted the core */
+            gdb_interrupted = false;
+            gdb_reply_stop();
+            break;
+        case 'g':
+            gdb_cmd_read_registers();
+            break;
+        case 'G':
+            gdb_cmd_write_registers(args, (uint16_t)(end - args));
+            break;
+        case 'p':
+            gdb_cmd_read_register(args);
+            break;
+        case 'P':
+            gdb_cmd_write_register(args);
+            break;
+        case 'm':
+            gdb_cmd_read_memory(args);
+            break;
+        case 'M':
+            gdb_cmd_write_memory(args, end);
+            break;
+        case 'c':
+        case 's':
+            return gdb_cmd_resume(args, command == 's');
+        case 'Z':
+        case 'z':
+            gdb_cmd_point(args, command == 'Z');
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+/* Ctrl-C: halt a running core. The poll reports the stop. */
+static void gdb_interrupt(void) {
+    if (!gdb_running) {
+        return;
+    }
+    gdb_write32(DHCSR, DHCSR_DBGKEY | DHCSR_C_DEBUGEN | DHCSR_C_HALT);
+    gdb_interrupted = true;
+    gdb_poll_start = get_ticks() - GDB_POLL_INTERVAL_MS;
+}
+
+static void gdb_packet_complete(void) {
+    bool valid = (gdb_checksum == gdb_rx_checksum);
+    if (!gdb_no_ack) {
+        vcdc_putchar(valid ? '+' : '-');
+    }
+    if (!valid) {
+        return;
+    }
+
+    if (gdb_overflow) {
+        gdb_reply("E01");
+    } else {
+        gdb_packet[gdb_packet_len] = '\0';
+        if (!gdb_process_packet(gdb_packet_len)) {
+            return;
+        }
+    }
+    gdb_send_reply();
+}
+
+/* Feed one received byte. Returns true once it has produced output. */
+static bool gdb_receive(uint8_t c) {
+    if (c == '$' && gdb_rx_state != GDB_RX_CHECKSUM_HIGH
+        && gdb_rx_state != GDB_RX_CHECKSUM_LOW) {
+        gdb_rx_state = GDB_RX_DATA;
+        gdb_packet_len = 0;
+        gdb_checksum = 0;
+        gdb_escape = false;
+        gdb_overflow = false;
+        gdb_reply_valid = false;
+        return false;
+    }
+
+    switch (gdb_rx_state) {
+        case GDB_RX_IDLE:
+            if (c == GDB_INTERRUPT) {
+                gdb_interrupt();
+            } else if (c == '-' && gdb_reply_valid) {
+                gdb_send_reply();
+                return true;
+            }
+            break;
+        case GDB_RX_DATA:
+            if (c == '#') {
+                gdb_rx_state = GDB_RX_CHECKSUM_HIGH;
+                break;
+            }
+            gdb_checksum += c;
+            if (gdb_escape) {
+                c ^= 0x20U;
+                gdb_escape = false;
+            } else if (c == '}') {
+                gdb_escape = true;
+                break;
+            }
+            /* Leave room to terminate the request */
+            if (gdb_packet_len < GDB_PACKET_SIZE - 1U) {
+                gdb_packet[gdb_packet_len++] = (char)c;
+            } else {
+                gdb_overflow = true;
+            }
+            break;
+        case GDB_RX_CHECKSUM_HIGH:
+            gdb_rx_checksum = (uint8_t)(gdb_hex_value((char)c) << 4);
+            gdb_rx_state = GDB_RX_CHECKSUM_LOW;
+            break;
+        case GDB_RX_CHECKSUM_LOW:
+            gdb_rx_checksum |= gdb_hex_value((char)c);
+            gdb_rx_state = GDB_RX_IDLE;
+            gdb_packet_complete();
+            return true;
+        default:
+            gdb_rx_state = GDB_RX_IDLE;
+            break;
+    }
+    return false;
+}
+
+static void gdb_poll(void) {
+    uint32_t dhcsr;
+    bool ok = gdb_read32(DHCSR, &dhcsr);
+
+    /* Don't leave GDB waiting on an interrupt the target can't answer */
+    if ((ok && (dhcsr & DHCSR_S_HALT)) || (!ok && gdb_interrupted)) {
+        gdb_running = false;
+        gdb_reply_stop();
+        gdb_send_reply();
+        gdb_interrupted = false;
+    }
+}
+
+void gdb_server_setup(void) {
+    gdb_rx_state = GDB_RX_IDLE;
+    gdb_no_ack = false;
+    gdb_reply_valid = false;
+    gdb_attached = false;
+    gdb_owns_port = false;
+    gdb_running = false;
+    gdb_interrupted = false;
+}
+
+bool gdb_server_update(void) {
+    bool active = false;
+    const uint8_t* span;
+    size_t span_len;
+
+    /* Only take input while the largest reply would fit */
+    while (vcdc_send_buffer_space() >= GDB_PACKET_SIZE + GDB_FRAMING_SIZE
+           && (span_len = vcdc_recv_span(&span)) > 0) {
+        size_t i = 0;
+        while (i < span_len && !gdb_receive(span[i++])) {
+        }
+        vcdc_recv_consume(i);
+        active = true;
+    }
+
+    if (gdb_running && gdb_rx_state == GDB_RX_IDLE
+        && vcdc_send_buffer_space() >= GDB_PACKET_SIZE + GDB_FRAMING_SIZE
+        && (get_ticks() - gdb_poll_start) >= GDB_POLL_INTERVAL_MS) {
+        gdb_poll_start = get_ticks();
+        gdb_poll();
+    }
+
+    return active;
+}
+
+#endif
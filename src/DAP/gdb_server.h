@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DAP_GDB_SERVER_H_INCLUDED
+#define DAP_GDB_SERVER_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Optional GDB remote serial protocol server on the virtual COM port,
+ * enabled with `make GDB_SERVER=1` on boards with VCDC_AVAILABLE. GDB
+ * connects straight to the port (`target extended-remote /dev/ttyACMx`)
+ * and every packet is served on the probe with SWD_Transfer, so a
+ * single step or a memory view refresh costs one USB round trip.
+ *
+ * The server takes over the virtual COM port from SLCAN and stdout. It
+ * talks to a Cortex-M core through AP 0 and connects the SWD port
+ * itself if the DAP host has not. It does not coordinate with a DAP
+ * host using the target at the same time.
+ */
+#ifndef GDB_SERVER
+#define GDB_SERVER 0
+#endif
+
+/* Largest packet payload, so that any reply fits the VCDC TX buffer */
+#ifndef GDB_PACKET_SIZE
+#define GDB_PACKET_SIZE             224U
+#endif
+
+/* How often a running target is polled for a halt */
+#define GDB_POLL_INTERVAL_MS        10U
+
+#define GDB_MAX_BREAKPOINTS         8U
+#define GDB_MAX_WATCHPOINTS         4U
+
+#define GDB_SERVER_RAM_USAGE        (GDB_PACKET_SIZE \
+                                     + 4 * (GDB_MAX_BREAKPOINTS + 2 * GDB_MAX_WATCHPOINTS) \
+                                     + 32)
+
+extern void gdb_server_setup(void);
+extern bool gdb_server_update(void);
+
+#endif
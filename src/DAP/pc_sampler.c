@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/core_regs.h"
+#include "DAP/gdb_server.h"
+#include "DAP/pc_sampler.h"
+#include "DAP/swd_shadow.h"
+
+#include "USB/vcdc.h"
+
+#include "tick.h"
+
+#if PC_SAMPLER
+
+_Static_assert(PC_SAMPLER_BUCKETS > 0 && PC_SAMPLER_BUCKETS <= 255,
+               "PC sampler bucket count must fit in a byte");
+
+/* Response: ID, DAP status, first bucket, bucket count */
+#define HISTOGRAM_RESPONSE_HEADER   4U
+#define HISTOGRAM_MAX_READ          ((DAP_PACKET_SIZE - HISTOGRAM_RESPONSE_HEADER) / 2U)
+
+#define DWT_PCSR                    0xE000101CUL
+
+#define DHCSR                       0xE000EDF0UL
+#define DHCSR_DBGKEY                0xA05F0000UL
+#define DHCSR_C_DEBUGEN             (1UL << 0)
+#define DHCSR_C_HALT                (1UL << 1)
+#define DHCSR_C_MASKINTS            (1UL << 3)
+#define DHCSR_S_REGRDY              (1UL << 16)
+#define DHCSR_S_HALT                (1UL << 17)
+
+/* What PCSR reads as while the core is halted or not to be sampled */
+#define PC_UNAVAILABLE              0xFFFFFFFFUL
+
+/*
+ * With TAR on a 16-byte block, bank 1 maps the four words of the block.
+ * The DHCSR block holds DHCSR, DCRSR and DCRDR; PCSR is the last word
+ * of its block. Banked accesses leave TAR alone, so PCSR can be read
+ * back to back.
+ */
+#define SELECT_APSEL_SHIFT          24
+#define SELECT_BANK_BD              0x10UL
+#define BD_BLOCK_MASK               0xFFFFFFF0UL
+#define AP_BD_DHCSR                 (DAP_TRANSFER_APnDP)
+#define AP_BD_DCRSR                 (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2)
+#define AP_BD_DCRDR                 (DAP_TRANSFER_APnDP | DAP_TRANSFER_A3)
+#define AP_BD_PCSR                  (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)
+
+#define CSW_SIZE_ADDRINC_MASK       0x37UL
+#define CSW_SIZE_WORD               0x02UL
+
+#define ABORT_CLEAR_ERRORS          0x1EUL
+
+#define HALT_RETRIES                16U
+
+/* Request, turnaround, ACK, data with parity, turnaround */
+#define SWD_READ_BITS(turnaround)   (8U + (turnaround) + 3U + 33U + (turnaround))
+
+#define RATE_WINDOW_MS              1000U
+#define ERROR_BACKOFF_MS            100U
+#define MAX_RATE                    1000000UL
+
+/* Largest piece of a snapshot line written at once */
+#define STREAM_CHUNK_SIZE           32U
+
+enum {
+    STREAM_IDLE,
+    STREAM_BUCKETS,
+    STREAM_TRAILER,
+};
+
+static uint16_t histogram[PC_SAMPLER_BUCKETS];
+
+static uint8_t sampler_flags;
+static uint8_t sampler_mode;
+static uint8_t sampler_apsel;
+static uint8_t sampler_shift;
+static uint32_t sampler_base;
+static uint32_t sampler_rate;       // Samples per second, 0 for as fast as possible
+static uint16_t stream_interval;    // Milliseconds between snapshots
+
+/* Mode in use; auto until the first sample shows whether PCSR works */
+static uint8_t active_mode;
+static bool select_unknown;
+
+static uint32_t credit;             // Thousandths of a sample
+static uint32_t last_tick;
+static uint32_t backoff_until;
+
+static uint32_t total_samples;
+static uint32_t total_halted;
+static uint32_t total_outside;
+static uint32_t total_errors;
+
+static uint32_t window_start;
+static uint32_t window_samples;
+static uint32_t achieved_rate;
+
+static uint16_t stream_outside;
+static uint16_t stream_halted;
+static uint8_t stream_state;
+static uint8_t stream_seq;
+static uint16_t stream_index;
+static uint32_t stream_due;
+
+bool DAP_sampler_enabled(void) {
+    return (sampler_flags & PC_SAMPLER_ENABLE) != 0;
+}
+
+static uint8_t DAP_sampler_transfer(uint32_t request, uint32_t* data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+    do {
+        ack = SWD_Transfer(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry--);
+    return ack;
+}
+
+static uint8_t DAP_sampler_select(uint32_t bank) {
+    uint32_t data = ((uint32_t)sampler_apsel << SELECT_APSEL_SHIFT) | bank;
+    return DAP_sampler_transfer(DP_SELECT, &data);
+}
+
+/*
+ * Save CSW and TAR, point TAR at the block holding `address` and switch
+ * to bank 1. With a sticky error already set, even the SELECT write
+ * FAULTs, so `owned` tells whether any later FAULT is the sampler's.
+ */
+static uint8_t DAP_sampler_open(uint32_t address, uint32_t* csw, uint32_t* tar, bool* owned) {
+    uint8_t ack = DAP_sampler_select(0);
+    *owned = (ack == DAP_TRANSFER_OK);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_CSW, NULL);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_TAR, csw);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, tar);
+    }
+
+    uint32_t data = (*csw & ~CSW_SIZE_ADDRINC_MASK) | CSW_SIZE_WORD;
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DAP_TRANSFER_APnDP | AP_CSW, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        data = address & BD_BLOCK_MASK;
+        ack = DAP_sampler_transfer(DAP_TRANSFER_APnDP | AP_TAR, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_select(SELECT_BANK_BD);
+    }
+    return ack;
+}
+
+/* Put back CSW, TAR and the host's SELECT */
+static uint8_t DAP_sampler_close(uint32_t select, uint32_t csw, uint32_t tar) {
+    uint8_t ack = DAP_sampler_select(0);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DAP_TRANSFER_APnDP | AP_CSW, &csw);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DAP_TRANSFER_APnDP | AP_TAR, &tar);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DP_SELECT, &select);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        /* Check the posted TAR write went through */
+        ack = DAP_sampler_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, NULL);
+    }
+    return ack;
+}
+
+/*
+ * Read PCSR `count` times. Each read returns the value posted by the
+ * one before it, and RDBUFF collects the last.
+ */
+static uint8_t DAP_sampler_read_pcsr(uint32_t* values, uint32_t count) {
+    uint8_t ack = DAP_sampler_transfer(AP_BD_PCSR | DAP_TRANSFER_RnW, NULL);
+    for (uint32_t i = 0; i < count && ack == DAP_TRANSFER_OK; i++) {
+        uint32_t request = (i + 1U < count) ? (AP_BD_PCSR | DAP_TRANSFER_RnW)
+                                            : (DP_RDBUFF | DAP_TRANSFER_RnW);
+        ack = DAP_sampler_transfer(request, &values[i]);
+    }
+    return ack;
+}
+
+/*
+ * Poll DHCSR until `status` is set. Each round posts `request` behind
+ * the DHCSR read, so that DCRDR can be waiting in RDBUFF once S_REGRDY
+ * shows.
+ */
+static uint8_t DAP_sampler_wait(uint32_t status, uint32_t request, bool* ready) {
+    uint8_t ack = DAP_TRANSFER_OK;
+    *ready = false;
+    for (uint8_t i = 0; i < HALT_RETRIES && ack == DAP_TRANSFER_OK && !*ready; i++) {
+        uint32_t dhcsr = 0;
+        ack = DAP_sampler_transfer(AP_BD_DHCSR | DAP_TRANSFER_RnW, NULL);
+        if (ack == DAP_TRANSFER_OK) {
+            ack = DAP_sampler_transfer(request | DAP_TRANSFER_RnW, &dhcsr);
+        }
+        *ready = (dhcsr & status) != 0;
+    }
+    return ack;
+}
+
+/*
+ * Halt the core, read its PC and let it run again, for cores without
+ * PCSR. A core that is already halted is left alone.
+ */
+static uint8_t DAP_sampler_halt_pc(uint32_t* pc) {
+    uint32_t dhcsr = 0;
+    *pc = PC_UNAVAILABLE;
+    uint8_t ack = DAP_sampler_transfer(AP_BD_DHCSR | DAP_TRANSFER_RnW, NULL);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, &dhcsr);
+    }
+    if (ack != DAP_TRANSFER_OK || (dhcsr & DHCSR_S_HALT)) {
+        return ack;
+    }
+
+    /* Halting needs C_DEBUGEN set beforehand */
+    uint32_t run = DHCSR_DBGKEY | DHCSR_C_DEBUGEN | (dhcsr & DHCSR_C_MASKINTS);
+    uint32_t data = run;
+    if (!(dhcsr & DHCSR_C_DEBUGEN)) {
+        ack = DAP_sampler_transfer(AP_BD_DHCSR, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        data = run | DHCSR_C_HALT;
+        ack = DAP_sampler_transfer(AP_BD_DHCSR, &data);
+    }
+
+    bool ready = false;
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_sampler_wait(DHCSR_S_HALT, AP_BD_DHCSR, &ready);
+    }
+    if (ack == DAP_TRANSFER_OK && ready) {
+        data = DAP_CORE_REG_PC;
+        ack = DAP_sampler_transfer(AP_BD_DCRSR, &data);
+        if (ack == DAP_TRANSFER_OK) {
+            ack = DAP_sampler_wait(DHCSR_S_REGRDY, AP_BD_DCRDR, &ready);
+        }
+        if (ack == DAP_TRANSFER_OK && ready) {
+            ack = DAP_sampler_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, pc);
+        }
+    }
+
+    /* Resume whatever happened, and hand back C_DEBUGEN as it was */
+    if (ack == DAP_TRANSFER_FAULT) {
+        data = ABORT_CLEAR_ERRORS;
+        DAP_sampler_transfer(DP_ABORT, &data);
+    }
+    data = run;
+    uint8_t resume_ack = DAP_sampler_transfer(AP_BD_DHCSR, &data);
+    if (resume_ack == DAP_TRANSFER_OK && !(dhcsr & DHCSR_C_DEBUGEN)) {
+        data = DHCSR_DBGKEY;
+        resume_ack = DAP_sampler_transfer(AP_BD_DHCSR, &data);
+    }
+    return (ack == DAP_TRANSFER_OK) ? resume_ack : ack;
+}
+
+static void DAP_sampler_record(uint32_t pc) {
+    total_samples++;
+    window_samples++;
+    if (pc == PC_UNAVAILABLE) {
+        total_halted++;
+        if (stream_halted != UINT16_MAX) {
+            stream_halted++;
+        }
+        return;
+    }
+
+    uint32_t index = (pc - sampler_base) >> sampler_shift;
+    if (pc < sampler_base || index >= PC_SAMPLER_BUCKETS) {
+        total_outside++;
+        if (stream_outside != UINT16_MAX) {
+            stream_outside++;
+        }
+    } else if (histogram[index] != UINT16_MAX) {
+        histogram[index]++;
+    }
+}
+
+/* Samples due now, out of the credit built up at the configured rate */
+static uint32_t DAP_sampler_due(uint32_t now) {
+    uint32_t elapsed = now - last_tick;
+    last_tick = now;
+    if (sampler_rate == 0U) {
+        return PC_SAMPLER_MAX_BURST;
+    }
+
+    if (elapsed > RATE_WINDOW_MS) {
+        elapsed = RATE_WINDOW_MS;
+    }
+    credit += elapsed * sampler_rate;
+    if (credit > 1000U * PC_SAMPLER_MAX_BURST) {
+        /* Idle time was short; drop what can't be caught up with */
+        credit = 1000U * PC_SAMPLER_MAX_BURST;
+    }
+
+    uint32_t count = credit / 1000U;
+    credit -= count * 1000U;
+    return count;
+}
+
+static void DAP_sampler_measure(uint32_t now) {
+    uint32_t elapsed = now - window_start;
+    if (elapsed >= RATE_WINDOW_MS) {
+        achieved_rate = (window_samples * 1000U) / elapsed;
+        window_samples = 0;
+        window_start = now;
+    }
+}
+
+/* SWCLK frequency for the clock the host last set with DAP_SWJ_Clock */
+static uint32_t DAP_sampler_swclk(void) {
+    uint32_t cycles = DAP_Data.fast_clock
+                    ? IO_PORT_WRITE_CYCLES + DELAY_FAST_CYCLES
+                    : IO_PORT_WRITE_CYCLES + DAP_Data.clock_delay * DELAY_SLOW_CYCLES;
+    return (CPU_CLOCK / 2U) / cycles;
+}
+
+/* Best possible PCSR sample rate: one SWD read per sample */
+static uint32_t DAP_sampler_ceiling(void) {
+    uint32_t bits = SWD_READ_BITS(DAP_Data.swd_conf.turnaround)
+                  + DAP_Data.transfer.idle_cycles;
+    return DAP_sampler_swclk() / bits;
+}
+
+void DAP_sampler_update(void) {
+    if (!DAP_sampler_enabled() || DAP_Data.debug_port != DAP_PORT_SWD) {
+        return;
+    }
+
+    uint32_t now = get_ticks();
+    DAP_sampler_measure(now);
+    uint32_t count = DAP_sampler_due(now);
+    if (count == 0U || (int32_t)(now - backoff_until) < 0) {
+        return;
+    }
+
+    /* SELECT can't be read back, so only borrow the AP if it can be restored */
+    uint32_t select;
+    select_unknown = !SWD_shadow_select(&select);
+    if (select_unknown) {
+        return;
+    }
+
+    uint32_t csw = 0;
+    uint32_t tar = 0;
+    bool halt = (active_mode == PC_SAMPLER_MODE_HALT);
+    bool owned = false;
+    uint8_t ack = DAP_sampler_open(halt ? DHCSR : DWT_PCSR, &csw, &tar, &owned);
+    bool opened = (ack == DAP_TRANSFER_OK);
+    bool probe_failed = false;
+    uint32_t values[PC_SAMPLER_MAX_BURST];
+
+    if (ack == DAP_TRANSFER_OK && halt) {
+        count = 1;
+        ack = DAP_sampler_halt_pc(&values[0]);
+    } else if (ack == DAP_TRANSFER_OK) {
+        if (active_mode == PC_SAMPLER_MODE_AUTO) {
+            count = 1;
+        }
+        ack = DAP_sampler_read_pcsr(values, count);
+        if (active_mode == PC_SAMPLER_MODE_AUTO) {
+            /* Without PCSR, the read faults or the word reads as zero */
+            probe_failed = (ack == DAP_TRANSFER_FAULT)
+                        || (ack == DAP_TRANSFER_OK && values[0] == 0U);
+            if (probe_failed) {
+                active_mode = PC_SAMPLER_MODE_HALT;
+            } else if (ack == DAP_TRANSFER_OK) {
+                active_mode = PC_SAMPLER_MODE_PCSR;
+            }
+        }
+    }
+
+    if (ack == DAP_TRANSFER_OK && !probe_failed) {
+        for (uint32_t i = 0; i < count; i++) {
+            DAP_sampler_record(values[i]);
+        }
+    }
+
+    if (ack == DAP_TRANSFER_FAULT && owned) {
+        /* Don't leave the host a sticky error from our own accesses */
+        uint32_t data = ABORT_CLEAR_ERRORS;
+        DAP_sampler_transfer(DP_ABORT, &data);
+    }
+    if (opened) {
+        uint8_t close_ack = DAP_sampler_close(select, csw, tar);
+        if (ack == DAP_TRANSFER_OK || probe_failed) {
+            ack = close_ack;
+        }
+    }
+
+    if (ack != DAP_TRANSFER_OK) {
+        total_errors++;
+        backoff_until = now + ERROR_BACKOFF_MS;
+    }
+}
+
+#if VCDC_AVAILABLE && !GDB_SERVER
+
+static void DAP_sampler_print_hex16(uint16_t x) {
+    vcdc_print_hex_byte((uint8_t)(x >> 8));
+    vcdc_print_hex_byte((uint8_t)x);
+}
+
+/*
+ * Send the histogram a piece at a time as the VCDC TX buffer drains.
+ * Buckets are cleared as they are sent, so samples that come in while
+ * a line is on its way count towards the next snapshot.
+ */
+void DAP_sampler_stream_update(void) {
+    const uint8_t streaming = PC_SAMPLER_ENABLE | PC_SAMPLER_STREAM;
+    if (stream_state == STREAM_IDLE) {
+        uint32_t now = get_ticks();
+        if ((sampler_flags & streaming) != streaming || stream_interval == 0U
+            || (int32_t)(now - stream_due) < 0
+            || vcdc_send_buffer_space() < STREAM_CHUNK_SIZE) {
+            return;
+        }
+
+        stream_due = now + stream_interval;
+        vcdc_putchar('P');
+        vcdc_print_hex_byte(stream_seq++);
+        vcdc_putchar(' ');
+        vcdc_print_hex(sampler_base);
+        vcdc_print_hex_byte(sampler_shift);
+        stream_index = 0;
+        stream_state = STREAM_BUCKETS;
+    }
+
+    while (stream_state == STREAM_BUCKETS
+           && vcdc_send_buffer_space() >= STREAM_CHUNK_SIZE) {
+        while (stream_index < PC_SAMPLER_BUCKETS && histogram[stream_index] == 0U) {
+            stream_index++;
+        }
+        if (stream_index == PC_SAMPLER_BUCKETS) {
+            stream_state = STREAM_TRAILER;
+            break;
+        }
+
+        vcdc_putchar(' ');
+        vcdc_print_hex_byte((uint8_t)stream_index);
+        DAP_sampler_print_hex16(histogram[stream_index]);
+        histogram[stream_index++] = 0;
+    }
+
+    if (stream_state == STREAM_TRAILER
+        && vcdc_send_buffer_space() >= STREAM_CHUNK_SIZE) {
+        vcdc_print(" O");
+        DAP_sampler_print_hex16(stream_outside);
+        vcdc_print(" H");
+        DAP_sampler_print_hex16(stream_halted);
+        vcdc_print(" R");
+        vcdc_print_hex(achieved_rate);
+        vcdc_print("\r\n");
+        stream_outside = 0;
+        stream_halted = 0;
+        stream_state = STREAM_IDLE;
+    }
+}
+
+#endif
+
+static void DAP_sampler_clear(void) {
+    memset(histogram, 0, sizeof(histogram));
+    total_samples = 0;
+    total_halted = 0;
+    total_outside = 0;
+    total_errors = 0;
+    stream_outside = 0;
+    stream_halted = 0;
+}
+
+uint32_t DAP_sampler_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num = 1;
+    response[0] = DAP_OK;
+    switch (request[0]) {
+        case PC_SAMPLER_READ_STATUS: {
+            uint32_t counters[] = {
+                total_samples, total_halted, total_outside, total_errors,
+                achieved_rate, DAP_sampler_swclk(), DAP_sampler_ceiling(),
+            };
+            response[1] = sampler_flags | (select_unknown ? PC_SAMPLER_NO_SELECT : 0U);
+            response[2] = active_mode;
+            response[3] = PC_SAMPLER_BUCKETS;
+            memcpy(&response[4], counters, sizeof(counters));
+            num += 3 + sizeof(counters);
+            break;
+        }
+        case PC_SAMPLER_CONFIGURE: {
+            request_len = 16;
+            uint32_t base;
+            uint32_t rate;
+            uint16_t interval;
+            memcpy(&base, &request[5], sizeof(base));
+            memcpy(&rate, &request[9], sizeof(rate));
+            memcpy(&interval, &request[13], sizeof(interval));
+            if (request[2] > PC_SAMPLER_MODE_HALT || request[4] > 31U || rate > MAX_RATE) {
+                response[0] = DAP_ERROR;
+                break;
+            }
+
+            uint32_t now = get_ticks();
+            sampler_flags = request[1] & (PC_SAMPLER_ENABLE | PC_SAMPLER_STREAM);
+            sampler_mode = request[2];
+            sampler_apsel = request[3];
+            sampler_shift = request[4];
+            sampler_base = base;
+            sampler_rate = rate;
+            stream_interval = interval;
+
+            active_mode = sampler_mode;
+            select_unknown = false;
+            credit = 0;
+            last_tick = now;
+            backoff_until = now;
+            window_start = now;
+            window_samples = 0;
+            achieved_rate = 0;
+            stream_due = now + stream_interval;
+            DAP_sampler_clear();
+            SWD_shadow_track();
+            break;
+        }
+        case PC_SAMPLER_READ_HISTOGRAM: {
+            request_len = 5;
+            uint32_t first = request[1];
+            uint32_t count = request[2];
+            if (first >= PC_SAMPLER_BUCKETS) {
+                count = 0;
+            } else if (count > PC_SAMPLER_BUCKETS - first) {
+                count = PC_SAMPLER_BUCKETS - first;
+            }
+            if (count > HISTOGRAM_MAX_READ) {
+                count = HISTOGRAM_MAX_READ;
+            }
+
+            response[1] = (uint8_t)first;
+            response[2] = (uint8_t)count;
+            if (count > 0U) {
+                memcpy(&response[3], &histogram[first], 2U * count);
+                if (request[3]) {
+                    memset(&histogram[first], 0, 2U * count);
+                }
+            }
+            num += 2 + 2U * count;
+            break;
+        }
+        case PC_SAMPLER_CLEAR:
+            DAP_sampler_clear();
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
+
+#endif
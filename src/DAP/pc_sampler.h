@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DAP_PC_SAMPLER_H_INCLUDED
+#define DAP_PC_SAMPLER_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Optional statistical profiler, enabled with `make PC_SAMPLER=1`. While
+ * no DAP command is queued, the probe samples the target's program
+ * counter and counts the samples in a histogram of fixed-size address
+ * buckets, so a profile builds up on the probe without the host polling.
+ *
+ * Samples come from DWT_PCSR, which reads the PC of a running core
+ * without stopping it. Cores without one are sampled by halting them,
+ * reading the PC through DCRSR and resuming them, which does disturb
+ * the target. Sampling only runs while the probe knows the host's
+ * SELECT value, and each burst puts back SELECT, CSW and TAR.
+ *
+ * On boards with VCDC_AVAILABLE the histogram is also streamed out of
+ * the virtual COM port as periodic snapshots, one line per snapshot.
+ * The stream takes the port over from SLCAN and stdout, but leaves it
+ * to the GDB server when both are built in:
+ *
+ *   P<seq> <base><shift>[ <bucket><count>]... O<outside> H<halted> R<rate>
+ *
+ * All fields are hex: seq, shift and bucket are 2 digits, base and
+ * rate 8, and count, outside and halted 4. Only buckets that were hit
+ * since the previous snapshot are listed, and each one is cleared as
+ * it is sent. Outside counts samples that missed the histogram range,
+ * halted those taken while the core was halted or its PC could not be
+ * read, and rate is the number of samples per second achieved.
+ */
+#ifndef PC_SAMPLER
+#define PC_SAMPLER 0
+#endif
+
+#ifndef PC_SAMPLER_BUCKETS
+#define PC_SAMPLER_BUCKETS          64U
+#endif
+
+/* Most samples taken in one pass through the idle loop */
+#define PC_SAMPLER_MAX_BURST        16U
+
+#define ID_DAP_PCSampler            0x88U
+
+/* ID_DAP_PCSampler sub-commands */
+#define PC_SAMPLER_READ_STATUS      0x00U
+#define PC_SAMPLER_CONFIGURE        0x01U   // <flags> <mode> <apsel> <shift> <u32 base> <u32 rate> <u16 interval>
+#define PC_SAMPLER_READ_HISTOGRAM   0x02U   // <first> <count> <clear>
+#define PC_SAMPLER_CLEAR            0x03U
+
+/* PC_SAMPLER_CONFIGURE flags */
+#define PC_SAMPLER_ENABLE           (1U << 0)
+#define PC_SAMPLER_STREAM           (1U << 1)
+
+/* PC_SAMPLER_READ_STATUS state bits, after the flags */
+#define PC_SAMPLER_NO_SELECT        (1U << 7)   // Waiting to learn the host's SELECT
+
+/* Sampling modes */
+#define PC_SAMPLER_MODE_AUTO        0x00U   // PCSR if the core has it, halting otherwise
+#define PC_SAMPLER_MODE_PCSR        0x01U
+#define PC_SAMPLER_MODE_HALT        0x02U
+
+#define PC_SAMPLER_RAM_USAGE        (2 * PC_SAMPLER_BUCKETS + 64)
+
+extern bool DAP_sampler_enabled(void);
+extern void DAP_sampler_update(void);
+extern void DAP_sampler_stream_update(void);
+
+extern uint32_t DAP_sampler_vendor_command(const uint8_t* request,
+                                           uint8_t* response);
+
+#endif
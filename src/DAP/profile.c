@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/profile.h"
+
+#include "tick.h"
+
+#if DAP_PROFILING
+
+#define DAP_PROFILE_ENTRY_LEN 21U
+
+static DAP_ProfileEntry profile_entries[DAP_PROFILE_SLOTS];
+static uint32_t profile_histogram[DAP_PROFILE_HISTOGRAM_SIZE];
+static uint32_t profile_packets;
+static uint64_t profile_queue_cycles;
+static uint64_t profile_send_cycles;
+
+static uint32_t received_at[DAP_PACKET_QUEUE_SIZE];
+static uint32_t finished_at[DAP_PACKET_QUEUE_SIZE];
+
+void DAP_profile_reset(void) {
+    memset(profile_entries, 0, sizeof(profile_entries));
+    memset(profile_histogram, 0, sizeof(profile_histogram));
+    profile_packets = 0;
+    profile_queue_cycles = 0;
+    profile_send_cycles = 0;
+}
+
+static uint8_t DAP_profile_slot(uint8_t id) {
+    if (id < DAP_PROFILE_SLOT_VENDOR) {
+        return id;
+    } else if ((id >= ID_DAP_Vendor0) && (id <= ID_DAP_Vendor31)) {
+        return DAP_PROFILE_SLOT_VENDOR;
+    } else {
+        return DAP_PROFILE_SLOT_OTHER;
+    }
+}
+
+void DAP_profile_command(uint8_t id, uint32_t cycles) {
+    DAP_ProfileEntry* entry = &profile_entries[DAP_profile_slot(id)];
+    if (entry->count == 0 || cycles < entry->min_cycles) {
+        entry->min_cycles = cycles;
+    }
+    if (cycles > entry->max_cycles) {
+        entry->max_cycles = cycles;
+    }
+    entry->total_cycles += cycles;
+    entry->count++;
+}
+
+void DAP_profile_received(uint8_t slot) {
+    received_at[slot] = get_cycles();
+}
+
+void DAP_profile_started(uint8_t slot) {
+    profile_queue_cycles += get_cycles() - received_at[slot];
+}
+
+void DAP_profile_finished(uint8_t slot) {
+    finished_at[slot] = get_cycles();
+}
+
+void DAP_profile_sent(uint8_t slot) {
+    uint32_t now = get_cycles();
+    profile_send_cycles += now - finished_at[slot];
+
+    uint32_t latency_us = (now - received_at[slot]) / (CPU_CLOCK / 1000000U);
+    uint8_t bucket = 0;
+    latency_us >>= DAP_PROFILE_HISTOGRAM_SHIFT;
+    while (latency_us != 0 && bucket < DAP_PROFILE_HISTOGRAM_SIZE - 1) {
+        latency_us >>= 1;
+        bucket++;
+    }
+    profile_histogram[bucket]++;
+    profile_packets++;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 0);
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return p + 4;
+}
+
+static uint8_t* put_u64(uint8_t* p, uint64_t value) {
+    p = put_u32(p, (uint32_t)value);
+    return put_u32(p, (uint32_t)(value >> 32));
+}
+
+static uint8_t DAP_profile_slot_id(uint8_t slot) {
+    if (slot == DAP_PROFILE_SLOT_VENDOR) {
+        return ID_DAP_Vendor0;
+    } else if (slot == DAP_PROFILE_SLOT_OTHER) {
+        return ID_DAP_Invalid;
+    } else {
+        return slot;
+    }
+}
+
+/*
+ * Summary response: status, CPU clock in Hz, packet count, total queue
+ * and send wait in cycles (64-bit) and the latency histogram.
+ */
+static uint32_t DAP_profile_read_summary(uint8_t* response) {
+    uint8_t* p = response;
+    *p++ = DAP_OK;
+    p = put_u32(p, CPU_CLOCK);
+    p = put_u32(p, profile_packets);
+    p = put_u64(p, profile_queue_cycles);
+    p = put_u64(p, profile_send_cycles);
+    for (uint8_t i = 0; i < DAP_PROFILE_HISTOGRAM_SIZE; i++) {
+        p = put_u32(p, profile_histogram[i]);
+    }
+    return (uint32_t)(p - response);
+}
+
+/*
+ * Reports the commands seen so far, starting from the given slot, as
+ * many as fit per packet. Each entry is the command ID (0x80 for all
+ * vendor commands, 0xFF for unknown ones), the call count, min and max
+ * cycles and the 64-bit cycle total. The response gives the slot to
+ * continue from, or 0xFF when there are no more.
+ */
+static uint32_t DAP_profile_read_commands(uint8_t start, uint8_t* response) {
+    uint8_t* p = response;
+    uint8_t* next = &response[1];
+    uint8_t* count = &response[2];
+    *p++ = DAP_OK;
+    *next = 0xFFU;
+    *count = 0;
+    p += 2;
+
+    for (uint8_t slot = start; slot < DAP_PROFILE_SLOTS; slot++) {
+        const DAP_ProfileEntry* entry = &profile_entries[slot];
+        if (entry->count == 0) {
+            continue;
+        }
+        if ((size_t)(p - response) + 1U + DAP_PROFILE_ENTRY_LEN > DAP_PACKET_SIZE) {
+            *next = slot;
+            break;
+        }
+        *p++ = DAP_profile_slot_id(slot);
+        p = put_u32(p, entry->count);
+        p = put_u32(p, entry->min_cycles);
+        p = put_u32(p, entry->max_cycles);
+        p = put_u64(p, entry->total_cycles);
+        (*count)++;
+    }
+
+    return (uint32_t)(p - response);
+}
+
+uint32_t DAP_profile_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num;
+    switch (request[0]) {
+        case DAP_PROFILE_READ_SUMMARY:
+            num = DAP_profile_read_summary(response);
+            break;
+        case DAP_PROFILE_READ_COMMANDS:
+            request_len = 3;
+            num = DAP_profile_read_commands(request[1], response);
+            break;
+        case DAP_PROFILE_RESET:
+            DAP_profile_reset();
+            response[0] = DAP_OK;
+            num = 1;
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            num = 1;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DAP_PROFILE_H_INCLUDED
+#define DAP_PROFILE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Optional cycle profiling of the DAP command dispatcher, enabled with
+ * `make DAP_PROFILING=1`. When disabled, none of it is linked in.
+ */
+#ifndef DAP_PROFILING
+#define DAP_PROFILING 0
+#endif
+
+#define ID_DAP_Profile              0x81U
+
+/* ID_DAP_Profile sub-commands */
+#define DAP_PROFILE_READ_SUMMARY    0x00U
+#define DAP_PROFILE_READ_COMMANDS   0x01U
+#define DAP_PROFILE_RESET           0x02U
+
+/* Command IDs 0x00-0x1F, then one slot each for vendor and other IDs */
+#define DAP_PROFILE_SLOTS           34U
+#define DAP_PROFILE_SLOT_VENDOR     32U
+#define DAP_PROFILE_SLOT_OTHER      33U
+
+/* Packet latency buckets: <32us, <64us, ... <2048us, >=2048us */
+#define DAP_PROFILE_HISTOGRAM_SIZE  8U
+#define DAP_PROFILE_HISTOGRAM_SHIFT 5U
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+} DAP_ProfileEntry;
+
+#define DAP_PROFILE_RAM_USAGE (DAP_PROFILE_SLOTS * sizeof(DAP_ProfileEntry) \
+                               + 8 * DAP_PACKET_QUEUE_SIZE + 64)
+
+extern void DAP_profile_reset(void);
+extern void DAP_profile_command(uint8_t id, uint32_t cycles);
+
+/* Packet lifecycle, indexed by DAP packet queue slot */
+extern void DAP_profile_received(uint8_t slot);
+extern void DAP_profile_started(uint8_t slot);
+extern void DAP_profile_finished(uint8_t slot);
+extern void DAP_profile_sent(uint8_t slot);
+
+extern uint32_t DAP_profile_vendor_command(const uint8_t* request,
+                                           uint8_t* response);
+
+#endif
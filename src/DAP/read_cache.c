@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/read_cache.h"
+#include "DAP/swd_shadow.h"
+
+#if DAP_READ_CACHE
+
+_Static_assert(DAP_READ_CACHE_LINES > 0 && DAP_READ_CACHE_LINES <= 255,
+               "Read cache line count must fit in a byte");
+_Static_assert(DAP_READ_CACHE_LINE_WORDS <= 16,
+               "Read cache valid mask has one bit per word");
+
+#define LINE_BYTES              (DAP_READ_CACHE_LINE_WORDS * 4U)
+#define LINE_FULL               ((uint16_t)((1UL << DAP_READ_CACHE_LINE_WORDS) - 1U))
+
+/* Cached addresses: code and SRAM, but no peripherals */
+#define CACHEABLE_LIMIT         0x40000000UL
+
+/* Auto-increment is only guaranteed within a 1KB block */
+#define TAR_AUTOINC_BLOCK_MASK  0x3FFUL
+
+#define SCS_BASE                0xE000E000UL
+#define SCS_MASK                0xFFFFF000UL
+#define DHCSR                   0xE000EDF0UL
+#define DHCSR_S_HALT            (1UL << 17)
+#define DCRSR                   0xE000EDF4UL
+#define DCRDR                   0xE000EDF8UL
+
+#define ABORT_STKERRCLR         (1UL << 2)
+
+static DAP_ReadCacheLine cache_lines[DAP_READ_CACHE_LINES];
+
+static uint8_t cache_flags;
+static uint8_t cache_line_count = DAP_READ_CACHE_LINES;
+static uint8_t cache_victim;
+static uint32_t cache_clock;
+
+/* Last DHCSR read showed the core halted, and nothing resumed it since */
+static bool target_halted;
+
+static bool prefetch_armed;
+static uint8_t prefetch_apsel;
+static uint32_t prefetch_address;
+
+/*
+ * A prefetch costs a line's worth of transfers, which only pays off if
+ * the host goes on to read that line. Each prefetch spends the credit
+ * and a hit in the line it fetched earns it back. A host that misses
+ * three blocks in a row, each starting where the last one ended, is
+ * reading memory through and gets the credit back too.
+ */
+static bool prefetch_credit;
+static uint8_t stream_misses;
+static bool prefetched_unused;
+static uint8_t prefetched_apsel;
+static uint32_t prefetched_base;
+
+static uint32_t cache_hits;
+static uint32_t cache_misses;
+static uint32_t cache_prefetches;
+
+bool DAP_cache_enabled(void) {
+    return (cache_flags & DAP_READ_CACHE_ENABLE) != 0;
+}
+
+static void DAP_cache_drop_lines(void) {
+    for (uint8_t i = 0; i < DAP_READ_CACHE_LINES; i++) {
+        cache_lines[i].valid = 0;
+    }
+    prefetch_armed = false;
+    prefetched_unused = false;
+}
+
+void DAP_cache_invalidate(void) {
+    DAP_cache_drop_lines();
+    target_halted = false;
+}
+
+static DAP_ReadCacheLine* DAP_cache_lookup(uint8_t apsel, uint32_t base) {
+    for (uint8_t i = 0; i < cache_line_count; i++) {
+        DAP_ReadCacheLine* line = &cache_lines[i];
+        if (line->valid && line->base == base && line->apsel == apsel) {
+            line->last_use = ++cache_clock;
+            return line;
+        }
+    }
+    return NULL;
+}
+
+static DAP_ReadCacheLine* DAP_cache_allocate(uint8_t apsel, uint32_t base) {
+    DAP_ReadCacheLine* line = NULL;
+    for (uint8_t i = 0; i < cache_line_count && !line; i++) {
+        if (!cache_lines[i].valid) {
+            line = &cache_lines[i];
+        }
+    }
+
+    if (!line && (cache_flags & DAP_READ_CACHE_LRU)) {
+        line = &cache_lines[0];
+        for (uint8_t i = 1; i < cache_line_count; i++) {
+            if ((int32_t)(cache_lines[i].last_use - line->last_use) < 0) {
+                line = &cache_lines[i];
+            }
+        }
+    } else if (!line) {
+        cache_victim = (uint8_t)((cache_victim + 1U) % cache_line_count);
+        line = &cache_lines[cache_victim];
+    }
+
+    line->base = base;
+    line->apsel = apsel;
+    line->valid = 0;
+    line->last_use = ++cache_clock;
+    return line;
+}
+
+void DAP_cache_observe_read(uint8_t apsel, uint32_t address, uint32_t value) {
+    if (address == DHCSR) {
+        target_halted = (value & DHCSR_S_HALT) != 0;
+        if (!target_halted) {
+            DAP_cache_drop_lines();
+        }
+        return;
+    }
+
+    if (!DAP_cache_enabled() || !target_halted
+        || address >= CACHEABLE_LIMIT || (address & 3U)) {
+        return;
+    }
+
+    uint32_t base = address & ~(LINE_BYTES - 1U);
+    DAP_ReadCacheLine* line = DAP_cache_lookup(apsel, base);
+    if (!line) {
+        line = DAP_cache_allocate(apsel, base);
+    }
+    uint32_t index = (address - base) / 4U;
+    line->words[index] = value;
+    line->valid |= (uint16_t)(1U << index);
+}
+
+void DAP_cache_observe_write(bool known, uint32_t address) {
+    DAP_cache_drop_lines();
+
+    /* Core register transfers leave the core halted; anything else in
+       the SCS might resume or reset it */
+    if (!known || ((address & SCS_MASK) == SCS_BASE
+                   && address != DCRSR && address != DCRDR)) {
+        target_halted = false;
+    }
+}
+
+/*
+ * Serve a DAP_TransferBlock read of count words from DRW, if every
+ * word is cached. On a miss, remember where the block ended so that
+ * the next line can be fetched while the probe is idle, provided the
+ * last line fetched that way was read.
+ */
+bool DAP_cache_read(uint32_t count, uint8_t* response) {
+    uint8_t apsel;
+    uint32_t address;
+    if (!DAP_cache_enabled() || count == 0U
+        || !SWD_shadow_drw_address(&apsel, &address)) {
+        return false;
+    }
+
+    uint32_t end = address + 4U * count;
+    prefetch_armed = false;
+
+    bool hit = target_halted && end <= CACHEABLE_LIMIT && !(address & 3U)
+            && !(((end - 1U) ^ address) & ~TAR_AUTOINC_BLOCK_MASK);
+    for (uint32_t word = address; hit && word != end; word += 4U) {
+        uint32_t base = word & ~(LINE_BYTES - 1U);
+        DAP_ReadCacheLine* line = DAP_cache_lookup(apsel, base);
+        uint16_t bit = (uint16_t)(1U << ((word - base) / 4U));
+        if (!line || !(line->valid & bit)) {
+            hit = false;
+        } else {
+            uint32_t value = line->words[(word - base) / 4U];
+            *response++ = (uint8_t) value;
+            *response++ = (uint8_t)(value >>  8);
+            *response++ = (uint8_t)(value >> 16);
+            *response++ = (uint8_t)(value >> 24);
+        }
+    }
+
+    if (!hit) {
+        cache_misses++;
+        if (apsel != prefetch_apsel || address != prefetch_address) {
+            stream_misses = 0;
+        } else if (++stream_misses >= 2) {
+            prefetch_credit = true;
+        }
+        prefetch_armed = target_halted && prefetch_credit
+                      && (cache_flags & DAP_READ_CACHE_PREFETCH)
+                      && !((end ^ address) & ~TAR_AUTOINC_BLOCK_MASK);
+        prefetch_apsel = apsel;
+        prefetch_address = end;
+        return false;
+    }
+
+    cache_hits++;
+    if (prefetched_unused && apsel == prefetched_apsel
+        && address < prefetched_base + LINE_BYTES && end > prefetched_base) {
+        prefetched_unused = false;
+        prefetch_credit = true;
+    }
+    SWD_shadow_set_host_tar(end);
+    return true;
+}
+
+static uint8_t DAP_cache_transfer(uint32_t request, uint32_t* data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+    do {
+        ack = SWD_TransferRaw(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry--);
+    return ack;
+}
+
+/*
+ * Fetch the line following the last block read, on the same AP and
+ * within the same 1KB block, so that it cannot run off the end of a
+ * memory region. The shadows record the words as they arrive.
+ */
+bool DAP_cache_prefetch(void) {
+    if (!prefetch_armed) {
+        return false;
+    }
+    prefetch_armed = false;
+
+    uint8_t apsel;
+    uint32_t host_tar;
+    if (!target_halted || DAP_Data.debug_port != DAP_PORT_SWD
+        || !SWD_shadow_drw_address(&apsel, &host_tar) || apsel != prefetch_apsel) {
+        return false;
+    }
+
+    uint32_t base = prefetch_address & ~(LINE_BYTES - 1U);
+    DAP_ReadCacheLine* line = DAP_cache_lookup(apsel, base);
+    if (base >= CACHEABLE_LIMIT || (line && line->valid == LINE_FULL)) {
+        return false;
+    }
+
+    uint32_t data = base;
+    uint8_t ack = DAP_cache_transfer(DAP_TRANSFER_APnDP | AP_TAR, &data);
+    /* A FAULT on the TAR write is the host's own sticky error */
+    bool owned = (ack == DAP_TRANSFER_OK);
+    for (uint32_t i = 0; i < DAP_READ_CACHE_LINE_WORDS && ack == DAP_TRANSFER_OK; i++) {
+        ack = DAP_cache_transfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, &data);
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = DAP_cache_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, &data);
+    }
+
+    if (ack == DAP_TRANSFER_OK) {
+        cache_prefetches++;
+        prefetch_credit = false;
+        prefetched_unused = true;
+        prefetched_apsel = apsel;
+        prefetched_base = base;
+    } else if (ack == DAP_TRANSFER_FAULT && owned) {
+        /* Don't leave the host a sticky error it didn't cause */
+        data = ABORT_STKERRCLR;
+        DAP_cache_transfer(DP_ABORT, &data);
+    }
+
+    SWD_shadow_set_host_tar(host_tar);
+    return true;
+}
+
+uint32_t DAP_cache_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num = 1;
+    response[0] = DAP_OK;
+    switch (request[0]) {
+        case DAP_READ_CACHE_READ_STATUS:
+            response[1] = cache_flags;
+            response[2] = cache_line_count;
+            response[3] = DAP_READ_CACHE_LINES;
+            response[4] = target_halted ? 1U : 0U;
+            memcpy(&response[5], &cache_hits, sizeof(cache_hits));
+            memcpy(&response[9], &cache_misses, sizeof(cache_misses));
+            memcpy(&response[13], &cache_prefetches, sizeof(cache_prefetches));
+            num += 4 + 3 * sizeof(uint32_t);
+            break;
+        case DAP_READ_CACHE_CONFIGURE:
+            request_len = 4;
+            cache_flags = request[1];
+            /* Zero lines means as many as were built in */
+            cache_line_count = request[2];
+            if (cache_line_count == 0U || cache_line_count > DAP_READ_CACHE_LINES) {
+                cache_line_count = DAP_READ_CACHE_LINES;
+            }
+            cache_victim = 0;
+            prefetch_credit = true;
+            stream_misses = 0;
+            DAP_cache_invalidate();
+            SWD_shadow_track();
+            break;
+        case DAP_READ_CACHE_CLEAR_COUNT:
+            cache_hits = 0;
+            cache_misses = 0;
+            cache_prefetches = 0;
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
+
+#endif
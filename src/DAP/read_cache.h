@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef READ_CACHE_H_INCLUDED
+#define READ_CACHE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Optional cache of target memory read through DAP_TransferBlock,
+ * enabled with `make DAP_READ_CACHE=1`. Lines are only filled and used
+ * while the last DHCSR read showed the core halted, and only for the
+ * code and SRAM regions, below the peripheral space. Any memory write,
+ * fault, DHCSR or other System Control Space write, line reset or
+ * target reset drops every line.
+ *
+ * The cache starts out disabled. DMA or another bus master can still
+ * change SRAM under a halted core, which the probe cannot see.
+ */
+#ifndef DAP_READ_CACHE
+#define DAP_READ_CACHE 0
+#endif
+
+#ifndef DAP_READ_CACHE_LINES
+#define DAP_READ_CACHE_LINES        8U
+#endif
+
+#define DAP_READ_CACHE_LINE_WORDS   16U
+
+#define ID_DAP_ReadCache            0x85U
+
+/* ID_DAP_ReadCache sub-commands */
+#define DAP_READ_CACHE_READ_STATUS  0x00U
+#define DAP_READ_CACHE_CONFIGURE    0x01U
+#define DAP_READ_CACHE_CLEAR_COUNT  0x02U
+
+/* DAP_READ_CACHE_CONFIGURE flags */
+#define DAP_READ_CACHE_ENABLE       (1U << 0)
+#define DAP_READ_CACHE_PREFETCH     (1U << 1)
+#define DAP_READ_CACHE_LRU          (1U << 2)   // Otherwise round-robin
+
+typedef struct {
+    uint32_t base;              // Address of the first word
+    uint32_t last_use;
+    uint16_t valid;             // One bit per word
+    uint8_t apsel;
+    uint32_t words[DAP_READ_CACHE_LINE_WORDS];
+} DAP_ReadCacheLine;
+
+#define DAP_READ_CACHE_RAM_USAGE (DAP_READ_CACHE_LINES * sizeof(DAP_ReadCacheLine) + 32)
+
+extern bool DAP_cache_enabled(void);
+extern void DAP_cache_invalidate(void);
+extern void DAP_cache_observe_read(uint8_t apsel, uint32_t address, uint32_t value);
+extern void DAP_cache_observe_write(bool known, uint32_t address);
+extern bool DAP_cache_read(uint32_t count, uint8_t* response);
+extern bool DAP_cache_prefetch(void);
+
+extern uint32_t DAP_cache_vendor_command(const uint8_t* request,
+                                         uint8_t* response);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/profile.h"
+#include "DAP/recorder.h"
+
+#include "tick.h"
+
+#if DAP_RECORDER
+
+#define DAP_RECORDER_MAGIC 0x44415052UL
+
+_Static_assert((DAP_RECORDER_ENTRIES & (DAP_RECORDER_ENTRIES - 1)) == 0,
+               "Recorder size must be a power of two");
+_Static_assert(sizeof(DAP_RecorderEntry) == 8, "Recorder entries must pack into 8 bytes");
+
+/*
+ * The checksum is the XOR of every word of the log and of the header
+ * counts. Each record only has to fold in the words it replaces, and a
+ * log left over from before a reset can be verified in one pass.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;               // Packets recorded since the log was cleared
+    uint32_t boots;
+    uint32_t checksum;
+    DAP_RecorderEntry entries[DAP_RECORDER_ENTRIES];
+} DAP_RecorderLog;
+
+static DAP_RecorderLog recorder_log __attribute__((section(".noinit")));
+
+static bool recorder_restored;
+
+#if DAP_PROFILING
+static uint32_t recorder_cycles;
+static uint32_t recorder_calls;
+#endif
+
+static uint32_t DAP_recorder_entry_xor(const DAP_RecorderEntry* entry) {
+    uint32_t words[2];
+    memcpy(words, entry, sizeof(words));
+    return words[0] ^ words[1];
+}
+
+static uint32_t DAP_recorder_compute_checksum(void) {
+    uint32_t checksum = recorder_log.seq ^ recorder_log.boots;
+    for (uint32_t i = 0; i < DAP_RECORDER_ENTRIES; i++) {
+        checksum ^= DAP_recorder_entry_xor(&recorder_log.entries[i]);
+    }
+    return checksum;
+}
+
+static void DAP_recorder_clear(void) {
+    memset(&recorder_log, 0, sizeof(recorder_log));
+    recorder_log.magic = DAP_RECORDER_MAGIC;
+}
+
+static void DAP_recorder_append(const DAP_RecorderEntry* entry) {
+    DAP_RecorderEntry* slot =
+        &recorder_log.entries[recorder_log.seq & (DAP_RECORDER_ENTRIES - 1)];
+    uint32_t checksum = recorder_log.checksum ^ recorder_log.seq
+                      ^ DAP_recorder_entry_xor(slot);
+    *slot = *entry;
+    recorder_log.seq++;
+    recorder_log.checksum = checksum ^ recorder_log.seq
+                          ^ DAP_recorder_entry_xor(slot);
+}
+
+void DAP_recorder_setup(void) {
+    recorder_restored = (recorder_log.magic == DAP_RECORDER_MAGIC)
+                     && (recorder_log.checksum == DAP_recorder_compute_checksum());
+    if (!recorder_restored) {
+        DAP_recorder_clear();
+    }
+
+    recorder_log.checksum ^= recorder_log.boots;
+    recorder_log.boots++;
+    recorder_log.checksum ^= recorder_log.boots;
+
+    DAP_RecorderEntry entry = {
+        .time_ms = (uint16_t)get_ticks(),
+        .id = DAP_RECORDER_ID_BOOT,
+        .status = recorder_restored ? DAP_OK : DAP_ERROR,
+    };
+    memcpy(entry.key, &recorder_log.boots, sizeof(entry.key));
+    DAP_recorder_append(&entry);
+}
+
+void DAP_recorder_record(const uint8_t* request, const uint8_t* response) {
+    if (request[0] == ID_DAP_Recorder) {
+        return;
+    }
+
+#if DAP_PROFILING
+    uint32_t start = get_cycles();
+#endif
+
+    DAP_RecorderEntry entry;
+    entry.time_ms = (uint16_t)get_ticks();
+    entry.id = request[0];
+    switch (request[0]) {
+        case ID_DAP_Transfer:
+            /* Count, first transfer request and transfers completed */
+            entry.status = response[2];
+            entry.key[0] = request[2];
+            entry.key[1] = request[3];
+            entry.key[2] = response[1];
+            entry.key[3] = 0;
+            break;
+        case ID_DAP_TransferBlock:
+            /* Count, transfer request and transfers completed */
+            entry.status = response[3];
+            entry.key[0] = request[2];
+            entry.key[1] = request[3];
+            entry.key[2] = request[4];
+            entry.key[3] = response[1];
+            break;
+        case ID_DAP_ExecuteCommands:
+            /* Command count, then the first command and its status */
+            entry.status = response[3];
+            memcpy(entry.key, &request[1], sizeof(entry.key));
+            break;
+        default:
+            entry.status = response[1];
+            memcpy(entry.key, &request[1], sizeof(entry.key));
+            break;
+    }
+    DAP_recorder_append(&entry);
+
+#if DAP_PROFILING
+    recorder_cycles += get_cycles() - start;
+    recorder_calls++;
+#endif
+}
+
+/*
+ * Info response: status, whether the log survived the last reset,
+ * capacity, packets recorded, boot count and, in profiling builds,
+ * the average cycles spent recording a packet.
+ */
+static uint32_t DAP_recorder_read_info(uint8_t* response) {
+    uint8_t* p = response;
+    *p++ = DAP_OK;
+    *p++ = recorder_restored ? 1U : 0U;
+    *p++ = (uint8_t)(DAP_RECORDER_ENTRIES & 0xFFU);
+    *p++ = (uint8_t)(DAP_RECORDER_ENTRIES >> 8);
+    memcpy(p, &recorder_log.seq, sizeof(uint32_t));
+    memcpy(p + 4, &recorder_log.boots, sizeof(uint32_t));
+#if DAP_PROFILING
+    uint32_t average = recorder_calls ? (recorder_cycles / recorder_calls) : 0U;
+#else
+    uint32_t average = 0;
+#endif
+    memcpy(p + 8, &average, sizeof(uint32_t));
+    p += 12;
+    return (uint32_t)(p - response);
+}
+
+/* Entries are indexed from the oldest one still in the log */
+static uint32_t DAP_recorder_read_entries(uint16_t index, uint8_t* response) {
+    uint32_t available = recorder_log.seq;
+    if (available > DAP_RECORDER_ENTRIES) {
+        available = DAP_RECORDER_ENTRIES;
+    }
+    uint32_t oldest = recorder_log.seq - available;
+
+    uint8_t* p = response;
+    uint8_t* count = &response[1];
+    *p++ = DAP_OK;
+    *p++ = 0;
+
+    while (index < available
+           && (size_t)(p - response) + 1U + sizeof(DAP_RecorderEntry) <= DAP_PACKET_SIZE) {
+        uint32_t slot = (oldest + index) & (DAP_RECORDER_ENTRIES - 1);
+        memcpy(p, &recorder_log.entries[slot], sizeof(DAP_RecorderEntry));
+        p += sizeof(DAP_RecorderEntry);
+        index++;
+        (*count)++;
+    }
+
+    return (uint32_t)(p - response);
+}
+
+uint32_t DAP_recorder_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num;
+    switch (request[0]) {
+        case DAP_RECORDER_READ_INFO:
+            num = DAP_recorder_read_info(response);
+            break;
+        case DAP_RECORDER_READ_ENTRIES:
+            request_len = 4;
+            num = DAP_recorder_read_entries((uint16_t)(request[1] | (request[2] << 8)),
+                                            response);
+            break;
+        case DAP_RECORDER_CLEAR:
+            DAP_recorder_clear();
+            response[0] = DAP_OK;
+            num = 1;
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            num = 1;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
+
+#endif
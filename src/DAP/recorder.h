@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DAP_RECORDER_H_INCLUDED
+#define DAP_RECORDER_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Optional flight recorder of the last DAP commands, enabled with
+ * `make DAP_RECORDER=1`. The log lives in .noinit RAM so that it can
+ * still be read back after a watchdog reset.
+ */
+#ifndef DAP_RECORDER
+#define DAP_RECORDER 0
+#endif
+
+#define ID_DAP_Recorder             0x83U
+
+/* ID_DAP_Recorder sub-commands */
+#define DAP_RECORDER_READ_INFO      0x00U
+#define DAP_RECORDER_READ_ENTRIES   0x01U
+#define DAP_RECORDER_CLEAR          0x02U
+
+/* Must be a power of two */
+#define DAP_RECORDER_ENTRIES        64U
+
+/* Pseudo command ID logged at startup */
+#define DAP_RECORDER_ID_BOOT        0xFEU
+
+/*
+ * One packet, squeezed into 8 bytes: the low 16 bits of the millisecond
+ * tick, the command ID, its status or transfer ACK and up to four bytes
+ * of the request that matter most for that command.
+ */
+typedef struct {
+    uint16_t time_ms;
+    uint8_t id;
+    uint8_t status;
+    uint8_t key[4];
+} DAP_RecorderEntry;
+
+#define DAP_RECORDER_RAM_USAGE (DAP_RECORDER_ENTRIES * sizeof(DAP_RecorderEntry) + 16)
+
+extern void DAP_recorder_setup(void);
+extern void DAP_recorder_record(const uint8_t* request, const uint8_t* response);
+
+extern uint32_t DAP_recorder_vendor_command(const uint8_t* request,
+                                            uint8_t* response);
+
+#endif
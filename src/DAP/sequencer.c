@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/sequencer.h"
+#include "DAP/swd_shadow.h"
+
+#include "tick.h"
+
+#if DAP_SEQUENCER
+
+#define SEQ_REQUEST_MASK    (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)
+
+/* Response: ID, DAP status, outcome, detail, pc, u16 steps, emit count */
+#define SEQ_RESPONSE_HEADER 8U
+#define SEQ_EMIT_WORDS      ((DAP_PACKET_SIZE - SEQ_RESPONSE_HEADER) / 4U)
+
+static const uint8_t seq_operand_bytes[DAP_SEQ_OPS] = {
+    [DAP_SEQ_OP_END]    = 0,
+    [DAP_SEQ_OP_READ]   = 2,
+    [DAP_SEQ_OP_WRITE]  = 2,
+    [DAP_SEQ_OP_WRITEI] = 5,
+    [DAP_SEQ_OP_MOVI]   = 5,
+    [DAP_SEQ_OP_MOV]    = 2,
+    [DAP_SEQ_OP_ANDI]   = 5,
+    [DAP_SEQ_OP_ADDI]   = 5,
+    [DAP_SEQ_OP_BEQ]    = 6,
+    [DAP_SEQ_OP_BNE]    = 6,
+    [DAP_SEQ_OP_LOOP]   = 2,
+    [DAP_SEQ_OP_DELAY]  = 2,
+    [DAP_SEQ_OP_PINS]   = 3,
+    [DAP_SEQ_OP_EMIT]   = 1,
+    [DAP_SEQ_OP_FAIL]   = 1,
+};
+
+/* Which operand bytes name a register, one bit per operand */
+static const uint8_t seq_register_operands[DAP_SEQ_OPS] = {
+    [DAP_SEQ_OP_READ]   = 1U << 1,
+    [DAP_SEQ_OP_WRITE]  = 1U << 1,
+    [DAP_SEQ_OP_MOVI]   = 1U << 0,
+    [DAP_SEQ_OP_MOV]    = (1U << 0) | (1U << 1),
+    [DAP_SEQ_OP_ANDI]   = 1U << 0,
+    [DAP_SEQ_OP_ADDI]   = 1U << 0,
+    [DAP_SEQ_OP_BEQ]    = 1U << 0,
+    [DAP_SEQ_OP_BNE]    = 1U << 0,
+    [DAP_SEQ_OP_LOOP]   = 1U << 0,
+    [DAP_SEQ_OP_PINS]   = 1U << 2,
+    [DAP_SEQ_OP_EMIT]   = 1U << 0,
+};
+
+static uint8_t seq_program[DAP_SEQ_PROGRAM_SIZE];
+static uint16_t seq_length;
+
+/* Lets USB in during a run, since it is only polled from the main loop */
+static void (*seq_poll_callback)(void);
+
+typedef struct {
+    uint32_t regs[DAP_SEQ_REGISTERS];
+    uint8_t* emit;
+    uint8_t emitted;
+    uint8_t status;
+    uint8_t detail;
+    uint8_t pc;
+    uint16_t steps;
+    bool check_write;
+} DAP_SeqState;
+
+static uint32_t DAP_seq_imm32(const uint8_t* p) {
+    return (uint32_t)(p[0] <<  0) |
+           (uint32_t)(p[1] <<  8) |
+           (uint32_t)(p[2] << 16) |
+           (uint32_t)(p[3] << 24);
+}
+
+static uint8_t DAP_seq_transfer(uint32_t request, uint32_t* data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+    do {
+        ack = SWD_Transfer(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry-- && !DAP_TransferAbort);
+    return ack;
+}
+
+static uint8_t DAP_seq_read(DAP_SeqState* state, uint8_t request, uint32_t* data) {
+    uint32_t read_request = (request & SEQ_REQUEST_MASK) | DAP_TRANSFER_RnW;
+    uint8_t ack;
+    if (read_request & DAP_TRANSFER_APnDP) {
+        /* Post the AP read and collect it straight away */
+        ack = DAP_seq_transfer(read_request, NULL);
+        if (ack == DAP_TRANSFER_OK) {
+            ack = DAP_seq_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, data);
+        }
+    } else {
+        ack = DAP_seq_transfer(read_request, data);
+    }
+    state->check_write = false;
+    return ack;
+}
+
+static uint8_t DAP_seq_write(DAP_SeqState* state, uint8_t request, uint32_t data) {
+    uint8_t ack = DAP_seq_transfer(request & SEQ_REQUEST_MASK, &data);
+    /* Only a write the target took needs checking */
+    state->check_write = (ack == DAP_TRANSFER_OK);
+    return ack;
+}
+
+static uint32_t DAP_seq_pins(uint8_t value, uint8_t select) {
+    SWD_shadow_invalidate();
+
+    if (select & (1U << DAP_SWJ_SWCLK_TCK)) {
+        if (value & (1U << DAP_SWJ_SWCLK_TCK)) {
+            PIN_SWCLK_TCK_SET();
+        } else {
+            PIN_SWCLK_TCK_CLR();
+        }
+    }
+    if (select & (1U << DAP_SWJ_SWDIO_TMS)) {
+        if (value & (1U << DAP_SWJ_SWDIO_TMS)) {
+            PIN_SWDIO_TMS_SET();
+        } else {
+            PIN_SWDIO_TMS_CLR();
+        }
+    }
+    if (select & (1U << DAP_SWJ_nRESET)) {
+        PIN_nRESET_OUT(value >> DAP_SWJ_nRESET);
+    }
+
+    return (PIN_SWCLK_TCK_IN() << DAP_SWJ_SWCLK_TCK) |
+           (PIN_SWDIO_TMS_IN() << DAP_SWJ_SWDIO_TMS) |
+           (PIN_nRESET_IN()    << DAP_SWJ_nRESET);
+}
+
+/* Execute one instruction. Returns false once the program has stopped. */
+static bool DAP_seq_step(DAP_SeqState* state) {
+    uint32_t pc = state->pc;
+    uint8_t op = seq_program[pc];
+    if (op >= DAP_SEQ_OPS || pc + 1U + seq_operand_bytes[op] > seq_length) {
+        state->status = DAP_SEQ_ERR_PROGRAM;
+        return false;
+    }
+
+    const uint8_t* args = &seq_program[pc + 1U];
+    uint32_t next = pc + 1U + seq_operand_bytes[op];
+    uint32_t target = next;
+    uint8_t ack = DAP_TRANSFER_OK;
+
+    for (uint8_t i = 0; i < seq_operand_bytes[op]; i++) {
+        if ((seq_register_operands[op] & (1U << i)) && args[i] >= DAP_SEQ_REGISTERS) {
+            state->status = DAP_SEQ_ERR_PROGRAM;
+            return false;
+        }
+    }
+
+    uint32_t* regs = state->regs;
+    uint8_t reg = seq_operand_bytes[op] ? args[0] : 0U;
+    switch (op) {
+        case DAP_SEQ_OP_END:
+            return false;
+        case DAP_SEQ_OP_READ:
+            ack = DAP_seq_read(state, args[0], &regs[args[1]]);
+            break;
+        case DAP_SEQ_OP_WRITE:
+            ack = DAP_seq_write(state, args[0], regs[args[1]]);
+            break;
+        case DAP_SEQ_OP_WRITEI:
+            ack = DAP_seq_write(state, args[0], DAP_seq_imm32(&args[1]));
+            break;
+        case DAP_SEQ_OP_MOVI:
+            regs[reg] = DAP_seq_imm32(&args[1]);
+            break;
+        case DAP_SEQ_OP_MOV:
+            regs[reg] = regs[args[1]];
+            break;
+        case DAP_SEQ_OP_ANDI:
+            regs[reg] &= DAP_seq_imm32(&args[1]);
+            break;
+        case DAP_SEQ_OP_ADDI:
+            regs[reg] += DAP_seq_imm32(&args[1]);
+            break;
+        case DAP_SEQ_OP_BEQ:
+            if (regs[reg] == DAP_seq_imm32(&args[1])) {
+                target = args[5];
+            }
+            break;
+        case DAP_SEQ_OP_BNE:
+            if (regs[reg] != DAP_seq_imm32(&args[1])) {
+                target = args[5];
+            }
+            break;
+        case DAP_SEQ_OP_LOOP:
+            if (--regs[reg] != 0U) {
+                target = args[1];
+            }
+            break;
+        case DAP_SEQ_OP_DELAY: {
+            uint32_t delay = (uint32_t)(args[0] | (args[1] << 8));
+            delay *= ((CPU_CLOCK/1000000U) + (DELAY_SLOW_CYCLES-1U)) / DELAY_SLOW_CYCLES;
+            PIN_DELAY_SLOW(delay);
+            break;
+        }
+        case DAP_SEQ_OP_PINS:
+            regs[args[2]] = DAP_seq_pins(args[0], args[1]);
+            break;
+        case DAP_SEQ_OP_EMIT:
+            if (state->emitted >= SEQ_EMIT_WORDS) {
+                state->status = DAP_SEQ_ERR_EMIT;
+                return false;
+            }
+            memcpy(state->emit, &regs[reg], sizeof(uint32_t));
+            state->emit += sizeof(uint32_t);
+            state->emitted++;
+            break;
+        case DAP_SEQ_OP_FAIL:
+            state->status = DAP_SEQ_ERR_FAIL;
+            state->detail = args[0];
+            return false;
+        default:
+            break;
+    }
+
+    if (ack != DAP_TRANSFER_OK) {
+        state->status = DAP_SEQ_ERR_TRANSFER;
+        state->detail = ack;
+        return false;
+    }
+    if (target >= seq_length) {
+        state->status = DAP_SEQ_ERR_PROGRAM;
+        return false;
+    }
+
+    state->pc = (uint8_t)target;
+    return true;
+}
+
+/*
+ * DAP_TransferAbort is left as it is: an abort that came in while this
+ * command was still queued is meant for it. The main loop clears it
+ * once there is nothing left to stop.
+ */
+static void DAP_seq_run(DAP_SeqState* state, uint32_t step_limit) {
+    uint32_t start = get_ticks();
+    uint32_t polled = start;
+
+    if (DAP_Data.debug_port != DAP_PORT_SWD) {
+        state->status = DAP_SEQ_ERR_PORT;
+        return;
+    }
+
+    while (true) {
+        uint32_t now = get_ticks();
+        if (seq_poll_callback && now != polled) {
+            /* Once a millisecond, so that a Transfer Abort can get in */
+            polled = now;
+            seq_poll_callback();
+        }
+
+        if (DAP_TransferAbort) {
+            state->status = DAP_SEQ_ERR_ABORTED;
+            break;
+        } else if (state->steps >= step_limit) {
+            state->status = DAP_SEQ_ERR_STEPS;
+            break;
+        } else if ((now - start) >= DAP_SEQ_TIMEOUT_MS) {
+            state->status = DAP_SEQ_ERR_TIMEOUT;
+            break;
+        }
+
+        state->steps++;
+        if (!DAP_seq_step(state)) {
+            break;
+        }
+    }
+
+    if (state->check_write) {
+        /* Make sure the last posted write went through */
+        uint8_t ack = DAP_seq_transfer(DP_RDBUFF | DAP_TRANSFER_RnW, NULL);
+        if (ack != DAP_TRANSFER_OK && state->status == DAP_SEQ_OK) {
+            state->status = DAP_SEQ_ERR_TRANSFER;
+            state->detail = ack;
+        }
+    }
+}
+
+void DAP_sequencer_register_poll_callback(void (*callback)(void)) {
+    seq_poll_callback = callback;
+}
+
+uint32_t DAP_sequencer_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num = 1;
+    response[0] = DAP_OK;
+    switch (request[0]) {
+        case DAP_SEQ_READ_INFO: {
+            uint16_t size = DAP_SEQ_PROGRAM_SIZE;
+            uint16_t timeout = DAP_SEQ_TIMEOUT_MS;
+            memcpy(&response[1], &size, sizeof(size));
+            memcpy(&response[3], &seq_length, sizeof(seq_length));
+            response[5] = DAP_SEQ_REGISTERS;
+            memcpy(&response[6], &timeout, sizeof(timeout));
+            num += 7;
+            break;
+        }
+        case DAP_SEQ_LOAD: {
+            uint32_t offset = request[1];
+            uint32_t length = request[2];
+            request_len = 4 + length;
+            if (offset + length > DAP_SEQ_PROGRAM_SIZE || request_len > DAP_PACKET_SIZE) {
+                response[0] = DAP_ERROR;
+                request_len = 4;
+                break;
+            }
+            memcpy(&seq_program[offset], &request[3], length);
+            if (offset + length > seq_length) {
+                seq_length = (uint16_t)(offset + length);
+            }
+            break;
+        }
+        case DAP_SEQ_RUN: {
+            uint32_t count = request[1];
+            request_len = 3 + 4 * count + 2;
+            if (count > DAP_SEQ_REGISTERS || seq_length == 0U) {
+                response[0] = DAP_ERROR;
+                request_len = 3;
+                break;
+            }
+
+            DAP_SeqState state;
+            memset(&state, 0, sizeof(state));
+            for (uint32_t i = 0; i < count; i++) {
+                state.regs[i] = DAP_seq_imm32(&request[2 + 4 * i]);
+            }
+            uint32_t step_limit = (uint32_t)(request[2 + 4 * count] |
+                                             (request[3 + 4 * count] << 8));
+            if (step_limit == 0U) {
+                step_limit = DAP_SEQ_MAX_STEPS;
+            }
+            state.emit = &response[SEQ_RESPONSE_HEADER - 1U];
+
+            DAP_seq_run(&state, step_limit);
+
+            response[1] = state.status;
+            response[2] = state.detail;
+            response[3] = state.pc;
+            memcpy(&response[4], &state.steps, sizeof(state.steps));
+            response[6] = state.emitted;
+            num += 6 + 4U * state.emitted;
+            break;
+        }
+        case DAP_SEQ_CLEAR:
+            seq_length = 0;
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
+
+#endif
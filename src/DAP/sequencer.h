@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DAP_SEQUENCER_H_INCLUDED
+#define DAP_SEQUENCER_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Optional probe-side sequencer, enabled with `make DAP_SEQUENCER=1`.
+ * The host uploads a small bytecode program once and then runs it with
+ * parameters, so loops like "write, poll until a bit is set, read" run
+ * at SWD speed instead of one USB round trip per step.
+ *
+ * A run is bounded by a step limit, a time limit well inside the
+ * watchdog period and DAP_TransferAbort. The poll callback, called once
+ * a millisecond during a run, is how a Transfer Abort request gets
+ * through while the main loop is busy with the run.
+ */
+#ifndef DAP_SEQUENCER
+#define DAP_SEQUENCER 0
+#endif
+
+#define ID_DAP_Sequencer            0x86U
+
+/* ID_DAP_Sequencer sub-commands */
+#define DAP_SEQ_READ_INFO           0x00U
+#define DAP_SEQ_LOAD                0x01U   // <offset> <length> <bytes...>
+#define DAP_SEQ_RUN                 0x02U   // <count> <u32 params...> <u16 step limit>
+#define DAP_SEQ_CLEAR               0x03U
+
+#define DAP_SEQ_PROGRAM_SIZE        256U
+#define DAP_SEQ_REGISTERS           8U
+#define DAP_SEQ_MAX_STEPS           65535U
+#define DAP_SEQ_TIMEOUT_MS          250U
+
+/*
+ * Instructions, with their operand bytes. Registers are numbered
+ * 0-7, branch targets are absolute program offsets and immediates are
+ * little-endian. A transfer request byte holds APnDP, A2 and A3 as in
+ * DAP_Transfer.
+ */
+enum {
+    DAP_SEQ_OP_END,         //                          stop
+    DAP_SEQ_OP_READ,        // <request> <dst>          r[dst] = DP/AP register
+    DAP_SEQ_OP_WRITE,       // <request> <src>          DP/AP register = r[src]
+    DAP_SEQ_OP_WRITEI,      // <request> <imm32>        DP/AP register = imm
+    DAP_SEQ_OP_MOVI,        // <dst> <imm32>            r[dst] = imm
+    DAP_SEQ_OP_MOV,         // <dst> <src>              r[dst] = r[src]
+    DAP_SEQ_OP_ANDI,        // <dst> <imm32>            r[dst] &= imm
+    DAP_SEQ_OP_ADDI,        // <dst> <imm32>            r[dst] += imm
+    DAP_SEQ_OP_BEQ,         // <src> <imm32> <target>   branch if r[src] == imm
+    DAP_SEQ_OP_BNE,         // <src> <imm32> <target>   branch if r[src] != imm
+    DAP_SEQ_OP_LOOP,        // <reg> <target>           branch if --r[reg] != 0
+    DAP_SEQ_OP_DELAY,       // <u16 us>
+    DAP_SEQ_OP_PINS,        // <value> <select> <dst>   as DAP_SWJ_Pins, r[dst] = pins
+    DAP_SEQ_OP_EMIT,        // <src>                    append r[src] to the response
+    DAP_SEQ_OP_FAIL,        // <code>                   stop with an error code
+    DAP_SEQ_OPS
+};
+
+/* Outcome of a run */
+enum {
+    DAP_SEQ_OK,
+    DAP_SEQ_ERR_TRANSFER,   // Detail is the transfer ACK
+    DAP_SEQ_ERR_STEPS,
+    DAP_SEQ_ERR_TIMEOUT,
+    DAP_SEQ_ERR_ABORTED,
+    DAP_SEQ_ERR_PROGRAM,    // Bad opcode, register or target
+    DAP_SEQ_ERR_EMIT,       // Response full
+    DAP_SEQ_ERR_FAIL,       // Detail is the FAIL code
+    DAP_SEQ_ERR_PORT,       // Not connected with SWD
+};
+
+#define DAP_SEQUENCER_RAM_USAGE (DAP_SEQ_PROGRAM_SIZE + 4 * DAP_SEQ_REGISTERS + 16)
+
+extern void DAP_sequencer_register_poll_callback(void (*callback)(void));
+extern uint32_t DAP_sequencer_vendor_command(const uint8_t* request,
+                                             uint8_t* response);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/swd_health.h"
+
+#include "tick.h"
+
+static SWD_HealthCounts health_counts;
+
+/* The retry loops re-send the same request right after a WAIT */
+static uint32_t last_request;
+static uint8_t last_ack;
+
+/*
+ * When an interval is set, the counts are also latched into a window
+ * snapshot and restarted every interval_ms, so the host can poll at
+ * its leisure and still see rates over well-defined periods.
+ */
+static uint16_t window_interval_ms;
+static uint32_t window_start;
+static uint32_t window_seq;
+static SWD_HealthCounts window_counts;
+static SWD_HealthCounts window_live;
+
+static void SWD_health_count(SWD_HealthCounts* counts, uint32_t request, uint8_t outcome) {
+    if (request & DAP_TRANSFER_APnDP) {
+        counts->ap[outcome]++;
+    } else {
+        counts->dp[outcome]++;
+    }
+}
+
+void SWD_health_record(uint32_t request, uint8_t ack) {
+    uint8_t outcome;
+    switch (ack) {
+        case DAP_TRANSFER_OK:
+            outcome = SWD_HEALTH_OK;
+            break;
+        case DAP_TRANSFER_WAIT:
+            outcome = SWD_HEALTH_WAIT;
+            break;
+        case DAP_TRANSFER_FAULT:
+            outcome = SWD_HEALTH_FAULT;
+            break;
+        case DAP_TRANSFER_ERROR:
+            outcome = SWD_HEALTH_PARITY;
+            break;
+        default:
+            outcome = SWD_HEALTH_NO_ACK;
+            break;
+    }
+
+    SWD_health_count(&health_counts, request, outcome);
+    SWD_health_count(&window_live, request, outcome);
+
+    if (last_ack == DAP_TRANSFER_WAIT && request == last_request) {
+        health_counts.retries++;
+        window_live.retries++;
+    }
+    last_request = request;
+    last_ack = ack;
+}
+
+void SWD_health_match_exhausted(void) {
+    health_counts.match_exhausted++;
+    window_live.match_exhausted++;
+}
+
+void SWD_health_update(void) {
+    if (window_interval_ms == 0) {
+        return;
+    }
+
+    uint32_t now = get_ticks();
+    if ((now - window_start) >= window_interval_ms) {
+        window_start = now;
+        window_counts = window_live;
+        memset(&window_live, 0, sizeof(window_live));
+        window_seq++;
+    }
+}
+
+/* Counts go out as little-endian words in SWD_HealthCounts order */
+uint32_t SWD_health_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num = 1;
+    response[0] = DAP_OK;
+    switch (request[0]) {
+        case SWD_HEALTH_READ:
+            memcpy(&response[1], &health_counts, sizeof(health_counts));
+            num += sizeof(health_counts);
+            break;
+        case SWD_HEALTH_READ_AND_CLEAR:
+            memcpy(&response[1], &health_counts, sizeof(health_counts));
+            num += sizeof(health_counts);
+            memset(&health_counts, 0, sizeof(health_counts));
+            break;
+        case SWD_HEALTH_SET_INTERVAL:
+            request_len = 4;
+            window_interval_ms = (uint16_t)(request[1] | (request[2] << 8));
+            window_start = get_ticks();
+            window_seq = 0;
+            memset(&window_counts, 0, sizeof(window_counts));
+            memset(&window_live, 0, sizeof(window_live));
+            break;
+        case SWD_HEALTH_READ_WINDOW:
+            memcpy(&response[1], &window_seq, sizeof(window_seq));
+            memcpy(&response[5], &window_counts, sizeof(window_counts));
+            num += sizeof(window_seq) + sizeof(window_counts);
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWD_HEALTH_H_INCLUDED
+#define SWD_HEALTH_H_INCLUDED
+
+#include <stdint.h>
+
+#define ID_DAP_SWDHealth            0x82U
+
+/* ID_DAP_SWDHealth sub-commands */
+#define SWD_HEALTH_READ             0x00U
+#define SWD_HEALTH_READ_AND_CLEAR   0x01U
+#define SWD_HEALTH_SET_INTERVAL     0x02U
+#define SWD_HEALTH_READ_WINDOW      0x03U
+
+/* Outcome of a single SWD packet, by ACK */
+enum {
+    SWD_HEALTH_OK,
+    SWD_HEALTH_WAIT,
+    SWD_HEALTH_FAULT,
+    SWD_HEALTH_NO_ACK,          // No target drove the ACK, or it was garbled
+    SWD_HEALTH_PARITY,          // Read data parity mismatch
+    SWD_HEALTH_OUTCOMES
+};
+
+typedef struct {
+    uint32_t dp[SWD_HEALTH_OUTCOMES];
+    uint32_t ap[SWD_HEALTH_OUTCOMES];
+    uint32_t retries;           // Packets re-sent after a WAIT
+    uint32_t match_exhausted;   // Value matches that ran out of retries
+} SWD_HealthCounts;
+
+extern void SWD_health_record(uint32_t request, uint8_t ack);
+extern void SWD_health_match_exhausted(void);
+extern void SWD_health_update(void);
+
+extern uint32_t SWD_health_vendor_command(const uint8_t* request,
+                                          uint8_t* response);
+
+#endif
@@ -0,0 +1,763 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/pc_sampler.h"
+#include "DAP/read_cache.h"
+#include "DAP/swd_shadow.h"
+
+/*
+ * Shadows of DP SELECT and the selected MEM-AP's CSW and TAR, as last
+ * written by a transfer that was ACKed OK. A write that would store the
+ * value a register is known to hold already is skipped.
+ *
+ * TAR follows DRW accesses according to the CSW increment mode, but
+ * only within the 1KB block that auto-increment is guaranteed to
+ * cover. Anything that could change the registers behind our back
+ * drops the shadows: a garbled ACK, a line reset or sequence, and
+ * connect, disconnect or target reset. A DP write to CTRL/STAT keeps
+ * SELECT, and a FAULT or an ABORT write only drops TAR.
+ */
+
+#define SHADOW_SELECT   (1U << 0)
+#define SHADOW_CSW      (1U << 1)
+#define SHADOW_TAR      (1U << 2)
+
+#define SELECT_APSEL_MASK       0xFF000000UL
+#define SELECT_APBANKSEL_MASK   0x000000F0UL
+
+#define CSW_SIZE_MASK           0x07UL
+#define CSW_SIZE_WORD           0x02UL
+#define CSW_ADDRINC_SHIFT       4
+#define CSW_ADDRINC_MASK        0x03UL
+#define CSW_ADDRINC_OFF         0U
+#define CSW_ADDRINC_SINGLE      1U
+#define CSW_ADDRINC_PACKED      2U
+
+#define TAR_AUTOINC_BLOCK_MASK  0x3FFUL
+
+#define REQUEST_ADDRESS_MASK    (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW \
+                                 | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)
+#define REQUEST_MATCH_MASK      (DAP_TRANSFER_MATCH_VALUE | DAP_TRANSFER_MATCH_MASK)
+
+#define REQUEST_AP_WRITE_TAR    (DAP_TRANSFER_APnDP | AP_TAR)
+#define REQUEST_AP_WRITE_CSW    (DAP_TRANSFER_APnDP | AP_CSW)
+#define REQUEST_READ_RDBUFF     (DP_RDBUFF | DAP_TRANSFER_RnW)
+
+/*
+ * Shortest TAR/DRW runs worth coalescing. Switching auto-increment on
+ * and back costs up to four extra transfers; each pair saves its TAR write,
+ * and for reads also the RDBUFF read that a write would force.
+ */
+#define COALESCE_MIN_READ_PAIRS     3U
+#define COALESCE_MIN_WRITE_PAIRS    6U
+#define COALESCE_MAX_RUNS           4U
+
+static bool shadow_enabled;
+static bool shadow_tracking;
+static uint8_t shadow_valid;
+static uint32_t shadow_select;
+static uint32_t shadow_csw;
+static uint32_t shadow_tar;
+static uint32_t shadow_elided;
+
+/*
+ * A failed AP transaction only shows up as a FAULT on the next access,
+ * and not at all on the accesses that ignore the sticky flags: IDCODE,
+ * CTRL/STAT and RESEND reads and ABORT writes. A skipped write could
+ * have been the access to report it, so once one is skipped after an AP
+ * transaction that nothing has confirmed yet, RDBUFF is read before any
+ * of those go out, rather than let them hide the error or clear it.
+ */
+static bool ap_unconfirmed;
+static bool skipped_unconfirmed;
+
+/* The last FAULT came while a skipped write was still unconfirmed */
+static bool fault_skipped;
+
+/* An AP read was ACKed and its data still waits in RDBUFF */
+static bool posted_read;
+
+/* Where the posted read came from, if it was a DRW read of a known word */
+static bool posted_known;
+static uint8_t posted_apsel;
+static uint32_t posted_address;
+
+/*
+ * TAR value the host expects, after the read cache answered DRW reads
+ * that never reached the target. Written out before the next transfer
+ * that depends on it.
+ */
+static bool tar_pending;
+static uint32_t tar_pending_value;
+
+/*
+ * Coalescing of TAR write + DRW access pairs for consecutive words,
+ * for hosts that leave CSW auto-increment off. At the start of a run
+ * found by SWD_shadow_plan(), auto-increment is switched on, after
+ * which the TAR writes are predicted and elided like any other. Before
+ * the first transfer that doesn't fit the pattern, CSW and TAR are put
+ * back to what the host expects. A run still going at the end of the
+ * packet is left as it is, so that the next packet of pairs can carry
+ * on with it.
+ */
+static bool coalesce_enabled;
+static uint8_t plan_count;
+static uint32_t plan_starts[COALESCE_MAX_RUNS];
+static bool run_active;
+static bool run_expect_drw;
+static uint32_t run_select;
+static uint32_t run_host_csw;
+static uint32_t run_host_tar;
+static uint32_t run_confirmed_tar;
+static uint32_t coalesced_runs;
+
+/*
+ * CSW and TAR still owed to the host after a run, because the packet
+ * ended or the target FAULTed. They are written before the next
+ * transfer that could depend on them, once SELECT is known to be back
+ * on the run's AP; should the host be writing them itself, its own
+ * write still follows.
+ */
+static uint8_t restore_pending;
+
+static uint8_t SWD_shadow_restore(void);
+
+/* Put back CSW and TAR while SELECT is still known, before it is forgotten */
+static void SWD_shadow_settle(void) {
+    if (restore_pending && DAP_Data.debug_port == DAP_PORT_SWD
+        && (shadow_valid & SHADOW_SELECT) && shadow_select == run_select) {
+        SWD_shadow_restore();
+    }
+}
+
+void SWD_shadow_invalidate(void) {
+    SWD_shadow_settle();
+    shadow_valid = 0;
+    if (DAP_READ_CACHE) {
+        DAP_cache_invalidate();
+    }
+}
+
+/* Full AP register address, or -1 if the bank is unknown */
+static int32_t SWD_shadow_ap_address(uint32_t request) {
+    if (!(shadow_valid & SHADOW_SELECT)) {
+        return -1;
+    }
+    return (int32_t)((shadow_select & SELECT_APBANKSEL_MASK)
+                     | (request & (DAP_TRANSFER_A2 | DAP_TRANSFER_A3)));
+}
+
+static bool SWD_shadow_matches(uint32_t request, uint32_t value) {
+    if (!shadow_enabled || (request & REQUEST_MATCH_MASK)) {
+        return false;
+    }
+
+    request &= REQUEST_ADDRESS_MASK;
+    if (request == DP_SELECT) {
+        return (shadow_valid & SHADOW_SELECT) && (value == shadow_select);
+    } else if (request & DAP_TRANSFER_APnDP) {
+        if (request & DAP_TRANSFER_RnW) {
+            return false;
+        }
+        int32_t address = SWD_shadow_ap_address(request);
+        if (address == AP_CSW) {
+            return (shadow_valid & SHADOW_CSW) && (value == shadow_csw);
+        } else if (address == AP_TAR) {
+            return (shadow_valid & SHADOW_TAR) && (value == shadow_tar);
+        }
+    }
+
+    return false;
+}
+
+/* Lets DAP_SWD_Transfer keep a posted read pending across a skipped write */
+bool SWD_shadow_write_redundant(uint32_t request, const uint8_t* data) {
+    uint32_t value = (uint32_t)(data[0] <<  0) |
+                     (uint32_t)(data[1] <<  8) |
+                     (uint32_t)(data[2] << 16) |
+                     (uint32_t)(data[3] << 24);
+    return SWD_shadow_matches(request, value);
+}
+
+/* Whether the DP answers this transfer regardless of the sticky flags */
+static bool SWD_shadow_ignores_sticky(uint32_t request) {
+    request &= REQUEST_ADDRESS_MASK;
+    if (request & DAP_TRANSFER_APnDP) {
+        return false;
+    } else if (request & DAP_TRANSFER_RnW) {
+        return request != REQUEST_READ_RDBUFF;
+    }
+    return request == DP_ABORT;
+}
+
+/* Predict TAR after one DRW access */
+static void SWD_shadow_advance_tar(void) {
+    if (!(shadow_valid & SHADOW_CSW)) {
+        shadow_valid &= ~SHADOW_TAR;
+        return;
+    }
+
+    uint32_t increment;
+    switch ((shadow_csw >> CSW_ADDRINC_SHIFT) & CSW_ADDRINC_MASK) {
+        case CSW_ADDRINC_OFF:
+            return;
+        case CSW_ADDRINC_SINGLE:
+            increment = ((shadow_csw & CSW_SIZE_MASK) <= 2U)
+                      ? (1UL << (shadow_csw & CSW_SIZE_MASK)) : 0U;
+            break;
+        case CSW_ADDRINC_PACKED:
+            increment = 4U;
+            break;
+        default:
+            increment = 0U;
+            break;
+    }
+
+    uint32_t tar = shadow_tar + increment;
+    if (increment == 0U || ((tar ^ shadow_tar) & ~TAR_AUTOINC_BLOCK_MASK)) {
+        shadow_valid &= ~SHADOW_TAR;
+    } else {
+        shadow_tar = tar;
+    }
+}
+
+/* Address of the next DRW access, if known and word sized */
+static bool SWD_shadow_drw_word(uint32_t* address) {
+    const uint8_t needed = SHADOW_SELECT | SHADOW_CSW | SHADOW_TAR;
+    if ((shadow_valid & needed) != needed
+        || (shadow_select & SELECT_APBANKSEL_MASK) != 0U
+        || (shadow_csw & CSW_SIZE_MASK) != CSW_SIZE_WORD) {
+        return false;
+    }
+    *address = shadow_tar;
+    return true;
+}
+
+/* Tell the read cache what an OK transfer did to target memory */
+static void SWD_shadow_observe(uint32_t request, const uint32_t* data) {
+    if (posted_read && posted_known && data
+        && (request & DAP_TRANSFER_RnW)
+        && ((request & DAP_TRANSFER_APnDP) || request == REQUEST_READ_RDBUFF)) {
+        DAP_cache_observe_read(posted_apsel, posted_address, *data);
+    }
+
+    if (!(request & DAP_TRANSFER_APnDP)) {
+        return;
+    }
+
+    int32_t address = SWD_shadow_ap_address(request);
+    uint32_t tar = 0;
+    if (request & DAP_TRANSFER_RnW) {
+        posted_known = (address == AP_DRW) && SWD_shadow_drw_word(&tar);
+        posted_apsel = (uint8_t)(shadow_select >> 24);
+        posted_address = tar;
+    } else if (address != AP_CSW && address != AP_TAR) {
+        bool known = (address == AP_DRW) && SWD_shadow_drw_word(&tar);
+        DAP_cache_observe_write(known, known ? tar : 0U);
+    }
+}
+
+void SWD_shadow_update(uint32_t request, const uint32_t* data, uint8_t ack) {
+    if (!shadow_tracking) {
+        return;
+    } else if (ack == DAP_TRANSFER_WAIT) {
+        /* The transfer was not accepted and changed nothing */
+        return;
+    } else if (ack != DAP_TRANSFER_OK) {
+        /* A FAULT leaves SELECT and CSW alone, but not necessarily TAR */
+        shadow_valid &= (ack == DAP_TRANSFER_FAULT) ? (SHADOW_SELECT | SHADOW_CSW) : 0U;
+        posted_read = false;
+        ap_unconfirmed = true;
+        fault_skipped = skipped_unconfirmed && (ack == DAP_TRANSFER_FAULT);
+        skipped_unconfirmed = false;
+        if (fault_skipped && run_active) {
+            /* The FAULT goes to a skipped write, so TAR stays as it was before it */
+            run_host_tar = run_confirmed_tar;
+        }
+        if (DAP_READ_CACHE) {
+            DAP_cache_invalidate();
+        }
+        return;
+    }
+
+    request &= REQUEST_ADDRESS_MASK;
+    if (DAP_READ_CACHE) {
+        SWD_shadow_observe(request, data);
+    }
+
+    if (!SWD_shadow_ignores_sticky(request)) {
+        ap_unconfirmed = (request & DAP_TRANSFER_APnDP) != 0;
+        skipped_unconfirmed = false;
+    }
+
+    if (!(request & DAP_TRANSFER_APnDP)) {
+        if (request == DP_SELECT) {
+            if (!(shadow_valid & SHADOW_SELECT)
+                || ((*data ^ shadow_select) & SELECT_APSEL_MASK)) {
+                shadow_valid = 0;
+            }
+            shadow_select = *data;
+            shadow_valid |= SHADOW_SELECT;
+        } else if (request == REQUEST_READ_RDBUFF) {
+            posted_read = false;
+        } else if (request == DP_ABORT) {
+            /* An aborted AP transfer may or may not have moved TAR */
+            shadow_valid &= ~SHADOW_TAR;
+        } else if (request == DP_CTRL_STAT) {
+            /* Power and reset requests may reset the APs, but not SELECT */
+            shadow_valid &= SHADOW_SELECT;
+        } else if (!(request & DAP_TRANSFER_RnW)) {
+            shadow_valid = 0;
+        }
+        return;
+    }
+
+    posted_read = (request & DAP_TRANSFER_RnW) != 0;
+
+    int32_t address = SWD_shadow_ap_address(request);
+    if (address < 0) {
+        /* Unknown bank: this could have been any of them */
+        shadow_valid &= ~(SHADOW_CSW | SHADOW_TAR);
+    } else if (address == AP_DRW) {
+        SWD_shadow_advance_tar();
+    } else if (!(request & DAP_TRANSFER_RnW)) {
+        if (address == AP_CSW) {
+            shadow_csw = *data;
+            shadow_valid |= SHADOW_CSW;
+        } else if (address == AP_TAR) {
+            shadow_tar = *data;
+            shadow_valid |= SHADOW_TAR;
+        }
+    }
+}
+
+/*
+ * For DAP_Transfer and DAP_TransferBlock, which report a FAULT that
+ * SWD_shadow_fault_skipped() owes to a skipped write against that
+ * write, where it would have come without the shadows.
+ */
+bool SWD_shadow_skipped(void) {
+    return skipped_unconfirmed;
+}
+
+bool SWD_shadow_fault_skipped(void) {
+    return fault_skipped;
+}
+
+/* Keep the shadows up to date for whichever features currently need them */
+void SWD_shadow_track(void) {
+    shadow_tracking = shadow_enabled
+                   || (DAP_READ_CACHE && DAP_cache_enabled())
+                   || (PC_SAMPLER && DAP_sampler_enabled());
+    SWD_shadow_settle();
+    shadow_valid = 0;
+    posted_read = false;
+    tar_pending = false;
+    restore_pending = 0;
+    ap_unconfirmed = true;
+    skipped_unconfirmed = false;
+    fault_skipped = false;
+}
+
+/* SELECT as the host last left it, for background work that must restore it */
+bool SWD_shadow_select(uint32_t* select) {
+    if (!shadow_tracking || !(shadow_valid & SHADOW_SELECT)) {
+        return false;
+    }
+    *select = shadow_select;
+    return true;
+}
+
+/*
+ * Access port and address the host expects the next DRW read to hit,
+ * provided the AP is set up for word reads with single auto-increment.
+ */
+bool SWD_shadow_drw_address(uint8_t* apsel, uint32_t* address) {
+    uint32_t tar;
+    if (restore_pending || !SWD_shadow_drw_word(&tar)
+        || ((shadow_csw >> CSW_ADDRINC_SHIFT) & CSW_ADDRINC_MASK) != CSW_ADDRINC_SINGLE) {
+        return false;
+    }
+    *apsel = (uint8_t)(shadow_select >> 24);
+    *address = tar_pending ? tar_pending_value : tar;
+    return true;
+}
+
+/* TAR as the host should see it, from here on */
+void SWD_shadow_set_host_tar(uint32_t tar) {
+    tar_pending = !((shadow_valid & SHADOW_TAR) && shadow_tar == tar);
+    tar_pending_value = tar;
+}
+
+static uint8_t SWD_shadow_transfer_retry(uint32_t request, uint32_t* data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+    do {
+        ack = SWD_TransferRaw(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry-- && !DAP_TransferAbort);
+    return ack;
+}
+
+/* Write an AP register on our own behalf, unless it already holds value */
+static uint8_t SWD_shadow_write(uint32_t request, uint32_t value) {
+    if (SWD_shadow_matches(request, value)) {
+        return DAP_TRANSFER_OK;
+    }
+    return SWD_shadow_transfer_retry(request, &value);
+}
+
+/* Write whichever of CSW and TAR are still owed to the host */
+static uint8_t SWD_shadow_restore(void) {
+    uint8_t ack = DAP_TRANSFER_OK;
+    if (restore_pending & SHADOW_CSW) {
+        ack = SWD_shadow_write(REQUEST_AP_WRITE_CSW, run_host_csw);
+        if (ack == DAP_TRANSFER_OK) {
+            restore_pending &= ~SHADOW_CSW;
+        }
+    }
+    if (ack == DAP_TRANSFER_OK && (restore_pending & SHADOW_TAR)) {
+        ack = SWD_shadow_write(REQUEST_AP_WRITE_TAR, run_host_tar);
+        if (ack == DAP_TRANSFER_OK) {
+            restore_pending &= ~SHADOW_TAR;
+        }
+    }
+    return ack;
+}
+
+/* Put CSW and TAR back to what the host last wrote */
+static uint8_t SWD_shadow_end_run(void) {
+    restore_pending = SHADOW_CSW | SHADOW_TAR;
+    uint8_t ack = SWD_shadow_restore();
+    run_active = false;
+    return ack;
+}
+
+/* Finish a restore that FAULTed, if this transfer could see the difference */
+static uint8_t SWD_shadow_restore_before(uint32_t request) {
+    if (!(shadow_valid & SHADOW_SELECT) || shadow_select != run_select
+        || SWD_shadow_ignores_sticky(request)) {
+        return DAP_TRANSFER_OK;
+    }
+    return SWD_shadow_restore();
+}
+
+static bool SWD_shadow_fits_run(uint32_t request) {
+    if (request & REQUEST_MATCH_MASK) {
+        return false;
+    }
+
+    request &= REQUEST_ADDRESS_MASK;
+    if (request == REQUEST_READ_RDBUFF) {
+        return true;
+    } else if (!(request & DAP_TRANSFER_APnDP)) {
+        return false;
+    }
+
+    int32_t address = SWD_shadow_ap_address(request);
+    if (address == AP_TAR) {
+        return !(request & DAP_TRANSFER_RnW);
+    } else if (address == AP_DRW) {
+        return run_expect_drw;
+    }
+    return false;
+}
+
+static bool SWD_shadow_planned(uint32_t request, uint32_t value) {
+    if ((request & (REQUEST_ADDRESS_MASK | REQUEST_MATCH_MASK)) != REQUEST_AP_WRITE_TAR
+        || SWD_shadow_ap_address(request) != AP_TAR
+        || !(shadow_valid & SHADOW_CSW)) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < plan_count; i++) {
+        if (plan_starts[i] == value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool SWD_shadow_starts_run(uint32_t request, uint32_t value) {
+    return (shadow_csw & ((CSW_ADDRINC_MASK << CSW_ADDRINC_SHIFT) | CSW_SIZE_MASK))
+           == CSW_SIZE_WORD
+        && SWD_shadow_planned(request, value);
+}
+
+/* A run planned for this packet can pick up where the last packet's run stopped */
+static bool SWD_shadow_resumes_run(uint32_t request, const uint32_t* data) {
+    return coalesce_enabled && restore_pending == (SHADOW_CSW | SHADOW_TAR)
+        && (shadow_valid & SHADOW_SELECT) && shadow_select == run_select
+        && !(request & DAP_TRANSFER_RnW)
+        && shadow_csw == (run_host_csw | (CSW_ADDRINC_SINGLE << CSW_ADDRINC_SHIFT))
+        && SWD_shadow_planned(request, *data);
+}
+
+/*
+ * An AP read that ends a run while another AP read is still posted:
+ * collect the posted data first, since restoring CSW and TAR would
+ * lose it, and hand it back as the result of this read.
+ */
+static uint8_t SWD_shadow_leave_run_reading(uint32_t request, uint32_t* data) {
+    uint32_t previous;
+    uint8_t ack = SWD_shadow_transfer_retry(REQUEST_READ_RDBUFF, &previous);
+    if (ack == DAP_TRANSFER_OK) {
+        ack = SWD_shadow_end_run();
+    } else {
+        run_active = false;
+        restore_pending = SHADOW_CSW | SHADOW_TAR;
+    }
+    if (ack == DAP_TRANSFER_OK) {
+        ack = SWD_shadow_transfer_retry(request, NULL);
+    }
+    if (data) {
+        *data = previous;
+    }
+    return ack;
+}
+
+/* Write the TAR value held back by the read cache, if this transfer needs it */
+static uint8_t SWD_shadow_flush_tar(uint32_t request) {
+    request &= REQUEST_ADDRESS_MASK | REQUEST_MATCH_MASK;
+    if (request == REQUEST_AP_WRITE_TAR) {
+        /* Overwritten anyway */
+        tar_pending = false;
+        return DAP_TRANSFER_OK;
+    } else if (!(request & DAP_TRANSFER_APnDP) && request != DP_SELECT) {
+        return DAP_TRANSFER_OK;
+    }
+
+    tar_pending = false;
+    return SWD_shadow_write(REQUEST_AP_WRITE_TAR, tar_pending_value);
+}
+
+uint8_t SWD_shadow_transfer(uint32_t request, uint32_t* data) {
+    if (restore_pending && SWD_shadow_resumes_run(request, data)) {
+        /* Auto-increment is still on; the TAR write is elided if it follows on */
+        restore_pending = 0;
+        run_active = true;
+        run_expect_drw = false;
+        run_confirmed_tar = run_host_tar;
+        coalesced_runs++;
+    } else if (restore_pending) {
+        uint8_t ack = SWD_shadow_restore_before(request);
+        if (ack != DAP_TRANSFER_OK) {
+            return ack;
+        }
+    }
+
+    if (DAP_READ_CACHE && tar_pending) {
+        uint8_t ack = SWD_shadow_flush_tar(request);
+        if (ack != DAP_TRANSFER_OK) {
+            return ack;
+        }
+    }
+
+    if (!shadow_enabled) {
+        return SWD_TransferRaw(request, data);
+    }
+
+    bool write = !(request & DAP_TRANSFER_RnW);
+    if (run_active && !SWD_shadow_fits_run(request)) {
+        if (posted_read && !write && (request & DAP_TRANSFER_APnDP)) {
+            return SWD_shadow_leave_run_reading(request, data);
+        }
+        uint8_t ack = SWD_shadow_end_run();
+        if (ack != DAP_TRANSFER_OK) {
+            return ack;
+        }
+    }
+
+    if (skipped_unconfirmed && SWD_shadow_ignores_sticky(request)) {
+        uint8_t ack = SWD_shadow_transfer_retry(REQUEST_READ_RDBUFF, NULL);
+        skipped_unconfirmed = false;
+        if (ack == DAP_TRANSFER_FAULT) {
+            return ack;
+        }
+    }
+
+    /* The TAR write starting a run may itself be redundant */
+    if (!run_active && !restore_pending && coalesce_enabled && write
+        && SWD_shadow_starts_run(request, *data)) {
+        uint32_t csw = shadow_csw | (CSW_ADDRINC_SINGLE << CSW_ADDRINC_SHIFT);
+        uint8_t ack = SWD_shadow_transfer_retry(REQUEST_AP_WRITE_CSW, &csw);
+        if (ack != DAP_TRANSFER_OK) {
+            return ack;
+        }
+        run_active = true;
+        run_select = shadow_select;
+        run_host_tar = shadow_tar;
+        run_confirmed_tar = shadow_tar;
+        run_host_csw = csw & ~(CSW_ADDRINC_MASK << CSW_ADDRINC_SHIFT);
+        coalesced_runs++;
+    }
+
+    if (write && SWD_shadow_matches(request, *data)) {
+        shadow_elided++;
+        if (run_active) {
+            if (!skipped_unconfirmed) {
+                run_confirmed_tar = run_host_tar;
+            }
+            run_host_tar = *data;
+            run_expect_drw = true;
+        }
+        skipped_unconfirmed = skipped_unconfirmed || ap_unconfirmed;
+        if (request & DAP_TRANSFER_TIMESTAMP) {
+            DAP_Data.timestamp = TIMESTAMP_GET();
+        }
+        return DAP_TRANSFER_OK;
+    }
+
+    uint8_t ack = SWD_TransferRaw(request, data);
+    if (restore_pending && ack == DAP_TRANSFER_OK && !(shadow_valid & SHADOW_SELECT)
+        && (request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW)) == DAP_TRANSFER_APnDP) {
+        /* An AP write to an unknown bank may have replaced either */
+        restore_pending = 0;
+    }
+    if (run_active && ack == DAP_TRANSFER_OK) {
+        if (write && SWD_shadow_ap_address(request) == AP_TAR) {
+            run_host_tar = *data;
+            run_expect_drw = true;
+        } else if (SWD_shadow_ap_address(request) == AP_DRW) {
+            run_expect_drw = false;
+        }
+    }
+    return ack;
+}
+
+static void SWD_shadow_plan_close(uint32_t start, uint32_t pairs, bool writes) {
+    uint32_t min_pairs = writes ? COALESCE_MIN_WRITE_PAIRS : COALESCE_MIN_READ_PAIRS;
+    if (pairs >= min_pairs && plan_count < COALESCE_MAX_RUNS) {
+        plan_starts[plan_count++] = start;
+    }
+}
+
+/*
+ * Look through a DAP_Transfer request for runs of TAR writes to
+ * consecutive words, each followed by a single DRW access. The scan
+ * stops at any DP write other than one rewriting the current SELECT,
+ * since SELECT may change the AP or bank.
+ */
+void SWD_shadow_plan(const uint8_t* request, uint32_t count) {
+    plan_count = 0;
+    run_active = false;
+    if (!coalesce_enabled
+        || !(shadow_valid & SHADOW_SELECT)
+        || (shadow_select & SELECT_APBANKSEL_MASK) != 0U) {
+        return;
+    }
+
+    uint32_t start = 0;
+    uint32_t next = 0;
+    uint32_t pairs = 0;
+    bool writes = false;
+    bool expect_drw = false;
+
+    for (; count != 0U; count--) {
+        uint32_t request_value = *request++;
+        uint32_t value = 0;
+        if (!(request_value & DAP_TRANSFER_RnW) || (request_value & DAP_TRANSFER_MATCH_VALUE)) {
+            value = (uint32_t)(request[0] <<  0) |
+                    (uint32_t)(request[1] <<  8) |
+                    (uint32_t)(request[2] << 16) |
+                    (uint32_t)(request[3] << 24);
+            request += 4;
+        }
+
+        uint32_t address = request_value & REQUEST_ADDRESS_MASK;
+        if (request_value & REQUEST_MATCH_MASK) {
+            address = UINT32_MAX;
+        }
+
+        if (address == REQUEST_AP_WRITE_TAR) {
+            if (expect_drw || pairs == 0U || value != next) {
+                SWD_shadow_plan_close(start, pairs, writes);
+                start = value;
+                pairs = 0;
+                writes = false;
+            }
+            next = value + 4U;
+            expect_drw = true;
+        } else if (expect_drw && (address & ~DAP_TRANSFER_RnW) == (DAP_TRANSFER_APnDP | AP_DRW)) {
+            pairs++;
+            writes = writes || !(address & DAP_TRANSFER_RnW);
+            expect_drw = false;
+        } else {
+            SWD_shadow_plan_close(start, pairs, writes);
+            pairs = 0;
+            expect_drw = false;
+            if (!(address & (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW))
+                && !(address == DP_SELECT && value == shadow_select)) {
+                return;
+            }
+        }
+    }
+
+    SWD_shadow_plan_close(start, pairs, writes);
+}
+
+/*
+ * Called once a DAP_Transfer request is done. CSW and TAR of a run are
+ * only put back before a transfer that depends on them, so that a host
+ * reading memory a packet of pairs at a time keeps auto-increment on.
+ */
+void SWD_shadow_finish(void) {
+    plan_count = 0;
+    if (run_active) {
+        run_active = false;
+        restore_pending = SHADOW_CSW | SHADOW_TAR;
+    }
+}
+
+uint32_t SWD_shadow_vendor_command(const uint8_t* request, uint8_t* response) {
+    *response++ = *request++;
+
+    uint32_t request_len = 2;
+    uint32_t num = 1;
+    response[0] = DAP_OK;
+    switch (request[0]) {
+        case SWD_SHADOW_READ_STATUS:
+            response[1] = (shadow_enabled ? SWD_SHADOW_ELIDE : 0U)
+                        | (coalesce_enabled ? SWD_SHADOW_COALESCE : 0U);
+            memcpy(&response[2], &shadow_elided, sizeof(shadow_elided));
+            memcpy(&response[6], &coalesced_runs, sizeof(coalesced_runs));
+            num += 1 + sizeof(shadow_elided) + sizeof(coalesced_runs);
+            break;
+        case SWD_SHADOW_CONFIGURE:
+            request_len = 3;
+            /* Coalescing relies on the shadows to elide the TAR writes */
+            coalesce_enabled = (request[1] & SWD_SHADOW_COALESCE) != 0;
+            shadow_enabled = coalesce_enabled || (request[1] & SWD_SHADOW_ELIDE);
+            SWD_shadow_track();
+            break;
+        case SWD_SHADOW_CLEAR_COUNT:
+            shadow_elided = 0;
+            coalesced_runs = 0;
+            break;
+        default:
+            response[0] = DAP_ERROR;
+            break;
+    }
+
+    return (request_len << 16) | (1U + num);
+}
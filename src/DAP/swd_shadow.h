@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWD_SHADOW_H_INCLUDED
+#define SWD_SHADOW_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ID_DAP_SWDShadow            0x84U
+
+/* ID_DAP_SWDShadow sub-commands */
+#define SWD_SHADOW_READ_STATUS      0x00U
+#define SWD_SHADOW_CONFIGURE        0x01U
+#define SWD_SHADOW_CLEAR_COUNT      0x02U
+
+/* SWD_SHADOW_CONFIGURE flags */
+#define SWD_SHADOW_ELIDE            (1U << 0)
+#define SWD_SHADOW_COALESCE         (1U << 1)
+
+/* MEM-AP registers in bank 0 */
+#define AP_CSW                      0x00U
+#define AP_TAR                      0x04U
+#define AP_DRW                      0x0CU
+
+/* Wire-level transfer, without elision or coalescing */
+extern uint8_t SWD_TransferRaw(uint32_t request, uint32_t* data);
+
+extern uint8_t SWD_shadow_transfer(uint32_t request, uint32_t* data);
+extern bool SWD_shadow_write_redundant(uint32_t request, const uint8_t* data);
+extern void SWD_shadow_update(uint32_t request, const uint32_t* data, uint8_t ack);
+extern void SWD_shadow_invalidate(void);
+extern bool SWD_shadow_skipped(void);
+extern bool SWD_shadow_fault_skipped(void);
+
+extern void SWD_shadow_plan(const uint8_t* request, uint32_t count);
+extern void SWD_shadow_finish(void);
+
+/* Used by the read cache to serve DRW reads without touching the wire */
+extern void SWD_shadow_track(void);
+extern bool SWD_shadow_drw_address(uint8_t* apsel, uint32_t* address);
+extern void SWD_shadow_set_host_tar(uint32_t tar);
+
+/* Used by the PC sampler to borrow the AP between host commands */
+extern bool SWD_shadow_select(uint32_t* select);
+
+extern uint32_t SWD_shadow_vendor_command(const uint8_t* request,
+                                          uint8_t* response);
+
+#endif
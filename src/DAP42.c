@@ -29,9 +29,12 @@
 #include "USB/cdc.h"
 #include "USB/vcdc.h"
 #include "USB/dfu.h"
+#include "USB/gs_usb.h"
 
 #include "DAP/app.h"
 #include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/gdb_server.h"
+#include "DAP/pc_sampler.h"
 #include "DFU/DFU.h"
 
 #include "CAN/slcan.h"
@@ -131,7 +134,7 @@ int main(void) {
     if (SEMIHOSTING) {
         initialise_monitor_handles();
     }
-    else if (VCDC_AVAILABLE) {
+    else if (VCDC_AVAILABLE && !GDB_SERVER && !PC_SAMPLER) {
         retarget(STDOUT_FILENO, VIRTUAL_USART);
         retarget(STDERR_FILENO, VIRTUAL_USART);
     } else if (CDC_AVAILABLE) {
@@ -155,7 +158,7 @@ int main(void) {
                            &on_cdc_set_control_line_state,
                            &on_usb_activity,
                            &on_usb_activity);
-        cdc_uart_app_set_timeout(1);
+        cdc_uart_app_set_timeout(16);
     }
 
     if (VCDC_AVAILABLE) {
@@ -166,10 +169,18 @@ int main(void) {
         dfu_setup(usbd_dev, &on_dfu_request);
     }
 
-    if (CAN_RX_AVAILABLE && VCDC_AVAILABLE) {
+    if (CAN_RX_AVAILABLE && VCDC_AVAILABLE && !GDB_SERVER && !PC_SAMPLER) {
         slcan_app_setup(500000, MODE_RESET);
     }
 
+    if (GDB_SERVER && VCDC_AVAILABLE) {
+        gdb_server_setup();
+    }
+
+    if (GSUSB_AVAILABLE) {
+        gs_usb_app_setup(usbd_dev);
+    }
+
     tick_start();
 
     LED_SELFTEST();
@@ -186,14 +197,28 @@ int main(void) {
             cdc_uart_app_update();
         }
 
-        if (CAN_RX_AVAILABLE && VCDC_AVAILABLE) {
+        if (CAN_RX_AVAILABLE && VCDC_AVAILABLE && !GDB_SERVER && !PC_SAMPLER) {
             slcan_app_update();
         }
 
+        if (GDB_SERVER && VCDC_AVAILABLE) {
+            gdb_server_update();
+        }
+
+        if (PC_SAMPLER && VCDC_AVAILABLE && !GDB_SERVER) {
+            DAP_sampler_stream_update();
+        }
+
         if (VCDC_AVAILABLE) {
             vcdc_app_update();
         }
 
+        if (GSUSB_AVAILABLE) {
+            if (gs_usb_app_update()) {
+                on_usb_activity();
+            }
+        }
+
 
         // Handle DAP
         bool dap_active = DAP_app_update();
@@ -24,6 +24,7 @@
 
 #include "composite_usb_conf.h"
 #include "cdc.h"
+#include "usb_dbl_buf.h"
 
 #include "console.h"
 #include "tick.h"
@@ -94,10 +95,8 @@ bool cdc_send_data(const uint8_t* data, size_t len) {
     if (!cmp_usb_configured()) {
         return false;
     }
-    uint16_t sent = usbd_ep_write_packet(cdc_usbd_dev, ENDP_CDC_DATA_IN,
-                                         (const void*)data,
-                                         (uint16_t)len);
-    return (sent != 0);
+    return usb_dbl_buf_ep_write_packet(cdc_usbd_dev, ENDP_CDC_DATA_IN,
+                                       (const void*)data, (uint16_t)len);
 }
 
 static enum usbd_request_return_codes
@@ -178,10 +177,14 @@ cdc_control_class_request(usbd_device *usbd_dev,
 
 /* CDC-ACM RX flow control */
 static bool cdc_rx_stalled = false;
+static uint32_t cdc_rx_stall_start = 0;
+static uint32_t cdc_rx_stall_ms = 0;
+
 static void cdc_set_nak(void) {
     if (!cdc_rx_stalled) {
         usbd_ep_nak_set(cdc_usbd_dev, ENDP_CDC_DATA_OUT, true);
         cdc_rx_stalled = true;
+        cdc_rx_stall_start = get_ticks();
     }
 }
 
@@ -189,7 +192,17 @@ static void cdc_clear_nak(void) {
     if (cdc_rx_stalled) {
         usbd_ep_nak_set(cdc_usbd_dev, ENDP_CDC_DATA_OUT, false);
         cdc_rx_stalled = false;
+        cdc_rx_stall_ms += get_ticks() - cdc_rx_stall_start;
+    }
+}
+
+/* Total time spent NAKing the host, including any stall in progress */
+static uint32_t cdc_rx_stall_time(void) {
+    uint32_t total = cdc_rx_stall_ms;
+    if (cdc_rx_stalled) {
+        total += get_ticks() - cdc_rx_stall_start;
     }
+    return total;
 }
 
 /* Receive data from the host */
@@ -214,17 +227,24 @@ static void cdc_bulk_data_out(usbd_device *usbd_dev, uint8_t ep) {
 
 static void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep);
 static void cdc_start_in_transfer(void);
+static enum usbd_request_return_codes
+cdc_uart_control_vendor_request(usbd_device *usbd_dev,
+                                struct usb_setup_data *req,
+                                uint8_t **buf, uint16_t *len,
+                                usbd_control_complete_callback* complete);
 
 static void cdc_set_config(usbd_device *usbd_dev, uint16_t wValue) {
     (void)wValue;
 
     usbd_ep_setup(usbd_dev, ENDP_CDC_DATA_OUT, USB_ENDPOINT_ATTR_BULK, 64,
                   cdc_bulk_data_out);
-    usbd_ep_setup(usbd_dev, ENDP_CDC_DATA_IN, USB_ENDPOINT_ATTR_BULK, 64, cdc_bulk_data_in);
+    usb_dbl_buf_ep_setup(usbd_dev, ENDP_CDC_DATA_IN, 64, cdc_bulk_data_in);
     usbd_ep_setup(usbd_dev, ENDP_CDC_COMM_IN, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
     cmp_usb_register_control_class_callback(INTF_CDC_DATA, cdc_control_class_request);
     cmp_usb_register_control_class_callback(INTF_CDC_COMM, cdc_control_class_request);
+    cmp_usb_register_control_vendor_callback(INTF_CDC_COMM, cdc_uart_control_vendor_request);
+    cmp_usb_register_control_vendor_callback(INTF_CDC_DATA, cdc_uart_control_vendor_request);
     cmp_usb_register_sof_callback(cdc_start_in_transfer);
 }
 
@@ -285,7 +305,9 @@ static bool cdc_uart_set_line_coding(const struct usb_cdc_line_coding* line_codi
     // Reset the output packet buffer
     cdc_uart_app_reset_buffer();
 
-    console_reconfigure(line_coding->dwDTERate, databits, stopbits, parity);
+    if (console_reconfigure(line_coding->dwDTERate, databits, stopbits, parity) == 0) {
+        return false;
+    }
     memcpy(&current_line_coding, (const void*)line_coding, sizeof(current_line_coding));
 
     if (line_coding->bDataBits == 0) {
@@ -296,6 +318,12 @@ static bool cdc_uart_set_line_coding(const struct usb_cdc_line_coding* line_codi
 
 static bool cdc_uart_get_line_coding(struct usb_cdc_line_coding* line_coding) {
     memcpy(line_coding, (const void*)&current_line_coding, sizeof(current_line_coding));
+
+    // Report the baudrate actually generated so the host can see the error
+    uint32_t actual_baudrate = console_get_actual_baudrate();
+    if (actual_baudrate != 0) {
+        line_coding->dwDTERate = actual_baudrate;
+    }
     return true;
 }
 
@@ -313,18 +341,30 @@ static uint8_t packet_buffer[USB_CDC_MAX_PACKET_SIZE];
 static uint32_t packet_timeout = 0;
 static uint32_t packet_timestamp = 0;
 static bool need_zlp = false;
+static bool flush_requested = false;
+
+/* UART error reporting */
+static ConsoleErrorCounts reported_errors;
+static ConsoleErrorCounts stats_baseline;
+static uint32_t stats_baseline_stall_ms = 0;
+static uint16_t serial_state_events = 0;
+static bool serial_state_pending = false;
 
 void cdc_uart_app_reset(void) {
     if (cdc_set_control_line_state_callback) {
         cdc_set_control_line_state_callback(false, false);
     }
     cdc_uart_app_reset_buffer();
+
+    // Report the line state again once the host reconfigures us
+    serial_state_pending = true;
 }
 
 void cdc_uart_app_reset_buffer(void) {
     packet_len = 0;
     packet_timestamp = get_ticks();
     need_zlp = false;
+    flush_requested = false;
     cdc_clear_nak();
 }
 
@@ -342,53 +382,179 @@ void cdc_uart_app_setup(usbd_device* usbd_dev,
     cmp_usb_register_reset_callback(cdc_uart_app_reset);
 }
 
+/*
+ * Sets the latency timer: how long a partially filled packet may wait
+ * for more data before it is sent anyway. The end of a burst, detected
+ * through the USART IDLE line interrupt, flushes it immediately.
+ */
 void cdc_uart_app_set_timeout(uint32_t timeout_ms) {
     packet_timeout = timeout_ms;
 }
 
-static bool transfer_complete = false;
-static void cdc_start_in_transfer(void) {
-    transfer_complete = false;
-    if (packet_len < USB_CDC_MAX_PACKET_SIZE) {
-        uint16_t max_bytes = (USB_CDC_MAX_PACKET_SIZE- packet_len);
-        packet_len += console_recv_buffered(&packet_buffer[packet_len], max_bytes);
+static enum usbd_request_return_codes
+cdc_uart_control_vendor_request(usbd_device *usbd_dev,
+                                struct usb_setup_data *req,
+                                uint8_t **buf, uint16_t *len,
+                                usbd_control_complete_callback* complete) {
+    (void)complete;
+    (void)usbd_dev;
+
+    if (req->wIndex != INTF_CDC_DATA && req->wIndex != INTF_CDC_COMM) {
+        return USBD_REQ_NEXT_CALLBACK;
     }
 
-    if (packet_len > 0) {
-        if (cdc_send_data(packet_buffer, packet_len)) {
-            transfer_complete = (packet_len < USB_CDC_MAX_PACKET_SIZE);
-            packet_len = console_recv_buffered(packet_buffer, USB_CDC_MAX_PACKET_SIZE);
-            if (cdc_uart_tx_callback) {
-                cdc_uart_tx_callback();
+    enum usbd_request_return_codes status = USBD_REQ_NOTSUPP;
+    switch (req->bRequest) {
+        case CDC_VENDOR_REQ_SET_LATENCY_TIMER: {
+            cdc_uart_app_set_timeout(req->wValue & 0xFF);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case CDC_VENDOR_REQ_GET_LATENCY_TIMER: {
+            if (*len >= 1) {
+                (*buf)[0] = (uint8_t)packet_timeout;
+                *len = 1;
+                status = USBD_REQ_HANDLED;
             }
+            break;
+        }
+        case CDC_VENDOR_REQ_GET_UART_STATS: {
+            ConsoleErrorCounts errors;
+            console_get_error_counts(&errors);
+            uint32_t stall_ms = cdc_rx_stall_time();
+
+            struct cdc_uart_stats stats = {
+                .overrun_errors = errors.overrun - stats_baseline.overrun,
+                .framing_errors = errors.framing - stats_baseline.framing,
+                .parity_errors = errors.parity - stats_baseline.parity,
+                .rx_overflows = errors.rx_overflow - stats_baseline.rx_overflow,
+                .rx_bytes_dropped = errors.rx_bytes_dropped - stats_baseline.rx_bytes_dropped,
+                .host_nak_ms = stall_ms - stats_baseline_stall_ms,
+            };
+
+            if (*len > sizeof(stats)) {
+                *len = sizeof(stats);
+            }
+            memcpy(*buf, &stats, *len);
+
+            if (req->wValue & CDC_UART_STATS_RESET) {
+                stats_baseline = errors;
+                stats_baseline_stall_ms = stall_ms;
+            }
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        default: {
+            status = USBD_REQ_NOTSUPP;
+            break;
         }
-    } else {
-        transfer_complete = true;
     }
+
+    return status;
 }
 
-static void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep) {
-    (void)usbd_dev;
-    (void)ep;
+/*
+ * Turn new UART errors into a SERIAL_STATE notification. The error
+ * bits are one-shot events; the carrier bits are always reported as
+ * present since the UART has no modem control lines.
+ */
+static void cdc_uart_update_serial_state(void) {
+    ConsoleErrorCounts errors;
+    console_get_error_counts(&errors);
+
+    if (errors.framing != reported_errors.framing) {
+        serial_state_events |= CDC_SERIAL_STATE_FRAMING;
+    }
+    if (errors.parity != reported_errors.parity) {
+        serial_state_events |= CDC_SERIAL_STATE_PARITY;
+    }
+    if (errors.overrun != reported_errors.overrun
+        || errors.rx_overflow != reported_errors.rx_overflow) {
+        serial_state_events |= CDC_SERIAL_STATE_OVERRUN;
+    }
+    reported_errors = errors;
+
+    if (serial_state_events == 0 && !serial_state_pending) {
+        return;
+    }
+
+    struct cdc_serial_state_notification notification = {
+        .header = {
+            .bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+            .bNotification = USB_CDC_NOTIFY_SERIAL_STATE,
+            .wValue = 0,
+            .wIndex = INTF_CDC_COMM,
+            .wLength = sizeof(notification.bmUartState),
+        },
+        .bmUartState = CDC_SERIAL_STATE_RX_CARRIER
+                     | CDC_SERIAL_STATE_TX_CARRIER
+                     | serial_state_events,
+    };
+
+    uint16_t sent = usbd_ep_write_packet(cdc_usbd_dev, ENDP_CDC_COMM_IN,
+                                         (const void*)&notification,
+                                         sizeof(notification));
+    if (sent != 0) {
+        serial_state_events = 0;
+        serial_state_pending = false;
+    }
+}
+
+/*
+ * Pull any pending UART data into the packet buffer and send it once
+ * it's full, the latency timer has expired or a flush was requested.
+ */
+static void cdc_uart_flush_in(void) {
+    if (!usb_dbl_buf_ep_ready(ENDP_CDC_DATA_IN)) {
+        return;
+    }
 
     if (packet_len < USB_CDC_MAX_PACKET_SIZE) {
-        uint16_t max_bytes = (USB_CDC_MAX_PACKET_SIZE- packet_len);
-        packet_len += console_recv_buffered(&packet_buffer[packet_len], max_bytes);
+        uint16_t max_bytes = (USB_CDC_MAX_PACKET_SIZE - packet_len);
+        uint16_t bytes_read = console_recv_buffered(&packet_buffer[packet_len], max_bytes);
+        if (packet_len == 0 && bytes_read > 0) {
+            packet_timestamp = get_ticks();
+        }
+        packet_len += bytes_read;
     }
 
-    if (!transfer_complete) {
-        cdc_send_data(packet_buffer, packet_len);
-        if (packet_len < USB_CDC_MAX_PACKET_SIZE) {
-            transfer_complete = true;
+    if (packet_len == 0) {
+        // Terminate the host's transfer if it ended on a full packet
+        if (need_zlp && cdc_send_data(packet_buffer, 0)) {
+            need_zlp = false;
         }
-        packet_len = 0;
+        flush_requested = false;
+        return;
+    }
 
+    bool due = (packet_len == USB_CDC_MAX_PACKET_SIZE)
+            || flush_requested
+            || ((uint32_t)(get_ticks() - packet_timestamp) >= packet_timeout);
+    if (!due) {
+        return;
+    }
+
+    if (cdc_send_data(packet_buffer, packet_len)) {
+        need_zlp = (packet_len == USB_CDC_MAX_PACKET_SIZE);
+        flush_requested = false;
+        packet_len = 0;
         if (cdc_uart_tx_callback) {
             cdc_uart_tx_callback();
         }
     }
 }
 
+static void cdc_start_in_transfer(void) {
+    cdc_uart_flush_in();
+}
+
+static void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep) {
+    (void)usbd_dev;
+    (void)ep;
+
+    cdc_uart_flush_in();
+}
+
 bool cdc_uart_app_update() {
     bool active = false;
 
@@ -397,6 +563,20 @@ bool cdc_uart_app_update() {
         cdc_clear_nak();
     }
 
+    // Send partial packets as soon as the UART goes idle
+    if (console_rx_idle()) {
+        flush_requested = true;
+    }
+
+    if (flush_requested && cmp_usb_configured()) {
+        cdc_uart_flush_in();
+        active = true;
+    }
+
+    if (cmp_usb_configured()) {
+        cdc_uart_update_serial_state();
+    }
+
     return active;
 }
 
@@ -23,6 +23,23 @@
 
 #define USB_CDC_REQ_GET_LINE_CODING_ALT 0xA0
 
+/* Vendor requests on the CDC interfaces, numbered after FTDI's */
+#define CDC_VENDOR_REQ_SET_LATENCY_TIMER 0x09
+#define CDC_VENDOR_REQ_GET_LATENCY_TIMER 0x0A
+#define CDC_VENDOR_REQ_GET_UART_STATS    0x0B
+
+/* wValue flag for CDC_VENDOR_REQ_GET_UART_STATS */
+#define CDC_UART_STATS_RESET (1 << 0)
+
+/* SERIAL_STATE notification bitmap */
+#define CDC_SERIAL_STATE_RX_CARRIER (1 << 0)
+#define CDC_SERIAL_STATE_TX_CARRIER (1 << 1)
+#define CDC_SERIAL_STATE_BREAK      (1 << 2)
+#define CDC_SERIAL_STATE_RING       (1 << 3)
+#define CDC_SERIAL_STATE_FRAMING    (1 << 4)
+#define CDC_SERIAL_STATE_PARITY     (1 << 5)
+#define CDC_SERIAL_STATE_OVERRUN    (1 << 6)
+
 struct cdc_acm_functional_descriptors {
     struct usb_cdc_header_descriptor header;
     struct usb_cdc_call_management_descriptor call_mgmt;
@@ -30,4 +47,19 @@ struct cdc_acm_functional_descriptors {
     struct usb_cdc_union_descriptor cdc_union;
 } __attribute__ ((packed));
 
+struct cdc_serial_state_notification {
+    struct usb_cdc_notification header;
+    uint16_t bmUartState;
+} __attribute__ ((packed));
+
+/* Reply to CDC_VENDOR_REQ_GET_UART_STATS, counted since the last reset */
+struct cdc_uart_stats {
+    uint32_t overrun_errors;
+    uint32_t framing_errors;
+    uint32_t parity_errors;
+    uint32_t rx_overflows;
+    uint32_t rx_bytes_dropped;
+    uint32_t host_nak_ms;
+} __attribute__ ((packed));
+
 #endif
@@ -34,6 +34,7 @@
 #include "dfu.h"
 #include "cdc.h"
 #include "vcdc.h"
+#include "gs_usb.h"
 
 #include "config.h"
 #include "USB/usb_limits.h"
@@ -45,28 +46,54 @@
 _Static_assert((1 + NUM_IN_ENDPOINTS <= 8), "Too many IN endpoints for USB core (max 8)");
 _Static_assert((1 + NUM_OUT_ENDPOINTS <= 8), "Too many OUT endpoints for USB core (max 8)");
 
+#if CDC_AVAILABLE
+_Static_assert(((ENDP_CDC_DATA_IN & 0x7F) >= HIGHEST_OUT_ENDPOINT),
+               "CDC data IN endpoint must not share an endpoint register");
+#endif
+#if VCDC_AVAILABLE
+_Static_assert(((ENDP_VCDC_DATA_IN & 0x7F) >= HIGHEST_OUT_ENDPOINT),
+               "VCDC data IN endpoint must not share an endpoint register");
+#endif
+
+/* Buffer descriptor table: 8 bytes for each of the 8 endpoint registers */
+#define BTABLE_PMA_USAGE 64
+
 #define CONTROL_PMA_USAGE 128
 
 #define HID_PMA_USAGE (2*USB_HID_MAX_PACKET_SIZE)
 
+#if USB_PMA_DOUBLE_BUFFER_AVAILABLE
+#define BULK_IN_PMA_BUFFERS 2
+#else
+#define BULK_IN_PMA_BUFFERS 1
+#endif
+
 #if CDC_AVAILABLE
-#define CDC_PMA_USAGE (2*USB_CDC_MAX_PACKET_SIZE+16)
+#define CDC_PMA_USAGE ((1+BULK_IN_PMA_BUFFERS)*USB_CDC_MAX_PACKET_SIZE+16)
 #else
 #define CDC_PMA_USAGE 0
 #endif
 
 #if VCDC_AVAILABLE
-#define VCDC_PMA_USAGE (2*USB_VCDC_MAX_PACKET_SIZE+16)
+#define VCDC_PMA_USAGE ((1+BULK_IN_PMA_BUFFERS)*USB_VCDC_MAX_PACKET_SIZE+16)
 #else
 #define VCDC_PMA_USAGE 0
 #endif
 
-#define TOTAL_PMA_USAGE (CONTROL_PMA_USAGE \
+#if GSUSB_AVAILABLE
+#define GSUSB_PMA_USAGE (2*USB_GSUSB_MAX_PACKET_SIZE)
+#else
+#define GSUSB_PMA_USAGE 0
+#endif
+
+#define TOTAL_PMA_USAGE (BTABLE_PMA_USAGE \
+                       + CONTROL_PMA_USAGE \
                        + HID_PMA_USAGE \
                        + CDC_PMA_USAGE \
-                       + VCDC_PMA_USAGE)
+                       + VCDC_PMA_USAGE \
+                       + GSUSB_PMA_USAGE)
 
-#if CAN_RX_AVAILABLE && VCDC_AVAILABLE
+#if CAN_RX_AVAILABLE && (VCDC_AVAILABLE || GSUSB_AVAILABLE)
 #define MAX_USB_PMA_SIZE USB_PMA_SIZE_WITH_CAN
 #else
 #define MAX_USB_PMA_SIZE USB_PMA_SIZE
@@ -94,9 +121,9 @@ static const struct usb_device_descriptor dev = {
 #if CDC_AVAILABLE
 
 /*
- * This notification endpoint isn't implemented. According to CDC spec it's
- * optional, but its absence causes a NULL pointer dereference in the
- * Linux cdc_acm driver.
+ * Carries SERIAL_STATE notifications for UART line errors and overruns.
+ * According to CDC spec it's optional, but its absence causes a NULL
+ * pointer dereference in the Linux cdc_acm driver.
  */
 static const struct usb_endpoint_descriptor comm_endpoints[] = {
     {
@@ -262,6 +289,43 @@ static const struct usb_interface_descriptor vdata_iface = {
 
 #endif
 
+#if GSUSB_AVAILABLE
+
+static const struct usb_endpoint_descriptor gsusb_endpoints[] = {
+    {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = ENDP_GSUSB_IN,
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = USB_GSUSB_MAX_PACKET_SIZE,
+        .bInterval = 1,
+    },
+    {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = ENDP_GSUSB_OUT,
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = USB_GSUSB_MAX_PACKET_SIZE,
+        .bInterval = 1,
+    },
+};
+
+static const struct usb_interface_descriptor gsusb_iface = {
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = INTF_GSUSB,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 2,
+    .bInterfaceClass = USB_CLASS_VENDOR,
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,
+    .iInterface = STR_GSUSB_INTF,
+
+    .endpoint = gsusb_endpoints,
+};
+
+#endif
+
 static const struct usb_endpoint_descriptor hid_endpoints[] = {
     {
         .bLength = USB_DT_ENDPOINT_SIZE,
@@ -351,6 +415,13 @@ static const struct usb_interface interfaces[] = {
         .altsetting = &vdata_iface,
     },
 #endif
+#if GSUSB_AVAILABLE
+    /* gs_usb CAN interface */
+    {
+        .num_altsetting = 1,
+        .altsetting = &gsusb_iface,
+    },
+#endif
 #if DFU_AVAILABLE
     /* DFU interface */
     {
@@ -393,6 +464,9 @@ static const char *usb_strings[] = {
     [STR_VCDC_CONTROL_INTF-1]   = "VCDC Control",
     [STR_VCDC_DATA_INTF-1]      = "VCDC Data",
 #endif
+#if GSUSB_AVAILABLE
+    [STR_GSUSB_INTF-1]          = (PRODUCT_NAME " gs_usb CAN"),
+#endif
 #if DFU_AVAILABLE
     [STR_DFU_INTF-1]            = (PRODUCT_NAME " DFU"),
 #endif
@@ -456,7 +530,7 @@ static void cmp_usb_handle_reset(void) {
     num_sof_callbacks = 0;
 }
 
-/* Class-specific control request handlers */
+/* Class and vendor-specific control request handlers */
 struct callback_entry {
     usbd_control_callback callback;
     uint16_t interface;
@@ -465,6 +539,9 @@ struct callback_entry {
 static struct callback_entry control_class_callbacks[USB_MAX_CONTROL_CLASS_CALLBACKS];
 static uint8_t num_control_class_callbacks;
 
+static struct callback_entry control_vendor_callbacks[USB_MAX_CONTROL_VENDOR_CALLBACKS];
+static uint8_t num_control_vendor_callbacks;
+
 /* Config setup handlers */
 static usbd_set_config_callback set_config_callbacks[USB_MAX_SET_CONFIG_CALLBACKS];
 static uint8_t num_set_config_callbacks;
@@ -478,19 +555,30 @@ void cmp_usb_register_control_class_callback(uint16_t interface,
     }
 }
 
+void cmp_usb_register_control_vendor_callback(uint16_t interface,
+                                              usbd_control_callback callback) {
+    if (num_control_vendor_callbacks < USB_MAX_CONTROL_VENDOR_CALLBACKS) {
+        control_vendor_callbacks[num_control_vendor_callbacks].interface = interface;
+        control_vendor_callbacks[num_control_vendor_callbacks].callback = callback;
+        num_control_vendor_callbacks++;
+    }
+}
+
 static enum usbd_request_return_codes
-cmp_usb_dispatch_control_class_request(usbd_device *usbd_dev,
-                                       struct usb_setup_data *req,
-                                       uint8_t **buf, uint16_t *len,
-                                       usbd_control_complete_callback* complete) {
+cmp_usb_dispatch_control_request(const struct callback_entry* callbacks,
+                                 uint8_t num_callbacks,
+                                 usbd_device *usbd_dev,
+                                 struct usb_setup_data *req,
+                                 uint8_t **buf, uint16_t *len,
+                                 usbd_control_complete_callback* complete) {
 
     enum usbd_request_return_codes result = USBD_REQ_NEXT_CALLBACK;
 
     uint8_t i;
     uint16_t interface = req->wIndex;
-    for (i=0; i < num_control_class_callbacks; i++) {
-        if (interface == control_class_callbacks[i].interface) {
-            usbd_control_callback callback = control_class_callbacks[i].callback;
+    for (i=0; i < num_callbacks; i++) {
+        if (interface == callbacks[i].interface) {
+            usbd_control_callback callback = callbacks[i].callback;
             result = callback(usbd_dev, req, buf, len, complete);
             if (result == USBD_REQ_HANDLED || result == USBD_REQ_NOTSUPP) {
                 break;
@@ -501,6 +589,26 @@ cmp_usb_dispatch_control_class_request(usbd_device *usbd_dev,
     return result;
 }
 
+static enum usbd_request_return_codes
+cmp_usb_dispatch_control_class_request(usbd_device *usbd_dev,
+                                       struct usb_setup_data *req,
+                                       uint8_t **buf, uint16_t *len,
+                                       usbd_control_complete_callback* complete) {
+    return cmp_usb_dispatch_control_request(control_class_callbacks,
+                                            num_control_class_callbacks,
+                                            usbd_dev, req, buf, len, complete);
+}
+
+static enum usbd_request_return_codes
+cmp_usb_dispatch_control_vendor_request(usbd_device *usbd_dev,
+                                        struct usb_setup_data *req,
+                                        uint8_t **buf, uint16_t *len,
+                                        usbd_control_complete_callback* complete) {
+    return cmp_usb_dispatch_control_request(control_vendor_callbacks,
+                                            num_control_vendor_callbacks,
+                                            usbd_dev, req, buf, len, complete);
+}
+
 void cmp_usb_register_set_config_callback(usbd_set_config_callback callback) {
     if (callback && num_set_config_callbacks < USB_MAX_SET_CONFIG_CALLBACKS) {
         set_config_callbacks[num_set_config_callbacks++] = callback;
@@ -518,6 +626,13 @@ static void cmp_usb_set_config(usbd_device* usbd_dev, uint16_t wValue) {
 
     num_control_class_callbacks = 0;
 
+    for (i=0; i < USB_MAX_CONTROL_VENDOR_CALLBACKS; i++) {
+        control_vendor_callbacks[i].interface = 0;
+        control_vendor_callbacks[i].callback = NULL;
+    }
+
+    num_control_vendor_callbacks = 0;
+
     /* Register our class-specific control request dispatcher */
     usbd_register_control_callback(
         usbd_dev,
@@ -525,6 +640,13 @@ static void cmp_usb_set_config(usbd_device* usbd_dev, uint16_t wValue) {
         USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
         cmp_usb_dispatch_control_class_request);
 
+    /* Register our vendor-specific control request dispatcher */
+    usbd_register_control_callback(
+        usbd_dev,
+        USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+        USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+        cmp_usb_dispatch_control_vendor_request);
+
     /* Record that we're configured */
     configured = true;
 
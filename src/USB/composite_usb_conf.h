@@ -25,6 +25,7 @@
 #define USB_CDC_MAX_PACKET_SIZE 64
 #define USB_VCDC_MAX_PACKET_SIZE 64
 #define USB_HID_MAX_PACKET_SIZE 64
+#define USB_GSUSB_MAX_PACKET_SIZE 64
 #define USB_SERIAL_NUM_LENGTH   24
 
 enum {
@@ -36,21 +37,37 @@ enum {
 #if VCDC_AVAILABLE
     ENDP_VCDC_DATA_OUT,
 #endif
+#if GSUSB_AVAILABLE
+    ENDP_GSUSB_OUT,
+#endif
 
     HIGHEST_OUT_ENDPOINT
 };
 
+/*
+ * The bulk data IN endpoints come last so that they get an endpoint
+ * register to themselves, which double-buffering requires. The gs_usb
+ * IN endpoint is single-buffered and shares a register with its OUT
+ * endpoint.
+ */
 enum {
     ENDP_CONTROL_IN = 0x80,
     ENDP_HID_REPORT_IN,
 #if CDC_AVAILABLE
-    ENDP_CDC_DATA_IN,
     ENDP_CDC_COMM_IN,
 #endif
 #if VCDC_AVAILABLE
-    ENDP_VCDC_DATA_IN,
     ENDP_VCDC_COMM_IN,
 #endif
+#if GSUSB_AVAILABLE
+    ENDP_GSUSB_IN,
+#endif
+#if CDC_AVAILABLE
+    ENDP_CDC_DATA_IN,
+#endif
+#if VCDC_AVAILABLE
+    ENDP_VCDC_DATA_IN,
+#endif
 
     HIGHEST_IN_ENDPOINT,
 };
@@ -65,6 +82,9 @@ enum {
     INTF_VCDC_COMM,
     INTF_VCDC_DATA,
 #endif
+#if GSUSB_AVAILABLE
+    INTF_GSUSB,
+#endif
 #if DFU_AVAILABLE
     INTF_DFU,
 #endif
@@ -86,12 +106,16 @@ enum {
     STR_VCDC_CONTROL_INTF,
     STR_VCDC_DATA_INTF,
 #endif
+#if GSUSB_AVAILABLE
+    STR_GSUSB_INTF,
+#endif
 #if DFU_AVAILABLE
     STR_DFU_INTF,
 #endif
 };
 
 #define USB_MAX_CONTROL_CLASS_CALLBACKS 8
+#define USB_MAX_CONTROL_VENDOR_CALLBACKS 4
 #define USB_MAX_SET_CONFIG_CALLBACKS    8
 #define USB_MAX_RESET_CALLBACKS 8
 #define USB_MAX_SOF_CALLBACKS 8
@@ -101,6 +125,8 @@ extern usbd_device* cmp_usb_setup(void);
 extern bool cmp_usb_configured(void);
 extern void cmp_usb_register_control_class_callback(uint16_t interface,
                                                     usbd_control_callback callback);
+extern void cmp_usb_register_control_vendor_callback(uint16_t interface,
+                                                     usbd_control_callback callback);
 extern void cmp_usb_register_set_config_callback(usbd_set_config_callback callback);
 extern void cmp_usb_register_reset_callback(GenericCallback callback);
 extern void cmp_usb_register_sof_callback(GenericCallback callback);
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+
+#include "composite_usb_conf.h"
+#include "gs_usb.h"
+#include "config.h"
+#include "ring.h"
+
+#include "CAN/can.h"
+
+#if GSUSB_AVAILABLE
+
+_Static_assert(CAN_RX_AVAILABLE && CAN_TX_AVAILABLE,
+               "gs_usb requires both CAN RX and TX");
+
+#define GSUSB_SW_VERSION 2
+#define GSUSB_HW_VERSION 1
+
+#define GSUSB_FEATURES (GS_CAN_FEATURE_LISTEN_ONLY  \
+                      | GS_CAN_FEATURE_LOOP_BACK    \
+                      | GS_CAN_FEATURE_HW_TIMESTAMP \
+                      | GS_CAN_FEATURE_GET_STATE)
+
+/*
+ * Frames from the host stay in a slot until they have been sent and
+ * echoed back; the slot index is used as the CAN transmit tag. Slots
+ * are only claimed and released from the main loop.
+ */
+#define GSUSB_TX_SLOTS 4
+
+static struct gs_host_frame tx_slots[GSUSB_TX_SLOTS];
+static uint8_t tx_slots_used = 0;
+
+/* Slot that didn't fit into the CAN transmit queue yet */
+static int8_t tx_slot_unsubmitted = -1;
+
+/*
+ * Slots finished by the CAN interrupt, in completion order. Failed
+ * transmissions are marked so that an error frame precedes the echo.
+ */
+#define GSUSB_TX_DONE_FAILED 0x80
+
+static uint8_t tx_done_buffer[GSUSB_TX_SLOTS];
+static struct ring tx_done_ring = RING_INITIALIZER(tx_done_buffer);
+static bool tx_error_frame_sent = false;
+
+_Static_assert(RING_CAPACITY_VALID(GSUSB_TX_SLOTS),
+               "gs_usb TX slot count must be a power of two <= UINT16_MAX/2");
+
+static bool out_nak = false;
+
+/* Receive overflows already flagged to the host */
+static uint32_t rx_overflows_reported = 0;
+
+static uint32_t gs_usb_rx_overflows(void) {
+    CanErrorCounts counts;
+    can_get_error_counts(&counts);
+    return counts.fifo_overruns + counts.rx_buffer_overflows;
+}
+
+static bool started = false;
+static uint32_t mode_flags = 0;
+static CanBitTiming bit_timing;
+
+static usbd_device* gs_usb_usbd_dev;
+
+static uint16_t gs_usb_frame_size(void) {
+    if (mode_flags & GS_CAN_MODE_HW_TIMESTAMP) {
+        return GS_HOST_FRAME_SIZE_TS;
+    } else {
+        return GS_HOST_FRAME_SIZE;
+    }
+}
+
+static CanMode gs_usb_can_mode(uint32_t flags) {
+    bool listen_only = (flags & GS_CAN_MODE_LISTEN_ONLY) != 0;
+    bool loop_back = (flags & GS_CAN_MODE_LOOP_BACK) != 0;
+    if (listen_only && loop_back) {
+        return MODE_TEST_SILENT;
+    } else if (loop_back) {
+        return MODE_TEST_LOCAL;
+    } else if (listen_only) {
+        return MODE_SILENT;
+    } else {
+        return MODE_NORMAL;
+    }
+}
+
+static void gs_usb_flush(void) {
+    ring_clear(&tx_done_ring);
+    tx_slots_used = 0;
+    tx_slot_unsubmitted = -1;
+    tx_error_frame_sent = false;
+    while (!can_rx_buffer_empty()) {
+        can_rx_buffer_pop();
+    }
+    rx_overflows_reported = gs_usb_rx_overflows();
+}
+
+static uint8_t gs_usb_free_slots(void) {
+    uint8_t count = 0;
+    uint8_t i;
+    for (i=0; i < GSUSB_TX_SLOTS; i++) {
+        if (!(tx_slots_used & (1 << i))) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void gs_usb_set_out_nak(bool nak) {
+    if (nak != out_nak) {
+        out_nak = nak;
+        usbd_ep_nak_set(gs_usb_usbd_dev, ENDP_GSUSB_OUT, nak ? 1 : 0);
+    }
+}
+
+/* Accept frames from the host only while there's somewhere to put them */
+static void gs_usb_update_out_nak(void) {
+    gs_usb_set_out_nak(!started || gs_usb_free_slots() == 0
+                       || tx_slot_unsubmitted >= 0);
+}
+
+static void gs_usb_tx_complete(uint32_t tag, bool success) {
+    uint8_t slot = (uint8_t)tag;
+    tx_slots[slot].timestamp_us = can_get_timestamp_us();
+    uint8_t done = slot | (success ? 0 : GSUSB_TX_DONE_FAILED);
+    ring_put(&tx_done_ring, &done);
+}
+
+static bool gs_usb_submit(uint8_t slot) {
+    const struct gs_host_frame* frame = &tx_slots[slot];
+    CAN_Message msg;
+    if (frame->can_id & GS_CAN_EFF_FLAG) {
+        msg.format = CANExtended;
+        msg.id = frame->can_id & GS_CAN_EFF_MASK;
+    } else {
+        msg.format = CANStandard;
+        msg.id = frame->can_id & GS_CAN_SFF_MASK;
+    }
+    msg.type = (frame->can_id & GS_CAN_RTR_FLAG) ? CANRemote : CANData;
+    msg.len = frame->can_dlc;
+    memcpy(msg.data, frame->data, sizeof(msg.data));
+
+    return can_write_tagged(&msg, slot);
+}
+
+static bool gs_usb_set_mode(const struct gs_device_mode* mode) {
+    if (mode->mode == GS_CAN_MODE_RESET) {
+        started = false;
+        can_reconfigure_timing(&bit_timing, MODE_RESET);
+        gs_usb_flush();
+        gs_usb_update_out_nak();
+        return true;
+    } else if (mode->mode == GS_CAN_MODE_START) {
+        if (mode->flags & ~(uint32_t)GSUSB_FEATURES) {
+            return false;
+        }
+        // Discard anything left over from before the restart
+        can_reconfigure_timing(&bit_timing, MODE_RESET);
+        gs_usb_flush();
+        mode_flags = mode->flags;
+        started = can_reconfigure_timing(&bit_timing, gs_usb_can_mode(mode_flags));
+        gs_usb_update_out_nak();
+        return started;
+    }
+
+    return false;
+}
+
+static bool gs_usb_set_bittiming(const struct gs_device_bittiming* timing) {
+    uint32_t ts1 = timing->prop_seg + timing->phase_seg1;
+    if (timing->brp < 1 || timing->brp > CAN_BRP_MAX
+        || ts1 < 1 || ts1 > CAN_TS1_MAX
+        || timing->phase_seg2 < 1 || timing->phase_seg2 > CAN_TS2_MAX
+        || timing->sjw < 1 || timing->sjw > CAN_SJW_MAX) {
+        return false;
+    }
+
+    bit_timing.brp = (uint16_t)timing->brp;
+    bit_timing.ts1 = (uint8_t)ts1;
+    bit_timing.ts2 = (uint8_t)timing->phase_seg2;
+    bit_timing.sjw = (uint8_t)timing->sjw;
+    return true;
+}
+
+static enum usbd_request_return_codes
+gs_usb_control_vendor_request(usbd_device *usbd_dev,
+                              struct usb_setup_data *req,
+                              uint8_t **buf, uint16_t *len,
+                              usbd_control_complete_callback* complete) {
+    (void)complete;
+    (void)usbd_dev;
+
+    if (req->wIndex != INTF_GSUSB) {
+        return USBD_REQ_NEXT_CALLBACK;
+    }
+
+    // All requests address channel 0, the only one we have
+    if (req->bRequest != GS_USB_BREQ_HOST_FORMAT
+        && req->bRequest != GS_USB_BREQ_DEVICE_CONFIG
+        && req->wValue != 0) {
+        return USBD_REQ_NOTSUPP;
+    }
+
+    enum usbd_request_return_codes status = USBD_REQ_NOTSUPP;
+    switch (req->bRequest) {
+        case GS_USB_BREQ_HOST_FORMAT: {
+            /* Only the little-endian format is supported */
+            const struct gs_host_config* config = (const struct gs_host_config*)(*buf);
+            if (*len >= sizeof(*config) && config->byte_order == GS_USB_HOST_BYTE_ORDER) {
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case GS_USB_BREQ_DEVICE_CONFIG: {
+            struct gs_device_config* config = (struct gs_device_config*)(*buf);
+            memset(config, 0, sizeof(*config));
+            config->icount = 0;
+            config->sw_version = GSUSB_SW_VERSION;
+            config->hw_version = GSUSB_HW_VERSION;
+            *len = sizeof(*config);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case GS_USB_BREQ_BT_CONST: {
+            struct gs_device_bt_const* bt_const = (struct gs_device_bt_const*)(*buf);
+            bt_const->feature = GSUSB_FEATURES;
+            bt_const->fclk_can = can_get_clock();
+            bt_const->tseg1_min = 1;
+            bt_const->tseg1_max = CAN_TS1_MAX;
+            bt_const->tseg2_min = 1;
+            bt_const->tseg2_max = CAN_TS2_MAX;
+            bt_const->sjw_max = CAN_SJW_MAX;
+            bt_const->brp_min = 1;
+            bt_const->brp_max = CAN_BRP_MAX;
+            bt_const->brp_inc = 1;
+            *len = sizeof(*bt_const);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case GS_USB_BREQ_BITTIMING: {
+            const struct gs_device_bittiming* timing = (const struct gs_device_bittiming*)(*buf);
+            if (*len >= sizeof(*timing) && !started && gs_usb_set_bittiming(timing)) {
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case GS_USB_BREQ_MODE: {
+            const struct gs_device_mode* mode = (const struct gs_device_mode*)(*buf);
+            if (*len >= sizeof(*mode) && gs_usb_set_mode(mode)) {
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case GS_USB_BREQ_TIMESTAMP: {
+            uint32_t timestamp = can_get_timestamp_us();
+            memcpy(*buf, &timestamp, sizeof(timestamp));
+            *len = sizeof(timestamp);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case GS_USB_BREQ_GET_STATE: {
+            struct gs_device_state* state = (struct gs_device_state*)(*buf);
+            uint8_t tec = 0;
+            uint8_t rec = 0;
+            if (!started) {
+                state->state = GS_CAN_STATE_STOPPED;
+            } else {
+                switch (can_get_bus_state(&tec, &rec)) {
+                    case CAN_BUS_ERROR_WARNING:
+                        state->state = GS_CAN_STATE_ERROR_WARNING;
+                        break;
+                    case CAN_BUS_ERROR_PASSIVE:
+                        state->state = GS_CAN_STATE_ERROR_PASSIVE;
+                        break;
+                    case CAN_BUS_OFF:
+                        state->state = GS_CAN_STATE_BUS_OFF;
+                        break;
+                    case CAN_BUS_ERROR_ACTIVE:
+                    default:
+                        state->state = GS_CAN_STATE_ERROR_ACTIVE;
+                        break;
+                }
+            }
+            state->rxerr = rec;
+            state->txerr = tec;
+            *len = sizeof(*state);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        default: {
+            status = USBD_REQ_NOTSUPP;
+            break;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Receive a frame from the host into a free slot and queue it for
+ * transmission. When the last slot is taken, or the CAN transmit queue
+ * is full, the OUT endpoint is NAKed so the host holds on to the next
+ * frame instead of us dropping it.
+ */
+static void gs_usb_bulk_data_out(usbd_device *usbd_dev, uint8_t ep) {
+    // NAK before reading if this could take the last slot, so that the
+    // endpoint isn't re-armed in between
+    if (gs_usb_free_slots() <= 1) {
+        gs_usb_set_out_nak(true);
+    }
+
+    struct gs_host_frame frame;
+    uint16_t len = usbd_ep_read_packet(usbd_dev, ep, (void*)&frame, sizeof(frame));
+
+    uint8_t slot;
+    for (slot=0; slot < GSUSB_TX_SLOTS; slot++) {
+        if (!(tx_slots_used & (1 << slot))) {
+            break;
+        }
+    }
+
+    if (started && slot < GSUSB_TX_SLOTS && len >= GS_HOST_FRAME_SIZE
+        && frame.channel == 0 && frame.can_dlc <= 8
+        && !(frame.can_id & GS_CAN_ERR_FLAG)) {
+        tx_slots[slot] = frame;
+        tx_slots[slot].flags = 0;
+        tx_slots_used |= (uint8_t)(1 << slot);
+        if (!gs_usb_submit(slot)) {
+            tx_slot_unsubmitted = (int8_t)slot;
+        }
+    }
+
+    gs_usb_update_out_nak();
+}
+
+static void gs_usb_set_config(usbd_device *usbd_dev, uint16_t wValue) {
+    (void)wValue;
+
+    usbd_ep_setup(usbd_dev, ENDP_GSUSB_OUT, USB_ENDPOINT_ATTR_BULK,
+                  USB_GSUSB_MAX_PACKET_SIZE, gs_usb_bulk_data_out);
+    usbd_ep_setup(usbd_dev, ENDP_GSUSB_IN, USB_ENDPOINT_ATTR_BULK,
+                  USB_GSUSB_MAX_PACKET_SIZE, NULL);
+
+    // Hold off frames from the host until the channel is started
+    out_nak = false;
+    gs_usb_set_out_nak(true);
+
+    cmp_usb_register_control_vendor_callback(INTF_GSUSB, gs_usb_control_vendor_request);
+}
+
+static void gs_usb_app_reset(void) {
+    started = false;
+    can_reconfigure_timing(&bit_timing, MODE_RESET);
+    gs_usb_flush();
+}
+
+void gs_usb_app_setup(usbd_device* usbd_dev) {
+    gs_usb_usbd_dev = usbd_dev;
+
+    /* Default to 500kbps until the host sets its own timing */
+    can_calc_bit_timing(can_get_clock(), 500000, CAN_DEFAULT_SAMPLE_POINT,
+                        &bit_timing, NULL);
+
+    can_setup(500000, MODE_RESET);
+    can_set_tx_complete_callback(gs_usb_tx_complete);
+
+    cmp_usb_register_set_config_callback(gs_usb_set_config);
+    cmp_usb_register_reset_callback(gs_usb_app_reset);
+}
+
+/* Send one echo, error or received frame to the host, echoes first */
+static bool gs_usb_send_frame(void) {
+    struct gs_host_frame frame;
+    uint8_t done = 0;
+    bool echo = false;
+    uint32_t rx_overflows = 0;
+
+    if (ring_peek(&tx_done_ring, &done, 1) > 0) {
+        uint8_t slot = done & ~GSUSB_TX_DONE_FAILED;
+        if ((done & GSUSB_TX_DONE_FAILED) && !tx_error_frame_sent) {
+            // Report the failure before releasing the echo
+            memset(&frame, 0, sizeof(frame));
+            frame.echo_id = GS_USB_ECHO_ID_RX;
+            frame.can_id = GS_CAN_ERR_FLAG | GS_CAN_ERR_TX_TIMEOUT;
+            frame.can_dlc = GS_CAN_ERR_DLC;
+            frame.timestamp_us = tx_slots[slot].timestamp_us;
+        } else {
+            frame = tx_slots[slot];
+            echo = true;
+        }
+    } else if (!can_rx_buffer_empty()) {
+        const CAN_Message* msg = can_rx_buffer_peek();
+        frame.echo_id = GS_USB_ECHO_ID_RX;
+        frame.can_id = msg->id;
+        if (msg->format == CANExtended) {
+            frame.can_id |= GS_CAN_EFF_FLAG;
+        }
+        if (msg->type == CANRemote) {
+            frame.can_id |= GS_CAN_RTR_FLAG;
+        }
+        frame.can_dlc = msg->len;
+        frame.channel = 0;
+        // Mark the first frame received after any frames were lost
+        rx_overflows = gs_usb_rx_overflows();
+        frame.flags = (rx_overflows != rx_overflows_reported) ? GS_CAN_FLAG_OVERFLOW : 0;
+        frame.reserved = 0;
+        memcpy(frame.data, msg->data, sizeof(frame.data));
+        frame.timestamp_us = msg->timestamp;
+    } else {
+        return false;
+    }
+
+    if (usbd_ep_write_packet(gs_usb_usbd_dev, ENDP_GSUSB_IN,
+                             (const void*)&frame, gs_usb_frame_size()) == 0) {
+        return false;
+    }
+
+    if (echo) {
+        uint8_t slot = done & ~GSUSB_TX_DONE_FAILED;
+        ring_consume(&tx_done_ring, 1);
+        tx_slots_used &= (uint8_t)~(1 << slot);
+        tx_error_frame_sent = false;
+        gs_usb_update_out_nak();
+    } else if (done & GSUSB_TX_DONE_FAILED) {
+        tx_error_frame_sent = true;
+    } else {
+        can_rx_buffer_pop();
+        rx_overflows_reported = rx_overflows;
+    }
+    return true;
+}
+
+bool gs_usb_app_update(void) {
+    if (!started || !cmp_usb_configured()) {
+        return false;
+    }
+
+    bool active = false;
+    if (tx_slot_unsubmitted >= 0 && gs_usb_submit((uint8_t)tx_slot_unsubmitted)) {
+        tx_slot_unsubmitted = -1;
+        gs_usb_update_out_nak();
+        active = true;
+    }
+
+    if (gs_usb_send_frame()) {
+        active = true;
+    }
+
+    return active;
+}
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef GS_USB_DEFS_H_INCLUDED
+#define GS_USB_DEFS_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Wire format of the gs_usb (candleLight) protocol, as understood by
+ * the Linux gs_usb driver. All multi-byte fields are little-endian.
+ */
+
+/* Vendor requests, addressed to the gs_usb interface */
+#define GS_USB_BREQ_HOST_FORMAT     0
+#define GS_USB_BREQ_BITTIMING       1
+#define GS_USB_BREQ_MODE            2
+#define GS_USB_BREQ_BERR            3
+#define GS_USB_BREQ_BT_CONST        4
+#define GS_USB_BREQ_DEVICE_CONFIG   5
+#define GS_USB_BREQ_TIMESTAMP       6
+#define GS_USB_BREQ_IDENTIFY        7
+#define GS_USB_BREQ_GET_STATE       14
+
+/* Feature bits in gs_device_bt_const, and matching mode flags */
+#define GS_CAN_FEATURE_LISTEN_ONLY  (1 << 0)
+#define GS_CAN_FEATURE_LOOP_BACK    (1 << 1)
+#define GS_CAN_FEATURE_TRIPLE_SAMPLE (1 << 2)
+#define GS_CAN_FEATURE_ONE_SHOT     (1 << 3)
+#define GS_CAN_FEATURE_HW_TIMESTAMP (1 << 4)
+#define GS_CAN_FEATURE_GET_STATE    (1 << 13)
+
+#define GS_CAN_MODE_LISTEN_ONLY     GS_CAN_FEATURE_LISTEN_ONLY
+#define GS_CAN_MODE_LOOP_BACK       GS_CAN_FEATURE_LOOP_BACK
+#define GS_CAN_MODE_HW_TIMESTAMP    GS_CAN_FEATURE_HW_TIMESTAMP
+
+#define GS_CAN_MODE_RESET           0
+#define GS_CAN_MODE_START           1
+
+#define GS_CAN_STATE_ERROR_ACTIVE   0
+#define GS_CAN_STATE_ERROR_WARNING  1
+#define GS_CAN_STATE_ERROR_PASSIVE  2
+#define GS_CAN_STATE_BUS_OFF        3
+#define GS_CAN_STATE_STOPPED        4
+
+#define GS_USB_HOST_BYTE_ORDER      0x0000beef
+
+/* Flags in the can_id field, matching Linux's struct can_frame */
+#define GS_CAN_EFF_FLAG             0x80000000UL
+#define GS_CAN_RTR_FLAG             0x40000000UL
+#define GS_CAN_ERR_FLAG             0x20000000UL
+#define GS_CAN_EFF_MASK             0x1FFFFFFFUL
+#define GS_CAN_SFF_MASK             0x000007FFUL
+
+/* Error frame class and length, matching Linux's can/error.h */
+#define GS_CAN_ERR_TX_TIMEOUT       0x00000001UL
+#define GS_CAN_ERR_DLC              8
+
+/* echo_id of frames received from the bus rather than echoed back */
+#define GS_USB_ECHO_ID_RX           0xFFFFFFFFUL
+
+#define GS_CAN_FLAG_OVERFLOW        (1 << 0)
+
+struct gs_host_config {
+    uint32_t byte_order;
+} __attribute__ ((packed));
+
+struct gs_device_config {
+    uint8_t reserved1;
+    uint8_t reserved2;
+    uint8_t reserved3;
+    uint8_t icount;
+    uint32_t sw_version;
+    uint32_t hw_version;
+} __attribute__ ((packed));
+
+struct gs_device_mode {
+    uint32_t mode;
+    uint32_t flags;
+} __attribute__ ((packed));
+
+struct gs_device_state {
+    uint32_t state;
+    uint32_t rxerr;
+    uint32_t txerr;
+} __attribute__ ((packed));
+
+struct gs_device_bittiming {
+    uint32_t prop_seg;
+    uint32_t phase_seg1;
+    uint32_t phase_seg2;
+    uint32_t sjw;
+    uint32_t brp;
+} __attribute__ ((packed));
+
+struct gs_device_bt_const {
+    uint32_t feature;
+    uint32_t fclk_can;
+    uint32_t tseg1_min;
+    uint32_t tseg1_max;
+    uint32_t tseg2_min;
+    uint32_t tseg2_max;
+    uint32_t sjw_max;
+    uint32_t brp_min;
+    uint32_t brp_max;
+    uint32_t brp_inc;
+} __attribute__ ((packed));
+
+/*
+ * One classic CAN frame per bulk transfer. The timestamp is only
+ * present when GS_CAN_MODE_HW_TIMESTAMP was requested.
+ */
+struct gs_host_frame {
+    uint32_t echo_id;
+    uint32_t can_id;
+    uint8_t can_dlc;
+    uint8_t channel;
+    uint8_t flags;
+    uint8_t reserved;
+    uint8_t data[8];
+    uint32_t timestamp_us;
+} __attribute__ ((packed));
+
+#define GS_HOST_FRAME_SIZE     (sizeof(struct gs_host_frame) - sizeof(uint32_t))
+#define GS_HOST_FRAME_SIZE_TS  (sizeof(struct gs_host_frame))
+
+#endif
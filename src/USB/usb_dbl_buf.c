@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/stm32/st_usbfs.h>
+
+#include "usb_dbl_buf.h"
+
+#if USB_PMA_DOUBLE_BUFFER_AVAILABLE
+
+#define USB_DBL_BUF_MAX_ENDPOINTS 8
+
+/*
+ * For a double-buffered IN endpoint, the peripheral transmits from the
+ * buffer selected by DTOG_TX while the application owns the buffer
+ * selected by SW_BUF (the DTOG_RX bit). When the two are equal, the
+ * peripheral has nothing to send and NAKs.
+ */
+#define USB_EP_SW_BUF_TX USB_EP_RX_DTOG
+
+/* Internal to libopencm3's st_usbfs driver */
+extern void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len);
+
+static usbd_endpoint_callback usb_dbl_buf_callbacks[USB_DBL_BUF_MAX_ENDPOINTS];
+
+/*
+ * A packet copied into the application buffer while the other buffer
+ * was still queued. It is handed over once that one has been sent.
+ */
+static bool usb_dbl_buf_pending[USB_DBL_BUF_MAX_ENDPOINTS];
+
+/* Update the endpoint register without disturbing the other toggle bits */
+static void usb_dbl_buf_ep_modify(uint8_t ep, uint16_t set, uint16_t toggle) {
+    uint16_t reg = GET_REG(USB_EP_REG(ep));
+    // Writing 1 to the CTR flags leaves them unchanged
+    SET_REG(USB_EP_REG(ep), (reg & USB_EP_NTOGGLE_MSK)
+                            | USB_EP_RX_CTR | USB_EP_TX_CTR
+                            | set | toggle);
+}
+
+static bool usb_dbl_buf_ep_queued(uint8_t ep) {
+    uint16_t reg = GET_REG(USB_EP_REG(ep));
+    return ((reg & USB_EP_TX_DTOG) != 0) != ((reg & USB_EP_SW_BUF_TX) != 0);
+}
+
+static void usb_dbl_buf_in_complete(usbd_device* usbd_dev, uint8_t ep) {
+    ep &= 0x7F;
+    if (usb_dbl_buf_pending[ep]) {
+        usb_dbl_buf_pending[ep] = false;
+        usb_dbl_buf_ep_modify(ep, 0, USB_EP_SW_BUF_TX);
+    }
+
+    if (usb_dbl_buf_callbacks[ep] != NULL) {
+        usb_dbl_buf_callbacks[ep](usbd_dev, ep);
+    }
+}
+
+void usb_dbl_buf_ep_setup(usbd_device* usbd_dev, uint8_t addr,
+                          uint16_t max_size,
+                          usbd_endpoint_callback callback) {
+    uint8_t ep = addr & 0x7F;
+    usb_dbl_buf_callbacks[ep] = callback;
+    usb_dbl_buf_pending[ep] = false;
+
+    // Allocate both buffers in one go; the second takes the RX slot
+    usbd_ep_setup(usbd_dev, addr, USB_ENDPOINT_ATTR_BULK, 2*max_size,
+                  usb_dbl_buf_in_complete);
+    USB_SET_EP_RX_ADDR(ep, USB_GET_EP_TX_ADDR(ep) + max_size);
+
+    // DTOG_TX was cleared by usbd_ep_setup; start with SW_BUF equal to it
+    uint16_t sw_buf = GET_REG(USB_EP_REG(ep)) & USB_EP_SW_BUF_TX;
+    usb_dbl_buf_ep_modify(ep, USB_EP_KIND, sw_buf);
+
+    // The DTOG/SW_BUF handshake does the flow control from now on
+    USB_SET_EP_TX_STAT(ep, USB_EP_TX_STAT_VALID);
+}
+
+bool usb_dbl_buf_ep_ready(uint8_t addr) {
+    return !usb_dbl_buf_pending[addr & 0x7F];
+}
+
+bool usb_dbl_buf_ep_write_packet(usbd_device* usbd_dev, uint8_t addr,
+                                 const void* buf, uint16_t len) {
+    (void)usbd_dev;
+    uint8_t ep = addr & 0x7F;
+    if (usb_dbl_buf_pending[ep]) {
+        return false;
+    }
+
+    if (GET_REG(USB_EP_REG(ep)) & USB_EP_SW_BUF_TX) {
+        st_usbfs_copy_to_pm(USB_GET_EP_RX_BUFF(ep), buf, len);
+        SET_REG(USB_EP_RX_COUNT(ep), len);
+    } else {
+        st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(ep), buf, len);
+        SET_REG(USB_EP_TX_COUNT(ep), len);
+    }
+
+    /*
+     * Toggling SW_BUF while the other buffer is still queued would make
+     * the two flags equal and strand it, so hold this packet back until
+     * the transfer-complete callback.
+     */
+    if (usb_dbl_buf_ep_queued(ep)) {
+        usb_dbl_buf_pending[ep] = true;
+    } else {
+        usb_dbl_buf_ep_modify(ep, 0, USB_EP_SW_BUF_TX);
+    }
+
+    return true;
+}
+
+#else
+
+void usb_dbl_buf_ep_setup(usbd_device* usbd_dev, uint8_t addr,
+                          uint16_t max_size,
+                          usbd_endpoint_callback callback) {
+    usbd_ep_setup(usbd_dev, addr, USB_ENDPOINT_ATTR_BULK, max_size, callback);
+}
+
+bool usb_dbl_buf_ep_ready(uint8_t addr) {
+    return (GET_REG(USB_EP_REG(addr & 0x7F)) & USB_EP_TX_STAT) != USB_EP_TX_STAT_VALID;
+}
+
+bool usb_dbl_buf_ep_write_packet(usbd_device* usbd_dev, uint8_t addr,
+                                 const void* buf, uint16_t len) {
+    // usbd_ep_write_packet can't distinguish a busy endpoint from a ZLP
+    if (!usb_dbl_buf_ep_ready(addr)) {
+        return false;
+    }
+    usbd_ep_write_packet(usbd_dev, addr, buf, len);
+    return true;
+}
+
+#endif
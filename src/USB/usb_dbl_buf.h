@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef USB_DBL_BUF_H_INCLUDED
+#define USB_DBL_BUF_H_INCLUDED
+
+#include <stdbool.h>
+
+#include "usb_common.h"
+#include "USB/usb_limits.h"
+
+/*
+ * Bulk IN endpoints that use both of their PMA buffers, so that the
+ * next packet can be copied in while the previous one is still waiting
+ * for the host to poll for it.
+ *
+ * The endpoint takes over both halves of its endpoint register, so it
+ * must not share its endpoint number with an OUT endpoint.
+ *
+ * When USB_PMA_DOUBLE_BUFFER_AVAILABLE is 0, the same calls fall back
+ * to a regular single-buffered endpoint.
+ */
+
+extern void usb_dbl_buf_ep_setup(usbd_device* usbd_dev, uint8_t addr,
+                                 uint16_t max_size,
+                                 usbd_endpoint_callback callback);
+
+/* True if another packet can be queued on the endpoint */
+extern bool usb_dbl_buf_ep_ready(uint8_t addr);
+
+/*
+ * Queue a packet, which may be zero-length. Returns false without
+ * copying anything if both buffers are already in use.
+ */
+extern bool usb_dbl_buf_ep_write_packet(usbd_device* usbd_dev, uint8_t addr,
+                                        const void* buf, uint16_t len);
+
+#endif
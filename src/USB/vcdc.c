@@ -16,11 +16,15 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <string.h>
+
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
 #include "composite_usb_conf.h"
 #include "vcdc.h"
+#include "usb_dbl_buf.h"
 #include "config.h"
+#include "ring.h"
 
 #if VCDC_AVAILABLE
 
@@ -59,83 +63,66 @@ const struct cdc_acm_functional_descriptors vcdc_acm_functional_descriptors = {
 static uint8_t vcdc_tx_buffer[VCDC_TX_BUFFER_SIZE];
 static uint8_t vcdc_rx_buffer[VCDC_RX_BUFFER_SIZE];
 
-static uint16_t vcdc_tx_head = 0;
-static uint16_t vcdc_tx_tail = 0;
-
-static uint16_t vcdc_rx_head = 0;
-static uint16_t vcdc_rx_tail = 0;
+static struct ring vcdc_tx_ring = RING_INITIALIZER(vcdc_tx_buffer);
+static struct ring vcdc_rx_ring = RING_INITIALIZER(vcdc_rx_buffer);
 
 _Static_assert((VCDC_RX_BUFFER_SIZE >= USB_VCDC_MAX_PACKET_SIZE),
                "RX buffer too small");
+_Static_assert(RING_CAPACITY_VALID(VCDC_RX_BUFFER_SIZE),
+               "VCDC RX buffer size must be a power of two <= UINT16_MAX/2");
+_Static_assert(RING_CAPACITY_VALID(VCDC_TX_BUFFER_SIZE),
+               "VCDC TX buffer size must be a power of two <= UINT16_MAX/2");
 
-#define IS_POW_OF_TWO(X) (((X) & ((X)-1)) == 0)
-_Static_assert(IS_POW_OF_TWO(VCDC_RX_BUFFER_SIZE),
-               "Unmasked circular buffer size must be a power of two");
-_Static_assert(IS_POW_OF_TWO(VCDC_TX_BUFFER_SIZE),
-               "Unmasked circular buffer size must be a power of two");
-_Static_assert(VCDC_TX_BUFFER_SIZE <= UINT16_MAX/2,
-               "Buffer size too big for unmasked circular buffer");
-_Static_assert(VCDC_RX_BUFFER_SIZE <= UINT16_MAX/2,
-               "Buffer size too big for unmasked circular buffer");
-
-static bool vcdc_tx_buffer_empty(void) {
-    return vcdc_tx_head == vcdc_tx_tail;
-}
-
-static bool vcdc_tx_buffer_full(void) {
-    return (uint16_t)(vcdc_tx_tail - vcdc_tx_head) == VCDC_TX_BUFFER_SIZE;
-}
-
-static void vcdc_tx_buffer_put(uint8_t data) {
-    vcdc_tx_buffer[vcdc_tx_tail % VCDC_TX_BUFFER_SIZE] = data;
-    vcdc_tx_tail++;
-}
-
-static uint8_t vcdc_tx_buffer_get(void) {
-    uint8_t data = vcdc_tx_buffer[vcdc_tx_head % VCDC_TX_BUFFER_SIZE];
-    vcdc_tx_head++;
-    return data;
-}
+static usbd_device* vcdc_usbd_dev;
 
-static bool vcdc_rx_buffer_empty(void) {
-    return vcdc_rx_head == vcdc_rx_tail;
-}
+/*
+ * Set while the OUT endpoint is NAKed because the RX buffer couldn't
+ * take another full packet. The host then holds on to its data until
+ * the application has caught up, instead of us dropping it.
+ */
+static bool vcdc_rx_throttled = false;
 
-static bool vcdc_rx_buffer_full(void) {
-    return (uint16_t)(vcdc_rx_tail - vcdc_rx_head) == VCDC_RX_BUFFER_SIZE;
+static void vcdc_rx_unthrottle(void) {
+    if (vcdc_rx_throttled && ring_space(&vcdc_rx_ring) >= USB_VCDC_MAX_PACKET_SIZE) {
+        vcdc_rx_throttled = false;
+        usbd_ep_nak_set(vcdc_usbd_dev, ENDP_VCDC_DATA_OUT, 0);
+    }
 }
 
-static void vcdc_rx_buffer_put(uint8_t data) {
-    vcdc_rx_buffer[vcdc_rx_tail % VCDC_RX_BUFFER_SIZE] = data;
-    vcdc_rx_tail++;
+size_t vcdc_recv_buffered(uint8_t* data, size_t max_bytes) {
+    if (max_bytes > UINT16_MAX) {
+        max_bytes = UINT16_MAX;
+    }
+    uint16_t len = ring_read(&vcdc_rx_ring, data, (uint16_t)max_bytes);
+    vcdc_rx_unthrottle();
+    return len;
 }
 
-static uint8_t vcdc_rx_buffer_get(void) {
-    uint8_t data = vcdc_rx_buffer[vcdc_rx_head % VCDC_RX_BUFFER_SIZE];
-    vcdc_rx_head++;
-    return data;
+/*
+ * Returns the number of received bytes that can be parsed in place at
+ * *data without wrapping. Follow with vcdc_recv_consume().
+ */
+size_t vcdc_recv_span(const uint8_t** data) {
+    void* span;
+    uint16_t len = ring_read_span(&vcdc_rx_ring, &span);
+    *data = (const uint8_t*)span;
+    return len;
 }
 
-size_t vcdc_recv_buffered(uint8_t* data, size_t max_bytes) {
-    size_t bytes_read = 0;
-    while (!vcdc_rx_buffer_empty() && (bytes_read < max_bytes)) {
-        data[bytes_read++] = vcdc_rx_buffer_get();
-    }
-
-    return bytes_read;
+void vcdc_recv_consume(size_t num_bytes) {
+    ring_consume(&vcdc_rx_ring, (uint16_t)num_bytes);
+    vcdc_rx_unthrottle();
 }
 
 size_t vcdc_send_buffered(const uint8_t* data, size_t num_bytes) {
-    size_t bytes_queued = 0;
-    while (!vcdc_tx_buffer_full() && bytes_queued < num_bytes) {
-        vcdc_tx_buffer_put(data[bytes_queued++]);
+    if (num_bytes > UINT16_MAX) {
+        num_bytes = UINT16_MAX;
     }
-
-    return bytes_queued;
+    return ring_write(&vcdc_tx_ring, data, (uint16_t)num_bytes);
 }
 
 size_t vcdc_send_buffer_space(void) {
-    return VCDC_TX_BUFFER_SIZE - (uint16_t)(vcdc_tx_tail - vcdc_tx_head);
+    return ring_space(&vcdc_tx_ring);
 }
 
 /* User callbacks */
@@ -198,13 +185,28 @@ vcdc_control_class_request(usbd_device *usbd_dev,
 /* Receive data from the host */
 static void vcdc_bulk_data_out(usbd_device *usbd_dev, uint8_t ep) {
     uint8_t buf[USB_VCDC_MAX_PACKET_SIZE];
+
+    /*
+     * If this packet might leave too little room for the next one, NAK
+     * before reading so that the endpoint is never re-armed in between.
+     */
+    bool throttle = ring_space(&vcdc_rx_ring) < 2*USB_VCDC_MAX_PACKET_SIZE;
+    if (throttle) {
+        usbd_ep_nak_set(usbd_dev, ep, 1);
+    }
+
     uint16_t len = usbd_ep_read_packet(usbd_dev, ep, (void*)buf, sizeof(buf));
 
-    uint16_t i;
-    for (i=0; i < len && !vcdc_rx_buffer_full(); i++) {
-        vcdc_rx_buffer_put(buf[i]);
+    ring_write(&vcdc_rx_ring, buf, len);
+
+    if (throttle) {
+        if (ring_space(&vcdc_rx_ring) >= USB_VCDC_MAX_PACKET_SIZE) {
+            usbd_ep_nak_set(usbd_dev, ep, 0);
+        } else {
+            vcdc_rx_throttled = true;
+        }
     }
-    
+
     if (len > 0 && (vcdc_rx_callback != NULL)) {
         vcdc_rx_callback();
     }
@@ -215,8 +217,7 @@ static void vcdc_set_config(usbd_device *usbd_dev, uint16_t wValue) {
 
     usbd_ep_setup(usbd_dev, ENDP_VCDC_DATA_OUT, USB_ENDPOINT_ATTR_BULK, 64,
                   vcdc_bulk_data_out);
-    usbd_ep_setup(usbd_dev, ENDP_VCDC_DATA_IN, USB_ENDPOINT_ATTR_BULK, 64,
-                  NULL);
+    usb_dbl_buf_ep_setup(usbd_dev, ENDP_VCDC_DATA_IN, 64, NULL);
     usbd_ep_setup(usbd_dev, ENDP_VCDC_COMM_IN, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
     cmp_usb_register_control_class_callback(INTF_VCDC_DATA, vcdc_control_class_request);
@@ -228,10 +229,9 @@ static uint8_t packet_buffer[USB_VCDC_MAX_PACKET_SIZE];
 
 static void vcdc_app_reset(void) {
     packet_len = 0;
+    vcdc_rx_throttled = false;
 }
 
-static usbd_device* vcdc_usbd_dev;
-
 void vcdc_app_setup(usbd_device* usbd_dev,
                     GenericCallback vcdc_tx_cb,
                     GenericCallback vcdc_rx_cb) {
@@ -246,17 +246,15 @@ void vcdc_app_setup(usbd_device* usbd_dev,
 bool vcdc_app_update(void) {
     bool active = false;
 
-    while (packet_len < USB_VCDC_MAX_PACKET_SIZE && !vcdc_tx_buffer_empty()) {
-        packet_buffer[packet_len] = vcdc_tx_buffer_get();
-        packet_len++;
+    if (packet_len < USB_VCDC_MAX_PACKET_SIZE) {
+        packet_len += ring_read(&vcdc_tx_ring, &packet_buffer[packet_len],
+                                USB_VCDC_MAX_PACKET_SIZE - packet_len);
     }
 
     if (packet_len > 0 && cmp_usb_configured()) {
-        uint16_t sent = usbd_ep_write_packet(vcdc_usbd_dev, ENDP_VCDC_DATA_IN,
-                                             (const void*)packet_buffer,
-                                             packet_len);
-        
-        if (sent != 0) {
+        if (usb_dbl_buf_ep_write_packet(vcdc_usbd_dev, ENDP_VCDC_DATA_IN,
+                                        (const void*)packet_buffer,
+                                        packet_len)) {
             packet_len = 0;
             active = true;
             if (vcdc_tx_callback != NULL) {
@@ -269,23 +267,16 @@ bool vcdc_app_update(void) {
 }
 
 void vcdc_putchar(const char c) {
-    if (!vcdc_tx_buffer_full()) {
-        vcdc_tx_buffer_put(c);
-    }
+    ring_put(&vcdc_tx_ring, &c);
 }
 
 void vcdc_print(const char* s) {
-    while (*s != '\0') {
-        vcdc_putchar(*s++);
-    }
+    vcdc_send_buffered((const uint8_t*)s, strlen(s));
 }
 
 void vcdc_println(const char* s) {
-    while (*s != '\0') {
-        vcdc_putchar(*s++);
-    }
-    vcdc_putchar('\r');
-    vcdc_putchar('\n');
+    vcdc_print(s);
+    vcdc_send_buffered((const uint8_t*)"\r\n", 2);
 }
 
 void vcdc_print_hex_nibble(uint8_t x) {
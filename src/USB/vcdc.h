@@ -29,6 +29,8 @@ extern void vcdc_app_setup(usbd_device* usbd_dev,
                            GenericCallback vcdc_rx_cb);
 extern bool vcdc_app_update(void);
 extern size_t vcdc_recv_buffered(uint8_t* data, size_t max_bytes);
+extern size_t vcdc_recv_span(const uint8_t** data);
+extern void vcdc_recv_consume(size_t num_bytes);
 extern size_t vcdc_send_buffered(const uint8_t* data, size_t num_bytes);
 
 extern size_t vcdc_send_buffer_space(void);
@@ -23,12 +23,16 @@
 
 #include "console.h"
 #include "target.h"
+#include "ring.h"
+
+static uint32_t console_baudrate = 0;
+static bool console_set_baudrate(uint32_t baudrate);
 
 void console_setup(uint32_t baudrate) {
     /* Setup GPIO */
     target_console_init();
 
-    usart_set_baudrate(CONSOLE_USART, baudrate);
+    console_set_baudrate(baudrate);
     usart_set_databits(CONSOLE_USART, 8);
     usart_set_parity(CONSOLE_USART, USART_PARITY_NONE);
     usart_set_stopbits(CONSOLE_USART, USART_STOPBITS_1);
@@ -45,28 +49,147 @@ void console_setup(uint32_t baudrate) {
 void console_tx_buffer_clear(void);
 void console_rx_buffer_clear(void);
 
-#define IS_POW_OF_TWO(X) (((X) & ((X)-1)) == 0)
-_Static_assert(IS_POW_OF_TWO(CONSOLE_TX_BUFFER_SIZE),
-               "Unmasked circular buffer size must be a power of two");
-_Static_assert(CONSOLE_TX_BUFFER_SIZE <= UINT16_MAX/2,
-               "Buffer size too big for unmasked circular buffer");
+_Static_assert(RING_CAPACITY_VALID(CONSOLE_TX_BUFFER_SIZE),
+               "Console TX buffer size must be a power of two <= UINT16_MAX/2");
+_Static_assert(RING_CAPACITY_VALID(CONSOLE_RX_BUFFER_SIZE),
+               "Console RX buffer size must be a power of two <= UINT16_MAX/2");
+#ifdef CONSOLE_RAM_BUDGET
+_Static_assert(CONSOLE_TX_BUFFER_SIZE + CONSOLE_RX_BUFFER_SIZE <= CONSOLE_RAM_BUDGET,
+               "Not enough RAM left over for the console buffers");
+#endif
+
+static uint8_t console_tx_buffer[CONSOLE_TX_BUFFER_SIZE];
+static uint8_t console_rx_buffer[CONSOLE_RX_BUFFER_SIZE];
+
+static struct ring console_tx_ring = RING_INITIALIZER(console_tx_buffer);
+
+/*
+ * The RX ring is filled by circular DMA; its tail is advanced from the
+ * DMA transfer counter whenever the consumer looks for new data.
+ */
+static struct ring console_rx_ring = RING_INITIALIZER(console_rx_buffer);
+static volatile bool console_rx_idle_detected = false;
+
+/* Half-buffer DMA interrupts seen since the RX DMA was started */
+static volatile uint16_t console_rx_dma_halves = 0;
+#define CONSOLE_RX_HALF_SIZE (CONSOLE_RX_BUFFER_SIZE / 2)
+
+static volatile ConsoleErrorCounts console_errors;
+
+/*
+ * USART kernel clock. On the F0, all USARTs run off PCLK; on the F1,
+ * USART1 sits on the faster APB2 bus while the others are on APB1.
+ */
+static uint32_t console_usart_clock(void) {
+#if defined(STM32F1)
+    if (CONSOLE_USART == USART1) {
+        return rcc_apb2_frequency;
+    }
+#endif
+    return rcc_apb1_frequency;
+}
+
+/* Largest acceptable baudrate error in parts per thousand */
+#define CONSOLE_MAX_BAUDRATE_ERROR 30
+
+/*
+ * Choose the divisor that best approximates the requested baudrate.
+ * 16x oversampling is preferred for its better noise immunity; on parts
+ * that support it, 8x oversampling is used when the divisor would
+ * otherwise be too small, which doubles the maximum baudrate
+ * (eg 6Mbaud from a 48MHz clock).
+ *
+ * Returns the resulting baudrate, or 0 if it can't be generated within
+ * CONSOLE_MAX_BAUDRATE_ERROR.
+ */
+static uint32_t console_calc_baudrate(uint32_t baudrate, uint32_t* brr, bool* over8) {
+    if (baudrate == 0) {
+        return 0;
+    }
+
+    uint32_t clock = console_usart_clock();
+    uint32_t usartdiv = (clock + baudrate / 2) / baudrate;
+
+    uint32_t actual;
+    *over8 = false;
+    *brr = usartdiv;
+    if (usartdiv < 16) {
+#if defined(STM32F0)
+        /*
+         * With OVER8 set, USARTDIV is relative to twice the clock,
+         * BRR[2:0] holds USARTDIV[3:0] shifted right by one and BRR[3]
+         * must be kept clear. It is rounded on its own, so that odd
+         * divisors give the extra resolution.
+         */
+        uint32_t usartdiv8 = (2 * clock + baudrate / 2) / baudrate;
+        if (usartdiv8 < 16) {
+            return 0;
+        }
+        *brr = (usartdiv8 & 0xFFF0) | ((usartdiv8 & 0x000F) >> 1);
+        *over8 = true;
+        actual = 2 * clock / usartdiv8;
+#else
+        return 0;
+#endif
+    } else if (usartdiv > 0xFFFF) {
+        return 0;
+    } else {
+        actual = clock / usartdiv;
+    }
 
-static volatile uint8_t console_tx_buffer[CONSOLE_TX_BUFFER_SIZE];
-static volatile uint8_t console_rx_buffer[CONSOLE_RX_BUFFER_SIZE];
+    uint32_t error = (actual > baudrate) ? (actual - baudrate) : (baudrate - actual);
+    if (error > (baudrate / 1000) * CONSOLE_MAX_BAUDRATE_ERROR) {
+        return 0;
+    }
 
-static volatile uint16_t console_tx_head = 0;
-static volatile uint16_t console_tx_tail = 0;
+    return actual;
+}
 
-static uint16_t console_rx_head = 0;
+static bool console_set_baudrate(uint32_t baudrate) {
+    uint32_t brr;
+    bool over8;
+    uint32_t actual = console_calc_baudrate(baudrate, &brr, &over8);
+    if (actual == 0) {
+        return false;
+    }
+
+    // OVER8 may only be changed while the USART is disabled
+#if defined(STM32F0)
+    if (over8) {
+        USART_CR1(CONSOLE_USART) |= USART_CR1_OVER8;
+    } else {
+        USART_CR1(CONSOLE_USART) &= ~USART_CR1_OVER8;
+    }
+#else
+    (void)over8;
+#endif
+    USART_BRR(CONSOLE_USART) = brr;
+    console_baudrate = actual;
+    return true;
+}
+
+uint32_t console_get_actual_baudrate(void) {
+    return console_baudrate;
+}
+
+uint32_t console_reconfigure(uint32_t baudrate, uint32_t databits, uint32_t stopbits,
+                             uint32_t parity) {
+    // Reject baudrates we can't generate before touching the UART
+    uint32_t brr;
+    bool over8;
+    if (console_calc_baudrate(baudrate, &brr, &over8) == 0) {
+        return 0;
+    }
 
-void console_reconfigure(uint32_t baudrate, uint32_t databits, uint32_t stopbits,
-                         uint32_t parity) {
     // Disable the UART and clear buffers
     usart_disable(CONSOLE_USART);
 
     usart_disable_rx_dma(CONSOLE_USART);
     usart_disable_tx_interrupt(CONSOLE_USART);
+    USART_CR1(CONSOLE_USART) &= ~(USART_CR1_IDLEIE | USART_CR1_PEIE);
+    USART_CR3(CONSOLE_USART) &= ~USART_CR3_EIE;
     nvic_disable_irq(CONSOLE_USART_NVIC_LINE);
+    nvic_disable_irq(CONSOLE_RX_DMA_NVIC_LINE);
 
     console_tx_buffer_clear();
     console_rx_buffer_clear();
@@ -76,7 +199,7 @@ void console_reconfigure(uint32_t baudrate, uint32_t databits, uint32_t stopbits
         databits += 1;
     }
 
-    usart_set_baudrate(CONSOLE_USART, baudrate);
+    console_set_baudrate(baudrate);
     usart_set_databits(CONSOLE_USART, databits);
     usart_set_stopbits(CONSOLE_USART, stopbits);
     usart_set_parity(CONSOLE_USART, parity);
@@ -95,71 +218,83 @@ void console_reconfigure(uint32_t baudrate, uint32_t databits, uint32_t stopbits
     dma_set_priority(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_CCR_PL_HIGH);
     dma_enable_circular_mode(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
 
+    // Count wraparounds so that overflows can be detected
+    console_rx_dma_halves = 0;
+    dma_enable_half_transfer_interrupt(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    dma_enable_transfer_complete_interrupt(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    nvic_enable_irq(CONSOLE_RX_DMA_NVIC_LINE);
+
     dma_enable_channel(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
 
     usart_enable_rx_dma(CONSOLE_USART);
+
+    // Flag the end of each burst so partial packets can be flushed
+    console_rx_idle_detected = false;
+    USART_CR1(CONSOLE_USART) |= USART_CR1_IDLEIE;
+
+    // Count line errors
+    USART_CR1(CONSOLE_USART) |= USART_CR1_PEIE;
+    USART_CR3(CONSOLE_USART) |= USART_CR3_EIE;
     nvic_enable_irq(CONSOLE_USART_NVIC_LINE);
 
     // Re-enable the UART with the new settings
     usart_enable(CONSOLE_USART);
-}
 
-static bool console_tx_buffer_empty(void) {
-    return console_tx_head == console_tx_tail;
-}
-
-static bool console_tx_buffer_full(void) {
-    return (uint16_t)(console_tx_tail - console_tx_head) == CONSOLE_TX_BUFFER_SIZE;
-}
-
-static void console_tx_buffer_put(uint8_t data) {
-    console_tx_buffer[console_tx_tail % CONSOLE_TX_BUFFER_SIZE] = data;
-    console_tx_tail++;
-}
-
-static uint8_t console_tx_buffer_get(void) {
-    uint8_t data = console_tx_buffer[console_tx_head % CONSOLE_TX_BUFFER_SIZE];
-    console_tx_head++;
-    return data;
+    return console_baudrate;
 }
 
 void console_tx_buffer_clear(void) {
-    console_tx_head = 0;
-    console_tx_tail = 0;
+    ring_clear(&console_tx_ring);
 }
 
 size_t console_send_buffer_space(void) {
-    return CONSOLE_TX_BUFFER_SIZE - (uint16_t)(console_tx_tail - console_tx_head);
+    return ring_space(&console_tx_ring);
 }
 
-static bool console_rx_buffer_empty(void) {
-    if (DMA_CCR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL) & DMA_CCR_EN) {
-        uint16_t console_rx_tail = (CONSOLE_RX_BUFFER_SIZE - DMA_CNDTR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL)) % CONSOLE_RX_BUFFER_SIZE;
-        return console_rx_tail == console_rx_head;
-    } else {
-        return true;
+static void console_rx_buffer_sync(void) {
+    if (!(DMA_CCR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL) & DMA_CCR_EN)) {
+        return;
     }
-}
 
-static uint8_t console_rx_buffer_get(void) {
-    uint8_t data = console_rx_buffer[console_rx_head];
-    console_rx_head = (console_rx_head + 1) % CONSOLE_RX_BUFFER_SIZE;
-    return data;
+    /*
+     * The DMA counter only gives the position within the buffer; the
+     * half-transfer count says how many times it has wrapped. If the
+     * interrupt for the half we're now in hasn't been serviced yet,
+     * the parities won't match.
+     */
+    uint16_t halves = console_rx_dma_halves;
+    uint16_t dma_index = (CONSOLE_RX_BUFFER_SIZE - DMA_CNDTR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL)) % CONSOLE_RX_BUFFER_SIZE;
+    if ((halves & 1) != (dma_index / CONSOLE_RX_HALF_SIZE)) {
+        halves++;
+    }
+    uint16_t dma_tail = (uint16_t)(halves * CONSOLE_RX_HALF_SIZE)
+                      + (dma_index % CONSOLE_RX_HALF_SIZE);
+
+    ring_commit(&console_rx_ring, (uint16_t)(dma_tail - console_rx_ring.tail));
+
+    // If the DMA lapped the reader, only the newest bufferful is left
+    uint16_t used = ring_used(&console_rx_ring);
+    if (used > CONSOLE_RX_BUFFER_SIZE) {
+        uint16_t dropped = used - CONSOLE_RX_BUFFER_SIZE;
+        ring_consume(&console_rx_ring, dropped);
+        console_errors.rx_overflow++;
+        console_errors.rx_bytes_dropped += dropped;
+    }
 }
 
 void console_rx_buffer_clear(void) {
-    console_rx_head = 0;
     dma_disable_channel(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    ring_clear(&console_rx_ring);
 }
 
 size_t console_send_buffered(const uint8_t* data, size_t num_bytes) {
-    size_t bytes_written = 0;
-
-    while (!console_tx_buffer_full() && (bytes_written < num_bytes)) {
-        console_tx_buffer_put(data[bytes_written++]);
+    if (num_bytes > UINT16_MAX) {
+        num_bytes = UINT16_MAX;
     }
 
-    if (!console_tx_buffer_empty()) {
+    size_t bytes_written = ring_write(&console_tx_ring, data, (uint16_t)num_bytes);
+
+    if (!ring_empty(&console_tx_ring)) {
         usart_enable_tx_interrupt(CONSOLE_USART);
     }
 
@@ -167,34 +302,20 @@ size_t console_send_buffered(const uint8_t* data, size_t num_bytes) {
 }
 
 size_t console_recv_buffered(uint8_t* data, size_t max_bytes) {
-    size_t bytes_read = 0;
-    if (max_bytes == 1) {
-        if (!console_rx_buffer_empty()) {
-            *data = console_rx_buffer_get();
-            bytes_read = 1;
-        }
-    } else if (!console_rx_buffer_empty()) {
-        uint16_t console_rx_tail = (CONSOLE_RX_BUFFER_SIZE - DMA_CNDTR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL)) % CONSOLE_RX_BUFFER_SIZE;
-        if (console_rx_head > console_rx_tail) {
-            while (console_rx_head < CONSOLE_RX_BUFFER_SIZE && bytes_read < max_bytes) {
-                data[bytes_read++] = console_rx_buffer[console_rx_head++];
-            }
-            if (console_rx_head == CONSOLE_RX_BUFFER_SIZE) {
-                console_rx_head = 0;
-            }
-        }
-
-        if ((bytes_read < max_bytes) && (console_rx_head < console_rx_tail)) {
-            while (console_rx_head < console_rx_tail && bytes_read < max_bytes) {
-                data[bytes_read++] = console_rx_buffer[console_rx_head++];
-            }
-            if (console_rx_head == CONSOLE_RX_BUFFER_SIZE) {
-                console_rx_head = 0;
-            }
-        }
+    if (max_bytes > UINT16_MAX) {
+        max_bytes = UINT16_MAX;
     }
 
-    return bytes_read;
+    console_rx_buffer_sync();
+    return ring_read(&console_rx_ring, data, (uint16_t)max_bytes);
+}
+
+bool console_rx_idle(void) {
+    if (console_rx_idle_detected) {
+        console_rx_idle_detected = false;
+        return true;
+    }
+    return false;
 }
 
 void console_send_blocking(uint8_t data) {
@@ -205,13 +326,85 @@ uint8_t console_recv_blocking(void) {
     return usart_recv_blocking(CONSOLE_USART);
 }
 
+void console_get_error_counts(ConsoleErrorCounts* counts) {
+    counts->overrun = console_errors.overrun;
+    counts->framing = console_errors.framing;
+    counts->parity = console_errors.parity;
+    counts->rx_overflow = console_errors.rx_overflow;
+    counts->rx_bytes_dropped = console_errors.rx_bytes_dropped;
+}
+
+#if defined(STM32F0)
+#define CONSOLE_USART_STATUS USART_ISR(CONSOLE_USART)
+#define CONSOLE_STATUS_IDLE USART_ISR_IDLE
+#define CONSOLE_STATUS_ORE  USART_ISR_ORE
+#define CONSOLE_STATUS_NE   USART_ISR_NF
+#define CONSOLE_STATUS_FE   USART_ISR_FE
+#define CONSOLE_STATUS_PE   USART_ISR_PE
+#else
+#define CONSOLE_USART_STATUS USART_SR(CONSOLE_USART)
+#define CONSOLE_STATUS_IDLE USART_SR_IDLE
+#define CONSOLE_STATUS_ORE  USART_SR_ORE
+#define CONSOLE_STATUS_NE   USART_SR_NE
+#define CONSOLE_STATUS_FE   USART_SR_FE
+#define CONSOLE_STATUS_PE   USART_SR_PE
+#endif
+
+#define CONSOLE_STATUS_ERRORS (CONSOLE_STATUS_ORE | CONSOLE_STATUS_NE \
+                               | CONSOLE_STATUS_FE | CONSOLE_STATUS_PE)
+
+static void console_clear_status(uint32_t flags) {
+#if defined(STM32F0)
+    // The ICR clear bits line up with the ISR flags
+    USART_ICR(CONSOLE_USART) = flags;
+#else
+    // Cleared by reading SR followed by DR
+    (void)flags;
+    (void)USART_DR(CONSOLE_USART);
+#endif
+}
+
 void CONSOLE_USART_IRQ_NAME(void) {
+    uint32_t status = CONSOLE_USART_STATUS;
+    uint32_t errors = status & CONSOLE_STATUS_ERRORS;
+    uint32_t idle = 0;
+    if (USART_CR1(CONSOLE_USART) & USART_CR1_IDLEIE) {
+        idle = status & CONSOLE_STATUS_IDLE;
+    }
+
+    if (errors | idle) {
+        if (errors & CONSOLE_STATUS_ORE) {
+            console_errors.overrun++;
+        }
+        if (errors & CONSOLE_STATUS_FE) {
+            console_errors.framing++;
+        }
+        if (errors & CONSOLE_STATUS_PE) {
+            console_errors.parity++;
+        }
+        console_clear_status(errors | idle);
+        if (idle) {
+            console_rx_idle_detected = true;
+        }
+    }
+
     if (usart_get_flag(CONSOLE_USART, USART_FLAG_TXE)) {
-        if (!console_tx_buffer_empty()) {
-            usart_word_t buffered_byte = console_tx_buffer_get();
+        uint8_t buffered_byte;
+        if (ring_get(&console_tx_ring, &buffered_byte)) {
             usart_send(CONSOLE_USART, buffered_byte);
         } else {
             usart_disable_tx_interrupt(CONSOLE_USART);
         }
     }
 }
+
+void CONSOLE_RX_DMA_IRQ_NAME(void) {
+    if (dma_get_interrupt_flag(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_HTIF)) {
+        dma_clear_interrupt_flags(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_HTIF);
+        console_rx_dma_halves++;
+    }
+    if (dma_get_interrupt_flag(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_TCIF)) {
+        dma_clear_interrupt_flags(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_TCIF);
+        console_rx_dma_halves++;
+    }
+}
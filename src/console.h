@@ -24,14 +24,145 @@
 
 #include "config.h"
 
+/*
+ * Boards can size the console buffers explicitly. Otherwise, they get
+ * whatever RAM is left over after the DAP packet queue and the other
+ * fixed buffers, split so that the DMA-fed RX ring gets the lion's
+ * share. Both sizes are rounded down to a power of two.
+ */
+#if !defined(CONSOLE_TX_BUFFER_SIZE) || !defined(CONSOLE_RX_BUFFER_SIZE)
+#include "ram_limits.h"
+#include "DAP/CMSIS_DAP_config.h"
+#include "DAP/gdb_server.h"
+#include "DAP/pc_sampler.h"
+#include "DAP/profile.h"
+#include "DAP/read_cache.h"
+#include "DAP/recorder.h"
+#include "DAP/sequencer.h"
+#include "CAN/can.h"
+#include "CAN/can_stats.h"
+#include "CAN/can_cyclic.h"
+#include "CAN/isotp.h"
+
+#define CONSOLE_POW2_FLOOR(X) \
+    ((X) >= 8192 ? 8192 : (X) >= 4096 ? 4096 : (X) >= 2048 ? 2048 : \
+     (X) >= 1024 ? 1024 : (X) >= 512 ? 512 : (X) >= 256 ? 256 : \
+     (X) >= 128 ? 128 : 64)
+
+/* Kept signed so that overcommitting shows up as a negative budget */
+#define CONSOLE_DAP_RAM_USAGE ((int)(2 * DAP_PACKET_SIZE * DAP_PACKET_QUEUE_SIZE))
+
+#if DAP_PROFILING
+#define CONSOLE_DAP_PROFILE_RAM_USAGE ((int)DAP_PROFILE_RAM_USAGE)
+#else
+#define CONSOLE_DAP_PROFILE_RAM_USAGE 0
+#endif
+
+#if DAP_RECORDER
+#define CONSOLE_DAP_RECORDER_RAM_USAGE ((int)DAP_RECORDER_RAM_USAGE)
+#else
+#define CONSOLE_DAP_RECORDER_RAM_USAGE 0
+#endif
+
+#if DAP_READ_CACHE
+#define CONSOLE_DAP_READ_CACHE_RAM_USAGE ((int)DAP_READ_CACHE_RAM_USAGE)
+#else
+#define CONSOLE_DAP_READ_CACHE_RAM_USAGE 0
+#endif
+
+#if DAP_SEQUENCER
+#define CONSOLE_DAP_SEQUENCER_RAM_USAGE ((int)DAP_SEQUENCER_RAM_USAGE)
+#else
+#define CONSOLE_DAP_SEQUENCER_RAM_USAGE 0
+#endif
+
+#if GDB_SERVER && VCDC_AVAILABLE
+#define CONSOLE_GDB_SERVER_RAM_USAGE ((int)GDB_SERVER_RAM_USAGE)
+#else
+#define CONSOLE_GDB_SERVER_RAM_USAGE 0
+#endif
+
+#if PC_SAMPLER
+#define CONSOLE_PC_SAMPLER_RAM_USAGE ((int)PC_SAMPLER_RAM_USAGE)
+#else
+#define CONSOLE_PC_SAMPLER_RAM_USAGE 0
+#endif
+
+#if VCDC_AVAILABLE
+#define CONSOLE_VCDC_RAM_USAGE (VCDC_TX_BUFFER_SIZE + VCDC_RX_BUFFER_SIZE + 64)
+#else
+#define CONSOLE_VCDC_RAM_USAGE 0
+#endif
+
+/* The CAN buffers are only linked in when an interface uses them */
+#if CAN_RX_AVAILABLE && ((VCDC_AVAILABLE && !GDB_SERVER && !PC_SAMPLER) || GSUSB_AVAILABLE)
+#define CONSOLE_CAN_RAM_USAGE ((int)CAN_RAM_USAGE)
+#else
+#define CONSOLE_CAN_RAM_USAGE 0
+#endif
+
+#if CAN_STATS_AVAILABLE
+#define CONSOLE_CAN_STATS_RAM_USAGE ((int)CAN_STATS_RAM_USAGE)
+#else
+#define CONSOLE_CAN_STATS_RAM_USAGE 0
+#endif
+
+#if CAN_CYCLIC_AVAILABLE
+#define CONSOLE_CAN_CYCLIC_RAM_USAGE ((int)CAN_CYCLIC_RAM_USAGE)
+#else
+#define CONSOLE_CAN_CYCLIC_RAM_USAGE 0
+#endif
+
+#if ISOTP_AVAILABLE
+#define CONSOLE_ISOTP_RAM_USAGE ((int)ISOTP_RAM_USAGE)
+#else
+#define CONSOLE_ISOTP_RAM_USAGE 0
+#endif
+
+#define CONSOLE_RAM_BUDGET (TARGET_RAM_SIZE - TARGET_RAM_RESERVED \
+                            - CONSOLE_DAP_RAM_USAGE - CONSOLE_DAP_PROFILE_RAM_USAGE \
+                            - CONSOLE_DAP_RECORDER_RAM_USAGE - CONSOLE_DAP_READ_CACHE_RAM_USAGE \
+                            - CONSOLE_DAP_SEQUENCER_RAM_USAGE - CONSOLE_GDB_SERVER_RAM_USAGE \
+                            - CONSOLE_PC_SAMPLER_RAM_USAGE \
+                            - CONSOLE_VCDC_RAM_USAGE - CONSOLE_CAN_RAM_USAGE \
+                            - CONSOLE_CAN_STATS_RAM_USAGE - CONSOLE_CAN_CYCLIC_RAM_USAGE \
+                            - CONSOLE_ISOTP_RAM_USAGE)
+
+/* Always leave at least a couple of USB packets worth for the TX side */
+#define CONSOLE_MIN_TX_BUFFER_SIZE 128
+
+#ifndef CONSOLE_RX_BUFFER_SIZE
+#define CONSOLE_RX_BUFFER_SIZE \
+    CONSOLE_POW2_FLOOR(CONSOLE_RAM_BUDGET - CONSOLE_MIN_TX_BUFFER_SIZE)
+#endif
+
+#ifndef CONSOLE_TX_BUFFER_SIZE
+#define CONSOLE_TX_BUFFER_SIZE \
+    CONSOLE_POW2_FLOOR(CONSOLE_RAM_BUDGET - CONSOLE_RX_BUFFER_SIZE)
+#endif
+
+#endif
+
+/* Cumulative receive error counts since startup */
+typedef struct {
+    uint32_t overrun;
+    uint32_t framing;
+    uint32_t parity;
+    uint32_t rx_overflow;       // Times the RX DMA overwrote unread data
+    uint32_t rx_bytes_dropped;  // Unread bytes lost to those overflows
+} ConsoleErrorCounts;
+
 extern void console_setup(uint32_t baudrate);
-extern void console_reconfigure(uint32_t baudrate, uint32_t databits,
-                                uint32_t stopbits, uint32_t parity);
+extern uint32_t console_reconfigure(uint32_t baudrate, uint32_t databits,
+                                    uint32_t stopbits, uint32_t parity);
+extern uint32_t console_get_actual_baudrate(void);
 
 extern void console_send_blocking(uint8_t data);
 extern uint8_t console_recv_blocking(void);
 extern size_t console_send_buffered(const uint8_t* data, size_t num_bytes);
 extern size_t console_recv_buffered(uint8_t* data, size_t max_bytes);
 extern size_t console_send_buffer_space(void);
+extern bool console_rx_idle(void);
+extern void console_get_error_counts(ConsoleErrorCounts* counts);
 
 #endif
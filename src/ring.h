@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Single-producer, single-consumer ring buffer of fixed-size elements.
+ *
+ * Only the producer moves the tail and only the consumer moves the
+ * head, so either side may run from an ISR without locking. Indices
+ * are free-running and masked on use: the capacity must be a power of
+ * two no larger than UINT16_MAX/2.
+ *
+ * Besides the copying read/write calls, each side can work in place on
+ * the contiguous span up to the wraparound point: the producer with
+ * ring_reserve()/ring_commit() and the consumer with
+ * ring_read_span()/ring_consume().
+ */
+
+#define IS_POW_OF_TWO(X) (((X) & ((X)-1)) == 0)
+
+#define RING_CAPACITY_VALID(N) (IS_POW_OF_TWO(N) && ((N) <= UINT16_MAX/2))
+
+struct ring {
+    uint8_t* buffer;
+    uint16_t capacity;
+    uint16_t element_size;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+};
+
+/* Static initializer for a ring backed by an array of elements */
+#define RING_INITIALIZER(storage) {                              \
+    .buffer = (uint8_t*)(storage),                               \
+    .capacity = sizeof(storage) / sizeof((storage)[0]),          \
+    .element_size = sizeof((storage)[0]),                        \
+    .head = 0,                                                   \
+    .tail = 0,                                                   \
+}
+
+/* Keep the compiler from moving buffer accesses across index updates */
+#define RING_BARRIER() __asm__ volatile ("" ::: "memory")
+
+static inline uint16_t ring_used(const struct ring* r) {
+    return (uint16_t)(r->tail - r->head);
+}
+
+static inline uint16_t ring_space(const struct ring* r) {
+    return r->capacity - ring_used(r);
+}
+
+static inline bool ring_empty(const struct ring* r) {
+    return r->head == r->tail;
+}
+
+static inline bool ring_full(const struct ring* r) {
+    return ring_used(r) == r->capacity;
+}
+
+/* Only safe while neither side is active */
+static inline void ring_clear(struct ring* r) {
+    r->head = 0;
+    r->tail = 0;
+}
+
+static inline uint8_t* ring_element(const struct ring* r, uint16_t index) {
+    return &r->buffer[(uint16_t)(index & (r->capacity - 1)) * r->element_size];
+}
+
+/* Copy count elements starting at index out of the ring */
+static inline void ring_copy_out(const struct ring* r, uint16_t index,
+                                 void* data, uint16_t count) {
+    uint16_t offset = index & (r->capacity - 1);
+    uint16_t first = r->capacity - offset;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(data, ring_element(r, index), (size_t)first * r->element_size);
+    if (count > first) {
+        memcpy((uint8_t*)data + (size_t)first * r->element_size,
+               r->buffer, (size_t)(count - first) * r->element_size);
+    }
+}
+
+/* Producer side */
+
+static inline uint16_t ring_write(struct ring* r, const void* data, uint16_t count) {
+    uint16_t space = ring_space(r);
+    RING_BARRIER();
+    if (count > space) {
+        count = space;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint16_t tail = r->tail;
+    uint16_t offset = tail & (r->capacity - 1);
+    uint16_t first = r->capacity - offset;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(ring_element(r, tail), data, (size_t)first * r->element_size);
+    if (count > first) {
+        memcpy(r->buffer, (const uint8_t*)data + (size_t)first * r->element_size,
+               (size_t)(count - first) * r->element_size);
+    }
+
+    RING_BARRIER();
+    r->tail = tail + count;
+    return count;
+}
+
+static inline bool ring_put(struct ring* r, const void* element) {
+    return ring_write(r, element, 1) == 1;
+}
+
+/*
+ * Returns the number of elements that can be written in place at
+ * *span without wrapping. Follow with ring_commit().
+ */
+static inline uint16_t ring_reserve(struct ring* r, void** span) {
+    uint16_t space = ring_space(r);
+    RING_BARRIER();
+    uint16_t tail = r->tail;
+    uint16_t contiguous = r->capacity - (tail & (r->capacity - 1));
+    *span = ring_element(r, tail);
+    return (space < contiguous) ? space : contiguous;
+}
+
+static inline void ring_commit(struct ring* r, uint16_t count) {
+    RING_BARRIER();
+    r->tail += count;
+}
+
+/* Consumer side */
+
+static inline uint16_t ring_peek(const struct ring* r, void* data, uint16_t count) {
+    uint16_t used = ring_used(r);
+    RING_BARRIER();
+    if (count > used) {
+        count = used;
+    }
+    if (count > 0) {
+        ring_copy_out(r, r->head, data, count);
+    }
+    return count;
+}
+
+static inline void ring_consume(struct ring* r, uint16_t count) {
+    RING_BARRIER();
+    r->head += count;
+}
+
+static inline uint16_t ring_read(struct ring* r, void* data, uint16_t count) {
+    count = ring_peek(r, data, count);
+    ring_consume(r, count);
+    return count;
+}
+
+static inline bool ring_get(struct ring* r, void* element) {
+    return ring_read(r, element, 1) == 1;
+}
+
+/*
+ * Returns the number of elements that can be read in place at *span
+ * without wrapping. Follow with ring_consume().
+ */
+static inline uint16_t ring_read_span(const struct ring* r, void** span) {
+    uint16_t used = ring_used(r);
+    RING_BARRIER();
+    uint16_t head = r->head;
+    uint16_t contiguous = r->capacity - (head & (r->capacity - 1));
+    *span = ring_element(r, head);
+    return (used < contiguous) ? used : contiguous;
+}
+
+#endif
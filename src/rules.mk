@@ -63,6 +63,66 @@ else
 	DEFS       += -DSEMIHOSTING=0
 endif
 
+####################################################################
+# DAP command profiling support
+DAP_PROFILING  ?= 0
+
+ifeq ($(DAP_PROFILING),1)
+	DEFS       += -DDAP_PROFILING=1
+else
+	DEFS       += -DDAP_PROFILING=0
+endif
+
+####################################################################
+# DAP command flight recorder support
+DAP_RECORDER   ?= 0
+
+ifeq ($(DAP_RECORDER),1)
+	DEFS       += -DDAP_RECORDER=1
+else
+	DEFS       += -DDAP_RECORDER=0
+endif
+
+####################################################################
+# Target memory read cache support
+DAP_READ_CACHE ?= 0
+
+ifeq ($(DAP_READ_CACHE),1)
+	DEFS       += -DDAP_READ_CACHE=1
+else
+	DEFS       += -DDAP_READ_CACHE=0
+endif
+
+####################################################################
+# Probe-side DAP sequencer support
+DAP_SEQUENCER  ?= 0
+
+ifeq ($(DAP_SEQUENCER),1)
+	DEFS       += -DDAP_SEQUENCER=1
+else
+	DEFS       += -DDAP_SEQUENCER=0
+endif
+
+####################################################################
+# GDB remote serial protocol server on the virtual COM port
+GDB_SERVER     ?= 0
+
+ifeq ($(GDB_SERVER),1)
+	DEFS       += -DGDB_SERVER=1
+else
+	DEFS       += -DGDB_SERVER=0
+endif
+
+####################################################################
+# Statistical PC sampling profiler, streamed on the virtual COM port
+PC_SAMPLER     ?= 0
+
+ifeq ($(PC_SAMPLER),1)
+	DEFS       += -DPC_SAMPLER=1
+else
+	DEFS       += -DPC_SAMPLER=0
+endif
+
 ####################################################################
 # OpenOCD specific variables
 
@@ -22,4 +22,7 @@
 #define USB_PMA_SIZE 1024
 #define USB_PMA_SIZE_WITH_CAN 768
 
+/* Bulk IN endpoints may use both PMA buffers (see usb_dbl_buf.h) */
+#define USB_PMA_DOUBLE_BUFFER_AVAILABLE 1
+
 #endif
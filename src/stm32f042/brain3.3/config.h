@@ -25,6 +25,10 @@
 #define CAN_RX_AVAILABLE 1
 #define CAN_TX_AVAILABLE 0
 #define CAN_NVIC_LINE NVIC_CEC_CAN_IRQ
+#define CAN_STATS_AVAILABLE 0
+#define CAN_CYCLIC_AVAILABLE 0
+#define ISOTP_AVAILABLE 0
+#define GSUSB_AVAILABLE 0
 
 #define VCDC_AVAILABLE 1
 #define VCDC_TX_BUFFER_SIZE 256
@@ -48,6 +52,8 @@
 #define CONSOLE_RX_DMA_CONTROLLER DMA1
 #define CONSOLE_RX_DMA_CLOCK RCC_DMA
 #define CONSOLE_RX_DMA_CHANNEL DMA_CHANNEL5
+#define CONSOLE_RX_DMA_IRQ_NAME  dma1_channel4_7_dma2_channel3_5_isr
+#define CONSOLE_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
 
 #define DFU_AVAILABLE 1
 #define nBOOT0_GPIO_CLOCK RCC_GPIOB
@@ -26,10 +26,20 @@
 #define CAN_TX_AVAILABLE 1
 #define CAN_NVIC_LINE NVIC_CEC_CAN_IRQ
 
-#define VCDC_AVAILABLE 1
+/* The gs_usb interface takes over the VCDC endpoints used by SLCAN */
+#ifndef GSUSB_AVAILABLE
+#define GSUSB_AVAILABLE 0
+#endif
+
+#define VCDC_AVAILABLE (!GSUSB_AVAILABLE)
 #define VCDC_TX_BUFFER_SIZE 256
 #define VCDC_RX_BUFFER_SIZE 256
 
+/* SLCAN extensions */
+#define CAN_STATS_AVAILABLE VCDC_AVAILABLE
+#define CAN_CYCLIC_AVAILABLE VCDC_AVAILABLE
+#define ISOTP_AVAILABLE VCDC_AVAILABLE
+
 #define CDC_AVAILABLE 1
 #define DEFAULT_BAUDRATE 115200
 
@@ -48,6 +58,8 @@
 #define CONSOLE_RX_DMA_CONTROLLER DMA1
 #define CONSOLE_RX_DMA_CLOCK RCC_DMA
 #define CONSOLE_RX_DMA_CHANNEL DMA_CHANNEL5
+#define CONSOLE_RX_DMA_IRQ_NAME  dma1_channel4_7_dma2_channel3_5_isr
+#define CONSOLE_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
 
 #define DFU_AVAILABLE 1
 #define nBOOT0_GPIO_CLOCK RCC_GPIOF
@@ -22,4 +22,7 @@
 #define USB_PMA_SIZE 512
 #define USB_PMA_SIZE_WITH_CAN 0
 
+/* Not enough PMA left over to double-buffer bulk IN endpoints */
+#define USB_PMA_DOUBLE_BUFFER_AVAILABLE 0
+
 #endif
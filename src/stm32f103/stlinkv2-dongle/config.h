@@ -23,6 +23,10 @@
 
 #define CAN_RX_AVAILABLE 0
 #define CAN_TX_AVAILABLE 0
+#define CAN_STATS_AVAILABLE 0
+#define CAN_CYCLIC_AVAILABLE 0
+#define ISOTP_AVAILABLE 0
+#define GSUSB_AVAILABLE 0
 
 #define VCDC_AVAILABLE 0
 #define VCDC_TX_BUFFER_SIZE 128
@@ -32,8 +36,6 @@
 #define DEFAULT_BAUDRATE 115200
 
 #define CONSOLE_USART USART3
-#define CONSOLE_TX_BUFFER_SIZE 128
-#define CONSOLE_RX_BUFFER_SIZE 4096
 
 #define CONSOLE_USART_GPIO_PORT GPIOB
 #define CONSOLE_USART_GPIO_TX   0
@@ -48,6 +50,8 @@
 #define CONSOLE_RX_DMA_CONTROLLER DMA1
 #define CONSOLE_RX_DMA_CLOCK RCC_DMA1
 #define CONSOLE_RX_DMA_CHANNEL DMA_CHANNEL3
+#define CONSOLE_RX_DMA_IRQ_NAME  dma1_channel3_isr
+#define CONSOLE_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL3_IRQ
 
 #define TARGET_DFU_AVAILABLE 0
 
@@ -38,6 +38,13 @@ ifeq ($(TARGET),KITCHEN42)
 	LDSCRIPT           ?= ./stm32f042/stm32f042x6.ld
 	ARCH                = STM32F0
 endif
+ifeq ($(TARGET),KITCHEN42-GSUSB)
+	TARGET_COMMON_DIR  := ./stm32f042
+	TARGET_SPEC_DIR    := ./stm32f042/kitchen42
+	LDSCRIPT           ?= ./stm32f042/stm32f042x6.ld
+	DEFS               += -DGSUSB_AVAILABLE=1
+	ARCH                = STM32F0
+endif
 ifeq ($(TARGET),DAP42K6U)
 	TARGET_COMMON_DIR  := ./stm32f042
 	TARGET_SPEC_DIR    := ./stm32f042/dap42k6u
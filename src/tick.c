@@ -52,3 +52,21 @@ void tick_stop(void) {
 uint32_t get_ticks(void) {
     return __ticks;
 }
+
+/*
+ * The Cortex-M0 has no DWT cycle counter, so count core cycles by
+ * extending the SysTick down-counter with the tick count. Retry if the
+ * tick interrupt fires between the two reads. With interrupts masked,
+ * a pending tick is not seen and the result may lag by one period.
+ */
+uint32_t get_cycles(void) {
+    uint32_t ticks;
+    uint32_t count;
+    do {
+        ticks = __ticks;
+        count = systick_get_value();
+    } while (ticks != __ticks);
+
+    uint32_t period = systick_get_reload() + 1;
+    return ticks * period + (period - 1 - count);
+}
@@ -26,5 +26,6 @@ extern void tick_stop(void);
 extern volatile uint32_t __ticks;
 
 extern uint32_t get_ticks(void);
+extern uint32_t get_cycles(void);
 
 #endif
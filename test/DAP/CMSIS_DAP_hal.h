@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DAP_HAL_H__
+#define __DAP_HAL_H__
+
+#include <stdint.h>
+
+/*
+ * Host stand-in for the target HAL and DAP configuration. There are no
+ * pins: the tests supply SWD_TransferRaw() and SWD_Sequence() against
+ * a simulated target, so only the calls CMSIS_DAP.c makes around them
+ * need to exist.
+ */
+
+#include "config.h"
+
+#define CPU_CLOCK               48000000U
+#define IO_PORT_WRITE_CYCLES    2U
+#define DAP_SWD                 1
+#define DAP_JTAG                0
+#define DAP_JTAG_DEV_CNT        8U
+#define DAP_DEFAULT_PORT        1U
+#define DAP_DEFAULT_SWJ_CLOCK   10000000U
+#define DAP_PACKET_SIZE         64U
+#define DAP_PACKET_COUNT        4U
+#define DAP_PACKET_QUEUE_SIZE   (DAP_PACKET_COUNT+4)
+#define SWO_UART                0
+#define SWO_UART_MAX_BAUDRATE   10000000U
+#define SWO_MANCHESTER          0
+#define SWO_BUFFER_SIZE         4096U
+#define SWO_STREAM              0
+#define TIMESTAMP_CLOCK         1000U
+#define TARGET_DEVICE_FIXED     0
+
+/* Advanced by the tests */
+static uint32_t hal_ticks;
+
+static __inline uint32_t TIMESTAMP_GET (void) { return hal_ticks; }
+
+static __inline void PORT_SWD_SETUP (void) {}
+static __inline void PORT_JTAG_SETUP (void) {}
+static __inline void PORT_OFF (void) {}
+static __inline void PIN_SWCLK_TCK_SET (void) {}
+static __inline void PIN_SWCLK_TCK_CLR (void) {}
+static __inline uint32_t PIN_SWCLK_TCK_IN (void) { return 1; }
+static __inline uint32_t PIN_SWDIO_TMS_IN (void) { return 1; }
+static __inline void PIN_SWDIO_TMS_SET (void) {}
+static __inline void PIN_SWDIO_TMS_CLR (void) {}
+static __inline uint32_t PIN_SWDIO_IN (void) { return 1; }
+static __inline void PIN_SWDIO_OUT (uint32_t bit) { (void)bit; }
+static __inline void PIN_SWDIO_OUT_ENABLE (void) {}
+static __inline void PIN_SWDIO_OUT_DISABLE (void) {}
+static __inline uint32_t PIN_TDI_IN (void) { return 0; }
+static __inline void PIN_TDI_OUT (uint32_t bit) { (void)bit; }
+static __inline uint32_t PIN_TDO_IN (void) { return 0; }
+static __inline uint32_t PIN_nTRST_IN (void) { return 0; }
+static __inline void PIN_nTRST_OUT (uint32_t bit) { (void)bit; }
+static __inline uint32_t PIN_nRESET_IN (void) { return 1; }
+static __inline void PIN_nRESET_OUT (uint32_t bit) { (void)bit; }
+static __inline void LED_CONNECTED_OUT (uint32_t bit) { (void)bit; }
+static __inline void LED_RUNNING_OUT (uint32_t bit) { (void)bit; }
+static __inline void LED_ACTIVITY_OUT (uint32_t bit) { (void)bit; }
+static __inline void DAP_SETUP (void) {}
+static __inline uint32_t RESET_TARGET (void) { return 0; }
+
+#endif
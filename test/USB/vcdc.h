@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef VCDC_H_INCLUDED
+#define VCDC_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ring.h"
+#include "config.h"
+
+/*
+ * Host stand-in for the virtual COM port. The firmware side sees the
+ * same calls as src/USB/vcdc.h, backed by the same rings; the test
+ * plays the USB host with vcdc_host_write() and vcdc_host_read().
+ */
+
+static uint8_t vcdc_tx_buffer[VCDC_TX_BUFFER_SIZE];
+static uint8_t vcdc_rx_buffer[VCDC_RX_BUFFER_SIZE];
+
+static struct ring vcdc_tx_ring = RING_INITIALIZER(vcdc_tx_buffer);
+static struct ring vcdc_rx_ring = RING_INITIALIZER(vcdc_rx_buffer);
+
+static inline void vcdc_reset(void) {
+    ring_clear(&vcdc_tx_ring);
+    ring_clear(&vcdc_rx_ring);
+}
+
+/* Host to device: returns how much of the data fit */
+static inline size_t vcdc_host_write(const char* data, size_t len) {
+    return ring_write(&vcdc_rx_ring, data, (uint16_t)len);
+}
+
+/* Device to host: drains up to max_len bytes and NUL-terminates them */
+static inline size_t vcdc_host_read(char* data, size_t max_len) {
+    size_t len = ring_read(&vcdc_tx_ring, data, (uint16_t)(max_len - 1));
+    data[len] = '\0';
+    return len;
+}
+
+static inline size_t vcdc_recv_buffered(uint8_t* data, size_t max_bytes) {
+    return ring_read(&vcdc_rx_ring, data, (uint16_t)max_bytes);
+}
+
+static inline size_t vcdc_recv_span(const uint8_t** data) {
+    void* span;
+    uint16_t len = ring_read_span(&vcdc_rx_ring, &span);
+    *data = (const uint8_t*)span;
+    return len;
+}
+
+static inline void vcdc_recv_consume(size_t num_bytes) {
+    ring_consume(&vcdc_rx_ring, (uint16_t)num_bytes);
+}
+
+static inline size_t vcdc_send_buffered(const uint8_t* data, size_t num_bytes) {
+    return ring_write(&vcdc_tx_ring, data, (uint16_t)num_bytes);
+}
+
+static inline size_t vcdc_send_buffer_space(void) {
+    return ring_space(&vcdc_tx_ring);
+}
+
+static inline void vcdc_putchar(const char c) {
+    ring_put(&vcdc_tx_ring, &c);
+}
+
+static inline void vcdc_print(const char* s) {
+    vcdc_send_buffered((const uint8_t*)s, strlen(s));
+}
+
+static inline void vcdc_print_hex_nibble(uint8_t x) {
+    vcdc_putchar("0123456789ABCDEF"[x & 0x0F]);
+}
+
+static inline void vcdc_print_hex_byte(uint8_t x) {
+    vcdc_print_hex_nibble(x >> 4);
+    vcdc_print_hex_nibble(x);
+}
+
+static inline void vcdc_print_hex(uint32_t x) {
+    vcdc_print_hex_byte((uint8_t)(x >> 24));
+    vcdc_print_hex_byte((uint8_t)(x >> 16));
+    vcdc_print_hex_byte((uint8_t)(x >> 8));
+    vcdc_print_hex_byte((uint8_t)x);
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define GSUSB_AVAILABLE 1
+
+#include "fake_can.h"
+#include "fake_usb.h"
+#include "CAN/can_timing.c"
+#include "USB/gs_usb.c"
+
+/*
+ * Host cost of the gs_usb path at 100% bus load: every pass the host
+ * queues one 8-byte frame, the controller reports the previous one
+ * sent and receives another, and the main loop forwards the echo and
+ * the received frame. The frames/s figure is what the host manages,
+ * printed against what a saturated 1Mbit/s bus can carry; as with
+ * bench_slcan, it only compares changes against each other.
+ */
+
+#define FRAMES  2000000UL
+
+/* 8-byte data frames without stuffing, including the 3-bit intermission */
+#define BUS_BITRATE         1000000UL
+#define BUS_STANDARD_BITS   111UL
+#define BUS_EXTENDED_BITS   131UL
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t bench_cycles(void) {
+    return __rdtsc();
+}
+#define CYCLE_UNIT "TSC cycles"
+#else
+static uint64_t bench_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#define CYCLE_UNIT "ns"
+#endif
+
+static uint64_t bench_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_full_load(bool extended) {
+    uint32_t bits = extended ? BUS_EXTENDED_BITS : BUS_STANDARD_BITS;
+    struct gs_host_frame out = {
+        .can_id = extended ? (0x18DA10F1 | GS_CAN_EFF_FLAG) : 0x7E0,
+        .can_dlc = 8,
+        .data = { 0x02, 0x10, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    CAN_Message msg = {
+        .id = extended ? 0x18DAF110 : 0x7E8, .len = 8,
+        .format = extended ? CANExtended : CANStandard, .type = CANData,
+        .data = { 0x10, 0x14, 0x62, 0xF1, 0x90, 0x57, 0x30, 0x4C },
+    };
+    struct gs_host_frame in;
+    unsigned long frames = 0;
+    fake_can_tx_count = 0;
+
+    uint64_t start_ns = bench_ns();
+    uint64_t start = bench_cycles();
+    while (frames < FRAMES) {
+        out.echo_id++;
+        fake_usb_host_out(ENDP_GSUSB_OUT, &out, GS_HOST_FRAME_SIZE);
+        /* Both directions share the bus */
+        fake_can_now_us += 2 * bits * 1000000UL / BUS_BITRATE;
+        if (fake_can_tx_count > 0) {
+            fake_can_transmitted(fake_can_tx_count - 1, true);
+            fake_can_tx_count = 0;
+        }
+        fake_can_receive(&msg);
+        while (gs_usb_app_update()) {
+            if (fake_usb_host_in(ENDP_GSUSB_IN, &in) == 0) {
+                break;
+            }
+            frames++;
+        }
+    }
+    uint64_t elapsed = bench_cycles() - start;
+    uint64_t elapsed_ns = bench_ns() - start_ns;
+    printf("%s %8.1f %s/frame %10.0f frames/s (bus %lu frames/s)\n",
+           extended ? "extended" : "standard",
+           (double)elapsed / (double)frames, CYCLE_UNIT,
+           (double)frames * 1e9 / (double)elapsed_ns,
+           BUS_BITRATE / bits);
+}
+
+int main(void) {
+    gs_usb_app_setup(fake_usb_device);
+    fake_usb_enumerate();
+    struct gs_device_mode mode = { .mode = GS_CAN_MODE_START, .flags = GS_CAN_MODE_HW_TIMESTAMP };
+    uint16_t len = sizeof(mode);
+    if (fake_usb_host_control(INTF_GSUSB, GS_USB_BREQ_MODE, 0, (uint8_t*)&mode, &len) != USBD_REQ_HANDLED) {
+        printf("couldn't start the channel\n");
+        return 1;
+    }
+    bench_full_load(false);
+    bench_full_load(true);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ring.h"
+
+/*
+ * Bytes moved per CPU cycle through a 256 byte buffer, in 64 byte USB
+ * packets: the shared ring against the byte-at-a-time loops that VCDC
+ * used before. Host figures only show the relative cost: the Cortex-M0
+ * copies a word per load/store pair at best, so the gain on the probe
+ * is smaller than on a host with wide vector copies.
+ */
+
+#define BUFFER_SIZE     256U
+#define PACKET_SIZE     64U
+#define TOTAL_BYTES     (64UL * 1024 * 1024)
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t bench_cycles(void) {
+    return __rdtsc();
+}
+#define CYCLE_UNIT "TSC cycle"
+#else
+static uint64_t bench_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#define CYCLE_UNIT "ns"
+#endif
+
+/* The loops from the previous vcdc.c */
+static uint8_t old_buffer[BUFFER_SIZE];
+static uint16_t old_head;
+static uint16_t old_tail;
+
+static size_t old_send_buffered(const uint8_t* data, size_t num_bytes) {
+    size_t bytes_queued = 0;
+    while ((uint16_t)(old_tail - old_head) != BUFFER_SIZE && bytes_queued < num_bytes) {
+        old_buffer[old_tail % BUFFER_SIZE] = data[bytes_queued++];
+        old_tail++;
+    }
+    return bytes_queued;
+}
+
+static size_t old_recv_buffered(uint8_t* data, size_t max_bytes) {
+    size_t bytes_read = 0;
+    while (old_head != old_tail && bytes_read < max_bytes) {
+        data[bytes_read++] = old_buffer[old_head % BUFFER_SIZE];
+        old_head++;
+    }
+    return bytes_read;
+}
+
+static uint8_t new_storage[BUFFER_SIZE];
+static struct ring new_ring = RING_INITIALIZER(new_storage);
+
+static uint32_t checksum(const uint8_t* data, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum = sum * 31U + data[i];
+    }
+    return sum;
+}
+
+typedef size_t (*Mover)(uint8_t* packet, const uint8_t* source, size_t len);
+
+/* Odd-sized writes, so that the offsets keep moving across the wrap */
+static size_t old_move(uint8_t* packet, const uint8_t* source, size_t len) {
+    size_t moved = old_send_buffered(source, len);
+    return old_recv_buffered(packet, moved);
+}
+
+static size_t new_move(uint8_t* packet, const uint8_t* source, size_t len) {
+    uint16_t moved = ring_write(&new_ring, source, (uint16_t)len);
+    return ring_read(&new_ring, packet, moved);
+}
+
+static double bench(const char* name, Mover move, uint32_t* sum) {
+    uint8_t source[PACKET_SIZE];
+    uint8_t packet[PACKET_SIZE];
+    for (size_t i = 0; i < sizeof(source); i++) {
+        source[i] = (uint8_t)(i * 7U);
+    }
+
+    uint64_t start = bench_cycles();
+    size_t total = 0;
+    uint32_t acc = 0;
+    for (size_t len = PACKET_SIZE - 3; total < TOTAL_BYTES;
+         len = (len == PACKET_SIZE) ? PACKET_SIZE - 3 : len + 1) {
+        size_t n = move(packet, source, len);
+        acc += packet[0] + packet[n - 1];
+        total += n;
+    }
+    uint64_t elapsed = bench_cycles() - start;
+
+    *sum = acc + checksum(packet, sizeof(packet));
+    double rate = (double)total / (double)elapsed;
+    printf("%-10s %8.3f bytes/%s\n", name, rate, CYCLE_UNIT);
+    return rate;
+}
+
+int main(void) {
+    uint32_t old_sum;
+    uint32_t new_sum;
+    double old_rate = bench("byte loop", old_move, &old_sum);
+    double new_rate = bench("ring", new_move, &new_sum);
+    printf("speedup    %8.2fx\n", new_rate / old_rate);
+    if (old_sum != new_sum) {
+        printf("data mismatch\n");
+        return 1;
+    }
+    return 0;
+}
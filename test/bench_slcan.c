@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "fake_can.h"
+#include "CAN/can_timing.c"
+#include "CAN/slcan.c"
+
+/*
+ * Host cost of the SLCAN path per frame: parsing t/T commands out of
+ * the VCDC receive buffer, and formatting received frames into the
+ * transmit buffer. As with bench_ring, the figures only compare
+ * changes against each other; they aren't what the probe achieves.
+ */
+
+#define FRAMES  2000000UL
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t bench_cycles(void) {
+    return __rdtsc();
+}
+#define CYCLE_UNIT "TSC cycles"
+#else
+static uint64_t bench_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#define CYCLE_UNIT "ns"
+#endif
+
+static char drain[VCDC_TX_BUFFER_SIZE + 1];
+
+/* Host to CAN: 8-byte frames, alternating standard and extended IDs */
+static void bench_transmit(void) {
+    static const char* commands[] = {
+        "t7E881021A0000000000\r",
+        "T18DAF1108021A000000000000\r",
+    };
+    unsigned long frames = 0;
+    size_t next = 0;
+    uint64_t start = bench_cycles();
+    while (frames < FRAMES) {
+        while (vcdc_host_write(commands[next], strlen(commands[next])) > 0) {
+            next ^= 1;
+        }
+        fake_can_tx_count = 0;
+        slcan_app_update();
+        frames += fake_can_tx_count;
+        vcdc_host_read(drain, sizeof(drain));
+    }
+    uint64_t elapsed = bench_cycles() - start;
+    printf("transmit %8.1f %s/frame\n", (double)elapsed / (double)frames, CYCLE_UNIT);
+}
+
+/* CAN to host, with timestamps */
+static void bench_receive(void) {
+    CAN_Message msg = {
+        .id = 0x18DAF110, .len = 8, .format = CANExtended, .type = CANData,
+        .data = { 0x10, 0x14, 0x62, 0xF1, 0x90, 0x57, 0x30, 0x4C },
+    };
+    slcan_timestamping = true;
+    unsigned long frames = 0;
+    uint64_t start = bench_cycles();
+    while (frames < FRAMES) {
+        while (fake_can_receive(&msg)) {
+            msg.id ^= 1;
+            fake_can_now_us += 250;
+        }
+        slcan_output_messages();
+        frames += vcdc_host_read(drain, sizeof(drain)) / slcan_calc_message_length(&msg);
+    }
+    uint64_t elapsed = bench_cycles() - start;
+    printf("receive  %8.1f %s/frame\n", (double)elapsed / (double)frames, CYCLE_UNIT);
+}
+
+int main(void) {
+    slcan_app_setup(500000, MODE_RESET);
+    if (!slcan_exec_command("O", 1)) {
+        printf("couldn't open the channel\n");
+        return 1;
+    }
+    bench_transmit();
+    bench_receive();
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CONFIG_H_INCLUDED
+#define CONFIG_H_INCLUDED
+
+/*
+ * Board configuration for the host tests. The SLCAN extensions and gs_usb
+ * are off unless a test turns them on before including the sources.
+ */
+
+#define PRODUCT_NAME "host"
+
+#define CAN_RX_AVAILABLE 1
+#define CAN_TX_AVAILABLE 1
+
+#define VCDC_AVAILABLE 1
+#define VCDC_TX_BUFFER_SIZE 256
+#define VCDC_RX_BUFFER_SIZE 256
+
+#ifndef CAN_STATS_AVAILABLE
+#define CAN_STATS_AVAILABLE 0
+#endif
+
+#ifndef CAN_CYCLIC_AVAILABLE
+#define CAN_CYCLIC_AVAILABLE 0
+#endif
+
+#ifndef ISOTP_AVAILABLE
+#define ISOTP_AVAILABLE 0
+#endif
+
+#ifndef GSUSB_AVAILABLE
+#define GSUSB_AVAILABLE 0
+#endif
+
+#endif
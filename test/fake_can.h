@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAKE_CAN_H_INCLUDED
+#define FAKE_CAN_H_INCLUDED
+
+#include <string.h>
+
+#include "ring.h"
+#include "CAN/can.h"
+
+/*
+ * Host stand-in for the bxCAN driver: received frames are queued by the
+ * test, transmitted frames are logged with the time they were queued,
+ * and time only moves when the test advances it.
+ */
+
+#define FAKE_CAN_TX_LOG_SIZE 1024
+
+static uint32_t fake_can_clock = 48000000;
+static uint32_t fake_can_now_us;
+
+static CAN_Message fake_can_rx_buffer[CAN_RX_BUFFER_SIZE];
+static struct ring fake_can_rx_ring = RING_INITIALIZER(fake_can_rx_buffer);
+
+static CAN_Message fake_can_tx_log[FAKE_CAN_TX_LOG_SIZE];
+static uint32_t fake_can_tx_tags[FAKE_CAN_TX_LOG_SIZE];
+static size_t fake_can_tx_count;
+static CanTxCompleteCallback fake_can_tx_complete;
+static bool fake_can_tx_full;
+
+static CanBitTiming fake_can_timing;
+static CanMode fake_can_mode;
+static int fake_can_filters;
+static CanErrorCounts fake_can_errors;
+static CanBusState fake_can_bus_state;
+
+static inline void fake_can_reset(void) {
+    ring_clear(&fake_can_rx_ring);
+    fake_can_tx_count = 0;
+    fake_can_tx_full = false;
+    fake_can_now_us = 0;
+    fake_can_filters = 0;
+    memset(&fake_can_errors, 0, sizeof(fake_can_errors));
+    fake_can_bus_state = CAN_BUS_ERROR_ACTIVE;
+}
+
+/* Deliver a frame as if the ISR had just received it */
+static inline bool fake_can_receive(const CAN_Message* msg) {
+    CAN_Message stamped = *msg;
+    stamped.timestamp = fake_can_now_us;
+    return ring_put(&fake_can_rx_ring, &stamped);
+}
+
+bool can_setup(uint32_t baudrate, CanMode mode) {
+    (void)baudrate;
+    fake_can_mode = mode;
+    return true;
+}
+
+bool can_reconfigure_timing(const CanBitTiming* timing, CanMode mode) {
+    fake_can_timing = *timing;
+    fake_can_mode = mode;
+    return true;
+}
+
+uint32_t can_get_clock(void) {
+    return fake_can_clock;
+}
+
+uint32_t can_get_timestamp_us(void) {
+    return fake_can_now_us;
+}
+
+CanBusState can_get_bus_state(uint8_t* tec, uint8_t* rec) {
+    *tec = (fake_can_bus_state == CAN_BUS_ERROR_ACTIVE) ? 0 : 128;
+    *rec = 0;
+    return fake_can_bus_state;
+}
+
+void can_get_error_counts(CanErrorCounts* counts) {
+    *counts = fake_can_errors;
+}
+
+void can_filter_clear(void) {
+    fake_can_filters = 0;
+}
+
+bool can_filter_add_mask(uint32_t id, uint32_t mask, CANFormat format) {
+    (void)id;
+    (void)mask;
+    (void)format;
+    fake_can_filters++;
+    return true;
+}
+
+bool can_write_tagged(const CAN_Message* msg, uint32_t tag) {
+    if (fake_can_tx_full || fake_can_tx_count == FAKE_CAN_TX_LOG_SIZE) {
+        return false;
+    }
+    fake_can_tx_log[fake_can_tx_count] = *msg;
+    fake_can_tx_log[fake_can_tx_count].timestamp = fake_can_now_us;
+    fake_can_tx_tags[fake_can_tx_count++] = tag;
+    return true;
+}
+
+bool can_write(CAN_Message* msg) {
+    return can_write_tagged(msg, CAN_TX_TAG_UNREPORTED);
+}
+
+void can_set_tx_complete_callback(CanTxCompleteCallback callback) {
+    fake_can_tx_complete = callback;
+}
+
+/* Report a logged frame as sent or failed, as the ISR would */
+static inline void fake_can_transmitted(size_t index, bool success) {
+    if (fake_can_tx_complete && fake_can_tx_tags[index] != CAN_TX_TAG_UNREPORTED) {
+        fake_can_tx_complete(fake_can_tx_tags[index], success);
+    }
+}
+
+bool can_write_priority(const CAN_Message* msg) {
+    return can_write((CAN_Message*)msg);
+}
+
+bool can_tx_queue_full(void) {
+    return fake_can_tx_full;
+}
+
+bool can_rx_buffer_empty(void) {
+    return ring_empty(&fake_can_rx_ring);
+}
+
+bool can_rx_buffer_full(void) {
+    return ring_full(&fake_can_rx_ring);
+}
+
+CAN_Message* can_rx_buffer_peek(void) {
+    return (CAN_Message*)ring_element(&fake_can_rx_ring, fake_can_rx_ring.head);
+}
+
+void can_rx_buffer_pop(void) {
+    ring_consume(&fake_can_rx_ring, 1);
+}
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAKE_CORTEX_M_H_INCLUDED
+#define FAKE_CORTEX_M_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/swd_shadow.h"
+
+/*
+ * Host stand-in for SW_DP.c with a Cortex-M3 behind it: a SW-DP, an
+ * AHB-AP on AP 0 and a core with halting debug, a revision 1 FPB and a
+ * DWT, for code that drives the core itself rather than relaying host
+ * transfers.
+ *
+ * The DP answers nothing until a line reset and only while the port is
+ * set up for SWD. AP reads are posted, a failed bus access sets
+ * STICKYERR and every later access except DP reads and ABORT FAULTs
+ * until ABORT clears it, and TAR auto-increment wraps within its 1KB
+ * block. Any access other than an ABORT write may be answered with
+ * WAIT, which changes nothing.
+ *
+ * The core runs a made-up program of two-byte instructions. The one at
+ * an address that is 2 mod 8 increments r0 and stores it to
+ * FAKE_CM_COUNTER, the one at 6 mod 8 loads FAKE_CM_INPUT into r1, and
+ * the others only move the PC on. A running core executes
+ * FAKE_CM_BURST instructions each time DHCSR is read, so it only gets
+ * anywhere while someone is polling it. Breakpoints halt before the
+ * instruction; the first instruction after leaving halt is not checked,
+ * as if the debugger had stepped off the breakpoint. Watchpoints halt
+ * after the access.
+ */
+
+#define FAKE_CM_FLASH_BASE      0x00000000UL
+#define FAKE_CM_RAM_BASE        0x20000000UL
+#define FAKE_CM_MEMORY_SIZE     0x10000U
+
+#define FAKE_CM_COUNTER         0x20000100UL
+#define FAKE_CM_INPUT           0x20000104UL
+#define FAKE_CM_RESET_PC        0x00000100UL
+#define FAKE_CM_BURST           5U
+
+#define FAKE_CM_IDCODE          0x2BA01477UL
+#define FAKE_CM_AP_IDR          0x24770011UL
+
+#define FAKE_CM_FPB_CODE        6U
+#define FAKE_CM_FPB_LITERAL     2U
+#define FAKE_CM_DWT_COMPARATORS 4U
+#define FAKE_CM_DWT_MAX_MASK    15U
+#define FAKE_CM_REGISTERS       128U
+
+#define FAKE_CM_STKERRCLR       (1UL << 2)
+#define FAKE_CM_STICKYERR       (1UL << 5)
+#define FAKE_CM_NO_ACK          7U
+
+#define FAKE_CM_DFSR            0xE000ED30UL
+#define FAKE_CM_DFSR_HALTED     (1UL << 0)
+#define FAKE_CM_DFSR_BKPT       (1UL << 1)
+#define FAKE_CM_DFSR_DWTTRAP    (1UL << 2)
+#define FAKE_CM_DFSR_VCATCH     (1UL << 3)
+#define FAKE_CM_AIRCR           0xE000ED0CUL
+#define FAKE_CM_SYSRESETREQ     0x05FA0004UL
+#define FAKE_CM_DHCSR           0xE000EDF0UL
+#define FAKE_CM_DCRSR           0xE000EDF4UL
+#define FAKE_CM_DCRDR           0xE000EDF8UL
+#define FAKE_CM_DEMCR           0xE000EDFCUL
+#define FAKE_CM_VC_CORERESET    (1UL << 0)
+#define FAKE_CM_TRCENA          (1UL << 24)
+#define FAKE_CM_FP_CTRL         0xE0002000UL
+#define FAKE_CM_FP_COMP         0xE0002008UL
+#define FAKE_CM_DWT_CTRL        0xE0001000UL
+#define FAKE_CM_DWT_COMP        0xE0001020UL
+#define FAKE_CM_DWT_MATCHED     (1UL << 24)
+
+typedef struct {
+    /* SW-DP and AP 0 */
+    bool awake;
+    uint32_t select;
+    uint32_t ctrl_stat;
+    uint32_t rdbuff;
+    bool sticky;
+    uint32_t csw;
+    uint32_t tar;
+
+    uint8_t flash[FAKE_CM_MEMORY_SIZE];
+    uint8_t ram[FAKE_CM_MEMORY_SIZE];
+
+    /* Core and debug */
+    uint32_t regs[FAKE_CM_REGISTERS];
+    bool halted;
+    bool debugen;
+    bool maskints;
+    bool regrdy;
+    bool stepped_off;
+    uint32_t dfsr;
+    uint32_t demcr;
+    uint32_t dcrdr;
+    uint32_t fp_ctrl;
+    uint32_t fp_comp[FAKE_CM_FPB_CODE + FAKE_CM_FPB_LITERAL];
+    uint32_t dwt_comp[FAKE_CM_DWT_COMPARATORS];
+    uint32_t dwt_mask[FAKE_CM_DWT_COMPARATORS];
+    uint32_t dwt_function[FAKE_CM_DWT_COMPARATORS];
+    uint32_t resets;
+} FakeCortexM;
+
+static FakeCortexM fake_cm;
+
+DAP_Data_t DAP_Data;
+
+/* One in this many accesses is answered with WAIT; 0 for none */
+static unsigned fake_cm_wait_odds;
+static unsigned fake_cm_wait_seed;
+
+/* Transfers that reached the wire, WAITs included */
+static uint32_t fake_cm_wire;
+static uint32_t fake_cm_bus_errors;
+static uint32_t fake_cm_line_resets;
+
+static inline uint8_t fake_cm_pattern(uint32_t offset, uint8_t salt) {
+    return (uint8_t)(((offset * 2654435761UL) >> 24) ^ salt);
+}
+
+/* Halted on a fresh core with the port unpowered and asleep */
+static inline void fake_cm_reset(unsigned wait_odds, unsigned wait_seed) {
+    memset(&fake_cm, 0, sizeof(fake_cm));
+    for (uint32_t i = 0; i < FAKE_CM_MEMORY_SIZE; i++) {
+        fake_cm.flash[i] = fake_cm_pattern(i, 0x00);
+        fake_cm.ram[i] = fake_cm_pattern(i, 0x5A);
+    }
+    for (uint32_t i = 0; i < 16U; i++) {
+        fake_cm.regs[i] = 0x1000U + i;
+    }
+    fake_cm.regs[15] = FAKE_CM_RESET_PC;
+    fake_cm.regs[16] = 0x01000000UL;
+    fake_cm.fp_ctrl = (FAKE_CM_FPB_LITERAL << 8) | (FAKE_CM_FPB_CODE << 4);
+    fake_cm.regrdy = true;
+
+    fake_cm_wait_odds = wait_odds;
+    fake_cm_wait_seed = wait_seed;
+    fake_cm_wire = 0;
+    fake_cm_bus_errors = 0;
+    fake_cm_line_resets = 0;
+}
+
+/* The bytes behind a memory address, or NULL outside flash and RAM */
+static inline uint8_t* fake_cm_memory(uint32_t address) {
+    if (address - FAKE_CM_FLASH_BASE < FAKE_CM_MEMORY_SIZE) {
+        return &fake_cm.flash[address - FAKE_CM_FLASH_BASE];
+    } else if (address - FAKE_CM_RAM_BASE < FAKE_CM_MEMORY_SIZE) {
+        return &fake_cm.ram[address - FAKE_CM_RAM_BASE];
+    }
+    return NULL;
+}
+
+/* Flag the DWT comparators a data access matches; returns whether any did */
+static inline bool fake_cm_watch(uint32_t address, bool write) {
+    bool hit = false;
+    if (!(fake_cm.demcr & FAKE_CM_TRCENA)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < FAKE_CM_DWT_COMPARATORS; i++) {
+        uint32_t function = fake_cm.dwt_function[i] & 0x0FU;
+        uint32_t ignore = (1UL << fake_cm.dwt_mask[i]) - 1U;
+        if ((function == 7U || function == (write ? 6U : 5U))
+            && ((address ^ fake_cm.dwt_comp[i]) & ~ignore) == 0U) {
+            fake_cm.dwt_function[i] |= FAKE_CM_DWT_MATCHED;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+static inline bool fake_cm_breakpoint(uint32_t pc) {
+    if (!(fake_cm.fp_ctrl & 1U)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < FAKE_CM_FPB_CODE; i++) {
+        uint32_t comp = fake_cm.fp_comp[i];
+        uint32_t replace = (pc & 2U) ? (1UL << 31) : (1UL << 30);
+        if ((comp & 1U) && (comp & 0x1FFFFFFCUL) == (pc & ~3UL) && (comp & replace)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void fake_cm_halt(uint32_t reason) {
+    fake_cm.halted = true;
+    fake_cm.dfsr |= reason;
+}
+
+/* Execute the instruction at PC unless a breakpoint is in the way */
+static inline void fake_cm_execute(void) {
+    uint32_t pc = fake_cm.regs[15];
+    if (!fake_cm.stepped_off && fake_cm_breakpoint(pc)) {
+        fake_cm_halt(FAKE_CM_DFSR_BKPT);
+        return;
+    }
+    fake_cm.stepped_off = false;
+    fake_cm.regs[15] = pc + 2U;
+
+    bool watch = false;
+    if ((pc & 7U) == 2U) {
+        uint32_t value = ++fake_cm.regs[0];
+        memcpy(fake_cm_memory(FAKE_CM_COUNTER), &value, sizeof(value));
+        watch = fake_cm_watch(FAKE_CM_COUNTER, true);
+    } else if ((pc & 7U) == 6U) {
+        memcpy(&fake_cm.regs[1], fake_cm_memory(FAKE_CM_INPUT), sizeof(uint32_t));
+        watch = fake_cm_watch(FAKE_CM_INPUT, false);
+    }
+    if (watch) {
+        fake_cm_halt(FAKE_CM_DFSR_DWTTRAP);
+    }
+}
+
+static inline void fake_cm_leave_halt(void) {
+    fake_cm.halted = false;
+    fake_cm.stepped_off = true;
+}
+
+static inline void fake_cm_write_dhcsr(uint32_t value) {
+    if ((value & 0xFFFF0000UL) != 0xA05F0000UL) {
+        return;
+    }
+    fake_cm.debugen = (value & 1U) != 0U;
+    fake_cm.maskints = (value & 8U) != 0U;
+    if (!fake_cm.debugen) {
+        fake_cm.halted = false;
+    } else if (value & 2U) {
+        if (!fake_cm.halted) {
+            fake_cm_halt(FAKE_CM_DFSR_HALTED);
+        }
+    } else if (fake_cm.halted) {
+        fake_cm_leave_halt();
+        if (value & 4U) {
+            fake_cm_execute();
+            if (!fake_cm.halted) {
+                fake_cm_halt(FAKE_CM_DFSR_HALTED);
+            }
+        }
+    }
+}
+
+static inline void fake_cm_write_dcrsr(uint32_t value) {
+    /* S_REGRDY stays clear for a core that is not halted */
+    fake_cm.regrdy = fake_cm.halted;
+    if (!fake_cm.halted) {
+        return;
+    }
+    uint32_t regsel = value & (FAKE_CM_REGISTERS - 1U);
+    if (value & (1UL << 16)) {
+        fake_cm.regs[regsel] = fake_cm.dcrdr;
+    } else {
+        fake_cm.dcrdr = fake_cm.regs[regsel];
+    }
+}
+
+static inline void fake_cm_system_reset(void) {
+    fake_cm.resets++;
+    memset(fake_cm.regs, 0, sizeof(fake_cm.regs));
+    fake_cm.regs[15] = FAKE_CM_RESET_PC;
+    fake_cm.regs[16] = 0x01000000UL;
+    fake_cm_leave_halt();
+    if (fake_cm.demcr & FAKE_CM_VC_CORERESET) {
+        fake_cm_halt(FAKE_CM_DFSR_VCATCH);
+    }
+}
+
+/* Debug and system registers; returns false if there is none at the address */
+static inline bool fake_cm_system(uint32_t address, uint32_t* data, bool write) {
+    uint32_t value = *data;
+    uint32_t* reg = NULL;
+
+    if (address - FAKE_CM_FP_COMP < 4U * (FAKE_CM_FPB_CODE + FAKE_CM_FPB_LITERAL)) {
+        reg = &fake_cm.fp_comp[(address - FAKE_CM_FP_COMP) / 4U];
+    } else if (address - FAKE_CM_DWT_COMP < 16U * FAKE_CM_DWT_COMPARATORS) {
+        uint32_t n = (address - FAKE_CM_DWT_COMP) / 16U;
+        switch (address & 0x0CU) {
+            case 0x0U:
+                reg = &fake_cm.dwt_comp[n];
+                break;
+            case 0x4U:
+                reg = &fake_cm.dwt_mask[n];
+                if (write && value > FAKE_CM_DWT_MAX_MASK) {
+                    value = FAKE_CM_DWT_MAX_MASK;
+                }
+                break;
+            case 0x8U:
+                reg = &fake_cm.dwt_function[n];
+                if (!write) {
+                    *data = *reg;
+                    *reg &= ~FAKE_CM_DWT_MATCHED;
+                    return true;
+                }
+                value &= 0x0FU;
+                break;
+            default:
+                break;
+        }
+    }
+
+    switch (address) {
+        case FAKE_CM_DHCSR:
+            if (write) {
+                fake_cm_write_dhcsr(value);
+            } else {
+                for (uint32_t i = 0; i < FAKE_CM_BURST && fake_cm.debugen && !fake_cm.halted; i++) {
+                    fake_cm_execute();
+                }
+                *data = (fake_cm.halted ? (1UL << 17) : 0U) | (fake_cm.regrdy ? (1UL << 16) : 0U)
+                      | (fake_cm.maskints ? 8U : 0U) | (fake_cm.halted ? 2U : 0U)
+                      | (fake_cm.debugen ? 1U : 0U);
+            }
+            return true;
+        case FAKE_CM_DCRSR:
+            if (write) {
+                fake_cm_write_dcrsr(value);
+            }
+            return true;
+        case FAKE_CM_DFSR:
+            if (write) {
+                fake_cm.dfsr &= ~value;
+            } else {
+                *data = fake_cm.dfsr;
+            }
+            return true;
+        case FAKE_CM_AIRCR:
+            if (write && value == FAKE_CM_SYSRESETREQ) {
+                fake_cm_system_reset();
+            }
+            return true;
+        case FAKE_CM_FP_CTRL:
+            if (write && (value & 2U)) {
+                fake_cm.fp_ctrl = (fake_cm.fp_ctrl & ~1UL) | (value & 1U);
+            } else if (!write) {
+                *data = fake_cm.fp_ctrl;
+            }
+            return true;
+        case FAKE_CM_DWT_CTRL:
+            if (!write) {
+                *data = FAKE_CM_DWT_COMPARATORS << 28;
+            }
+            return true;
+        case FAKE_CM_DCRDR:
+            reg = &fake_cm.dcrdr;
+            break;
+        case FAKE_CM_DEMCR:
+            reg = &fake_cm.demcr;
+            break;
+        default:
+            break;
+    }
+
+    if (!reg) {
+        return false;
+    } else if (write) {
+        *reg = value;
+    } else {
+        *data = *reg;
+    }
+    return true;
+}
+
+/* One bus access through the AHB-AP; returns false for a bus error */
+static inline bool fake_cm_bus(uint32_t address, uint32_t size, uint32_t* data, bool write) {
+    if (address >= 0xE0000000UL) {
+        return size == 2U && fake_cm_system(address, data, write);
+    }
+
+    /* Flash is read-only */
+    uint8_t* bytes = fake_cm_memory(address & ~3UL);
+    bool flash = (address & ~3UL) - FAKE_CM_FLASH_BASE < FAKE_CM_MEMORY_SIZE;
+    if (!bytes || size > 2U || (write && flash)) {
+        return false;
+    } else if (!write) {
+        memcpy(data, bytes, sizeof(*data));
+        return true;
+    }
+
+    uint32_t lanes = (size == 2U) ? 4U : (1U << size);
+    uint32_t first = address & 3U & ~(lanes - 1U);
+    for (uint32_t i = first; i < first + lanes; i++) {
+        bytes[i] = (uint8_t)(*data >> (8U * i));
+    }
+    return true;
+}
+
+/* AP register access; returns false for a failed bus access */
+static inline bool fake_cm_ap(uint32_t request, uint32_t* data) {
+    uint32_t address = (fake_cm.select & 0xF0U) | (request & (DAP_TRANSFER_A2 | DAP_TRANSFER_A3));
+    bool write = !(request & DAP_TRANSFER_RnW);
+    uint32_t value = *data;
+    bool ok = true;
+
+    if ((fake_cm.select >> 24) != 0U) {
+        /* No AP there: reads as zero, ignores writes */
+        *data = 0;
+        return true;
+    }
+
+    switch (address) {
+        case AP_CSW:
+            if (write) {
+                fake_cm.csw = value;
+            }
+            value = fake_cm.csw;
+            break;
+        case AP_TAR:
+            if (write) {
+                fake_cm.tar = value;
+            }
+            value = fake_cm.tar;
+            break;
+        case AP_DRW: {
+            uint32_t size = fake_cm.csw & 0x07U;
+            ok = fake_cm_bus(fake_cm.tar, size, &value, write);
+            if (((fake_cm.csw >> 4) & 0x03U) == 1U && size <= 2U) {
+                uint32_t tar = fake_cm.tar;
+                fake_cm.tar = (tar & ~0x3FFUL) | ((tar + (1UL << size)) & 0x3FFUL);
+            }
+            break;
+        }
+        case 0x10U: case 0x14U: case 0x18U: case 0x1CU:
+            ok = fake_cm_bus((fake_cm.tar & ~0x0FUL) | (address & 0x0CU), 2U, &value, write);
+            break;
+        case 0xFCU:
+            value = FAKE_CM_AP_IDR;
+            break;
+        default:
+            value = 0;
+            break;
+    }
+
+    if (!write) {
+        *data = ok ? value : 0U;
+    }
+    return ok;
+}
+
+uint8_t SWD_Transfer(uint32_t request, uint32_t* data) {
+    uint32_t scratch = 0;
+    uint32_t address = request & (DAP_TRANSFER_A2 | DAP_TRANSFER_A3);
+    bool read = (request & DAP_TRANSFER_RnW) != 0;
+    bool ap = (request & DAP_TRANSFER_APnDP) != 0;
+    if (!data) {
+        data = &scratch;
+    }
+
+    fake_cm_wire++;
+    if (DAP_Data.debug_port != DAP_PORT_SWD || !fake_cm.awake) {
+        return FAKE_CM_NO_ACK;
+    }
+
+    bool abort = !ap && !read && address == DP_ABORT;
+    if (!abort && fake_cm_wait_odds
+        && (rand_r(&fake_cm_wait_seed) % fake_cm_wait_odds) == 0U) {
+        return DAP_TRANSFER_WAIT;
+    }
+
+    bool exempt = abort || (!ap && read && address != DP_RDBUFF);
+    if (fake_cm.sticky && !exempt) {
+        return DAP_TRANSFER_FAULT;
+    }
+
+    if (ap) {
+        uint32_t value = *data;
+        if (!fake_cm_ap(request, &value)) {
+            fake_cm.sticky = true;
+            fake_cm_bus_errors++;
+        }
+        if (read) {
+            *data = fake_cm.rdbuff;
+            fake_cm.rdbuff = value;
+        }
+        return DAP_TRANSFER_OK;
+    }
+
+    if (read) {
+        switch (address) {
+            case DP_IDCODE:
+                *data = FAKE_CM_IDCODE;
+                break;
+            case DP_CTRL_STAT:
+                *data = fake_cm.ctrl_stat | ((fake_cm.ctrl_stat & 0x50000000UL) << 1)
+                      | (fake_cm.sticky ? FAKE_CM_STICKYERR : 0U);
+                break;
+            default:
+                *data = fake_cm.rdbuff;
+                break;
+        }
+    } else {
+        switch (address) {
+            case DP_ABORT:
+                if (*data & FAKE_CM_STKERRCLR) {
+                    fake_cm.sticky = false;
+                }
+                break;
+            case DP_CTRL_STAT:
+                fake_cm.ctrl_stat = *data & 0x50000F00UL;
+                break;
+            case DP_SELECT:
+                fake_cm.select = *data;
+                break;
+        }
+    }
+    return DAP_TRANSFER_OK;
+}
+
+/* Any sequence counts as the line reset that wakes the DP up */
+void SWJ_Sequence(uint32_t count, const uint8_t* data) {
+    (void)count;
+    (void)data;
+    fake_cm.awake = true;
+    fake_cm.select = 0;
+    fake_cm_line_resets++;
+}
+
+void SWD_shadow_invalidate(void) {
+}
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAKE_SWD_H_INCLUDED
+#define FAKE_SWD_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "DAP/CMSIS_DAP_hal.h"
+#include "DAP/CMSIS_DAP.h"
+#include "DAP/swd_shadow.h"
+
+/*
+ * Host stand-in for SW_DP.c: a simulated SW-DP with two MEM-APs behind
+ * it, at the level of the transfers CMSIS_DAP.c puts on the wire.
+ *
+ * AP reads are posted, so an AP read returns the previous read's data
+ * and RDBUFF the last one. A failed bus access doesn't FAULT itself; it
+ * sets STICKYERR, and from then on every access except IDCODE,
+ * CTRL/STAT and RESEND reads and ABORT writes FAULTs until ABORT clears
+ * it. TAR auto-increment wraps within its 1KB block. Any access other
+ * than an ABORT write may be answered with WAIT, which changes nothing.
+ *
+ * AP 0 sees RAM, read-only flash and a DHCSR; AP 1 has RAM of its own.
+ * Everything else is unmapped. A DHCSR write with the debug key halts
+ * the core or lets it run, and the test decides what a running core
+ * does to memory.
+ */
+
+#define FAKE_SWD_RAM_BASE       0x20000000UL
+#define FAKE_SWD_RAM_WORDS      4096U
+#define FAKE_SWD_FLASH_BASE     0x08000000UL
+#define FAKE_SWD_FLASH_WORDS    1024U
+#define FAKE_SWD_AP1_RAM_BASE   0x00000000UL
+#define FAKE_SWD_AP1_RAM_WORDS  1024U
+#define FAKE_SWD_DHCSR          0xE000EDF0UL
+
+#define FAKE_SWD_IDCODE         0x0BB11477UL
+#define FAKE_SWD_AP_IDR         0x24770011UL
+#define FAKE_SWD_AP_BASE        0xE00FF003UL
+
+#define FAKE_SWD_STICKYERR      (1UL << 5)
+#define FAKE_SWD_STKERRCLR      (1UL << 2)
+#define FAKE_SWD_DHCSR_S_HALT   (1UL << 17)
+#define FAKE_SWD_DHCSR_C_HALT   (1UL << 1)
+#define FAKE_SWD_DHCSR_KEY      0xA05F0000UL
+
+typedef struct {
+    uint32_t select;
+    uint32_t ctrl_stat;
+    uint32_t rdbuff;
+    bool sticky;
+    uint32_t csw[2];
+    uint32_t tar[2];
+    uint32_t ram[FAKE_SWD_RAM_WORDS];
+    uint32_t flash[FAKE_SWD_FLASH_WORDS];
+    uint32_t ap1_ram[FAKE_SWD_AP1_RAM_WORDS];
+    uint32_t dhcsr;
+} FakeSwdTarget;
+
+static FakeSwdTarget fake_swd;
+
+/* One in this many accesses is answered with WAIT; 0 for none */
+static unsigned fake_swd_wait_odds;
+static unsigned fake_swd_wait_seed;
+
+/* Transfers that reached the wire, WAITs included */
+static uint32_t fake_swd_wire;
+static uint32_t fake_swd_ap_accesses;
+static uint32_t fake_swd_line_resets;
+
+static inline void fake_swd_reset(unsigned wait_odds, unsigned wait_seed) {
+    memset(&fake_swd, 0, sizeof(fake_swd));
+    for (uint32_t i = 0; i < FAKE_SWD_FLASH_WORDS; i++) {
+        fake_swd.flash[i] = 0x08000000UL ^ (i * 0x9E3779B9UL);
+    }
+    fake_swd.dhcsr = FAKE_SWD_DHCSR_S_HALT;
+    fake_swd_wait_odds = wait_odds;
+    fake_swd_wait_seed = wait_seed;
+    fake_swd_wire = 0;
+    fake_swd_ap_accesses = 0;
+    fake_swd_line_resets = 0;
+}
+
+/* The word behind a bus address, or NULL for a bus error */
+static inline uint32_t* fake_swd_word(uint8_t ap, uint32_t address, bool write) {
+    if (ap == 0U) {
+        if (address - FAKE_SWD_RAM_BASE < 4U * FAKE_SWD_RAM_WORDS) {
+            return &fake_swd.ram[(address - FAKE_SWD_RAM_BASE) / 4U];
+        } else if (address - FAKE_SWD_FLASH_BASE < 4U * FAKE_SWD_FLASH_WORDS) {
+            return write ? NULL : &fake_swd.flash[(address - FAKE_SWD_FLASH_BASE) / 4U];
+        } else if ((address & ~3UL) == FAKE_SWD_DHCSR) {
+            return &fake_swd.dhcsr;
+        }
+    } else if (address - FAKE_SWD_AP1_RAM_BASE < 4U * FAKE_SWD_AP1_RAM_WORDS) {
+        return &fake_swd.ap1_ram[(address - FAKE_SWD_AP1_RAM_BASE) / 4U];
+    }
+    return NULL;
+}
+
+static inline bool fake_swd_bus(uint8_t ap, uint32_t address, uint32_t size,
+                                uint32_t* data, bool write) {
+    uint32_t* word = fake_swd_word(ap, address, write);
+    if (!word || size > 2U) {
+        return false;
+    } else if (!write) {
+        *data = *word;
+        return true;
+    } else if (word == &fake_swd.dhcsr) {
+        if (size == 2U && (*data & 0xFFFF0000UL) == FAKE_SWD_DHCSR_KEY) {
+            fake_swd.dhcsr = (*data & 0x0FU)
+                           | ((*data & FAKE_SWD_DHCSR_C_HALT) ? FAKE_SWD_DHCSR_S_HALT : 0U);
+        }
+        return true;
+    }
+
+    uint32_t mask = 0xFFFFFFFFUL;
+    if (size == 0U) {
+        mask = 0xFFUL << (8U * (address & 3U));
+    } else if (size == 1U) {
+        mask = 0xFFFFUL << (8U * (address & 2U));
+    }
+    *word = (*word & ~mask) | (*data & mask);
+    return true;
+}
+
+/* AP register access; returns false for a failed bus access */
+static inline bool fake_swd_ap(uint32_t request, uint32_t* data) {
+    uint8_t apsel = (uint8_t)(fake_swd.select >> 24);
+    uint32_t address = (fake_swd.select & 0xF0U) | (request & (DAP_TRANSFER_A2 | DAP_TRANSFER_A3));
+    bool write = !(request & DAP_TRANSFER_RnW);
+    uint32_t value = 0;
+
+    fake_swd_ap_accesses++;
+    if (apsel > 1U) {
+        /* No AP there: reads as zero, ignores writes */
+        *data = 0;
+        return true;
+    }
+
+    uint32_t* csw = &fake_swd.csw[apsel];
+    uint32_t* tar = &fake_swd.tar[apsel];
+    bool ok = true;
+    switch (address) {
+        case AP_CSW:
+            if (write) {
+                *csw = *data;
+            }
+            value = *csw;
+            break;
+        case AP_TAR:
+            if (write) {
+                *tar = *data;
+            }
+            value = *tar;
+            break;
+        case AP_DRW: {
+            uint32_t size = *csw & 0x07U;
+            value = *data;
+            ok = fake_swd_bus(apsel, *tar, size, &value, write);
+            uint32_t increment = 0;
+            switch ((*csw >> 4) & 0x03U) {
+                case 1U: increment = (size <= 2U) ? (1UL << size) : 0U; break;
+                case 2U: increment = 4U; break;
+            }
+            *tar = (*tar & ~0x3FFUL) | ((*tar + increment) & 0x3FFUL);
+            break;
+        }
+        case 0x10U: case 0x14U: case 0x18U: case 0x1CU:
+            value = *data;
+            ok = fake_swd_bus(apsel, (*tar & ~0x0FUL) | (address & 0x0CU), 2U, &value, write);
+            break;
+        case 0xF8U:
+            value = FAKE_SWD_AP_BASE;
+            break;
+        case 0xFCU:
+            value = FAKE_SWD_AP_IDR;
+            break;
+    }
+
+    if (!write) {
+        *data = ok ? value : 0U;
+    }
+    return ok;
+}
+
+static inline uint8_t fake_swd_transfer(uint32_t request, uint32_t* data) {
+    uint32_t scratch = 0;
+    uint32_t address = request & (DAP_TRANSFER_A2 | DAP_TRANSFER_A3);
+    bool read = (request & DAP_TRANSFER_RnW) != 0;
+    bool ap = (request & DAP_TRANSFER_APnDP) != 0;
+    if (!data) {
+        data = &scratch;
+    }
+
+    fake_swd_wire++;
+    if (request & DAP_TRANSFER_TIMESTAMP) {
+        DAP_Data.timestamp = TIMESTAMP_GET();
+    }
+
+    bool abort = !ap && !read && address == DP_ABORT;
+    if (!abort && fake_swd_wait_odds
+        && (rand_r(&fake_swd_wait_seed) % fake_swd_wait_odds) == 0U) {
+        return DAP_TRANSFER_WAIT;
+    }
+
+    bool exempt = abort || (!ap && read && address != DP_RDBUFF);
+    if (fake_swd.sticky && !exempt) {
+        return DAP_TRANSFER_FAULT;
+    }
+
+    if (ap) {
+        uint32_t value = *data;
+        if (!fake_swd_ap(request, &value)) {
+            fake_swd.sticky = true;
+        }
+        if (read) {
+            *data = fake_swd.rdbuff;
+            fake_swd.rdbuff = value;
+        }
+        return DAP_TRANSFER_OK;
+    }
+
+    if (read) {
+        switch (address) {
+            case DP_IDCODE:
+                *data = FAKE_SWD_IDCODE;
+                break;
+            case DP_CTRL_STAT:
+                *data = fake_swd.ctrl_stat | ((fake_swd.ctrl_stat & 0x50000000UL) << 1)
+                      | (fake_swd.sticky ? FAKE_SWD_STICKYERR : 0U);
+                break;
+            default:
+                *data = fake_swd.rdbuff;
+                break;
+        }
+    } else {
+        switch (address) {
+            case DP_ABORT:
+                if (*data & FAKE_SWD_STKERRCLR) {
+                    fake_swd.sticky = false;
+                }
+                break;
+            case DP_CTRL_STAT:
+                fake_swd.ctrl_stat = *data & 0x50000F00UL;
+                break;
+            case DP_SELECT:
+                fake_swd.select = *data;
+                break;
+        }
+    }
+    return DAP_TRANSFER_OK;
+}
+
+/* Mirrors SWD_TransferRaw() and SWD_Transfer() in SW_DP.c */
+uint8_t SWD_TransferRaw(uint32_t request, uint32_t* data) {
+    uint8_t ack = fake_swd_transfer(request, data);
+    SWD_shadow_update(request, data, ack);
+    return ack;
+}
+
+uint8_t SWD_Transfer(uint32_t request, uint32_t* data) {
+    return SWD_shadow_transfer(request, data);
+}
+
+/* Any sequence may have been a line reset or a reconnect */
+void SWJ_Sequence(uint32_t count, const uint8_t* data) {
+    (void)count;
+    (void)data;
+    SWD_shadow_invalidate();
+    fake_swd.select = 0;
+    fake_swd_line_resets++;
+}
+
+void SWD_Sequence(uint32_t info, const uint8_t* swdo, uint8_t* swdi) {
+    (void)swdo;
+    if (info & SWD_SEQUENCE_DIN) {
+        memset(swdi, 0, ((info & SWD_SEQUENCE_CLK) + 7U) / 8U);
+    }
+    SWD_shadow_invalidate();
+}
+
+void SWD_health_record(uint32_t request, uint8_t ack) {
+    (void)request;
+    (void)ack;
+}
+
+void SWD_health_match_exhausted(void) {
+}
+
+uint8_t DAP_GetVendorString(char* str) {
+    (void)str;
+    return 0;
+}
+
+uint8_t DAP_GetProductString(char* str) {
+    (void)str;
+    return 0;
+}
+
+uint8_t DAP_GetSerNumString(char* str) {
+    (void)str;
+    return 0;
+}
+
+static inline uint32_t fake_swd_hash(uint32_t hash, const uint32_t* words, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ words[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+/*
+ * Digest of everything about the target that the host could observe;
+ * RDBUFF only counts for a host that reads it without posting a read.
+ */
+static inline uint32_t fake_swd_digest(bool rdbuff) {
+    uint32_t dp[4] = {
+        fake_swd.select, fake_swd.ctrl_stat, rdbuff ? fake_swd.rdbuff : 0U, fake_swd.sticky
+    };
+    uint32_t hash = fake_swd_hash(2166136261UL, dp, 4);
+    hash = fake_swd_hash(hash, fake_swd.csw, 2);
+    hash = fake_swd_hash(hash, fake_swd.tar, 2);
+    hash = fake_swd_hash(hash, fake_swd.ram, FAKE_SWD_RAM_WORDS);
+    hash = fake_swd_hash(hash, fake_swd.ap1_ram, FAKE_SWD_AP1_RAM_WORDS);
+    return fake_swd_hash(hash, &fake_swd.dhcsr, 1);
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FAKE_USB_H_INCLUDED
+#define FAKE_USB_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+
+#include "USB/usb_common.h"
+
+/*
+ * Host stand-in for the USB device stack and composite_usb_conf.c. The
+ * test plays the USB host: it hands OUT packets to the endpoint
+ * callbacks, collects what was written to the IN endpoints and makes
+ * control requests to the registered vendor callbacks.
+ *
+ * An OUT endpoint that is NAKed refuses packets. An IN endpoint holds
+ * one packet until the host collects it, and writes to it fail until
+ * then, like a single-buffered endpoint.
+ */
+
+#define FAKE_USB_ENDPOINTS      8
+#define FAKE_USB_MAX_PACKET     64
+#define FAKE_USB_INTERFACES     8
+
+typedef struct {
+    usbd_endpoint_callback callback;
+    bool nak;
+    uint8_t data[FAKE_USB_MAX_PACKET];
+    uint16_t len;
+    bool full;
+} FakeUsbEndpoint;
+
+static FakeUsbEndpoint fake_usb_out[FAKE_USB_ENDPOINTS];
+static FakeUsbEndpoint fake_usb_in[FAKE_USB_ENDPOINTS];
+
+static bool fake_usb_configured = true;
+static usbd_set_config_callback fake_usb_set_config;
+static GenericCallback fake_usb_reset_callback;
+static usbd_control_callback fake_usb_vendor[FAKE_USB_INTERFACES];
+
+/* Anything to stand in for the device; the drivers only pass it on */
+static usbd_device* const fake_usb_device = (usbd_device*)&fake_usb_out;
+
+static inline void fake_usb_reset(void) {
+    memset(fake_usb_out, 0, sizeof(fake_usb_out));
+    memset(fake_usb_in, 0, sizeof(fake_usb_in));
+    memset(fake_usb_vendor, 0, sizeof(fake_usb_vendor));
+    fake_usb_configured = true;
+    fake_usb_set_config = NULL;
+    fake_usb_reset_callback = NULL;
+}
+
+/* Host to device; returns false if the endpoint NAKed the packet */
+static inline bool fake_usb_host_out(uint8_t ep, const void* data, uint16_t len) {
+    FakeUsbEndpoint* endpoint = &fake_usb_out[ep & 0x7F];
+    if (endpoint->nak || !endpoint->callback || len > FAKE_USB_MAX_PACKET) {
+        return false;
+    }
+    memcpy(endpoint->data, data, len);
+    endpoint->len = len;
+    endpoint->full = true;
+    endpoint->callback(fake_usb_device, ep);
+    endpoint->full = false;
+    return true;
+}
+
+/* Device to host; returns the packet length, or 0 if there was none */
+static inline uint16_t fake_usb_host_in(uint8_t ep, void* data) {
+    FakeUsbEndpoint* endpoint = &fake_usb_in[ep & 0x7F];
+    if (!endpoint->full) {
+        return 0;
+    }
+    memcpy(data, endpoint->data, endpoint->len);
+    endpoint->full = false;
+    return endpoint->len;
+}
+
+static inline enum usbd_request_return_codes
+fake_usb_host_control(uint16_t interface, uint8_t request, uint16_t value,
+                      uint8_t* buf, uint16_t* len) {
+    struct usb_setup_data req = {
+        .bmRequestType = 0x41, .bRequest = request,
+        .wValue = value, .wIndex = interface, .wLength = *len,
+    };
+    if (interface >= FAKE_USB_INTERFACES || !fake_usb_vendor[interface]) {
+        return USBD_REQ_NOTSUPP;
+    }
+    return fake_usb_vendor[interface](fake_usb_device, &req, &buf, len, NULL);
+}
+
+void usbd_ep_setup(usbd_device* usbd_dev, uint8_t addr, uint8_t type,
+                   uint16_t max_size, usbd_endpoint_callback callback) {
+    (void)usbd_dev;
+    (void)type;
+    (void)max_size;
+    FakeUsbEndpoint* endpoint = (addr & 0x80) ? &fake_usb_in[addr & 0x7F]
+                                              : &fake_usb_out[addr & 0x7F];
+    memset(endpoint, 0, sizeof(*endpoint));
+    endpoint->callback = callback;
+}
+
+uint16_t usbd_ep_write_packet(usbd_device* usbd_dev, uint8_t addr,
+                              const void* buf, uint16_t len) {
+    (void)usbd_dev;
+    FakeUsbEndpoint* endpoint = &fake_usb_in[addr & 0x7F];
+    if (endpoint->full || len > FAKE_USB_MAX_PACKET) {
+        return 0;
+    }
+    memcpy(endpoint->data, buf, len);
+    endpoint->len = len;
+    endpoint->full = true;
+    return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device* usbd_dev, uint8_t addr,
+                             void* buf, uint16_t len) {
+    (void)usbd_dev;
+    FakeUsbEndpoint* endpoint = &fake_usb_out[addr & 0x7F];
+    if (!endpoint->full) {
+        return 0;
+    }
+    if (len > endpoint->len) {
+        len = endpoint->len;
+    }
+    memcpy(buf, endpoint->data, len);
+    return len;
+}
+
+void usbd_ep_nak_set(usbd_device* usbd_dev, uint8_t addr, uint8_t nak) {
+    (void)usbd_dev;
+    fake_usb_out[addr & 0x7F].nak = (nak != 0);
+}
+
+bool cmp_usb_configured(void) {
+    return fake_usb_configured;
+}
+
+void cmp_usb_register_control_vendor_callback(uint16_t interface,
+                                              usbd_control_callback callback) {
+    if (interface < FAKE_USB_INTERFACES) {
+        fake_usb_vendor[interface] = callback;
+    }
+}
+
+void cmp_usb_register_set_config_callback(usbd_set_config_callback callback) {
+    fake_usb_set_config = callback;
+}
+
+void cmp_usb_register_reset_callback(GenericCallback callback) {
+    fake_usb_reset_callback = callback;
+}
+
+/* What the host does on enumeration */
+static inline void fake_usb_enumerate(void) {
+    if (fake_usb_set_config) {
+        fake_usb_set_config(fake_usb_device, 1);
+    }
+}
+
+#endif
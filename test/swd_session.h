@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWD_SESSION_H_INCLUDED
+#define SWD_SESSION_H_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "fake_swd.h"
+
+/*
+ * A debug host for the simulated target in fake_swd.h: builds CMSIS-DAP
+ * requests, runs them through DAP_ProcessCommand(), and plays random
+ * sessions of the kind pyOCD and OpenOCD produce, so that a session can
+ * be replayed with an optimization on and off and the two compared.
+ */
+
+#define CSW_WORD            0x23000002UL
+#define CSW_WORD_INC        0x23000012UL
+#define CSW_WORD_PACKED     0x23000022UL
+#define CSW_HALF_INC        0x23000011UL
+#define CSW_BYTE_INC        0x23000010UL
+#define CSW_BYTE            0x23000000UL
+
+#define REQ_AP_WRITE(reg)   (DAP_TRANSFER_APnDP | (reg))
+#define REQ_AP_READ(reg)    (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | (reg))
+#define REQ_DP_WRITE(reg)   (reg)
+#define REQ_DP_READ(reg)    (DAP_TRANSFER_RnW | (reg))
+
+#define ABORT_CLEAR_ALL     0x1EUL
+
+#define SESSION_RETRIES     1000U
+#define SESSION_MATCH_RETRIES 3U
+
+typedef struct {
+    uint8_t data[DAP_PACKET_SIZE];
+    uint32_t length;
+    uint32_t response;      /* Response bytes the request may need */
+} Packet;
+
+static uint8_t session_response[DAP_PACKET_SIZE];
+static uint32_t session_response_length;
+
+static void transfer_begin(Packet* packet) {
+    packet->data[0] = ID_DAP_Transfer;
+    packet->data[1] = 0;
+    packet->data[2] = 0;
+    packet->length = 3;
+    packet->response = 3;
+}
+
+static bool transfer_add(Packet* packet, uint8_t request, uint32_t value) {
+    bool read = (request & DAP_TRANSFER_RnW) != 0;
+    bool match = (request & DAP_TRANSFER_MATCH_VALUE) != 0;
+    uint32_t length = 1U + ((!read || match) ? 4U : 0U);
+    uint32_t response = ((read && !match) ? 4U : 0U)
+                      + ((request & DAP_TRANSFER_TIMESTAMP) ? 4U : 0U);
+    if (packet->length + length > DAP_PACKET_SIZE
+        || packet->response + response > DAP_PACKET_SIZE
+        || packet->data[2] == UINT8_MAX) {
+        return false;
+    }
+
+    packet->data[packet->length++] = request;
+    if (!read || match) {
+        memcpy(&packet->data[packet->length], &value, 4);
+        packet->length += 4;
+    }
+    packet->response += response;
+    packet->data[2]++;
+    return true;
+}
+
+/* Block transfer of one register; values are only used for writes */
+static bool block_build(Packet* packet, uint8_t request, uint16_t count, const uint32_t* values) {
+    bool read = (request & DAP_TRANSFER_RnW) != 0;
+    uint32_t length = 5U + (read ? 0U : 4U * count);
+    if (length > DAP_PACKET_SIZE || 3U + (read ? 4U * count : 0U) > DAP_PACKET_SIZE) {
+        return false;
+    }
+    packet->data[0] = ID_DAP_TransferBlock;
+    packet->data[1] = 0;
+    packet->data[2] = (uint8_t)count;
+    packet->data[3] = (uint8_t)(count >> 8);
+    packet->data[4] = request;
+    packet->length = 5;
+    if (!read) {
+        memcpy(&packet->data[5], values, 4U * count);
+        packet->length += 4U * count;
+    }
+    packet->response = 3U + (read ? 4U * count : 0U);
+    return true;
+}
+
+static uint32_t session_execute(const uint8_t* request) {
+    memset(session_response, 0xA5, sizeof(session_response));
+    uint32_t result = DAP_ProcessCommand(request, session_response);
+    session_response_length = result & 0xFFFFU;
+    CHECK(session_response_length <= DAP_PACKET_SIZE);
+    return session_response_length;
+}
+
+static uint32_t session_send(const Packet* packet) {
+    return session_execute(packet->data);
+}
+
+/* Transfer status and count from the last response */
+static uint8_t transfer_status(void) {
+    return session_response[2];
+}
+
+static uint8_t transfer_count(void) {
+    return session_response[1];
+}
+
+static uint32_t transfer_word(uint32_t index) {
+    uint32_t value;
+    memcpy(&value, &session_response[3 + 4 * index], 4);
+    return value;
+}
+
+static void session_shadow(uint8_t flags) {
+    uint8_t request[3] = { ID_DAP_SWDShadow, SWD_SHADOW_CONFIGURE, flags };
+    uint8_t response[16];
+    CHECK_EQ(SWD_shadow_vendor_command(request, response), (3U << 16) | 2U);
+    CHECK_EQ(response[1], DAP_OK);
+}
+
+static uint32_t session_elided(void) {
+    uint8_t request[2] = { ID_DAP_SWDShadow, SWD_SHADOW_READ_STATUS };
+    uint8_t response[16];
+    uint32_t elided;
+    SWD_shadow_vendor_command(request, response);
+    memcpy(&elided, &response[3], 4);
+    return elided;
+}
+
+/* Fresh target and probe, connected over SWD */
+static void session_connect(uint8_t shadow_flags, unsigned wait_odds, unsigned wait_seed) {
+    const uint8_t connect[] = { ID_DAP_Connect, DAP_PORT_SWD };
+    const uint8_t configure[] = {
+        ID_DAP_TransferConfigure, 0,
+        (uint8_t)SESSION_RETRIES, (uint8_t)(SESSION_RETRIES >> 8),
+        (uint8_t)SESSION_MATCH_RETRIES, (uint8_t)(SESSION_MATCH_RETRIES >> 8),
+    };
+    const uint8_t clear[] = { ID_DAP_SWDShadow, SWD_SHADOW_CLEAR_COUNT };
+    uint8_t response[16];
+
+    /* As after power-up */
+    memset(&DAP_Data, 0, sizeof(DAP_Data));
+    DAP_Setup();
+    fake_swd_reset(wait_odds, wait_seed);
+    session_shadow(shadow_flags);
+    SWD_shadow_vendor_command(clear, response);
+    session_execute(connect);
+    session_execute(configure);
+    fake_swd_wire = 0;
+}
+
+/*
+ * Random host. Its choices only depend on its own seed, never on what
+ * the target answers, so the same seed replays the same session.
+ */
+
+/* Whether the host reads RDBUFF other than for a posted read */
+static bool host_reads_rdbuff = true;
+
+typedef struct {
+    unsigned seed;
+    uint8_t ap;
+    uint32_t csw;
+    uint32_t address;
+    bool reset;             /* The last command was a line reset */
+} Host;
+
+static uint32_t host_random(Host* host, uint32_t range) {
+    return (uint32_t)rand_r(&host->seed) % range;
+}
+
+static uint32_t host_address(Host* host) {
+    uint32_t roll = host_random(host, 100);
+    if (host->ap == 1U) {
+        return (roll < 97) ? FAKE_SWD_AP1_RAM_BASE + 4U * host_random(host, FAKE_SWD_AP1_RAM_WORDS)
+                           : 0x00100000UL;
+    } else if (roll < 70) {
+        return FAKE_SWD_RAM_BASE + 4U * host_random(host, FAKE_SWD_RAM_WORDS);
+    } else if (roll < 88) {
+        /* Just below a 1KB boundary, where auto-increment stops */
+        return FAKE_SWD_RAM_BASE + 1024U * (1U + host_random(host, 15))
+             - 4U * (1U + host_random(host, 4));
+    } else if (roll < 94) {
+        return FAKE_SWD_FLASH_BASE + 4U * host_random(host, FAKE_SWD_FLASH_WORDS);
+    } else if (roll < 97) {
+        return FAKE_SWD_DHCSR;
+    }
+    return 0x30000000UL + 4U * host_random(host, 64);
+}
+
+static uint32_t host_csw(Host* host) {
+    static const uint32_t csws[] = {
+        CSW_WORD_INC, CSW_WORD_INC, CSW_WORD_INC, CSW_WORD, CSW_WORD,
+        CSW_WORD_PACKED, CSW_HALF_INC, CSW_BYTE_INC, CSW_BYTE,
+    };
+    return csws[host_random(host, sizeof(csws) / sizeof(csws[0]))];
+}
+
+static uint32_t host_select(Host* host) {
+    uint32_t roll = host_random(host, 100);
+    uint32_t bank = (roll < 90) ? 0x00U : (roll < 97) ? 0x10U : 0xF0U;
+    return ((uint32_t)host->ap << 24) | bank;
+}
+
+/* Mostly keep the AP and CSW, as a host going about its business does */
+static void host_move(Host* host) {
+    if (host_random(host, 10) == 0) {
+        host->ap ^= 1U;
+    }
+    if (host_random(host, 4) == 0) {
+        host->csw = host_csw(host);
+    }
+    host->address = host_address(host);
+}
+
+/* SELECT, CSW and TAR as the host sets them up before a memory access */
+static void host_prologue(Host* host, Packet* packet) {
+    transfer_add(packet, REQ_DP_WRITE(DP_SELECT), (uint32_t)host->ap << 24);
+    transfer_add(packet, REQ_AP_WRITE(AP_CSW), host->csw);
+    transfer_add(packet, REQ_AP_WRITE(AP_TAR), host->address);
+}
+
+static uint8_t host_timestamp(Host* host) {
+    return (host_random(host, 40) == 0) ? DAP_TRANSFER_TIMESTAMP : 0U;
+}
+
+static void host_random_op(Host* host, Packet* packet) {
+    uint8_t ts = host_timestamp(host);
+    switch (host_random(host, 22)) {
+        case 0: case 1:
+            transfer_add(packet, REQ_DP_WRITE(DP_SELECT) | ts, host_select(host));
+            break;
+        case 2: case 3:
+            transfer_add(packet, REQ_AP_WRITE(AP_CSW) | ts,
+                         host_random(host, 2) ? host->csw : host_csw(host));
+            break;
+        case 4: case 5:
+            transfer_add(packet, REQ_AP_WRITE(AP_TAR) | ts,
+                         host_random(host, 2) ? host->address : host_address(host));
+            break;
+        case 6: case 7:
+            transfer_add(packet, REQ_AP_READ(AP_DRW) | ts, 0);
+            break;
+        case 8:
+            transfer_add(packet, REQ_AP_WRITE(AP_DRW) | ts, (uint32_t)rand_r(&host->seed));
+            break;
+        case 9:
+            transfer_add(packet, REQ_AP_READ(host_random(host, 4) << 2) | ts, 0);
+            break;
+        case 10:
+            transfer_add(packet, REQ_AP_WRITE(host_random(host, 4) << 2) | ts,
+                         (uint32_t)rand_r(&host->seed));
+            break;
+        case 11:
+            transfer_add(packet, REQ_DP_READ(host_reads_rdbuff ? DP_RDBUFF : DP_CTRL_STAT) | ts, 0);
+            break;
+        case 12:
+            transfer_add(packet, REQ_DP_READ(DP_CTRL_STAT) | ts, 0);
+            break;
+        case 13:
+            transfer_add(packet, REQ_DP_READ(DP_IDCODE) | ts, 0);
+            break;
+        case 14:
+            transfer_add(packet, REQ_DP_WRITE(DP_ABORT), ABORT_CLEAR_ALL);
+            break;
+        case 15:
+            transfer_add(packet, REQ_DP_WRITE(DP_CTRL_STAT) | ts, 0x50000000UL);
+            break;
+        case 16:
+            transfer_add(packet, DAP_TRANSFER_MATCH_MASK, host_random(host, 2) ? 0xFFFFFFFFUL : 0x00020000UL);
+            break;
+        case 17:
+            transfer_add(packet, REQ_AP_READ(AP_DRW) | DAP_TRANSFER_MATCH_VALUE,
+                         host_random(host, 2) ? FAKE_SWD_DHCSR_S_HALT : 0U);
+            break;
+        case 18:
+            transfer_add(packet, REQ_DP_READ(DP_CTRL_STAT) | DAP_TRANSFER_MATCH_VALUE, 0xF0000000UL);
+            break;
+        default:
+            /* Another round of the same setup, likely to be redundant */
+            host_prologue(host, packet);
+            break;
+    }
+}
+
+static void host_transfer(Host* host, Packet* packet) {
+    transfer_begin(packet);
+    uint32_t roll = host_random(host, 100);
+    if (roll < 35) {
+        /* Memory access: setup, then a few DRW accesses */
+        host_move(host);
+        host_prologue(host, packet);
+        bool write = host_random(host, 3) == 0;
+        uint32_t count = 1U + host_random(host, 10);
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t request = write ? REQ_AP_WRITE(AP_DRW) : REQ_AP_READ(AP_DRW);
+            if (!transfer_add(packet, request | host_timestamp(host), (uint32_t)rand_r(&host->seed))) {
+                break;
+            }
+        }
+    } else if (roll < 55) {
+        /* TAR write + DRW access pairs over consecutive words */
+        host_move(host);
+        transfer_add(packet, REQ_DP_WRITE(DP_SELECT), (uint32_t)host->ap << 24);
+        transfer_add(packet, REQ_AP_WRITE(AP_CSW), host_random(host, 4) ? CSW_WORD : host->csw);
+        bool write = host_random(host, 3) == 0;
+        uint32_t count = 1U + host_random(host, 12);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t address = host->address + 4U * i;
+            if (host_random(host, 30) == 0) {
+                address += 4U;
+            }
+            if (!transfer_add(packet, REQ_AP_WRITE(AP_TAR), address)) {
+                break;
+            }
+            uint8_t request = write ? REQ_AP_WRITE(AP_DRW) : REQ_AP_READ(AP_DRW);
+            if (!transfer_add(packet, request, (uint32_t)rand_r(&host->seed))) {
+                break;
+            }
+        }
+    } else if (roll < 65) {
+        /* Poll DHCSR for the core to halt */
+        transfer_add(packet, REQ_DP_WRITE(DP_SELECT), 0);
+        transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD);
+        transfer_add(packet, REQ_AP_WRITE(AP_TAR), FAKE_SWD_DHCSR);
+        if (host_random(host, 2)) {
+            transfer_add(packet, DAP_TRANSFER_MATCH_MASK, FAKE_SWD_DHCSR_S_HALT);
+            transfer_add(packet, REQ_AP_READ(AP_DRW) | DAP_TRANSFER_MATCH_VALUE, FAKE_SWD_DHCSR_S_HALT);
+        } else {
+            transfer_add(packet, REQ_AP_READ(AP_DRW), 0);
+        }
+    } else {
+        uint32_t count = 1U + host_random(host, 12);
+        for (uint32_t i = 0; i < count; i++) {
+            host_random_op(host, packet);
+        }
+    }
+}
+
+static void host_block(Host* host, Packet* packet) {
+    uint32_t values[16];
+    for (uint32_t i = 0; i < 16; i++) {
+        values[i] = (uint32_t)rand_r(&host->seed);
+    }
+
+    uint16_t count = (uint16_t)(1U + host_random(host, 14));
+    switch (host_random(host, 8)) {
+        case 0: case 1: case 2:
+            block_build(packet, REQ_AP_READ(AP_DRW), count, NULL);
+            break;
+        case 3: case 4:
+            block_build(packet, REQ_AP_WRITE(AP_DRW), count, values);
+            break;
+        case 5:
+            /* The same setup value over and over */
+            for (uint32_t i = 0; i < count; i++) {
+                values[i] = host->address;
+            }
+            block_build(packet, REQ_AP_WRITE(AP_TAR), count, values);
+            break;
+        case 6:
+            block_build(packet, REQ_DP_READ(DP_CTRL_STAT), count, NULL);
+            break;
+        default:
+            block_build(packet, REQ_DP_READ(host_reads_rdbuff ? DP_RDBUFF : DP_CTRL_STAT), count, NULL);
+            break;
+    }
+}
+
+/* One random command of a session */
+static void host_command(Host* host, Packet* packet) {
+    uint32_t roll = host_random(host, 100);
+    if (host->reset) {
+        /* Reconnect: IDCODE first, clear any errors, and SELECT is unknown */
+        transfer_begin(packet);
+        transfer_add(packet, REQ_DP_READ(DP_IDCODE), 0);
+        transfer_add(packet, REQ_DP_WRITE(DP_ABORT), ABORT_CLEAR_ALL);
+        transfer_add(packet, REQ_DP_WRITE(DP_SELECT), (uint32_t)host->ap << 24);
+        host->reset = false;
+    } else if (roll < 68) {
+        host_transfer(host, packet);
+    } else if (roll < 90) {
+        host_block(host, packet);
+    } else if (roll < 97) {
+        uint32_t abort = host_random(host, 4) ? ABORT_CLEAR_ALL : 0x01UL;
+        packet->data[0] = ID_DAP_WriteABORT;
+        packet->data[1] = 0;
+        memcpy(&packet->data[2], &abort, 4);
+        packet->length = 6;
+    } else {
+        /* Line reset */
+        packet->data[0] = ID_DAP_SWJ_Sequence;
+        packet->data[1] = 51;
+        memset(&packet->data[2], 0xFF, 7);
+        packet->length = 9;
+        host->reset = true;
+    }
+}
+
+/*
+ * Replaying a session with an optimization on and off. Responses and
+ * target state must be identical, with one exception: a match read
+ * that FAULTs also reports a MISMATCH or not depending on whatever
+ * CMSIS_DAP.c last stored in its data word.
+ */
+#define SESSION_MAX_COMMANDS 4000U
+
+typedef struct {
+    uint8_t response[DAP_PACKET_SIZE];
+    uint32_t length;
+    uint32_t digest;
+} SessionStep;
+
+static SessionStep session_steps[SESSION_MAX_COMMANDS];
+
+typedef struct {
+    uint32_t mismatches;
+    uint32_t faults;
+    uint32_t wire;
+} SessionResult;
+
+/*
+ * Whether the optimized side owes the target nothing that it will only
+ * write before the next transfer; target state is compared only then.
+ */
+static bool (*session_settled)(void);
+
+/* Commands of the session, if not just host_command() */
+static void (*session_host)(Host* host, Packet* packet);
+
+/* Runs between commands, as the probe's main loop does while idle */
+static void (*session_idle)(void);
+
+/* Target state, and the match mask that the host set */
+static uint32_t session_digest(void) {
+    return fake_swd_digest(host_reads_rdbuff) ^ DAP_Data.transfer.match_mask;
+}
+
+static bool session_same_response(const SessionStep* step, uint8_t command) {
+    if (step->length != session_response_length) {
+        return false;
+    }
+
+    uint32_t status = (command == ID_DAP_TransferBlock) ? 3U : 2U;
+    for (uint32_t i = 0; i < step->length; i++) {
+        uint8_t expected = step->response[i];
+        uint8_t actual = session_response[i];
+        if (i == status && (command == ID_DAP_Transfer || command == ID_DAP_TransferBlock)
+            && (expected & actual & DAP_TRANSFER_FAULT)) {
+            expected &= ~DAP_TRANSFER_MISMATCH;
+            actual &= ~DAP_TRANSFER_MISMATCH;
+        }
+        if (expected != actual) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Runs a session, recording it if compare is false, checking it against the recording otherwise */
+static SessionResult session_run(unsigned seed, uint32_t commands, void (*setup)(void), bool compare) {
+    SessionResult result = { 0, 0, 0 };
+    Host host = { seed, 0, CSW_WORD_INC, FAKE_SWD_RAM_BASE, false };
+    Packet packet;
+
+    setup();
+    for (uint32_t i = 0; i < commands && i < SESSION_MAX_COMMANDS; i++) {
+        SessionStep* step = &session_steps[i];
+        if (session_host) {
+            session_host(&host, &packet);
+        } else {
+            host_command(&host, &packet);
+        }
+        session_send(&packet);
+        if (session_idle) {
+            session_idle();
+        }
+        if ((packet.data[0] == ID_DAP_Transfer && (session_response[2] & DAP_TRANSFER_FAULT))
+            || (packet.data[0] == ID_DAP_TransferBlock && (session_response[3] & DAP_TRANSFER_FAULT))) {
+            result.faults++;
+        }
+        if (!compare) {
+            memcpy(step->response, session_response, sizeof(session_response));
+            step->length = session_response_length;
+            step->digest = session_digest();
+        } else if (!session_same_response(step, packet.data[0])
+                   || ((!session_settled || session_settled()) && step->digest != session_digest())) {
+            if (result.mismatches++ == 0) {
+                printf("seed %u: command %u (0x%02X) differs\n", seed, i, packet.data[0]);
+            }
+        }
+    }
+    result.wire = fake_swd_wire;
+    return result;
+}
+
+/* The plain session, then the optimized one compared against it */
+static SessionResult session_compare(unsigned seed, uint32_t commands,
+                                     void (*plain)(void), void (*optimized)(void),
+                                     uint32_t* plain_wire) {
+    *plain_wire = session_run(seed, commands, plain, false).wire;
+    return session_run(seed, commands, optimized, true);
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TEST_H_INCLUDED
+#define TEST_H_INCLUDED
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Minimal checking for the host tests: a failed CHECK reports itself
+ * and the test carries on, and test_report() sets the exit status.
+ */
+
+static int test_checks;
+static int test_failures;
+
+#define CHECK(cond) do {                                                \
+        test_checks++;                                                  \
+        if (!(cond)) {                                                  \
+            test_failures++;                                            \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                               \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) do {                                 \
+        test_checks++;                                                  \
+        long long a_ = (long long)(actual);                             \
+        long long e_ = (long long)(expected);                           \
+        if (a_ != e_) {                                                 \
+            test_failures++;                                            \
+            printf("%s:%d: %s is %lld, expected %lld\n",                \
+                   __FILE__, __LINE__, #actual, a_, e_);                \
+        }                                                               \
+    } while (0)
+
+#define CHECK_STR(actual, expected) do {                                \
+        test_checks++;                                                  \
+        const char* a_ = (actual);                                      \
+        const char* e_ = (expected);                                    \
+        if (strcmp(a_, e_) != 0) {                                      \
+            test_failures++;                                            \
+            printf("%s:%d: %s is \"%s\", expected \"%s\"\n",            \
+                   __FILE__, __LINE__, #actual, a_, e_);                \
+        }                                                               \
+    } while (0)
+
+static inline int test_report(const char* name) {
+    printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+    return test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CAN_STATS_AVAILABLE 1
+
+#include "test.h"
+#include "config.h"
+#include "CAN/can_stats.c"
+
+static CAN_Message make_frame(uint32_t key, uint8_t len, uint32_t timestamp) {
+    CAN_Message msg = {
+        .id = key & ~CAN_STATS_EXTENDED,
+        .len = len,
+        .format = (key & CAN_STATS_EXTENDED) ? CANExtended : CANStandard,
+        .type = CANData,
+        .timestamp = timestamp,
+    };
+    for (uint8_t i = 0; i < len; i++) {
+        msg.data[i] = (uint8_t)(key + timestamp + i);
+    }
+    return msg;
+}
+
+static const CanStatsEntry* find(uint32_t key) {
+    for (uint8_t i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+        const CanStatsEntry* entry = can_stats_get(i);
+        if (entry != NULL && entry->key == key) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Every entry must be reachable by probing from its home slot without
+ * crossing an empty slot, and appear only once.
+ */
+static bool table_consistent(void) {
+    for (uint8_t i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+        const CanStatsEntry* entry = can_stats_get(i);
+        if (entry == NULL) {
+            continue;
+        }
+        uint8_t slot = can_stats_hash(entry->key);
+        while (slot != i) {
+            if (can_stats_get(slot) == NULL || can_stats_get(slot)->key == entry->key) {
+                return false;
+            }
+            slot = (slot + 1) & CAN_STATS_INDEX_MASK;
+        }
+    }
+    return true;
+}
+
+/* Collect count keys with the given home slot */
+static void colliding_keys(uint8_t home, uint32_t* keys, int count) {
+    uint32_t key = 0;
+    for (int found = 0; found < count; key++) {
+        if (can_stats_hash(key) == home) {
+            keys[found++] = key;
+        }
+    }
+}
+
+/* End an interval the way SLCAN's statistics mode does */
+static void finish_interval(void) {
+    for (uint8_t i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+        if (can_stats_get(i) != NULL) {
+            can_stats_restart(i);
+        }
+    }
+    CanStatsTotals totals;
+    can_stats_take_totals(&totals);
+    can_stats_evict_idle();
+}
+
+static void test_periods_and_dlc(void) {
+    can_stats_clear();
+
+    CAN_Message msg = make_frame(0x123, 2, 1000);
+    CHECK(can_stats_add(&msg));
+    const CanStatsEntry* entry = find(0x123);
+    CHECK(entry != NULL);
+    CHECK_EQ(entry->count, 1);
+    CHECK_EQ(entry->min_period, UINT32_MAX);
+    CHECK_EQ(entry->max_period, 0);
+    CHECK_EQ(entry->dlc_changes, 0);
+
+    static const uint32_t gaps[] = { 100, 50, 400, 50 };
+    uint32_t now = 1000;
+    for (size_t i = 0; i < 4; i++) {
+        now += gaps[i];
+        msg = make_frame(0x123, (uint8_t)((i == 2) ? 8 : 2), now);
+        CHECK(can_stats_add(&msg));
+    }
+    CHECK_EQ(entry->count, 5);
+    CHECK_EQ(entry->min_period, 50);
+    CHECK_EQ(entry->max_period, 400);
+    CHECK_EQ(entry->dlc_changes, 2);
+    CHECK_EQ(entry->len, 2);
+    CHECK(memcmp(entry->data, msg.data, 2) == 0);
+
+    /* The first gap of the next interval counts, across a timer wrap */
+    can_stats_restart((uint8_t)(entry - can_stats_table));
+    CHECK_EQ(entry->count, 0);
+    msg = make_frame(0x123, 2, now);
+    msg.timestamp = 0xFFFFFF00;
+    can_stats_add(&msg);
+    msg.timestamp = 0x00000100;
+    can_stats_add(&msg);
+    CHECK_EQ(entry->min_period, 0x200);
+    CHECK_EQ(entry->max_period, 0xFFFFFF00 - now);
+
+    /* DLC changes saturate */
+    for (int i = 0; i < 300; i++) {
+        msg = make_frame(0x123, (uint8_t)(i & 1), (uint32_t)i);
+        can_stats_add(&msg);
+    }
+    CHECK_EQ(entry->dlc_changes, UINT8_MAX);
+
+    /* Standard and extended frames with the same ID are kept apart */
+    msg = make_frame(0x123 | CAN_STATS_EXTENDED, 0, 0);
+    can_stats_add(&msg);
+    CHECK(find(0x123 | CAN_STATS_EXTENDED) != NULL);
+    CHECK_EQ(find(0x123)->count, 302);
+}
+
+static void test_collisions(void) {
+    can_stats_clear();
+
+    /* Chains that wrap from the last slot to the first */
+    uint32_t keys[CAN_STATS_TABLE_SIZE];
+    colliding_keys(CAN_STATS_TABLE_SIZE - 2, keys, 6);
+    colliding_keys(1, &keys[6], CAN_STATS_TABLE_SIZE - 6);
+    for (int i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+        CAN_Message msg = make_frame(keys[i], 1, (uint32_t)i);
+        CHECK(can_stats_add(&msg));
+    }
+    CHECK(table_consistent());
+    for (int i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+        CHECK(find(keys[i]) != NULL);
+    }
+
+    /* Full: new IDs are counted but not tracked, known ones still are */
+    uint32_t extra[1];
+    colliding_keys(5, extra, 1);
+    CAN_Message msg = make_frame(extra[0], 0, 100);
+    CHECK(!can_stats_add(&msg));
+    msg = make_frame(keys[3], 0, 100);
+    CHECK(can_stats_add(&msg));
+    CHECK_EQ(find(keys[3])->count, 2);
+
+    CanStatsTotals totals;
+    can_stats_take_totals(&totals);
+    CHECK_EQ(totals.frames, CAN_STATS_TABLE_SIZE + 2);
+    CHECK_EQ(totals.untracked, 1);
+    CHECK_EQ(totals.bits, CAN_STATS_TABLE_SIZE * (47 + 8) + 2 * 47);
+}
+
+/* Evicting from the middle of chains must leave the rest reachable */
+static void test_eviction(void) {
+    uint32_t keys[CAN_STATS_TABLE_SIZE];
+    colliding_keys(CAN_STATS_TABLE_SIZE - 3, keys, 8);
+    colliding_keys(CAN_STATS_TABLE_SIZE - 1, &keys[8], 4);
+    colliding_keys(2, &keys[12], 4);
+
+    for (unsigned pattern = 0; pattern < (1U << 16); pattern += 37) {
+        can_stats_clear();
+        for (int i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+            CAN_Message msg = make_frame(keys[i], 1, 0);
+            can_stats_add(&msg);
+        }
+        finish_interval();
+
+        /* Keys in the pattern stay active for another interval */
+        for (int i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+            if (pattern & (1U << i)) {
+                CAN_Message msg = make_frame(keys[i], 2, 10);
+                can_stats_add(&msg);
+            }
+        }
+        finish_interval();
+
+        bool ok = table_consistent();
+        for (int i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+            const CanStatsEntry* entry = find(keys[i]);
+            ok = ok && ((entry != NULL) == ((pattern & (1U << i)) != 0));
+            ok = ok && (entry == NULL || entry->len == 2);
+        }
+        CHECK(ok);
+    }
+}
+
+/* Reference model: per-key statistics for the IDs known to be tracked */
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+    uint32_t last;
+    uint32_t min_period;
+    uint32_t max_period;
+    uint8_t len;
+    uint8_t dlc_changes;
+    bool timed;
+} ModelEntry;
+
+static ModelEntry model[CAN_STATS_TABLE_SIZE];
+static int model_size;
+
+static void model_add(uint32_t key, uint8_t len, uint32_t timestamp) {
+    ModelEntry* entry = NULL;
+    for (int i = 0; i < model_size; i++) {
+        if (model[i].key == key) {
+            entry = &model[i];
+        }
+    }
+    if (entry == NULL) {
+        if (model_size == CAN_STATS_TABLE_SIZE) {
+            return;
+        }
+        entry = &model[model_size++];
+        *entry = (ModelEntry){ .key = key, .min_period = UINT32_MAX, .len = len };
+    }
+    if (entry->timed) {
+        uint32_t period = timestamp - entry->last;
+        entry->min_period = (period < entry->min_period) ? period : entry->min_period;
+        entry->max_period = (period > entry->max_period) ? period : entry->max_period;
+    }
+    if (len != entry->len && entry->dlc_changes < UINT8_MAX) {
+        entry->dlc_changes++;
+    }
+    entry->count++;
+    entry->last = timestamp;
+    entry->len = len;
+    entry->timed = true;
+}
+
+static void model_finish_interval(void) {
+    int kept = 0;
+    for (int i = 0; i < model_size; i++) {
+        if (model[i].count > 0) {
+            model[kept] = model[i];
+            model[kept].count = 0;
+            model[kept].min_period = UINT32_MAX;
+            model[kept].max_period = 0;
+            model[kept].dlc_changes = 0;
+            kept++;
+        }
+    }
+    model_size = kept;
+}
+
+static bool matches_model(void) {
+    int used = 0;
+    for (uint8_t i = 0; i < CAN_STATS_TABLE_SIZE; i++) {
+        used += (can_stats_get(i) != NULL);
+    }
+    if (used != model_size || !table_consistent()) {
+        return false;
+    }
+    for (int i = 0; i < model_size; i++) {
+        const CanStatsEntry* entry = find(model[i].key);
+        if (entry == NULL || entry->count != model[i].count
+            || entry->min_period != model[i].min_period
+            || entry->max_period != model[i].max_period
+            || entry->len != model[i].len
+            || entry->dlc_changes != model[i].dlc_changes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A bus whose set of active IDs drifts from one interval to the next */
+static void test_synthetic_stream(void) {
+    can_stats_clear();
+    model_size = 0;
+    srand(1);
+
+    uint32_t pool[48];
+    for (int i = 0; i < 48; i++) {
+        pool[i] = (i & 1) ? (((uint32_t)rand() & CAN_EXT_ID_MASK) | CAN_STATS_EXTENDED)
+                          : ((uint32_t)rand() & CAN_STD_ID_MASK);
+    }
+
+    uint32_t now = 0xFFF00000;
+    int bad = 0;
+    for (int interval = 0; interval < 2000; interval++) {
+        int first = rand() % 48;
+        int active = 4 + rand() % 20;
+        uint32_t frames = 0;
+        uint32_t untracked = 0;
+        for (int n = 0; n < 200; n++) {
+            uint32_t key = pool[(first + rand() % active) % 48];
+            uint8_t len = (uint8_t)((rand() % 16 == 0) ? rand() % 9 : 8);
+            now += (uint32_t)(rand() % 1000);
+            CAN_Message msg = make_frame(key, len, now);
+            untracked += !can_stats_add(&msg);
+            model_add(key, len, now);
+            frames++;
+        }
+        bad += !matches_model();
+
+        CanStatsTotals totals = can_stats_totals;
+        bad += (totals.frames != frames);
+        bad += (untracked != totals.untracked);
+
+        finish_interval();
+        model_finish_interval();
+        bad += !matches_model();
+    }
+    CHECK_EQ(bad, 0);
+}
+
+int main(void) {
+    test_periods_and_dlc();
+    test_collisions();
+    test_eviction();
+    test_synthetic_stream();
+    return test_report("test_can_stats");
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "CAN/can_timing.c"
+
+#define F042_CAN_CLOCK  48000000U
+#define F103_CAN_CLOCK  36000000U
+
+typedef struct {
+    uint32_t clock;
+    uint32_t bitrate;
+    uint16_t brp;
+    uint8_t ts1;
+    uint8_t ts2;
+    uint16_t sample_point;
+} Expected;
+
+/* SLCAN S0-S8 on both CAN clocks, at the default 75% sample point */
+static const Expected slcan_rates[] = {
+    { F042_CAN_CLOCK,   10000, 240, 14, 5, 750 },
+    { F042_CAN_CLOCK,   20000, 120, 14, 5, 750 },
+    { F042_CAN_CLOCK,   50000,  48, 14, 5, 750 },
+    { F042_CAN_CLOCK,  100000,  24, 14, 5, 750 },
+    { F042_CAN_CLOCK,  125000,  24, 11, 4, 750 },
+    { F042_CAN_CLOCK,  250000,  12, 11, 4, 750 },
+    { F042_CAN_CLOCK,  500000,   6, 11, 4, 750 },
+    { F042_CAN_CLOCK,  800000,   3, 14, 5, 750 },
+    { F042_CAN_CLOCK, 1000000,   3, 11, 4, 750 },
+    { F103_CAN_CLOCK,   10000, 180, 14, 5, 750 },
+    { F103_CAN_CLOCK,   20000,  90, 14, 5, 750 },
+    { F103_CAN_CLOCK,   50000,  36, 14, 5, 750 },
+    { F103_CAN_CLOCK,  100000,  18, 14, 5, 750 },
+    { F103_CAN_CLOCK,  125000,  18, 11, 4, 750 },
+    { F103_CAN_CLOCK,  250000,   9, 11, 4, 750 },
+    { F103_CAN_CLOCK,  500000,   6,  8, 3, 750 },
+    /* 45 clocks per bit: 15 tq is the closest split to 75% */
+    { F103_CAN_CLOCK,  800000,   3, 10, 4, 733 },
+    { F103_CAN_CLOCK, 1000000,   3,  8, 3, 750 },
+};
+
+static uint16_t sample_point_of(const CanBitTiming* t) {
+    return (uint16_t)((1U + t->ts1) * 1000U / (1U + t->ts1 + t->ts2));
+}
+
+static void test_slcan_rates(void) {
+    for (size_t i = 0; i < sizeof(slcan_rates) / sizeof(slcan_rates[0]); i++) {
+        const Expected* e = &slcan_rates[i];
+        CanBitTiming t;
+        uint32_t error_ppm = 12345;
+        CHECK(can_calc_bit_timing(e->clock, e->bitrate, 0, &t, &error_ppm));
+        CHECK_EQ(t.brp, e->brp);
+        CHECK_EQ(t.ts1, e->ts1);
+        CHECK_EQ(t.ts2, e->ts2);
+        CHECK_EQ(t.sjw, 1);
+        CHECK_EQ(error_ppm, 0);
+        CHECK_EQ(sample_point_of(&t), e->sample_point);
+        CHECK_EQ(can_bit_timing_bitrate(e->clock, &t), e->bitrate);
+    }
+}
+
+/* Smallest bitrate error any prescaler and bit length could give */
+static uint32_t best_possible_error(uint32_t clock, uint32_t bitrate) {
+    uint32_t best = UINT32_MAX;
+    for (uint32_t tq = CAN_TQ_PER_BIT_MIN; tq <= CAN_TQ_PER_BIT_MAX; tq++) {
+        for (uint32_t brp = 1; brp <= CAN_BRP_MAX; brp++) {
+            uint32_t error = can_abs_diff(clock / (brp * tq), bitrate);
+            if (error < best) {
+                best = error;
+            }
+        }
+    }
+    return best;
+}
+
+/* Any answer must be programmable, optimal and report its error honestly */
+static void test_limits_and_error(void) {
+    static const uint32_t clocks[] = { F042_CAN_CLOCK, F103_CAN_CLOCK };
+    int bad = 0;
+    for (size_t c = 0; c < 2; c++) {
+        for (uint32_t bitrate = 5000; bitrate <= 1000000; bitrate += 4999) {
+            CanBitTiming t;
+            uint32_t error_ppm;
+            if (!can_calc_bit_timing(clocks[c], bitrate, 800, &t, &error_ppm)) {
+                bad++;
+                continue;
+            }
+            uint32_t tq = 1U + t.ts1 + t.ts2;
+            bad += (t.brp < 1 || t.brp > CAN_BRP_MAX);
+            bad += (t.ts1 < 1 || t.ts1 > CAN_TS1_MAX);
+            bad += (t.ts2 < 1 || t.ts2 > CAN_TS2_MAX);
+            bad += (tq < CAN_TQ_PER_BIT_MIN);
+            uint32_t actual = can_bit_timing_bitrate(clocks[c], &t);
+            uint64_t diff = (actual > bitrate) ? actual - bitrate : bitrate - actual;
+            bad += (error_ppm != (uint32_t)((diff * 1000000 + bitrate / 2) / bitrate));
+            bad += (diff != best_possible_error(clocks[c], bitrate));
+        }
+    }
+    CHECK_EQ(bad, 0);
+}
+
+static void test_sample_point(void) {
+    CanBitTiming t;
+    uint32_t error_ppm;
+    CHECK(can_calc_bit_timing(F042_CAN_CLOCK, 500000, 875, &t, &error_ppm));
+    CHECK_EQ(error_ppm, 0);
+    CHECK_EQ(sample_point_of(&t), 875);
+
+    CHECK(can_calc_bit_timing(F103_CAN_CLOCK, 250000, 600, &t, &error_ppm));
+    CHECK(abs((int)sample_point_of(&t) - 600) <= 20);
+
+    /* TS2 can't exceed 8 tq, so an early sample point is clamped */
+    CHECK(can_calc_bit_timing(F042_CAN_CLOCK, 125000, 500, &t, NULL));
+    CHECK(t.ts2 <= CAN_TS2_MAX);
+    CHECK_EQ(can_bit_timing_bitrate(F042_CAN_CLOCK, &t), 125000);
+}
+
+static void test_invalid(void) {
+    CanBitTiming t;
+    uint32_t error_ppm;
+    CHECK(!can_calc_bit_timing(F042_CAN_CLOCK, 0, 0, &t, &error_ppm));
+    CHECK(!can_calc_bit_timing(0, 500000, 0, &t, &error_ppm));
+    CHECK(!can_calc_bit_timing(F042_CAN_CLOCK, 500000, 1000, &t, &error_ppm));
+    /* Too slow for the prescaler */
+    CHECK(!can_calc_bit_timing(F042_CAN_CLOCK, 1000, 0, &t, &error_ppm));
+
+    /* Too fast: the nearest rate is returned and its error reported */
+    CHECK(can_calc_bit_timing(F042_CAN_CLOCK, 10000000, 0, &t, &error_ppm));
+    CHECK_EQ(can_bit_timing_bitrate(F042_CAN_CLOCK, &t), 6000000);
+    CHECK_EQ(error_ppm, 400000);
+}
+
+int main(void) {
+    test_slcan_rates();
+    test_limits_and_error();
+    test_sample_point();
+    test_invalid();
+    return test_report("test_can_timing");
+}
@@ -0,0 +1,599 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define GDB_SERVER 1
+
+#include "test.h"
+#include "fake_cortex_m.h"
+#include "USB/vcdc.h"
+#include "DAP/core_regs.c"
+#include "DAP/gdb_server.c"
+
+/* Stand-in for tick.c: each call moves the clock on by a millisecond */
+static uint32_t fake_ticks;
+
+uint32_t get_ticks(void) {
+    return ++fake_ticks;
+}
+
+/* What the server sent since the last host_take() */
+static char host_output[1024];
+static size_t host_output_len;
+static char host_payload[512];
+/* Whether the server still sends '+' for each request */
+static bool host_acks;
+
+static void host_collect(void) {
+    host_output_len += vcdc_host_read(&host_output[host_output_len],
+                                      sizeof(host_output) - host_output_len);
+}
+
+/* Run the server, with the host draining the port between updates */
+static void host_pump(uint32_t updates) {
+    for (uint32_t i = 0; i < updates; i++) {
+        gdb_server_update();
+        host_collect();
+    }
+}
+
+/* Raw bytes, with no framing of their own */
+static void host_write(const char* data, size_t len) {
+    CHECK_EQ(vcdc_host_write(data, len), len);
+}
+
+static size_t host_frame(char* out, const char* payload) {
+    uint8_t checksum = 0;
+    for (const char* p = payload; *p; p++) {
+        checksum += (uint8_t)*p;
+    }
+    return (size_t)sprintf(out, "$%s#%02x", payload, checksum);
+}
+
+static void host_send(const char* payload) {
+    char frame[300];
+    host_write(frame, host_frame(frame, payload));
+}
+
+static void host_discard(void) {
+    host_collect();
+    host_output_len = 0;
+}
+
+/*
+ * Take the next packet the server sent, after the ack when one is due,
+ * and check its framing. Returns NULL if it sent no packet.
+ */
+static const char* host_take(void) {
+    const char* p = host_output;
+    const char* end = &host_output[host_output_len];
+    if (host_acks) {
+        CHECK(p < end && *p == '+');
+        p++;
+    }
+    if (p >= end) {
+        host_output_len = 0;
+        return NULL;
+    }
+
+    const char* hash = memchr(p, '#', (size_t)(end - p));
+    CHECK(*p == '$' && hash && end - hash >= 3);
+    if (*p != '$' || !hash || end - hash < 3) {
+        host_output_len = 0;
+        return NULL;
+    }
+
+    size_t len = (size_t)(hash - p - 1);
+    uint8_t checksum = 0;
+    memcpy(host_payload, p + 1, len);
+    host_payload[len] = '\0';
+    for (size_t i = 0; i < len; i++) {
+        checksum += (uint8_t)host_payload[i];
+    }
+    unsigned sent = 0;
+    sscanf(hash + 1, "%2X", &sent);
+    CHECK_EQ(sent, checksum);
+    CHECK_EQ(end - hash, 3);
+
+    host_output_len = 0;
+    return host_payload;
+}
+
+/* One request and its reply; "(none)" if there was none */
+static const char* gdb_request(const char* payload) {
+    host_discard();
+    host_send(payload);
+    host_pump(4);
+    const char* reply = host_take();
+    return reply ? reply : "(none)";
+}
+
+/* Let a running core go until the server reports the stop */
+static const char* gdb_wait_stop(void) {
+    for (uint32_t i = 0; i < 1000U && host_output_len == 0U; i++) {
+        host_pump(1);
+    }
+    bool acks = host_acks;
+    host_acks = false;
+    const char* reply = host_take();
+    host_acks = acks;
+    return reply ? reply : "(none)";
+}
+
+static const char* gdb_continue(void) {
+    CHECK_STR(gdb_request("c"), "(none)");
+    return gdb_wait_stop();
+}
+
+static void server_connect(unsigned wait_odds, unsigned wait_seed) {
+    fake_cm_reset(wait_odds, wait_seed);
+    memset(&DAP_Data, 0, sizeof(DAP_Data));
+    DAP_Data.transfer.retry_count = 100;
+    vcdc_reset();
+    gdb_server_setup();
+    host_output_len = 0;
+    host_acks = true;
+}
+
+/* Attach with "?" and leave ack mode, as GDB does */
+static void server_attach(unsigned wait_odds, unsigned wait_seed) {
+    server_connect(wait_odds, wait_seed);
+    CHECK_STR(gdb_request("?"), "T05");
+    CHECK_STR(gdb_request("QStartNoAckMode"), "OK");
+    host_acks = false;
+}
+
+static uint32_t hex_word(const char* hex) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        unsigned byte = 0;
+        sscanf(&hex[2 * i], "%2x", &byte);
+        value = (value << 8) | byte;
+    }
+    return value;
+}
+
+static void hex_bytes(char* out, const uint8_t* bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        sprintf(&out[2 * i], "%02x", bytes[i]);
+    }
+}
+
+/* Whether a reply is the hex of count bytes of target memory */
+static bool hex_matches(const char* hex, uint32_t address, size_t count) {
+    char expected[512];
+    hex_bytes(expected, fake_cm_memory(address), count);
+    return hex && strlen(hex) == 2U * count && strcmp(hex, expected) == 0;
+}
+
+static void monitor(char* packet, const char* command) {
+    strcpy(packet, "qRcmd,");
+    hex_bytes(&packet[6], (const uint8_t*)command, strlen(command));
+}
+
+static void test_attach(void) {
+    server_connect(0, 0);
+    CHECK_STR(gdb_request("qSupported:multiprocess+;swbreak+"),
+              "PacketSize=000000df;qXfer:features:read+;QStartNoAckMode+");
+    CHECK_STR(gdb_request("vMustReplyEmpty"), "");
+    CHECK_STR(gdb_request("Hg0"), "OK");
+    CHECK_STR(gdb_request("qAttached"), "1");
+    CHECK_EQ(DAP_Data.debug_port, DAP_PORT_DISABLED);
+
+    /* The DP only answers after the wakeup sequence */
+    CHECK_STR(gdb_request("?"), "T05");
+    CHECK_EQ(fake_cm_line_resets, 1);
+    CHECK_EQ(DAP_Data.debug_port, DAP_PORT_SWD);
+    CHECK(fake_cm.halted && fake_cm.debugen);
+    CHECK(fake_cm.demcr & FAKE_CM_TRCENA);
+    CHECK_EQ(fake_cm.fp_ctrl & 1U, 1);
+    CHECK_EQ(fake_cm.dfsr, 0);
+    CHECK_EQ(fake_cm.ctrl_stat, CTRL_STAT_PWRUPREQ);
+
+    /* The target description, in chunks */
+    char xml[sizeof(gdb_target_xml)] = "";
+    size_t offset = 0;
+    for (int i = 0; i < 20; i++) {
+        char request[64];
+        sprintf(request, "qXfer:features:read:target.xml:%zx,40", offset);
+        const char* reply = gdb_request(request);
+        CHECK(reply[0] == 'm' || reply[0] == 'l');
+        CHECK(offset + strlen(reply + 1) < sizeof(xml));
+        if (offset + strlen(reply + 1) >= sizeof(xml)) {
+            break;
+        }
+        strcpy(&xml[offset], reply + 1);
+        offset += strlen(reply + 1);
+        if (reply[0] != 'm') {
+            break;
+        }
+    }
+    CHECK_STR(xml, gdb_target_xml);
+    CHECK_STR(gdb_request("qXfer:features:read:other.xml:0,40"), "E00");
+
+    /* Core registers through DCRSR and DCRDR */
+    const char* reply = gdb_request("g");
+    CHECK_EQ(strlen(reply), 8 * GDB_CORE_REGISTERS);
+    CHECK_EQ(hex_word(reply), 0x1000);
+    CHECK_EQ(hex_word(reply + 8 * 13), 0x100D);
+    CHECK_EQ(hex_word(reply + 8 * 15), FAKE_CM_RESET_PC);
+    CHECK_EQ(hex_word(reply + 8 * 16), 0x01000000);
+    CHECK_EQ(hex_word(gdb_request("p19")), 0x01000000);
+    CHECK_STR(gdb_request("p11"), "E01");
+    CHECK_STR(gdb_request("P3=78563412"), "OK");
+    CHECK_EQ(fake_cm.regs[3], 0x12345678);
+
+    char request[300] = "G";
+    for (uint32_t i = 0; i < GDB_CORE_REGISTERS; i++) {
+        uint32_t value = 0x55000000UL + i;
+        hex_bytes(&request[1 + 8 * i], (const uint8_t*)&value, 4);
+    }
+    CHECK_STR(gdb_request(request), "OK");
+    CHECK_EQ(fake_cm.regs[4], 0x55000004);
+    CHECK_EQ(fake_cm.regs[16], 0x55000010);
+    CHECK_STR(gdb_request("G0011"), "E01");
+}
+
+static void test_framing(void) {
+    char frame[300];
+    server_connect(0, 0);
+
+    /* A request split over updates, with noise in front */
+    size_t len = host_frame(frame, "m20000000,4");
+    host_discard();
+    host_write("xx+", 3);
+    host_write(frame, 5);
+    host_pump(2);
+    CHECK_EQ(host_output_len, 0);
+    host_write(&frame[5], len - 6);
+    host_pump(2);
+    CHECK_EQ(host_output_len, 0);
+    host_write(&frame[len - 1], 1);
+    host_pump(2);
+    CHECK(hex_matches(host_take(), FAKE_CM_RAM_BASE, 4));
+
+    /* A '$' starts over */
+    host_discard();
+    host_write("$m2000", 6);
+    host_send("?");
+    host_pump(2);
+    CHECK_STR(host_take(), "T05");
+
+    /* An escaped ',' counts towards the checksum as sent */
+    static const char escaped[] = "m20000010}\x0c" "4";
+    uint8_t checksum = 0;
+    for (const char* p = escaped; *p; p++) {
+        checksum += (uint8_t)*p;
+    }
+    len = (size_t)sprintf(frame, "$%s#%02x", escaped, checksum);
+    host_discard();
+    host_write(frame, len);
+    host_pump(2);
+    CHECK(hex_matches(host_take(), FAKE_CM_RAM_BASE + 0x10, 4));
+
+    /* A bad checksum is NAKed and the request dropped */
+    uint8_t before = fake_cm.ram[0];
+    host_discard();
+    host_write("$M20000000,1:00#00", 18);
+    host_pump(2);
+    host_collect();
+    CHECK_EQ(host_output_len, 1);
+    CHECK_EQ(host_output[0], '-');
+    CHECK_EQ(fake_cm.ram[0], before);
+
+    /* A NAK resends the last reply, but none is left after a dropped request */
+    host_output_len = 0;
+    host_write("-", 1);
+    host_pump(2);
+    CHECK_EQ(host_output_len, 0);
+    CHECK(hex_matches(gdb_request("m20000020,2"), FAKE_CM_RAM_BASE + 0x20, 2));
+    host_write("-", 1);
+    host_pump(2);
+    host_acks = false;
+    const char* reply = host_take();
+    CHECK(reply && hex_matches(reply, FAKE_CM_RAM_BASE + 0x20, 2));
+    host_acks = true;
+
+    /* A request too long for the buffer */
+    char big[GDB_PACKET_SIZE + 40] = "m";
+    memset(&big[1], '0', GDB_PACKET_SIZE + 20);
+    big[GDB_PACKET_SIZE + 21] = '\0';
+    CHECK_STR(gdb_request(big), "E01");
+    CHECK(hex_matches(gdb_request("m20000000,1"), FAKE_CM_RAM_BASE, 1));
+
+    /* Unknown requests get the empty reply */
+    CHECK_STR(gdb_request("X20000000,0:"), "");
+    CHECK_STR(gdb_request("vCont?"), "");
+
+    /*
+     * Input waits while the largest reply would not fit the TX buffer:
+     * the second request stays queued until the host drains the first.
+     */
+    CHECK_STR(gdb_request("QStartNoAckMode"), "OK");
+    host_acks = false;
+    host_discard();
+    host_send("m20000000,70");
+    host_send("m20000070,70");
+    for (int i = 0; i < 4; i++) {
+        gdb_server_update();
+    }
+    CHECK_EQ(ring_used(&vcdc_tx_ring), 0xE0 + 4);
+    host_collect();
+    CHECK(hex_matches(host_take(), FAKE_CM_RAM_BASE, 0x70));
+    host_pump(2);
+    CHECK(hex_matches(host_take(), FAKE_CM_RAM_BASE + 0x70, 0x70));
+
+    /* In no-ack mode nothing but replies goes out */
+    host_discard();
+    host_write("$?#00", 5);
+    host_pump(2);
+    CHECK_EQ(host_output_len, 0);
+}
+
+static void test_memory(void) {
+    char request[300];
+    uint8_t data[0x80];
+    server_attach(8, 4242);
+
+    /* Bytes up to the first aligned word, then words, then bytes */
+    for (uint32_t i = 0; i < 37; i++) {
+        data[i] = (uint8_t)(0xA0 + i);
+    }
+    int n = sprintf(request, "M20000003,25:");
+    hex_bytes(&request[n], data, 37);
+    CHECK_STR(gdb_request(request), "OK");
+    CHECK(memcmp(&fake_cm.ram[3], data, 37) == 0);
+    CHECK_EQ(fake_cm.ram[2], fake_cm_pattern(2, 0x5A));
+    CHECK_EQ(fake_cm.ram[40], fake_cm_pattern(40, 0x5A));
+    CHECK(hex_matches(gdb_request("m20000001,3c"), FAKE_CM_RAM_BASE + 1, 0x3C));
+
+    /* TAR wraps within 1KB, so a read across the boundary needs a new TAR */
+    CHECK(hex_matches(gdb_request("m200003f1,6f"), FAKE_CM_RAM_BASE + 0x3F1, 0x6F));
+    CHECK(hex_matches(gdb_request("m200007fe,2"), FAKE_CM_RAM_BASE + 0x7FE, 2));
+    CHECK(hex_matches(gdb_request("m1000,20"), FAKE_CM_FLASH_BASE + 0x1000, 0x20));
+
+    /* Longer reads are cut to what fits a reply */
+    CHECK(hex_matches(gdb_request("m20000000,200"), FAKE_CM_RAM_BASE, GDB_PACKET_SIZE / 2));
+
+    /* Byte writes across the boundary */
+    CHECK_STR(gdb_request("M200003fe,4:01020304"), "OK");
+    CHECK_EQ(fake_cm.ram[0x3FE], 0x01);
+    CHECK_EQ(fake_cm.ram[0x3FF], 0x02);
+    CHECK_EQ(fake_cm.ram[0x400], 0x03);
+    CHECK_EQ(fake_cm.ram[0x401], 0x04);
+    CHECK_EQ(fake_cm.ram[0x000], fake_cm_pattern(0x000, 0x5A));
+    CHECK_EQ(fake_cm.ram[0x001], fake_cm_pattern(0x001, 0x5A));
+
+    /* Word writes across it, and the read back */
+    for (uint32_t i = 0; i < 0x60; i++) {
+        data[i] = (uint8_t)(0x31 * i);
+    }
+    n = sprintf(request, "M200007d0,60:");
+    hex_bytes(&request[n], data, 0x60);
+    CHECK_STR(gdb_request(request), "OK");
+    CHECK(memcmp(&fake_cm.ram[0x7D0], data, 0x60) == 0);
+    CHECK_EQ(fake_cm.ram[0x400], 0x03);
+    CHECK(hex_matches(gdb_request("m200007d0,60"), FAKE_CM_RAM_BASE + 0x7D0, 0x60));
+
+    /* Bus errors are reported and cleared, and leave nothing behind */
+    uint32_t errors = fake_cm_bus_errors;
+    CHECK_STR(gdb_request("m30000000,4"), "E01");
+    CHECK(!fake_cm.sticky);
+    CHECK_STR(gdb_request("M00000010,4:00000000"), "E01");
+    CHECK(!fake_cm.sticky);
+    CHECK_EQ(fake_cm.flash[0x10], fake_cm_pattern(0x10, 0x00));
+    CHECK_STR(gdb_request("m2000fffc,8"), "E01");
+    CHECK_EQ(fake_cm_bus_errors, errors + 3);
+    CHECK(hex_matches(gdb_request("m2000fffc,4"), FAKE_CM_RAM_BASE + 0xFFFC, 4));
+
+    CHECK_STR(gdb_request("m20000000"), "E01");
+    CHECK_STR(gdb_request("M20000000,2:00"), "E01");
+    CHECK_STR(gdb_request("M20000000,1:zz"), "E01");
+}
+
+static void test_breakpoints(void) {
+    char request[32];
+    server_attach(8, 77);
+
+    /* Both halfwords of a word share a revision 1 comparator */
+    CHECK_STR(gdb_request("Z0,110,2"), "OK");
+    CHECK_STR(gdb_request("Z1,112,2"), "OK");
+    CHECK_EQ(fake_cm.fp_comp[0], 0x110 | FP_COMP_REPLACE_MASK | FP_COMP_ENABLE);
+    CHECK_EQ(fake_cm.fp_comp[1], 0);
+    CHECK_STR(gdb_request("Z0,20000000,2"), "E01");
+
+    /* 0x102 and 0x10a are the counting instructions on the way */
+    CHECK_STR(gdb_continue(), "T05");
+    CHECK_EQ(fake_cm.regs[15], 0x110);
+    CHECK_EQ(fake_cm.regs[0], 0x1002);
+    CHECK(fake_cm.halted);
+    CHECK_EQ(fake_cm.dfsr, 0);
+
+    CHECK_STR(gdb_request("s"), "T05");
+    CHECK_EQ(fake_cm.regs[15], 0x112);
+    CHECK(fake_cm.halted && fake_cm.maskints == false);
+
+    /* Removing one halfword keeps the other */
+    CHECK_STR(gdb_request("z0,110,2"), "OK");
+    CHECK_EQ(fake_cm.fp_comp[0], 0x110 | FP_COMP_REPLACE_UPPER | FP_COMP_ENABLE);
+    CHECK_STR(gdb_request("z1,112,2"), "OK");
+    CHECK_EQ(fake_cm.fp_comp[0], 0);
+    CHECK_STR(gdb_request("z0,150,2"), "OK");
+
+    /* Resume at an address */
+    CHECK_STR(gdb_request("Z0,130,2"), "OK");
+    CHECK_STR(gdb_request("c120"), "(none)");
+    CHECK_STR(gdb_wait_stop(), "T05");
+    CHECK_EQ(fake_cm.regs[15], 0x130);
+    CHECK_STR(gdb_request("z0,130,2"), "OK");
+
+    /* Six code comparators */
+    uint32_t inserted = 0;
+    for (uint32_t i = 0; i < 8; i++) {
+        sprintf(request, "Z0,%x,2", 0x200 + 8 * i);
+        inserted += (strcmp(gdb_request(request), "OK") == 0);
+    }
+    CHECK_EQ(inserted, FAKE_CM_FPB_CODE);
+    CHECK_EQ(fake_cm.fp_comp[5], 0x228 | FP_COMP_REPLACE_LOWER | FP_COMP_ENABLE);
+    CHECK_EQ(fake_cm.fp_comp[6], 0);
+    for (uint32_t i = 0; i < 8; i++) {
+        sprintf(request, "z0,%x,2", 0x200 + 8 * i);
+        CHECK_STR(gdb_request(request), "OK");
+    }
+    for (uint32_t i = 0; i < FAKE_CM_FPB_CODE; i++) {
+        CHECK_EQ(fake_cm.fp_comp[i], 0);
+    }
+    CHECK_STR(gdb_request("Z5,100,2"), "");
+    CHECK_STR(gdb_request("Z0100,2"), "E01");
+}
+
+static void test_watchpoints(void) {
+    server_attach(8, 31337);
+    memcpy(fake_cm_memory(FAKE_CM_INPUT), "\x44\x33\x22\x11", 4);
+
+    /* Naturally aligned powers of two the comparator can cover */
+    CHECK_STR(gdb_request("Z2,20000101,4"), "E01");
+    CHECK_STR(gdb_request("Z2,20000100,3"), "E01");
+    CHECK_STR(gdb_request("Z2,20000000,10000"), "E01");
+    CHECK_STR(gdb_request("z2,20000100,4"), "OK");
+
+    CHECK_STR(gdb_request("Z2,20000100,4"), "OK");
+    CHECK_EQ(fake_cm.dwt_comp[0], FAKE_CM_COUNTER);
+    CHECK_EQ(fake_cm.dwt_mask[0], 2);
+    CHECK_EQ(fake_cm.dwt_function[0], DWT_FUNCTION_WRITE);
+    CHECK_STR(gdb_continue(), "T05watch:20000100;");
+    CHECK_EQ(fake_cm.regs[15], 0x104);
+    CHECK_EQ(fake_cm.regs[0], 0x1001);
+    CHECK_STR(gdb_request("?"), "T05");
+    CHECK_STR(gdb_request("z2,20000100,4"), "OK");
+    CHECK_EQ(fake_cm.dwt_function[0], 0);
+
+    CHECK_STR(gdb_request("Z3,20000104,4"), "OK");
+    CHECK_STR(gdb_continue(), "T05rwatch:20000104;");
+    CHECK_EQ(fake_cm.regs[15], 0x108);
+    CHECK_EQ(fake_cm.regs[1], 0x11223344);
+    CHECK_STR(gdb_request("z3,20000104,4"), "OK");
+
+    /* An access watch on a block covering both */
+    CHECK_STR(gdb_request("Z4,20000100,8"), "OK");
+    CHECK_EQ(fake_cm.dwt_mask[0], 3);
+    CHECK_STR(gdb_continue(), "T05awatch:20000100;");
+    CHECK_EQ(fake_cm.regs[15], 0x10C);
+    CHECK_STR(gdb_continue(), "T05awatch:20000100;");
+    CHECK_EQ(fake_cm.regs[15], 0x110);
+    CHECK_STR(gdb_request("z4,20000100,8"), "OK");
+
+    /* The report names the comparator that matched */
+    CHECK_STR(gdb_request("Z2,20001000,4"), "OK");
+    CHECK_STR(gdb_request("Z3,20000104,4"), "OK");
+    CHECK_STR(gdb_request("Z2,20002000,4"), "OK");
+    CHECK_STR(gdb_request("Z2,20003000,4"), "OK");
+    CHECK_STR(gdb_request("Z2,20004000,4"), "E01");
+    CHECK_STR(gdb_continue(), "T05rwatch:20000104;");
+    CHECK_EQ(fake_cm.dwt_function[1], DWT_FUNCTION_READ);
+
+    /* Watchpoints and breakpoints go with the detach */
+    CHECK_STR(gdb_request("Z0,180,2"), "OK");
+    CHECK_STR(gdb_request("D"), "OK");
+    for (uint32_t i = 0; i < FAKE_CM_DWT_COMPARATORS; i++) {
+        CHECK_EQ(fake_cm.dwt_function[i], 0);
+    }
+    CHECK_EQ(fake_cm.fp_comp[0], 0);
+    CHECK_EQ(fake_cm.fp_ctrl & 1U, 0);
+    CHECK(!fake_cm.debugen && !fake_cm.halted);
+    CHECK_EQ(DAP_Data.debug_port, DAP_PORT_DISABLED);
+}
+
+static void test_run_control(void) {
+    char request[64];
+    server_attach(8, 99);
+
+    /* Ctrl-C is ignored while halted */
+    host_write("\x03", 1);
+    host_pump(2);
+    CHECK_EQ(host_output_len, 0);
+
+    CHECK_STR(gdb_request("c"), "(none)");
+    CHECK(!fake_cm.halted);
+    CHECK_STR(gdb_request("g"), "E01");
+    CHECK_STR(gdb_request("s"), "E01");
+    CHECK_STR(gdb_request("c"), "E01");
+    CHECK_EQ(strlen(gdb_request("m20000100,4")), 8);
+    host_pump(30);
+    CHECK_EQ(host_output_len, 0);
+    host_write("\x03", 1);
+    CHECK_STR(gdb_wait_stop(), "T02");
+    CHECK(fake_cm.halted);
+    CHECK(fake_cm.regs[15] > FAKE_CM_RESET_PC);
+    CHECK_EQ(strlen(gdb_request("g")), 8 * GDB_CORE_REGISTERS);
+    CHECK_STR(gdb_request("?"), "T05");
+
+    /* monitor reset halts on the reset vector */
+    fake_cm.regs[0] = 0x1234;
+    monitor(request, "reset");
+    CHECK_STR(gdb_request(request), "OK");
+    CHECK_EQ(fake_cm.resets, 1);
+    CHECK(fake_cm.halted);
+    CHECK_EQ(fake_cm.regs[15], FAKE_CM_RESET_PC);
+    CHECK_EQ(fake_cm.regs[0], 0);
+    CHECK_EQ(fake_cm.demcr & FAKE_CM_VC_CORERESET, 0);
+    CHECK_EQ(fake_cm.dfsr, 0);
+    monitor(request, "bogus");
+    CHECK_STR(gdb_request(request), "");
+    CHECK_STR(gdb_request("qRcmd,zz"), "E01");
+
+    /* A target that stops answering still ends the interrupt */
+    CHECK_STR(gdb_request("c"), "(none)");
+    fake_cm.awake = false;
+    host_write("\x03", 1);
+    CHECK_STR(gdb_wait_stop(), "T02");
+    fake_cm.awake = true;
+
+    /* Kill detaches without a reply */
+    CHECK_STR(gdb_request("k"), "(none)");
+    CHECK_EQ(DAP_Data.debug_port, DAP_PORT_DISABLED);
+    CHECK(!fake_cm.debugen);
+
+    /* A port the DAP host set up is left to it */
+    server_connect(0, 0);
+    DAP_Data.debug_port = DAP_PORT_SWD;
+    fake_cm.awake = true;
+    CHECK_STR(gdb_request("?"), "T05");
+    CHECK_EQ(fake_cm_line_resets, 0);
+    CHECK_STR(gdb_request("D"), "OK");
+    CHECK_EQ(DAP_Data.debug_port, DAP_PORT_SWD);
+
+    /* JTAG is not ours to change */
+    server_connect(0, 0);
+    DAP_Data.debug_port = DAP_PORT_JTAG;
+    CHECK_STR(gdb_request("?"), "E01");
+    CHECK_STR(gdb_request("qSupported"),
+              "PacketSize=000000df;qXfer:features:read+;QStartNoAckMode+");
+}
+
+int main(void) {
+    test_attach();
+    test_framing();
+    test_memory();
+    test_breakpoints();
+    test_watchpoints();
+    test_run_control();
+    return test_report("test_gdb_server");
+}
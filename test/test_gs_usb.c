@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GSUSB_AVAILABLE 1
+
+#include "test.h"
+#include "fake_can.h"
+#include "fake_usb.h"
+#include "CAN/can_timing.c"
+#include "USB/gs_usb.c"
+
+/* The layout the Linux gs_usb driver expects */
+_Static_assert(sizeof(struct gs_host_frame) == 24, "gs_host_frame size");
+_Static_assert(offsetof(struct gs_host_frame, can_id) == 4, "can_id offset");
+_Static_assert(offsetof(struct gs_host_frame, can_dlc) == 8, "can_dlc offset");
+_Static_assert(offsetof(struct gs_host_frame, channel) == 9, "channel offset");
+_Static_assert(offsetof(struct gs_host_frame, flags) == 10, "flags offset");
+_Static_assert(offsetof(struct gs_host_frame, data) == 12, "data offset");
+_Static_assert(offsetof(struct gs_host_frame, timestamp_us) == 20, "timestamp offset");
+_Static_assert(GS_HOST_FRAME_SIZE == 20, "frame size without timestamp");
+
+static enum usbd_request_return_codes control(uint8_t request, void* data, uint16_t* len) {
+    return fake_usb_host_control(INTF_GSUSB, request, 0, (uint8_t*)data, len);
+}
+
+static bool set_mode(uint32_t mode, uint32_t flags) {
+    struct gs_device_mode request = { .mode = mode, .flags = flags };
+    uint16_t len = sizeof(request);
+    return control(GS_USB_BREQ_MODE, &request, &len) == USBD_REQ_HANDLED;
+}
+
+static void gs_usb_connect(uint32_t flags) {
+    fake_can_reset();
+    fake_usb_reset();
+    gs_usb_app_setup(fake_usb_device);
+    fake_usb_enumerate();
+    CHECK(set_mode(GS_CAN_MODE_START, flags));
+}
+
+static bool host_send(uint32_t echo_id, uint32_t can_id, uint8_t dlc) {
+    struct gs_host_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.echo_id = echo_id;
+    frame.can_id = can_id;
+    frame.can_dlc = dlc;
+    for (uint8_t i = 0; i < 8; i++) {
+        frame.data[i] = (uint8_t)(echo_id + i);
+    }
+    return fake_usb_host_out(ENDP_GSUSB_OUT, &frame, GS_HOST_FRAME_SIZE);
+}
+
+/* Run the main loop once and collect what it sent, if anything */
+static uint16_t host_receive(struct gs_host_frame* frame) {
+    memset(frame, 0xA5, sizeof(*frame));
+    gs_usb_app_update();
+    return fake_usb_host_in(ENDP_GSUSB_IN, frame);
+}
+
+static void test_control_requests(void) {
+    fake_can_reset();
+    fake_usb_reset();
+    gs_usb_app_setup(fake_usb_device);
+    fake_usb_enumerate();
+
+    /* Nothing from the host until the channel is started */
+    CHECK(fake_usb_out[ENDP_GSUSB_OUT].nak);
+    CHECK(!host_send(1, 0x123, 8));
+
+    uint8_t buf[64];
+    uint16_t len = 4;
+    uint32_t byte_order = GS_USB_HOST_BYTE_ORDER;
+    memcpy(buf, &byte_order, 4);
+    CHECK_EQ(control(GS_USB_BREQ_HOST_FORMAT, buf, &len), USBD_REQ_HANDLED);
+    byte_order = 0xEFBE0000UL;
+    memcpy(buf, &byte_order, 4);
+    CHECK_EQ(control(GS_USB_BREQ_HOST_FORMAT, buf, &len), USBD_REQ_NOTSUPP);
+
+    struct gs_device_config config;
+    len = sizeof(config);
+    CHECK_EQ(control(GS_USB_BREQ_DEVICE_CONFIG, &config, &len), USBD_REQ_HANDLED);
+    CHECK_EQ(len, 12);
+    CHECK_EQ(config.icount, 0);
+    CHECK_EQ(config.sw_version, GSUSB_SW_VERSION);
+
+    struct gs_device_bt_const bt_const;
+    len = sizeof(bt_const);
+    CHECK_EQ(control(GS_USB_BREQ_BT_CONST, &bt_const, &len), USBD_REQ_HANDLED);
+    CHECK_EQ(len, 40);
+    CHECK_EQ(bt_const.fclk_can, fake_can_clock);
+    CHECK_EQ(bt_const.feature, GSUSB_FEATURES);
+    CHECK_EQ(bt_const.tseg1_max, CAN_TS1_MAX);
+    CHECK_EQ(bt_const.brp_max, CAN_BRP_MAX);
+
+    /* 48MHz / 6 / (1 + 11 + 4) = 500kbit/s */
+    struct gs_device_bittiming timing = {
+        .prop_seg = 1, .phase_seg1 = 10, .phase_seg2 = 4, .sjw = 1, .brp = 6,
+    };
+    len = sizeof(timing);
+    CHECK_EQ(control(GS_USB_BREQ_BITTIMING, &timing, &len), USBD_REQ_HANDLED);
+    timing.phase_seg2 = CAN_TS2_MAX + 1;
+    CHECK_EQ(control(GS_USB_BREQ_BITTIMING, &timing, &len), USBD_REQ_NOTSUPP);
+
+    struct gs_device_state state;
+    len = sizeof(state);
+    CHECK_EQ(control(GS_USB_BREQ_GET_STATE, &state, &len), USBD_REQ_HANDLED);
+    CHECK_EQ(state.state, GS_CAN_STATE_STOPPED);
+
+    CHECK(!set_mode(GS_CAN_MODE_START, GS_CAN_FEATURE_ONE_SHOT));
+    CHECK(set_mode(GS_CAN_MODE_START, GS_CAN_MODE_LOOP_BACK));
+    CHECK_EQ(fake_can_mode, MODE_TEST_LOCAL);
+    CHECK_EQ(fake_can_timing.brp, 6);
+    CHECK_EQ(fake_can_timing.ts1, 11);
+    CHECK_EQ(fake_can_timing.ts2, 4);
+    CHECK(!fake_usb_out[ENDP_GSUSB_OUT].nak);
+
+    /* Timing is fixed while the channel runs */
+    timing.phase_seg2 = 4;
+    len = sizeof(timing);
+    CHECK_EQ(control(GS_USB_BREQ_BITTIMING, &timing, &len), USBD_REQ_NOTSUPP);
+
+    fake_can_bus_state = CAN_BUS_ERROR_PASSIVE;
+    len = sizeof(state);
+    CHECK_EQ(control(GS_USB_BREQ_GET_STATE, &state, &len), USBD_REQ_HANDLED);
+    CHECK_EQ(state.state, GS_CAN_STATE_ERROR_PASSIVE);
+    CHECK_EQ(state.txerr, 128);
+
+    fake_can_now_us = 123456;
+    uint32_t timestamp = 0;
+    len = sizeof(timestamp);
+    CHECK_EQ(control(GS_USB_BREQ_TIMESTAMP, &timestamp, &len), USBD_REQ_HANDLED);
+    CHECK_EQ(timestamp, 123456);
+
+    /* Only channel 0, and only requests for this interface */
+    len = sizeof(state);
+    CHECK_EQ(fake_usb_host_control(INTF_GSUSB, GS_USB_BREQ_GET_STATE, 1, (uint8_t*)&state, &len),
+             USBD_REQ_NOTSUPP);
+    struct usb_setup_data req = { .bRequest = GS_USB_BREQ_GET_STATE, .wIndex = INTF_GSUSB + 1 };
+    uint8_t* data = buf;
+    CHECK_EQ(gs_usb_control_vendor_request(fake_usb_device, &req, &data, &len, NULL),
+             USBD_REQ_NEXT_CALLBACK);
+
+    CHECK(set_mode(GS_CAN_MODE_RESET, 0));
+    CHECK_EQ(fake_can_mode, MODE_RESET);
+    CHECK(fake_usb_out[ENDP_GSUSB_OUT].nak);
+}
+
+static void test_received_frames(void) {
+    struct gs_host_frame frame;
+    gs_usb_connect(GS_CAN_MODE_HW_TIMESTAMP);
+
+    CAN_Message msg = {
+        .id = 0x18DAF110, .len = 8, .format = CANExtended, .type = CANData,
+        .data = { 0x10, 0x14, 0x62, 0xF1, 0x90, 0x57, 0x30, 0x4C },
+    };
+    fake_can_now_us = 1000;
+    CHECK(fake_can_receive(&msg));
+    msg.id = 0x7E8;
+    msg.format = CANStandard;
+    msg.type = CANRemote;
+    msg.len = 2;
+    fake_can_now_us = 1250;
+    CHECK(fake_can_receive(&msg));
+
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.echo_id, GS_USB_ECHO_ID_RX);
+    CHECK_EQ(frame.can_id, 0x18DAF110 | GS_CAN_EFF_FLAG);
+    CHECK_EQ(frame.can_dlc, 8);
+    CHECK_EQ(frame.channel, 0);
+    CHECK_EQ(frame.flags, 0);
+    CHECK_EQ(frame.reserved, 0);
+    CHECK(memcmp(frame.data, "\x10\x14\x62\xF1\x90\x57\x30\x4C", 8) == 0);
+    CHECK_EQ(frame.timestamp_us, 1000);
+
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.can_id, 0x7E8 | GS_CAN_RTR_FLAG);
+    CHECK_EQ(frame.can_dlc, 2);
+    CHECK_EQ(frame.timestamp_us, 1250);
+    CHECK_EQ(host_receive(&frame), 0);
+
+    /* A busy IN endpoint keeps the frame until the next try */
+    CHECK(fake_can_receive(&msg));
+    fake_usb_in[ENDP_GSUSB_IN & 0x7F].full = true;
+    gs_usb_app_update();
+    CHECK(!can_rx_buffer_empty());
+    fake_usb_in[ENDP_GSUSB_IN & 0x7F].full = false;
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK(can_rx_buffer_empty());
+
+    /* The first frame after a loss carries the overflow flag */
+    fake_can_errors.rx_buffer_overflows++;
+    CHECK(fake_can_receive(&msg));
+    CHECK(fake_can_receive(&msg));
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.flags, GS_CAN_FLAG_OVERFLOW);
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.flags, 0);
+    fake_can_errors.fifo_overruns += 3;
+    CHECK(fake_can_receive(&msg));
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.flags, GS_CAN_FLAG_OVERFLOW);
+
+    /* Without hardware timestamps the frame is four bytes shorter */
+    CHECK(set_mode(GS_CAN_MODE_START, 0));
+    CHECK(fake_can_receive(&msg));
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE);
+
+    /* Nothing goes out once the channel is reset, and the backlog is dropped */
+    CHECK(fake_can_receive(&msg));
+    CHECK(set_mode(GS_CAN_MODE_RESET, 0));
+    CHECK(can_rx_buffer_empty());
+    CHECK(!gs_usb_app_update());
+}
+
+static void test_echoes(void) {
+    struct gs_host_frame frame;
+    gs_usb_connect(GS_CAN_MODE_HW_TIMESTAMP);
+
+    CHECK(host_send(0x11, 0x123, 8));
+    CHECK(host_send(0x22, 0x1ABCDEF0 | GS_CAN_EFF_FLAG, 4));
+    CHECK_EQ(fake_can_tx_count, 2);
+    CHECK_EQ(fake_can_tx_log[0].id, 0x123);
+    CHECK_EQ(fake_can_tx_log[0].format, CANStandard);
+    CHECK_EQ(fake_can_tx_log[0].len, 8);
+    CHECK_EQ(fake_can_tx_log[0].data[7], 0x18);
+    CHECK_EQ(fake_can_tx_log[1].id, 0x1ABCDEF0);
+    CHECK_EQ(fake_can_tx_log[1].format, CANExtended);
+    CHECK(fake_can_tx_tags[0] != fake_can_tx_tags[1]);
+
+    /* Nothing is echoed until it has been sent; then in completion order */
+    CHECK_EQ(host_receive(&frame), 0);
+    fake_can_now_us = 500;
+    fake_can_transmitted(1, true);
+    fake_can_now_us = 600;
+    fake_can_transmitted(0, true);
+
+    /* Echoes go ahead of received frames */
+    CAN_Message msg = { .id = 0x456, .len = 1, .format = CANStandard, .type = CANData };
+    CHECK(fake_can_receive(&msg));
+
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.echo_id, 0x22);
+    CHECK_EQ(frame.can_id, 0x1ABCDEF0 | GS_CAN_EFF_FLAG);
+    CHECK_EQ(frame.can_dlc, 4);
+    CHECK_EQ(frame.flags, 0);
+    CHECK_EQ(frame.timestamp_us, 500);
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.echo_id, 0x11);
+    CHECK_EQ(frame.data[0], 0x11);
+    CHECK_EQ(frame.timestamp_us, 600);
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.echo_id, GS_USB_ECHO_ID_RX);
+    CHECK_EQ(frame.can_id, 0x456);
+
+    /* A failed transmission is reported with an error frame before its echo */
+    CHECK(host_send(0x33, 0x100, 0));
+    fake_can_now_us = 700;
+    fake_can_transmitted(2, false);
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.echo_id, GS_USB_ECHO_ID_RX);
+    CHECK_EQ(frame.can_id, GS_CAN_ERR_FLAG | GS_CAN_ERR_TX_TIMEOUT);
+    CHECK_EQ(frame.can_dlc, GS_CAN_ERR_DLC);
+    CHECK_EQ(frame.timestamp_us, 700);
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE_TS);
+    CHECK_EQ(frame.echo_id, 0x33);
+    CHECK_EQ(host_receive(&frame), 0);
+
+    /* Frames the device can't send are dropped without taking a slot */
+    size_t before = fake_can_tx_count;
+    CHECK(host_send(0x44, 0x100, 9));
+    CHECK(host_send(0x45, 0x100 | GS_CAN_ERR_FLAG, 8));
+    struct gs_host_frame bad;
+    memset(&bad, 0, sizeof(bad));
+    bad.channel = 1;
+    CHECK(fake_usb_host_out(ENDP_GSUSB_OUT, &bad, GS_HOST_FRAME_SIZE));
+    CHECK(fake_usb_host_out(ENDP_GSUSB_OUT, &bad, GS_HOST_FRAME_SIZE - 1));
+    CHECK_EQ(fake_can_tx_count, before);
+    CHECK_EQ(gs_usb_free_slots(), GSUSB_TX_SLOTS);
+}
+
+static void test_flow_control(void) {
+    struct gs_host_frame frame;
+    gs_usb_connect(0);
+
+    /* The host is held off once every slot waits for its echo */
+    for (uint32_t i = 0; i < GSUSB_TX_SLOTS; i++) {
+        CHECK(host_send(i, 0x200 + i, 8));
+    }
+    CHECK(fake_usb_out[ENDP_GSUSB_OUT].nak);
+    CHECK(!host_send(99, 0x2FF, 8));
+    CHECK_EQ(fake_can_tx_count, GSUSB_TX_SLOTS);
+
+    fake_can_transmitted(2, true);
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE);
+    CHECK_EQ(frame.echo_id, 2);
+    CHECK(!fake_usb_out[ENDP_GSUSB_OUT].nak);
+
+    /* The slot is reused, and its tag with it */
+    CHECK(host_send(0x55, 0x255, 1));
+    CHECK_EQ(fake_can_tx_tags[GSUSB_TX_SLOTS], fake_can_tx_tags[2]);
+    for (size_t i = 0; i < GSUSB_TX_SLOTS; i++) {
+        if (i != 2) {
+            fake_can_transmitted(i, true);
+        }
+    }
+    fake_can_transmitted(GSUSB_TX_SLOTS, true);
+    for (uint32_t i = 0; i < GSUSB_TX_SLOTS; i++) {
+        CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE);
+    }
+    CHECK_EQ(frame.echo_id, 0x55);
+    CHECK_EQ(gs_usb_free_slots(), GSUSB_TX_SLOTS);
+
+    /* A full CAN transmit queue holds the frame and the endpoint */
+    fake_can_tx_count = 0;
+    fake_can_tx_full = true;
+    CHECK(host_send(0x66, 0x266, 8));
+    CHECK_EQ(fake_can_tx_count, 0);
+    CHECK(fake_usb_out[ENDP_GSUSB_OUT].nak);
+    gs_usb_app_update();
+    CHECK_EQ(fake_can_tx_count, 0);
+    fake_can_tx_full = false;
+    gs_usb_app_update();
+    CHECK_EQ(fake_can_tx_count, 1);
+    CHECK_EQ(fake_can_tx_log[0].id, 0x266);
+    CHECK(!fake_usb_out[ENDP_GSUSB_OUT].nak);
+
+    /* Nothing happens before the host configures the device */
+    fake_usb_configured = false;
+    fake_can_transmitted(0, true);
+    CHECK(!gs_usb_app_update());
+    fake_usb_configured = true;
+    CHECK_EQ(host_receive(&frame), GS_HOST_FRAME_SIZE);
+    CHECK_EQ(frame.echo_id, 0x66);
+
+    /* A USB reset stops the channel and drops whatever was pending */
+    CHECK(host_send(0x77, 0x277, 8));
+    fake_usb_reset_callback();
+    CHECK(!started);
+    CHECK_EQ(gs_usb_free_slots(), GSUSB_TX_SLOTS);
+    CHECK_EQ(fake_can_mode, MODE_RESET);
+}
+
+int main(void) {
+    test_control_requests();
+    test_received_frames();
+    test_echoes();
+    test_flow_control();
+    return test_report("test_gs_usb");
+}
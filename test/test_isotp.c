@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ISOTP_AVAILABLE 1
+
+#include "test.h"
+#include "fake_can.h"
+#include "CAN/isotp.c"
+
+#define PROBE_ID    0x7E0
+#define ECU_ID      0x7E8
+
+/* Simulation step; the firmware polls ISO-TP at least this often */
+#define TICK_US     100
+
+/*
+ * A simulated ECU on the other end of the bus. It reassembles what the
+ * probe sends, answering with flow control as scripted, and sends its
+ * own PDUs as the probe's flow control allows.
+ */
+typedef struct {
+    /* Flow control given to the probe */
+    uint8_t fc_status;          // Answer after the WAITs
+    uint8_t block_size;
+    uint8_t st_min;
+    int waits;                  // WAITs before each answer
+    uint32_t wait_interval_us;
+    int fc_limit;               // Answers before going quiet, or -1
+
+    /* Reassembly of the probe's PDU */
+    uint8_t rx[ISOTP_MAX_PDU_LEN];
+    uint16_t rx_len;
+    uint16_t rx_expected;
+    uint8_t rx_sn;
+    int rx_in_block;
+    bool rx_done;
+    int errors;                 // Bad SN, bad padding or a CF before its FC
+    int cf_count;
+    uint32_t last_cf_time;
+    uint32_t min_cf_gap;        // Within a block
+    uint32_t max_cf_gap;
+
+    bool fc_due;
+    uint32_t fc_time;
+    int waits_left;
+    int fc_sent;
+
+    /* The ECU's own PDU */
+    const uint8_t* tx;
+    uint16_t tx_len;
+    uint16_t tx_offset;
+    uint8_t tx_sn;
+    bool tx_waiting_fc;
+    bool tx_refused;
+    int tx_block_left;
+    uint8_t tx_block_size;
+    uint32_t tx_st_min_us;
+    uint32_t tx_time;
+    int tx_bad_sn_at;           // CF number to send out of sequence, or 0
+    int tx_stop_after;          // CFs to send before going quiet, or -1
+    int tx_cf_sent;
+    int probe_fc_count;
+    uint8_t probe_fc[3];
+
+    size_t log_index;
+} Ecu;
+
+static Ecu ecu;
+static bool probe_padding;
+
+static void setup(uint8_t block_size, uint8_t st_min, bool padding) {
+    fake_can_reset();
+    memset(&ecu, 0, sizeof(ecu));
+    ecu.fc_status = ISOTP_FC_CONTINUE;
+    ecu.fc_limit = -1;
+    ecu.tx_stop_after = -1;
+    ecu.min_cf_gap = UINT32_MAX;
+    probe_padding = padding;
+
+    IsotpConfig config = {
+        .tx_id = PROBE_ID,
+        .rx_id = ECU_ID,
+        .tx_format = CANStandard,
+        .rx_format = CANStandard,
+        .block_size = block_size,
+        .st_min = st_min,
+        .padding = padding,
+    };
+    isotp_configure(&config);
+}
+
+static void ecu_send_frame(const uint8_t* data, uint8_t len) {
+    CAN_Message msg = {
+        .id = ECU_ID, .len = len, .format = CANStandard, .type = CANData,
+        .timestamp = fake_can_now_us,
+    };
+    memcpy(msg.data, data, len);
+    CHECK(isotp_handle_frame(&msg));
+}
+
+static void ecu_receive(const CAN_Message* msg) {
+    const uint8_t* d = msg->data;
+    if (probe_padding && msg->len != 8) {
+        ecu.errors++;
+    }
+    switch (d[0] & 0xF0) {
+        case ISOTP_PCI_SINGLE: {
+            ecu.rx_len = d[0] & 0x0F;
+            memcpy(ecu.rx, &d[1], ecu.rx_len);
+            ecu.rx_expected = ecu.rx_len;
+            ecu.rx_done = true;
+            break;
+        }
+        case ISOTP_PCI_FIRST: {
+            ecu.rx_expected = (uint16_t)(((d[0] & 0x0F) << 8) | d[1]);
+            memcpy(ecu.rx, &d[2], ISOTP_FF_DATA);
+            ecu.rx_len = ISOTP_FF_DATA;
+            ecu.rx_sn = 1;
+            ecu.rx_done = false;
+            ecu.fc_due = true;
+            ecu.fc_time = fake_can_now_us;
+            ecu.waits_left = ecu.waits;
+            break;
+        }
+        case ISOTP_PCI_CONSECUTIVE: {
+            if (ecu.fc_due || (d[0] & 0x0F) != ecu.rx_sn || ecu.rx_done) {
+                ecu.errors++;
+                break;
+            }
+            if (ecu.rx_in_block > 0) {
+                uint32_t gap = msg->timestamp - ecu.last_cf_time;
+                ecu.min_cf_gap = (gap < ecu.min_cf_gap) ? gap : ecu.min_cf_gap;
+                ecu.max_cf_gap = (gap > ecu.max_cf_gap) ? gap : ecu.max_cf_gap;
+            }
+            ecu.last_cf_time = msg->timestamp;
+            ecu.cf_count++;
+            uint16_t len = ecu.rx_expected - ecu.rx_len;
+            len = (len < ISOTP_CF_DATA) ? len : ISOTP_CF_DATA;
+            memcpy(&ecu.rx[ecu.rx_len], &d[1], len);
+            ecu.rx_len += len;
+            ecu.rx_sn = (ecu.rx_sn + 1) & 0x0F;
+            ecu.rx_in_block++;
+            if (ecu.rx_len == ecu.rx_expected) {
+                ecu.rx_done = true;
+            } else if (ecu.block_size != 0 && ecu.rx_in_block == ecu.block_size) {
+                ecu.fc_due = true;
+                ecu.fc_time = fake_can_now_us;
+                ecu.waits_left = ecu.waits;
+            }
+            break;
+        }
+        case ISOTP_PCI_FLOW_CONTROL: {
+            memcpy(ecu.probe_fc, d, 3);
+            ecu.probe_fc_count++;
+            if (!ecu.tx_waiting_fc) {
+                break;
+            }
+            if ((d[0] & 0x0F) == ISOTP_FC_CONTINUE) {
+                ecu.tx_waiting_fc = false;
+                ecu.tx_block_size = d[1];
+                ecu.tx_block_left = d[1];
+                ecu.tx_st_min_us = isotp_st_min_us(d[2]);
+                ecu.tx_time = fake_can_now_us - ecu.tx_st_min_us;
+            } else if ((d[0] & 0x0F) == ISOTP_FC_OVERFLOW) {
+                ecu.tx_waiting_fc = false;
+                ecu.tx_refused = true;
+                ecu.tx = NULL;
+            }
+            break;
+        }
+        default:
+            ecu.errors++;
+            break;
+    }
+}
+
+static void ecu_send_pdu(const uint8_t* data, uint16_t len) {
+    uint8_t frame[8];
+    if (len <= ISOTP_SF_MAX_DATA) {
+        frame[0] = (uint8_t)len;
+        memcpy(&frame[1], data, len);
+        ecu_send_frame(frame, (uint8_t)(len + 1));
+        return;
+    }
+    frame[0] = (uint8_t)(ISOTP_PCI_FIRST | (len >> 8));
+    frame[1] = (uint8_t)len;
+    memcpy(&frame[2], data, ISOTP_FF_DATA);
+    ecu.tx = data;
+    ecu.tx_len = len;
+    ecu.tx_offset = ISOTP_FF_DATA;
+    ecu.tx_sn = 1;
+    ecu.tx_cf_sent = 0;
+    ecu.tx_waiting_fc = true;
+    ecu.tx_refused = false;
+    ecu_send_frame(frame, sizeof(frame));
+}
+
+static void ecu_step(void) {
+    while (ecu.log_index < fake_can_tx_count) {
+        const CAN_Message* msg = &fake_can_tx_log[ecu.log_index++];
+        if (msg->id == PROBE_ID && msg->format == CANStandard) {
+            ecu_receive(msg);
+        } else {
+            ecu.errors++;
+        }
+    }
+
+    if (ecu.fc_due && fake_can_now_us - ecu.fc_time < UINT32_MAX / 2
+        && ecu.fc_limit != 0) {
+        uint8_t frame[3] = { ISOTP_PCI_FLOW_CONTROL | ISOTP_FC_WAIT, ecu.block_size, ecu.st_min };
+        if (ecu.waits_left > 0) {
+            ecu.waits_left--;
+            ecu.fc_time = fake_can_now_us + ecu.wait_interval_us;
+        } else {
+            frame[0] = (uint8_t)(ISOTP_PCI_FLOW_CONTROL | ecu.fc_status);
+            ecu.fc_due = false;
+            ecu.rx_in_block = 0;
+            if (ecu.fc_limit > 0) {
+                ecu.fc_limit--;
+            }
+        }
+        ecu.fc_sent++;
+        ecu_send_frame(frame, sizeof(frame));
+    }
+
+    while (ecu.tx != NULL && !ecu.tx_waiting_fc && ecu.tx_cf_sent != ecu.tx_stop_after
+           && fake_can_now_us - ecu.tx_time >= ecu.tx_st_min_us) {
+        uint8_t frame[8];
+        uint16_t len = ecu.tx_len - ecu.tx_offset;
+        len = (len < ISOTP_CF_DATA) ? len : ISOTP_CF_DATA;
+        ecu.tx_cf_sent++;
+        uint8_t sn = (ecu.tx_cf_sent == ecu.tx_bad_sn_at) ? (uint8_t)(ecu.tx_sn + 1) : ecu.tx_sn;
+        frame[0] = (uint8_t)(ISOTP_PCI_CONSECUTIVE | (sn & 0x0F));
+        memcpy(&frame[1], &ecu.tx[ecu.tx_offset], len);
+        ecu_send_frame(frame, (uint8_t)(len + 1));
+        ecu.tx_offset += len;
+        ecu.tx_sn = (ecu.tx_sn + 1) & 0x0F;
+        ecu.tx_time = fake_can_now_us;
+        if (ecu.tx_offset == ecu.tx_len) {
+            ecu.tx = NULL;
+        } else if (ecu.tx_block_size != 0 && --ecu.tx_block_left == 0) {
+            ecu.tx_waiting_fc = true;
+        }
+    }
+}
+
+/* Run the bus until an event arrives or time runs out */
+static uint8_t run_for(uint32_t duration_us) {
+    uint8_t events = 0;
+    for (uint32_t t = 0; t < duration_us && events == 0; t += TICK_US) {
+        fake_can_now_us += TICK_US;
+        isotp_update();
+        ecu_step();
+        events = isotp_take_events();
+    }
+    return events;
+}
+
+static uint8_t pdu[ISOTP_MAX_PDU_LEN];
+
+static void fill_pdu(uint16_t len, unsigned seed) {
+    srand(seed);
+    for (uint16_t i = 0; i < len; i++) {
+        pdu[i] = (uint8_t)rand();
+    }
+}
+
+static bool probe_send(uint16_t len) {
+    return isotp_tx_append(pdu, len) && isotp_tx_start();
+}
+
+static void test_single_frames(void) {
+    setup(0, 0, true);
+    fill_pdu(7, 1);
+    CHECK(probe_send(7));
+    CHECK_EQ(isotp_take_events(), ISOTP_EVENT_TX_DONE);
+    ecu_step();
+    CHECK(ecu.rx_done);
+    CHECK_EQ(ecu.rx_len, 7);
+    CHECK(memcmp(ecu.rx, pdu, 7) == 0);
+    CHECK_EQ(ecu.errors, 0);
+
+    /* Unpadded */
+    setup(0, 0, false);
+    CHECK(probe_send(3));
+    CHECK_EQ(fake_can_tx_log[0].len, 4);
+    CHECK_EQ(fake_can_tx_log[0].data[0], 0x03);
+
+    /* Nothing to send, or appending mid-transmission */
+    CHECK(!isotp_tx_start());
+    CHECK(probe_send(20));
+    CHECK(!isotp_tx_append(pdu, 1));
+    CHECK(!isotp_tx_append(pdu, ISOTP_MAX_PDU_LEN + 1));
+
+    setup(0, 0, false);
+    ecu_send_pdu((const uint8_t*)"\x3E\x00", 2);
+    const uint8_t* data;
+    CHECK_EQ(isotp_rx_pdu(&data), 2);
+    CHECK(memcmp(data, "\x3E\x00", 2) == 0);
+    isotp_rx_release();
+    CHECK_EQ(isotp_rx_pdu(&data), 0);
+
+    /* Not for us */
+    CAN_Message other = { .id = ECU_ID + 1, .len = 8, .type = CANData };
+    CHECK(!isotp_handle_frame(&other));
+    other.id = ECU_ID;
+    other.format = CANExtended;
+    CHECK(!isotp_handle_frame(&other));
+    other.format = CANStandard;
+    other.type = CANRemote;
+    CHECK(!isotp_handle_frame(&other));
+
+    /* Invalid single frame lengths are ignored */
+    ecu_send_frame((const uint8_t*)"\x00", 1);
+    ecu_send_frame((const uint8_t*)"\x08\x01\x02\x03\x04\x05\x06\x07", 8);
+    ecu_send_frame((const uint8_t*)"\x05\x01\x02", 3);
+    CHECK_EQ(isotp_rx_pdu(&data), 0);
+    isotp_disable();
+    CHECK(!isotp_handle_frame(&other));
+}
+
+/* Segmented transmission paced by the ECU's block size and STmin */
+static void test_segmented_tx(void) {
+    static const struct {
+        uint8_t block_size;
+        uint8_t st_min;
+        uint32_t st_min_us;
+    } cases[] = {
+        { 0, 0x00, 0 },
+        { 1, 0x00, 0 },
+        { 4, 0x05, 5000 },
+        { 8, 0xF3, 300 },
+        { 3, 0xF9, 900 },
+        { 0, 0x14, 20000 },
+        { 2, 0x80, 127000 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        setup(0, 0, (i & 1) != 0);
+        ecu.block_size = cases[i].block_size;
+        ecu.st_min = cases[i].st_min;
+        fill_pdu(ISOTP_MAX_PDU_LEN, (unsigned)i);
+        CHECK(probe_send(ISOTP_MAX_PDU_LEN));
+        CHECK_EQ(run_for(10000000), ISOTP_EVENT_TX_DONE);
+        ecu_step();
+
+        int cfs = (ISOTP_MAX_PDU_LEN - ISOTP_FF_DATA + ISOTP_CF_DATA - 1) / ISOTP_CF_DATA;
+        int blocks = cases[i].block_size ? (cfs + cases[i].block_size - 1) / cases[i].block_size : 1;
+        CHECK(ecu.rx_done);
+        CHECK_EQ(ecu.rx_len, ISOTP_MAX_PDU_LEN);
+        CHECK(memcmp(ecu.rx, pdu, ISOTP_MAX_PDU_LEN) == 0);
+        CHECK_EQ(ecu.errors, 0);
+        CHECK_EQ(ecu.cf_count, cfs);
+        CHECK_EQ(ecu.fc_sent, blocks);
+        if (cases[i].block_size != 1) {
+            // No faster than STmin, and no more than a tick slower
+            CHECK(ecu.min_cf_gap >= cases[i].st_min_us);
+            CHECK(ecu.max_cf_gap <= cases[i].st_min_us + TICK_US);
+        }
+    }
+}
+
+static void test_fc_wait(void) {
+    /* WAITs, each well within N_Bs, for longer than N_Bs in total */
+    setup(0, 0, false);
+    ecu.waits = 3;
+    ecu.wait_interval_us = 900000;
+    fill_pdu(100, 2);
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(5000000), ISOTP_EVENT_TX_DONE);
+    CHECK_EQ(ecu.errors, 0);
+    CHECK_EQ(ecu.fc_sent, 4);
+
+    /* The limit applies to each flow control, not the whole PDU */
+    setup(0, 0, false);
+    ecu.waits = ISOTP_MAX_WAIT_FRAMES;
+    ecu.wait_interval_us = 1000;
+    ecu.block_size = 5;
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(5000000), ISOTP_EVENT_TX_DONE);
+    ecu_step();
+    CHECK(ecu.rx_done);
+    CHECK_EQ(ecu.errors, 0);
+
+    /* One WAIT too many abandons the PDU */
+    setup(0, 0, false);
+    ecu.waits = ISOTP_MAX_WAIT_FRAMES + 1;
+    ecu.wait_interval_us = 1000;
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(5000000), ISOTP_EVENT_TX_STALLED);
+    CHECK_EQ(run_for(5000000), 0);
+    CHECK_EQ(ecu.cf_count, 0);
+    CHECK_EQ(fake_can_tx_count, 1);
+
+    /* Ready for the next one */
+    ecu.waits = 0;
+    CHECK(probe_send(10));
+    CHECK_EQ(run_for(1000000), ISOTP_EVENT_TX_DONE);
+}
+
+static void test_fc_overflow(void) {
+    setup(0, 0, false);
+    ecu.fc_status = ISOTP_FC_OVERFLOW;
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(1000000), ISOTP_EVENT_TX_REFUSED);
+    CHECK_EQ(run_for(1000000), 0);
+    CHECK_EQ(ecu.cf_count, 0);
+
+    /* Reserved flow status values are treated the same */
+    setup(0, 0, false);
+    ecu.fc_status = 0x7;
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(1000000), ISOTP_EVENT_TX_REFUSED);
+}
+
+/* N_Bs: no flow control after the first frame, or after a block */
+static void test_fc_timeout(void) {
+    setup(0, 0, false);
+    ecu.fc_limit = 0;
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(ISOTP_TIMEOUT_US - TICK_US), 0);
+    CHECK_EQ(run_for(2 * TICK_US), ISOTP_EVENT_TX_TIMEOUT);
+
+    setup(0, 0, false);
+    ecu.fc_limit = 2;
+    ecu.block_size = 3;
+    CHECK(probe_send(100));
+    CHECK_EQ(run_for(2 * ISOTP_TIMEOUT_US), ISOTP_EVENT_TX_TIMEOUT);
+    CHECK_EQ(ecu.cf_count, 6);
+    uint32_t quiet = fake_can_now_us - ecu.last_cf_time;
+    CHECK(quiet > ISOTP_TIMEOUT_US && quiet <= ISOTP_TIMEOUT_US + TICK_US);
+}
+
+/* A full CAN TX queue delays frames without losing or reordering them */
+static void test_tx_queue_full(void) {
+    setup(0, 0, false);
+    ecu.st_min = 0x01;
+    fill_pdu(200, 3);
+    CHECK(probe_send(200));
+    CHECK_EQ(run_for(500), 0);
+    fake_can_tx_full = true;
+    CHECK_EQ(run_for(10000), 0);
+    fake_can_tx_full = false;
+    CHECK_EQ(run_for(1000000), ISOTP_EVENT_TX_DONE);
+    ecu_step();
+    CHECK(ecu.rx_done);
+    CHECK(memcmp(ecu.rx, pdu, 200) == 0);
+    CHECK_EQ(ecu.errors, 0);
+}
+
+/* Segmented reception, paced by our own block size and STmin */
+static void test_segmented_rx(void) {
+    static const struct {
+        uint8_t block_size;
+        uint8_t st_min;
+    } cases[] = {
+        { 0, 0x00 },
+        { 1, 0x00 },
+        { 4, 0x02 },
+        { 8, 0xF5 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        setup(cases[i].block_size, cases[i].st_min, false);
+        fill_pdu(200, (unsigned)(10 + i));
+        ecu_send_pdu(pdu, 200);
+        CHECK_EQ(run_for(2000000), 0);
+
+        const uint8_t* data;
+        CHECK_EQ(isotp_rx_pdu(&data), 200);
+        CHECK(memcmp(data, pdu, 200) == 0);
+        CHECK_EQ(ecu.errors, 0);
+        CHECK_EQ(ecu.probe_fc[1], cases[i].block_size);
+        CHECK_EQ(ecu.probe_fc[2], cases[i].st_min);
+
+        int cfs = (200 - ISOTP_FF_DATA + ISOTP_CF_DATA - 1) / ISOTP_CF_DATA;
+        int fcs = 1 + (cases[i].block_size ? (cfs - 1) / cases[i].block_size : 0);
+        CHECK_EQ(ecu.probe_fc_count, fcs);
+        isotp_rx_release();
+    }
+}
+
+static void test_bad_sequence(void) {
+    setup(0, 0, false);
+    fill_pdu(100, 4);
+    ecu.tx_bad_sn_at = 3;
+    ecu_send_pdu(pdu, 100);
+    CHECK_EQ(run_for(100000), ISOTP_EVENT_RX_ERROR);
+    CHECK_EQ(run_for(2 * ISOTP_TIMEOUT_US), 0);
+
+    const uint8_t* data;
+    CHECK_EQ(isotp_rx_pdu(&data), 0);
+
+    /* The next PDU goes through */
+    ecu.tx_bad_sn_at = 0;
+    ecu_send_pdu(pdu, 100);
+    CHECK_EQ(run_for(100000), 0);
+    CHECK_EQ(isotp_rx_pdu(&data), 100);
+    CHECK(memcmp(data, pdu, 100) == 0);
+
+    /* Consecutive frames out of the blue are ignored */
+    isotp_rx_release();
+    ecu_send_frame((const uint8_t*)"\x21\x01\x02\x03\x04\x05\x06\x07", 8);
+    CHECK_EQ(isotp_take_events(), 0);
+    CHECK_EQ(isotp_rx_pdu(&data), 0);
+}
+
+/* N_Cr: the ECU stops sending mid-PDU */
+static void test_cf_timeout(void) {
+    setup(0, 0, false);
+    fill_pdu(100, 5);
+    ecu.tx_stop_after = 2;
+    ecu_send_pdu(pdu, 100);
+    CHECK_EQ(run_for(TICK_US), 0);
+    CHECK_EQ(ecu.tx_cf_sent, 2);
+    CHECK_EQ(run_for(ISOTP_TIMEOUT_US - TICK_US), 0);
+    CHECK_EQ(run_for(2 * TICK_US), ISOTP_EVENT_RX_TIMEOUT);
+    const uint8_t* data;
+    CHECK_EQ(isotp_rx_pdu(&data), 0);
+
+    /* A first frame restarts reception */
+    ecu.tx_stop_after = -1;
+    ecu_send_pdu(pdu, 100);
+    CHECK_EQ(run_for(100000), 0);
+    CHECK_EQ(isotp_rx_pdu(&data), 100);
+}
+
+static void test_rx_overflow(void) {
+    /* Longer than we can hold */
+    setup(0, 0, false);
+    ecu_send_frame((const uint8_t*)"\x11\x01\x00\x00\x00\x00\x00\x00", 8);
+    ecu_step();
+    CHECK_EQ(ecu.probe_fc_count, 1);
+    CHECK_EQ(ecu.probe_fc[0], ISOTP_PCI_FLOW_CONTROL | ISOTP_FC_OVERFLOW);
+
+    /* The host hasn't collected the last PDU yet */
+    setup(0, 0, false);
+    ecu_send_pdu((const uint8_t*)"\x01", 1);
+    ecu_send_pdu((const uint8_t*)"\x02", 1);
+    CHECK_EQ(isotp_take_events(), ISOTP_EVENT_RX_DROPPED);
+    fill_pdu(50, 6);
+    ecu_send_pdu(pdu, 50);
+    CHECK_EQ(isotp_take_events(), ISOTP_EVENT_RX_DROPPED);
+    ecu_step();
+    CHECK_EQ(ecu.probe_fc[0], ISOTP_PCI_FLOW_CONTROL | ISOTP_FC_OVERFLOW);
+    CHECK(ecu.tx_refused);
+
+    const uint8_t* data;
+    CHECK_EQ(isotp_rx_pdu(&data), 1);
+    CHECK_EQ(data[0], 0x01);
+
+    /* First frames that should have been single frames are ignored */
+    isotp_rx_release();
+    ecu_send_frame((const uint8_t*)"\x10\x07\x01\x02\x03\x04\x05\x06", 8);
+    ecu_step();
+    CHECK_EQ(ecu.probe_fc_count, 1);
+}
+
+int main(void) {
+    test_single_frames();
+    test_segmented_tx();
+    test_fc_wait();
+    test_fc_overflow();
+    test_fc_timeout();
+    test_tx_queue_full();
+    test_segmented_rx();
+    test_bad_sequence();
+    test_cf_timeout();
+    test_rx_overflow();
+    return test_report("test_isotp");
+}
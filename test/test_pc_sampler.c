@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#define PC_SAMPLER 1
+
+#include "test.h"
+#include "swd_session.h"
+#include "DAP/CMSIS_DAP.c"
+#include "DAP/swd_shadow.c"
+#include "DAP/pc_sampler.c"
+
+/* Stand-in for tick.c; the tests move the clock past any backoff */
+static uint32_t fake_ticks;
+
+uint32_t get_ticks(void) {
+    return fake_ticks;
+}
+
+/* As fast as possible, over the whole of RAM */
+static void sampler_start(uint8_t mode) {
+    const uint8_t request[16] = {
+        ID_DAP_PCSampler, PC_SAMPLER_CONFIGURE, PC_SAMPLER_ENABLE, mode, 0, 8,
+        0x00, 0x00, 0x00, 0x20,
+        0, 0, 0, 0,
+        0, 0,
+    };
+    uint8_t response[8];
+    CHECK_EQ(DAP_sampler_vendor_command(request, response), (16U << 16) | 2U);
+    CHECK_EQ(response[1], DAP_OK);
+}
+
+/* The host's word setup, which also tells the shadows SELECT */
+static void host_setup(void) {
+    Packet packet;
+    transfer_begin(&packet);
+    transfer_add(&packet, REQ_DP_WRITE(DP_SELECT), 0);
+    transfer_add(&packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+    transfer_add(&packet, REQ_AP_WRITE(AP_TAR), FAKE_SWD_RAM_BASE + 0x40U);
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+}
+
+static void sampler_run(void) {
+    fake_ticks += 1000U;
+    DAP_sampler_update();
+}
+
+/* The fake target has no PCSR, so reading it is the sampler's own bus error */
+static void test_update_clears_own_error(void) {
+    session_connect(0, 0, 0);
+    sampler_start(PC_SAMPLER_MODE_PCSR);
+    host_setup();
+
+    sampler_run();
+    CHECK(!fake_swd.sticky);
+    CHECK_EQ(total_errors, 1);
+    CHECK_EQ(fake_swd.select, 0);
+    CHECK_EQ(fake_swd.csw[0], CSW_WORD_INC);
+    CHECK_EQ(fake_swd.tar[0], FAKE_SWD_RAM_BASE + 0x40U);
+}
+
+/* A sticky error the host left behind is for the host to clear */
+static void test_update_keeps_host_error(void) {
+    for (uint8_t mode = PC_SAMPLER_MODE_AUTO; mode <= PC_SAMPLER_MODE_HALT; mode++) {
+        session_connect(0, 0, 0);
+        sampler_start(mode);
+        host_setup();
+
+        fake_swd.sticky = true;
+        uint32_t accesses = fake_swd_ap_accesses;
+        sampler_run();
+        CHECK(fake_swd.sticky);
+        CHECK_EQ(fake_swd_ap_accesses, accesses);
+        CHECK_EQ(active_mode, mode);
+
+        /* Once the host clears it, sampling carries on and cleans up after itself */
+        const uint8_t abort[] = { ID_DAP_WriteABORT, 0, ABORT_CLEAR_ALL, 0, 0, 0 };
+        session_execute(abort);
+        sampler_run();
+        CHECK(fake_swd_ap_accesses > accesses);
+        CHECK(!fake_swd.sticky);
+        CHECK_EQ(fake_swd.csw[0], CSW_WORD_INC);
+        CHECK_EQ(fake_swd.tar[0], FAKE_SWD_RAM_BASE + 0x40U);
+    }
+}
+
+int main(void) {
+    test_update_clears_own_error();
+    test_update_keeps_host_error();
+    return test_report("test_pc_sampler");
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#define DAP_READ_CACHE 1
+
+#include "test.h"
+#include "swd_session.h"
+#include "DAP/CMSIS_DAP.c"
+#include "DAP/swd_shadow.c"
+#include "DAP/read_cache.c"
+
+#define SEEDS       40U
+#define COMMANDS    2000U
+
+/* Memory a debugger keeps on screen, and the running core keeps changing */
+#define WATCH_BASE  (FAKE_SWD_RAM_BASE + 0x400U)
+#define WATCH_WORDS 64U
+
+static unsigned wait_seed;
+static uint8_t cache_flags_on;
+
+/* Debugger and core state, started over by each connect */
+static bool block_next;
+static uint16_t block_words;
+static uint32_t core_steps;
+static uint32_t refresh_index;
+
+static void cache_configure(uint8_t flags, uint8_t lines) {
+    const uint8_t request[4] = { ID_DAP_ReadCache, DAP_READ_CACHE_CONFIGURE, flags, lines };
+    uint8_t response[32];
+    CHECK_EQ(DAP_cache_vendor_command(request, response), (4U << 16) | 2U);
+    CHECK_EQ(response[1], DAP_OK);
+
+    const uint8_t clear[2] = { ID_DAP_ReadCache, DAP_READ_CACHE_CLEAR_COUNT };
+    DAP_cache_vendor_command(clear, response);
+}
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t prefetches;
+} CacheCounts;
+
+static CacheCounts cache_counts(void) {
+    const uint8_t request[2] = { ID_DAP_ReadCache, DAP_READ_CACHE_READ_STATUS };
+    uint8_t response[32];
+    CacheCounts counts;
+    DAP_cache_vendor_command(request, response);
+    memcpy(&counts.hits, &response[6], 4);
+    memcpy(&counts.misses, &response[10], 4);
+    memcpy(&counts.prefetches, &response[14], 4);
+    return counts;
+}
+
+static void connect_plain(void) {
+    session_connect(0, 12, wait_seed);
+    block_next = false;
+    core_steps = 0;
+    refresh_index = 0;
+    cache_configure(0, 0);
+}
+
+static void connect_cached(void) {
+    session_connect(0, 12, wait_seed);
+    block_next = false;
+    core_steps = 0;
+    refresh_index = 0;
+    cache_configure(cache_flags_on, (uint8_t)(wait_seed % 4U));
+}
+
+/* The core changes a few watched words each time round, while it runs */
+static void core_step(void) {
+    if (fake_swd.dhcsr & FAKE_SWD_DHCSR_S_HALT) {
+        return;
+    }
+    core_steps++;
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t index = (core_steps * 37U + i * 11U) % WATCH_WORDS;
+        fake_swd.ram[(WATCH_BASE - FAKE_SWD_RAM_BASE) / 4U + index] += core_steps;
+    }
+}
+
+/* What app.c does between commands */
+static void probe_idle(void) {
+    core_step();
+    DAP_cache_prefetch();
+}
+
+static bool cache_settled(void) {
+    return !tar_pending && restore_pending == 0U;
+}
+
+static void dhcsr_write(Packet* packet, uint32_t value) {
+    transfer_begin(packet);
+    transfer_add(packet, REQ_DP_WRITE(DP_SELECT), 0);
+    transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD);
+    transfer_add(packet, REQ_AP_WRITE(AP_TAR), FAKE_SWD_DHCSR);
+    transfer_add(packet, REQ_AP_WRITE(AP_DRW), value);
+}
+
+static void dhcsr_read(Packet* packet) {
+    transfer_begin(packet);
+    transfer_add(packet, REQ_DP_WRITE(DP_SELECT), 0);
+    transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD);
+    transfer_add(packet, REQ_AP_WRITE(AP_TAR), FAKE_SWD_DHCSR);
+    transfer_add(packet, REQ_AP_READ(AP_DRW), 0);
+}
+
+/*
+ * A debugger that halts and resumes the core, polls DHCSR, and keeps
+ * reading the same stretch of memory a block at a time, in between
+ * the random host's commands.
+ */
+static void debugger_command(Host* host, Packet* packet) {
+    if (block_next) {
+        block_next = false;
+        block_build(packet, REQ_AP_READ(AP_DRW), block_words, NULL);
+        return;
+    }
+
+    uint32_t roll = host_random(host, 100);
+    if (roll < 10) {
+        host_command(host, packet);
+    } else if (roll < 70) {
+        /* TAR now, the block read as the next command */
+        uint32_t word = host_random(host, WATCH_WORDS);
+        block_words = (uint16_t)(1U + host_random(host, 15));
+        transfer_begin(packet);
+        transfer_add(packet, REQ_DP_WRITE(DP_SELECT), 0);
+        transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+        transfer_add(packet, REQ_AP_WRITE(AP_TAR), WATCH_BASE + 4U * word);
+        block_next = true;
+    } else if (roll < 78) {
+        dhcsr_write(packet, FAKE_SWD_DHCSR_KEY | FAKE_SWD_DHCSR_C_HALT | 1U);
+    } else if (roll < 81) {
+        dhcsr_write(packet, FAKE_SWD_DHCSR_KEY | 1U);
+    } else if (roll < 95) {
+        dhcsr_read(packet);
+    } else {
+        /* A memory write; the TAR setup is reused by the next block read */
+        transfer_begin(packet);
+        transfer_add(packet, REQ_DP_WRITE(DP_SELECT), 0);
+        transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+        transfer_add(packet, REQ_AP_WRITE(AP_TAR), WATCH_BASE + 4U * host_random(host, WATCH_WORDS));
+        transfer_add(packet, REQ_AP_WRITE(AP_DRW), (uint32_t)rand_r(&host->seed));
+    }
+}
+
+/* Locals, a stack frame and a memory view read straight through */
+static const struct {
+    uint32_t offset;
+    uint16_t words;
+} refresh_views[] = {
+    { 0x000U, 6 }, { 0x080U, 12 }, { 0x100U, 14 }, { 0x138U, 14 }, { 0x170U, 14 },
+};
+
+#define REFRESH_VIEWS   (sizeof(refresh_views) / sizeof(refresh_views[0]))
+#define REFRESH_ROUNDS  4U
+
+/*
+ * A debugger stepping the core, then refreshing its views a few times
+ * over while the core sits halted: resume, halt, poll DHCSR, then each
+ * view's TAR setup followed by its block read.
+ */
+static void refresh_command(Host* host, Packet* packet) {
+    (void)host;
+    uint32_t step = refresh_index++ % (3U + 2U * REFRESH_VIEWS * REFRESH_ROUNDS);
+    if (step == 0U) {
+        dhcsr_write(packet, FAKE_SWD_DHCSR_KEY | 1U);
+    } else if (step == 1U) {
+        dhcsr_write(packet, FAKE_SWD_DHCSR_KEY | FAKE_SWD_DHCSR_C_HALT | 1U);
+    } else if (step == 2U) {
+        dhcsr_read(packet);
+    } else {
+        uint32_t view = ((step - 3U) / 2U) % REFRESH_VIEWS;
+        if ((step - 3U) % 2U == 0U) {
+            transfer_begin(packet);
+            transfer_add(packet, REQ_DP_WRITE(DP_SELECT), 0);
+            transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+            transfer_add(packet, REQ_AP_WRITE(AP_TAR), WATCH_BASE + refresh_views[view].offset);
+        } else {
+            block_build(packet, REQ_AP_READ(AP_DRW), refresh_views[view].words, NULL);
+        }
+    }
+}
+
+/* Setup and a block read of count words at address */
+static void read_block(uint32_t address, uint16_t count) {
+    Packet packet;
+    transfer_begin(&packet);
+    transfer_add(&packet, REQ_DP_WRITE(DP_SELECT), 0);
+    transfer_add(&packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+    transfer_add(&packet, REQ_AP_WRITE(AP_TAR), address);
+    session_send(&packet);
+    block_build(&packet, REQ_AP_READ(AP_DRW), count, NULL);
+    session_send(&packet);
+}
+
+static uint32_t block_word(uint32_t index) {
+    uint32_t value;
+    memcpy(&value, &session_response[4 + 4 * index], 4);
+    return value;
+}
+
+static void test_hit_only_while_halted(void) {
+    Packet packet;
+    session_connect(0, 0, 0);
+    cache_configure(DAP_READ_CACHE_ENABLE, 0);
+    fake_swd.ram[0x100] = 0x11111111;
+
+    /* Nothing is cached until DHCSR has been seen to show a halt */
+    read_block(WATCH_BASE, 4);
+    read_block(WATCH_BASE, 4);
+    CHECK_EQ(cache_counts().hits, 0);
+
+    dhcsr_read(&packet);
+    session_send(&packet);
+    read_block(WATCH_BASE, 4);
+    uint32_t wire = fake_swd_wire;
+    read_block(WATCH_BASE, 4);
+    CHECK_EQ(cache_counts().hits, 1);
+    CHECK_EQ(block_word(0), 0x11111111);
+    /* Only the setup writes and the RDBUFF read that checks them */
+    CHECK_EQ(fake_swd_wire - wire, 4);
+
+    /* Resuming drops the lines; the core then changes the word */
+    dhcsr_write(&packet, FAKE_SWD_DHCSR_KEY | 1U);
+    session_send(&packet);
+    fake_swd.ram[0x100] = 0x22222222;
+    read_block(WATCH_BASE, 4);
+    CHECK_EQ(block_word(0), 0x22222222);
+    CHECK_EQ(cache_counts().hits, 1);
+}
+
+static void test_prefetch_fills_next_line(void) {
+    Packet packet;
+    session_connect(0, 0, 0);
+    cache_configure(DAP_READ_CACHE_ENABLE | DAP_READ_CACHE_PREFETCH, 0);
+    for (uint32_t i = 0; i < 32; i++) {
+        fake_swd.ram[0x100 + i] = 0xC0DE0000U + i;
+    }
+
+    dhcsr_read(&packet);
+    session_send(&packet);
+    read_block(WATCH_BASE, 8);
+    CHECK(DAP_cache_prefetch());
+    CHECK_EQ(cache_counts().prefetches, 1);
+
+    /* The host's TAR is put back before anything else goes out */
+    transfer_begin(&packet);
+    transfer_add(&packet, REQ_AP_READ(AP_TAR), 0);
+    transfer_add(&packet, REQ_DP_READ(DP_RDBUFF), 0);
+    session_send(&packet);
+    CHECK_EQ(transfer_word(1), WATCH_BASE + 32U);
+
+    block_build(&packet, REQ_AP_READ(AP_DRW), 8, NULL);
+    session_send(&packet);
+    CHECK_EQ(cache_counts().hits, 1);
+    CHECK_EQ(block_word(7), 0xC0DE000FU);
+}
+
+/* A prefetched line the host never reads stops further prefetching */
+static void test_prefetch_backs_off(void) {
+    Packet packet;
+    session_connect(0, 0, 0);
+    cache_configure(DAP_READ_CACHE_ENABLE | DAP_READ_CACHE_PREFETCH, 0);
+    dhcsr_read(&packet);
+    session_send(&packet);
+
+    read_block(WATCH_BASE, 8);
+    CHECK(DAP_cache_prefetch());
+    read_block(WATCH_BASE + 0x80U, 8);
+    CHECK(!DAP_cache_prefetch());
+
+    /* Reading into the prefetched line earns it back; a hit arms nothing */
+    read_block(WATCH_BASE + 0x20U, 8);
+    CHECK_EQ(cache_counts().hits, 1);
+    CHECK(!DAP_cache_prefetch());
+    read_block(WATCH_BASE + 0xC0U, 8);
+    CHECK(DAP_cache_prefetch());
+
+    /* So does reading straight through */
+    read_block(WATCH_BASE + 0x100U, 4);
+    read_block(WATCH_BASE + 0x110U, 4);
+    CHECK(!DAP_cache_prefetch());
+    read_block(WATCH_BASE + 0x120U, 4);
+    CHECK(DAP_cache_prefetch());
+    CHECK_EQ(cache_counts().prefetches, 3);
+}
+
+/* A sticky error the host left behind is for the host to clear */
+static void test_prefetch_keeps_host_error(void) {
+    Packet packet;
+    session_connect(0, 0, 0);
+    cache_configure(DAP_READ_CACHE_ENABLE | DAP_READ_CACHE_PREFETCH, 0);
+    dhcsr_read(&packet);
+    session_send(&packet);
+    read_block(WATCH_BASE, 4);
+
+    fake_swd.sticky = true;
+    DAP_cache_prefetch();
+    CHECK(fake_swd.sticky);
+}
+
+/* Refreshing halted memory must take fewer transfers, prefetch included */
+static void test_halted_refresh(void) {
+    uint64_t plain_wire = 0;
+    uint64_t cached_wire = 0;
+    CacheCounts total = { 0, 0, 0 };
+
+    host_reads_rdbuff = false;
+    session_host = refresh_command;
+    session_idle = probe_idle;
+    session_settled = cache_settled;
+    for (unsigned seed = 1; seed <= 8; seed++) {
+        uint32_t wire;
+        /* All the lines, so that the views fit */
+        wait_seed = seed * 4U * 7919U;
+        cache_flags_on = DAP_READ_CACHE_ENABLE | DAP_READ_CACHE_PREFETCH
+                       | ((seed & 1U) ? DAP_READ_CACHE_LRU : 0U);
+        SessionResult result = session_compare(seed, COMMANDS, connect_plain, connect_cached, &wire);
+        CHECK_EQ(result.mismatches, 0);
+        CacheCounts counts = cache_counts();
+        plain_wire += wire;
+        cached_wire += result.wire;
+        total.hits += counts.hits;
+        total.misses += counts.misses;
+        total.prefetches += counts.prefetches;
+    }
+
+    CHECK(total.hits > total.misses);
+    CHECK(total.prefetches > 0);
+    CHECK(cached_wire < plain_wire);
+    printf("test_read_cache: halted refresh %llu wire transfers plain, %llu cached, %u hits, %u misses, %u prefetches\n",
+           (unsigned long long)plain_wire, (unsigned long long)cached_wire,
+           total.hits, total.misses, total.prefetches);
+}
+
+static void test_sessions_match(void) {
+    static const uint8_t flags[] = {
+        DAP_READ_CACHE_ENABLE,
+        DAP_READ_CACHE_ENABLE | DAP_READ_CACHE_PREFETCH,
+        DAP_READ_CACHE_ENABLE | DAP_READ_CACHE_PREFETCH | DAP_READ_CACHE_LRU,
+    };
+    uint64_t plain_wire = 0;
+    uint64_t cached_wire = 0;
+    CacheCounts total = { 0, 0, 0 };
+
+    host_reads_rdbuff = false;
+    session_host = debugger_command;
+    session_idle = probe_idle;
+    session_settled = cache_settled;
+    for (unsigned seed = 1; seed <= SEEDS; seed++) {
+        uint32_t wire;
+        wait_seed = seed * 7919U;
+        cache_flags_on = flags[seed % 3U];
+        SessionResult result = session_compare(seed, COMMANDS, connect_plain, connect_cached, &wire);
+        CHECK_EQ(result.mismatches, 0);
+        CacheCounts counts = cache_counts();
+        plain_wire += wire;
+        cached_wire += result.wire;
+        total.hits += counts.hits;
+        total.misses += counts.misses;
+        total.prefetches += counts.prefetches;
+    }
+
+    /* Random reads rarely use a prefetched line, so prefetching mostly backs off */
+    CHECK(total.hits > SEEDS * 10);
+    CHECK(cached_wire < plain_wire);
+    printf("test_read_cache: %llu wire transfers plain, %llu cached, %u hits, %u misses, %u prefetches\n",
+           (unsigned long long)plain_wire, (unsigned long long)cached_wire,
+           total.hits, total.misses, total.prefetches);
+}
+
+int main(void) {
+    test_hit_only_while_halted();
+    test_prefetch_fills_next_line();
+    test_prefetch_backs_off();
+    test_prefetch_keeps_host_error();
+    test_halted_refresh();
+    test_sessions_match();
+    return test_report("test_read_cache");
+}
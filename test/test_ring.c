@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "test.h"
+#include "ring.h"
+
+_Static_assert(RING_CAPACITY_VALID(1), "1 is a power of two");
+_Static_assert(RING_CAPACITY_VALID(256), "256 is valid");
+_Static_assert(RING_CAPACITY_VALID(16384), "16384 is valid");
+_Static_assert(!RING_CAPACITY_VALID(32768), "32768 is too large");
+_Static_assert(!RING_CAPACITY_VALID(48), "48 is not a power of two");
+_Static_assert(!RING_CAPACITY_VALID(255), "255 is not a power of two");
+
+typedef struct {
+    uint32_t id;
+    uint8_t tag;
+} __attribute__((packed)) Record;
+
+static void test_capacity_valid(void) {
+    CHECK(RING_CAPACITY_VALID(2));
+    CHECK(RING_CAPACITY_VALID(UINT16_MAX / 2 + 1) == 0);
+    CHECK(RING_CAPACITY_VALID(3) == 0);
+}
+
+static void test_empty_full(void) {
+    static uint8_t storage[16];
+    struct ring r = RING_INITIALIZER(storage);
+    uint8_t data[32];
+    for (int i = 0; i < 32; i++) {
+        data[i] = (uint8_t)i;
+    }
+
+    CHECK(ring_empty(&r));
+    CHECK(!ring_full(&r));
+    CHECK_EQ(ring_space(&r), 16);
+    CHECK_EQ(ring_read(&r, data, 4), 0);
+
+    CHECK_EQ(ring_write(&r, data, 15), 15);
+    CHECK(!ring_full(&r));
+    CHECK(ring_put(&r, &data[15]));
+    CHECK(ring_full(&r));
+    CHECK_EQ(ring_space(&r), 0);
+    CHECK(!ring_put(&r, &data[0]));
+    CHECK_EQ(ring_write(&r, data, 8), 0);
+
+    /* A short write keeps what fits */
+    uint8_t out[32];
+    CHECK_EQ(ring_read(&r, out, 4), 4);
+    CHECK_EQ(ring_write(&r, &data[16], 8), 4);
+    CHECK(ring_full(&r));
+    CHECK_EQ(ring_read(&r, out, 32), 16);
+    CHECK(ring_empty(&r));
+    CHECK(memcmp(out, &data[4], 12) == 0);
+    CHECK(memcmp(&out[12], &data[16], 4) == 0);
+
+    ring_clear(&r);
+    CHECK(ring_empty(&r));
+    CHECK_EQ(ring_space(&r), 16);
+}
+
+/* Stream through a small ring in uneven chunks so every offset wraps */
+static void test_wraparound(uint16_t start) {
+    static uint8_t storage[8];
+    struct ring r = RING_INITIALIZER(storage);
+    /* Free-running indices also wrap past UINT16_MAX */
+    r.head = start;
+    r.tail = start;
+
+    uint8_t next_in = 0;
+    uint8_t next_out = 0;
+    int mismatches = 0;
+    for (int round = 0; round < 2000; round++) {
+        uint8_t chunk[8];
+        uint16_t want = (uint16_t)(1 + round % 7);
+        for (uint16_t i = 0; i < want; i++) {
+            chunk[i] = (uint8_t)(next_in + i);
+        }
+        uint16_t written = ring_write(&r, chunk, want);
+        next_in = (uint8_t)(next_in + written);
+
+        uint8_t peeked[8];
+        uint8_t got[8];
+        uint16_t count = (uint16_t)(1 + round % 5);
+        uint16_t npeek = ring_peek(&r, peeked, count);
+        uint16_t nread = ring_read(&r, got, count);
+        if (npeek != nread || memcmp(peeked, got, nread) != 0) {
+            mismatches++;
+        }
+        for (uint16_t i = 0; i < nread; i++) {
+            if (got[i] != next_out++) {
+                mismatches++;
+            }
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(ring_used(&r), (uint8_t)(next_in - next_out));
+}
+
+static void test_records(void) {
+    static Record storage[4];
+    struct ring r = RING_INITIALIZER(storage);
+    CHECK_EQ(r.capacity, 4);
+    CHECK_EQ(r.element_size, sizeof(Record));
+
+    int mismatches = 0;
+    uint32_t next_in = 0;
+    uint32_t next_out = 0;
+    for (int round = 0; round < 100; round++) {
+        Record in[3];
+        for (int i = 0; i < 3; i++) {
+            in[i].id = next_in + (uint32_t)i;
+            in[i].tag = (uint8_t)~(next_in + (uint32_t)i);
+        }
+        next_in += ring_write(&r, in, 3);
+
+        Record out[2];
+        uint16_t n = ring_read(&r, out, 2);
+        for (uint16_t i = 0; i < n; i++, next_out++) {
+            if (out[i].id != next_out || out[i].tag != (uint8_t)~next_out) {
+                mismatches++;
+            }
+        }
+        if (round % 4 == 3) {
+            Record one;
+            while (ring_get(&r, &one)) {
+                mismatches += (one.id != next_out++);
+            }
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_spans(void) {
+    static uint8_t storage[8];
+    struct ring r = RING_INITIALIZER(storage);
+    void* span;
+
+    /* Producer span stops at the end of the storage */
+    r.head = r.tail = 5;
+    CHECK_EQ(ring_reserve(&r, &span), 3);
+    CHECK(span == &storage[5]);
+    memcpy(span, "abc", 3);
+    ring_commit(&r, 3);
+    CHECK_EQ(ring_reserve(&r, &span), 5);
+    CHECK(span == &storage[0]);
+    memcpy(span, "defgh", 5);
+    ring_commit(&r, 5);
+    CHECK(ring_full(&r));
+    CHECK_EQ(ring_reserve(&r, &span), 0);
+
+    /* Consumer span likewise, then the rest after the wrap */
+    CHECK_EQ(ring_read_span(&r, &span), 3);
+    CHECK(memcmp(span, "abc", 3) == 0);
+    ring_consume(&r, 2);
+    CHECK_EQ(ring_read_span(&r, &span), 1);
+    CHECK(memcmp(span, "c", 1) == 0);
+    ring_consume(&r, 1);
+    CHECK_EQ(ring_read_span(&r, &span), 5);
+    CHECK(memcmp(span, "defgh", 5) == 0);
+
+    /* Reserving is limited by free space as well as by the wrap */
+    CHECK_EQ(ring_reserve(&r, &span), 3);
+    CHECK(span == &storage[5]);
+    memcpy(span, "ij", 2);
+    ring_commit(&r, 2);
+    CHECK_EQ(ring_reserve(&r, &span), 1);
+    ring_consume(&r, 5);
+    CHECK_EQ(ring_read_span(&r, &span), 2);
+    CHECK(memcmp(span, "ij", 2) == 0);
+    ring_consume(&r, 2);
+    CHECK(ring_empty(&r));
+    CHECK_EQ(ring_read_span(&r, &span), 0);
+    CHECK_EQ(ring_reserve(&r, &span), 1);
+}
+
+int main(void) {
+    test_capacity_valid();
+    test_empty_full();
+    test_wraparound(0);
+    test_wraparound(0xFFF3);
+    test_records();
+    test_spans();
+    return test_report("test_ring");
+}
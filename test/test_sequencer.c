@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DAP_SEQUENCER 1
+
+#include "test.h"
+#include "swd_session.h"
+#include "DAP/CMSIS_DAP.c"
+#include "DAP/swd_shadow.c"
+#include "DAP/sequencer.c"
+
+#define I32(v)  (uint8_t)(v), (uint8_t)((v) >> 8), (uint8_t)((v) >> 16), (uint8_t)((v) >> 24)
+
+#define AP(reg) (DAP_TRANSFER_APnDP | (reg))
+
+/* Stand-in for tick.c: each call moves the clock on by fake_tick_step */
+static uint32_t fake_ticks;
+static uint32_t fake_tick_step;
+
+uint32_t get_ticks(void) {
+    fake_ticks += fake_tick_step;
+    return fake_ticks;
+}
+
+static uint8_t seq_response[DAP_PACKET_SIZE];
+static uint32_t seq_response_length;
+
+static void seq_load(const uint8_t* program, uint32_t length) {
+    const uint8_t clear[2] = { ID_DAP_Sequencer, DAP_SEQ_CLEAR };
+    DAP_sequencer_vendor_command(clear, seq_response);
+
+    for (uint32_t offset = 0; offset < length; offset += DAP_PACKET_SIZE - 4U) {
+        uint32_t chunk = length - offset;
+        if (chunk > DAP_PACKET_SIZE - 4U) {
+            chunk = DAP_PACKET_SIZE - 4U;
+        }
+        uint8_t request[DAP_PACKET_SIZE] = {
+            ID_DAP_Sequencer, DAP_SEQ_LOAD, (uint8_t)offset, (uint8_t)chunk
+        };
+        memcpy(&request[4], &program[offset], chunk);
+        CHECK_EQ(DAP_sequencer_vendor_command(request, seq_response), ((4U + chunk) << 16) | 2U);
+        CHECK_EQ(seq_response[1], DAP_OK);
+    }
+}
+
+static void seq_run(const uint32_t* params, uint8_t count, uint16_t step_limit) {
+    uint8_t request[DAP_PACKET_SIZE] = { ID_DAP_Sequencer, DAP_SEQ_RUN, count };
+    if (count) {
+        memcpy(&request[3], params, 4U * count);
+    }
+    request[3 + 4 * count] = (uint8_t)step_limit;
+    request[4 + 4 * count] = (uint8_t)(step_limit >> 8);
+
+    memset(seq_response, 0xA5, sizeof(seq_response));
+    uint32_t result = DAP_sequencer_vendor_command(request, seq_response);
+    seq_response_length = result & 0xFFFFU;
+    CHECK_EQ(result >> 16, 5U + 4U * count);
+    CHECK(seq_response_length <= DAP_PACKET_SIZE);
+    CHECK_EQ(seq_response[1], DAP_OK);
+}
+
+/* Fields of the last RUN response */
+static uint8_t seq_status(void) {
+    return seq_response[2];
+}
+
+static uint8_t seq_detail(void) {
+    return seq_response[3];
+}
+
+static uint8_t seq_pc(void) {
+    return seq_response[4];
+}
+
+static uint16_t seq_steps(void) {
+    return (uint16_t)(seq_response[5] | (seq_response[6] << 8));
+}
+
+static uint8_t seq_emitted(void) {
+    return seq_response[7];
+}
+
+static uint32_t seq_word(uint32_t index) {
+    uint32_t value;
+    memcpy(&value, &seq_response[8 + 4 * index], 4);
+    return value;
+}
+
+static void seq_connect(unsigned wait_odds) {
+    session_connect(0, wait_odds, 4242);
+    fake_tick_step = 0;
+    DAP_TransferAbort = 0U;
+    DAP_sequencer_register_poll_callback(NULL);
+}
+
+/* r0 words from r1 onwards, through an auto-incrementing TAR */
+static const uint8_t dump_program[] = {
+    /*  0 */ DAP_SEQ_OP_WRITEI, DP_SELECT, I32(0),
+    /*  6 */ DAP_SEQ_OP_WRITEI, AP(AP_CSW), I32(CSW_WORD_INC),
+    /* 12 */ DAP_SEQ_OP_WRITE, AP(AP_TAR), 1,
+    /* 15 */ DAP_SEQ_OP_READ, AP(AP_DRW), 2,
+    /* 18 */ DAP_SEQ_OP_EMIT, 2,
+    /* 20 */ DAP_SEQ_OP_LOOP, 0, 15,
+    /* 23 */ DAP_SEQ_OP_END,
+};
+
+/* Spins for ever */
+static const uint8_t spin_program[] = {
+    /*  0 */ DAP_SEQ_OP_BNE, 0, I32(1), 0,
+};
+
+static void test_dump(void) {
+    const uint32_t params[2] = { 5, FAKE_SWD_RAM_BASE + 0x40 };
+    for (unsigned wait_odds = 0; wait_odds <= 3; wait_odds += 3) {
+        seq_connect(wait_odds);
+        for (uint32_t i = 0; i < 5; i++) {
+            fake_swd.ram[0x10 + i] = 0x5EC00000U + i;
+        }
+        seq_load(dump_program, sizeof(dump_program));
+        seq_run(params, 2, 0);
+
+        CHECK_EQ(seq_status(), DAP_SEQ_OK);
+        CHECK_EQ(seq_pc(), 23);
+        CHECK_EQ(seq_steps(), 3 + 5 * 3 + 1);
+        CHECK_EQ(seq_emitted(), 5);
+        CHECK_EQ(seq_response_length, 8 + 4 * 5);
+        CHECK_EQ(seq_word(0), 0x5EC00000U);
+        CHECK_EQ(seq_word(4), 0x5EC00004U);
+    }
+}
+
+/* Write, poll until a bit is set, read */
+static void test_halt_and_poll(void) {
+    static const uint8_t program[] = {
+        /*  0 */ DAP_SEQ_OP_WRITEI, DP_SELECT, I32(0),
+        /*  6 */ DAP_SEQ_OP_WRITEI, AP(AP_CSW), I32(CSW_WORD),
+        /* 12 */ DAP_SEQ_OP_WRITEI, AP(AP_TAR), I32(FAKE_SWD_DHCSR),
+        /* 18 */ DAP_SEQ_OP_WRITEI, AP(AP_DRW), I32(FAKE_SWD_DHCSR_KEY | FAKE_SWD_DHCSR_C_HALT | 1U),
+        /* 24 */ DAP_SEQ_OP_READ, AP(AP_DRW), 1,
+        /* 27 */ DAP_SEQ_OP_MOV, 2, 1,
+        /* 30 */ DAP_SEQ_OP_ANDI, 2, I32(FAKE_SWD_DHCSR_S_HALT),
+        /* 36 */ DAP_SEQ_OP_BEQ, 2, I32(0), 24,
+        /* 42 */ DAP_SEQ_OP_EMIT, 1,
+        /* 44 */ DAP_SEQ_OP_END,
+    };
+    seq_connect(0);
+    fake_swd.dhcsr = 0;
+    seq_load(program, sizeof(program));
+    seq_run(NULL, 0, 0);
+
+    CHECK_EQ(seq_status(), DAP_SEQ_OK);
+    CHECK_EQ(seq_emitted(), 1);
+    CHECK_EQ(seq_word(0), FAKE_SWD_DHCSR_S_HALT | FAKE_SWD_DHCSR_C_HALT | 1U);
+    CHECK(fake_swd.dhcsr & FAKE_SWD_DHCSR_S_HALT);
+}
+
+static void test_step_limit(void) {
+    const uint32_t params[1] = { 0 };
+    seq_connect(0);
+    seq_load(spin_program, sizeof(spin_program));
+
+    seq_run(params, 1, 100);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_STEPS);
+    CHECK_EQ(seq_steps(), 100);
+
+    /* Zero is the largest limit there is */
+    seq_run(params, 1, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_STEPS);
+    CHECK_EQ(seq_steps(), DAP_SEQ_MAX_STEPS);
+}
+
+static void test_timeout(void) {
+    seq_connect(0);
+    fake_tick_step = 1;
+    seq_load(spin_program, sizeof(spin_program));
+    seq_run(NULL, 0, 0);
+
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_TIMEOUT);
+    CHECK_EQ(seq_steps(), DAP_SEQ_TIMEOUT_MS - 1U);
+}
+
+static void test_bad_program(void) {
+    static const struct {
+        uint8_t program[8];
+        uint8_t length;
+        uint8_t pc;
+    } cases[] = {
+        /* Unknown opcode */
+        { { DAP_SEQ_OP_MOVI, 0, I32(1), DAP_SEQ_OPS }, 7, 6 },
+        /* Register out of range, as the destination and as the source */
+        { { DAP_SEQ_OP_MOV, DAP_SEQ_REGISTERS, 0, DAP_SEQ_OP_END }, 4, 0 },
+        { { DAP_SEQ_OP_EMIT, DAP_SEQ_REGISTERS, DAP_SEQ_OP_END }, 3, 0 },
+        { { DAP_SEQ_OP_PINS, 0, 0, 0xFF, DAP_SEQ_OP_END }, 5, 0 },
+        /* Operands run off the end */
+        { { DAP_SEQ_OP_MOVI, 0, I32(1) }, 5, 0 },
+        /* Branch out of the program */
+        { { DAP_SEQ_OP_BEQ, 0, I32(0), 7 }, 7, 0 },
+        /* Falling off the end */
+        { { DAP_SEQ_OP_MOV, 0, 1 }, 3, 0 },
+    };
+
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        seq_connect(0);
+        seq_load(cases[i].program, cases[i].length);
+        seq_run(NULL, 0, 0);
+        CHECK_EQ(seq_status(), DAP_SEQ_ERR_PROGRAM);
+        CHECK_EQ(seq_pc(), cases[i].pc);
+        CHECK_EQ(seq_emitted(), 0);
+    }
+}
+
+static void test_bad_requests(void) {
+    const uint8_t load[] = { ID_DAP_Sequencer, DAP_SEQ_LOAD, 250, 10 };
+    const uint8_t run[] = { ID_DAP_Sequencer, DAP_SEQ_RUN, DAP_SEQ_REGISTERS + 1 };
+    const uint8_t clear[] = { ID_DAP_Sequencer, DAP_SEQ_CLEAR };
+    const uint8_t empty[] = { ID_DAP_Sequencer, DAP_SEQ_RUN, 0, 0, 0 };
+    const uint8_t unknown[] = { ID_DAP_Sequencer, 0x7F };
+    seq_connect(0);
+
+    CHECK_EQ(DAP_sequencer_vendor_command(load, seq_response), (4U << 16) | 2U);
+    CHECK_EQ(seq_response[1], DAP_ERROR);
+    seq_load(spin_program, sizeof(spin_program));
+    CHECK_EQ(DAP_sequencer_vendor_command(run, seq_response), (3U << 16) | 2U);
+    CHECK_EQ(seq_response[1], DAP_ERROR);
+    DAP_sequencer_vendor_command(clear, seq_response);
+    CHECK_EQ(DAP_sequencer_vendor_command(empty, seq_response), (3U << 16) | 2U);
+    CHECK_EQ(seq_response[1], DAP_ERROR);
+    CHECK_EQ(DAP_sequencer_vendor_command(unknown, seq_response), (2U << 16) | 2U);
+    CHECK_EQ(seq_response[1], DAP_ERROR);
+
+    /* Not connected */
+    const uint8_t disconnect[] = { ID_DAP_Disconnect };
+    seq_load(spin_program, sizeof(spin_program));
+    session_execute(disconnect);
+    seq_run(NULL, 0, 10);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_PORT);
+    CHECK_EQ(seq_steps(), 0);
+}
+
+static void test_emit_overflow(void) {
+    static const uint8_t program[] = {
+        /* 0 */ DAP_SEQ_OP_EMIT, 0,
+        /* 2 */ DAP_SEQ_OP_ADDI, 0, I32(1),
+        /* 8 */ DAP_SEQ_OP_BNE, 0, I32(100), 0,
+        /* 14 */ DAP_SEQ_OP_END,
+    };
+    seq_connect(0);
+    seq_load(program, sizeof(program));
+    seq_run(NULL, 0, 0);
+
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_EMIT);
+    CHECK_EQ(seq_emitted(), SEQ_EMIT_WORDS);
+    CHECK_EQ(seq_response_length, DAP_PACKET_SIZE);
+    CHECK_EQ(seq_word(SEQ_EMIT_WORDS - 1U), SEQ_EMIT_WORDS - 1U);
+}
+
+static void test_fail(void) {
+    static const uint8_t program[] = { DAP_SEQ_OP_FAIL, 0x42 };
+    seq_connect(0);
+    seq_load(program, sizeof(program));
+    seq_run(NULL, 0, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_FAIL);
+    CHECK_EQ(seq_detail(), 0x42);
+}
+
+static void test_wait_and_fault(void) {
+    const uint32_t params[2] = { 1, 0x30000000 };
+
+    /* A target that never stops answering WAIT */
+    seq_connect(1);
+    seq_load(dump_program, sizeof(dump_program));
+    seq_run(params, 2, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_TRANSFER);
+    CHECK_EQ(seq_detail(), DAP_TRANSFER_WAIT);
+    CHECK_EQ(seq_pc(), 0);
+    CHECK_EQ(fake_swd_wire, SESSION_RETRIES + 1U);
+
+    /* A read from nowhere FAULTs when RDBUFF collects it */
+    seq_connect(0);
+    seq_load(dump_program, sizeof(dump_program));
+    seq_run(params, 2, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_TRANSFER);
+    CHECK_EQ(seq_detail(), DAP_TRANSFER_FAULT);
+    CHECK_EQ(seq_pc(), 15);
+    CHECK_EQ(seq_emitted(), 0);
+
+    /* A write to flash only FAULTs on the RDBUFF check after the run */
+    static const uint8_t program[] = {
+        /*  0 */ DAP_SEQ_OP_WRITEI, DP_SELECT, I32(0),
+        /*  6 */ DAP_SEQ_OP_WRITEI, AP(AP_CSW), I32(CSW_WORD),
+        /* 12 */ DAP_SEQ_OP_WRITEI, AP(AP_TAR), I32(FAKE_SWD_FLASH_BASE),
+        /* 18 */ DAP_SEQ_OP_WRITEI, AP(AP_DRW), I32(0),
+        /* 24 */ DAP_SEQ_OP_END,
+    };
+    seq_connect(0);
+    seq_load(program, sizeof(program));
+    seq_run(NULL, 0, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_TRANSFER);
+    CHECK_EQ(seq_detail(), DAP_TRANSFER_FAULT);
+    CHECK_EQ(seq_pc(), 24);
+    CHECK(fake_swd.sticky);
+}
+
+static uint32_t polls;
+static uint32_t polls_before_abort;
+
+/* What a Transfer Abort coming in over USB does */
+static void poll_abort(void) {
+    if (++polls == polls_before_abort) {
+        DAP_TransferAbort = 1U;
+    }
+}
+
+static void test_abort(void) {
+    seq_connect(0);
+    seq_load(spin_program, sizeof(spin_program));
+
+    /* An abort that came while the run was queued still stops it */
+    DAP_TransferAbort = 1U;
+    seq_run(NULL, 0, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_ABORTED);
+    CHECK_EQ(seq_steps(), 0);
+
+    /* One that comes in while it runs */
+    DAP_TransferAbort = 0U;
+    fake_tick_step = 1;
+    polls = 0;
+    polls_before_abort = 3;
+    DAP_sequencer_register_poll_callback(poll_abort);
+    seq_run(NULL, 0, 0);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_ABORTED);
+    CHECK_EQ(polls, 3);
+    CHECK_EQ(seq_steps(), 2);
+
+    /* No poll while the clock stands still */
+    DAP_TransferAbort = 0U;
+    fake_tick_step = 0;
+    polls = 0;
+    seq_run(NULL, 0, 1000);
+    CHECK_EQ(seq_status(), DAP_SEQ_ERR_STEPS);
+    CHECK_EQ(polls, 0);
+}
+
+int main(void) {
+    test_dump();
+    test_halt_and_poll();
+    test_step_limit();
+    test_timeout();
+    test_bad_program();
+    test_bad_requests();
+    test_emit_overflow();
+    test_fail();
+    test_wait_and_fault();
+    test_abort();
+    return test_report("test_sequencer");
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CAN_STATS_AVAILABLE 1
+
+#include "test.h"
+#include "fake_can.h"
+#include "CAN/can_timing.c"
+#include "CAN/can_stats.c"
+#include "CAN/slcan.c"
+
+/* Everything the probe sent back for the last run() */
+static char reply[4096];
+
+/* Feed input in as the host would and collect the replies */
+static const char* run(const char* input) {
+    size_t len = strlen(input);
+    size_t reply_len = 0;
+    do {
+        size_t written = vcdc_host_write(input, len);
+        input += written;
+        len -= written;
+        while (slcan_app_update()) {
+            reply_len += vcdc_host_read(&reply[reply_len], sizeof(reply) - reply_len);
+        }
+        reply_len += vcdc_host_read(&reply[reply_len], sizeof(reply) - reply_len);
+    } while (len > 0);
+    return reply;
+}
+
+static CAN_Message make_frame(uint32_t id, CANFormat format, CANType type,
+                              uint8_t len, const char* data) {
+    CAN_Message msg = { .id = id, .len = len, .format = format, .type = type };
+    memcpy(msg.data, data, (type == CANData) ? len : 0);
+    return msg;
+}
+
+static void setup(void) {
+    fake_can_reset();
+    vcdc_reset();
+    slcan_app_setup(500000, MODE_RESET);
+    slcan_timestamping = false;
+    slcan_acceptance_code = 0x00000000;
+    slcan_acceptance_mask = 0xFFFFFFFF;
+    slcan_stats_interval_ms = 0;
+}
+
+static void test_config(void) {
+    setup();
+    CHECK_STR(run("S0\rS8\r"), "\r\r");
+    CHECK_STR(run("S9\rS\rS10\r"), "\a\a\a");
+    CHECK_STR(run("C\r"), "\a");
+
+    /* 100k: the same timing can_calc_bit_timing gives */
+    CHECK_STR(run("S3\rO\r"), "\r\r");
+    CHECK_EQ(fake_can_mode, MODE_NORMAL);
+    CHECK_EQ(can_bit_timing_bitrate(fake_can_clock, &fake_can_timing), 100000);
+
+    /* Only C works while the channel is open */
+    CHECK_STR(run("S6\rO\rZ1\rC\r"), "\a\a\a\r");
+    CHECK_EQ(fake_can_mode, MODE_RESET);
+    CHECK_STR(run("L\r"), "\r");
+    CHECK_EQ(fake_can_mode, MODE_SILENT);
+    CHECK_STR(run("C\rl\r"), "\r\r");
+    CHECK_EQ(fake_can_mode, MODE_TEST_SILENT);
+    CHECK_STR(run("C\r"), "\r");
+
+    /* SJA1000 BTR0/BTR1 for 125k, reproduced exactly at 48 MHz */
+    CHECK_STR(run("s031C\r"), "\r");
+    CHECK_EQ(slcan_timing.brp, 24);
+    CHECK_EQ(slcan_timing.ts1, 13);
+    CHECK_EQ(slcan_timing.ts2, 2);
+    CHECK_EQ(slcan_timing.sjw, 1);
+
+    /* ... and solved for at 36 MHz */
+    fake_can_clock = 36000000;
+    CHECK_STR(run("s031C\r"), "\r");
+    CHECK_EQ(can_bit_timing_bitrate(fake_can_clock, &slcan_timing), 125000);
+    fake_can_clock = 48000000;
+
+    /* Raw bxCAN timing */
+    CHECK_STR(run("s005D41\r"), "\r");
+    CHECK_EQ(slcan_timing.brp, 6);
+    CHECK_EQ(slcan_timing.ts1, 14);
+    CHECK_EQ(slcan_timing.ts2, 5);
+    CHECK_EQ(slcan_timing.sjw, 2);
+    CHECK_STR(run("s005D91\rs005D45\rs405D41\rs0\rs005G41\r"), "\a\a\a\a\a");
+
+    /* Acceptance filter, applied when opened */
+    CHECK_STR(run("M00000000\rm001FFFFF\r"), "\r\r");
+    CHECK_STR(run("O\rC\r"), "\r\r");
+    CHECK_EQ(fake_can_filters, 2);
+    CHECK_STR(run("M0000000\rm001FFFFFF\r"), "\a\a");
+}
+
+static void test_transmit(void) {
+    setup();
+
+    /* Nothing goes out until the channel is open, nor in silent mode */
+    CHECK_STR(run("t1230\r"), "\a");
+    CHECK_STR(run("L\rt1230\rC\r"), "\r\a\r");
+    CHECK_EQ(fake_can_tx_count, 0);
+
+    CHECK_STR(run("O\r"), "\r");
+    CHECK_STR(run("t7FF81122334455667788\r"), "z\r");
+    CHECK_STR(run("T1FFFFFFF0\r"), "Z\r");
+    CHECK_STR(run("r0003\r"), "z\r");
+    CHECK_STR(run("R0ABCDEF08\r"), "Z\r");
+    CHECK_STR(run("t1232aBcD\r"), "z\r");
+    CHECK_EQ(fake_can_tx_count, 5);
+
+    const CAN_Message* sent = fake_can_tx_log;
+    CHECK_EQ(sent[0].id, 0x7FF);
+    CHECK_EQ(sent[0].format, CANStandard);
+    CHECK_EQ(sent[0].type, CANData);
+    CHECK_EQ(sent[0].len, 8);
+    CHECK(memcmp(sent[0].data, "\x11\x22\x33\x44\x55\x66\x77\x88", 8) == 0);
+    CHECK_EQ(sent[1].id, 0x1FFFFFFF);
+    CHECK_EQ(sent[1].format, CANExtended);
+    CHECK_EQ(sent[1].len, 0);
+    CHECK_EQ(sent[2].id, 0x000);
+    CHECK_EQ(sent[2].type, CANRemote);
+    CHECK_EQ(sent[2].len, 3);
+    CHECK_EQ(sent[3].id, 0x0ABCDEF0);
+    CHECK_EQ(sent[3].format, CANExtended);
+    CHECK_EQ(sent[3].type, CANRemote);
+    CHECK_EQ(sent[3].len, 8);
+    CHECK_EQ(sent[4].len, 2);
+    CHECK(memcmp(sent[4].data, "\xAB\xCD", 2) == 0);
+
+    /* Malformed frames */
+    CHECK_STR(run("t123\rt1239\rt12311\rt1231222\rt12G0\rt1231GG\r"), "\a\a\a\a\a\a");
+    CHECK_STR(run("T1234567\rT123456780A\rr1239\rr12310\rR1234567819\r"), "\a\a\a\a\a");
+    CHECK_EQ(fake_can_tx_count, 5);
+}
+
+static void test_receive(void) {
+    setup();
+
+    /* Frames wait in the RX buffer while the channel is closed */
+    CAN_Message msg = make_frame(0x123, CANStandard, CANData, 2, "\x0A\xF1");
+    fake_can_receive(&msg);
+    CHECK_STR(run(""), "");
+
+    CHECK_STR(run("O\r"), "\rt1232" "0AF1\r");
+    msg = make_frame(0x1ABCDEF0, CANExtended, CANData, 8, "\x01\x23\x45\x67\x89\xAB\xCD\xEF");
+    fake_can_receive(&msg);
+    msg = make_frame(0x7FF, CANStandard, CANRemote, 4, "");
+    fake_can_receive(&msg);
+    msg = make_frame(0x00000001, CANExtended, CANRemote, 0, "");
+    fake_can_receive(&msg);
+    msg = make_frame(0x000, CANStandard, CANData, 0, "");
+    fake_can_receive(&msg);
+    CHECK_STR(run(""), "T1ABCDEF080123456789ABCDEF\rr7FF4\rR000000010\rt0000\r");
+    CHECK_STR(run("C\r"), "\r");
+}
+
+/* Timestamps count milliseconds since the channel opened, modulo 60s */
+static void test_timestamps(void) {
+    setup();
+    CHECK_STR(run("Z1\r"), "\r");
+    fake_can_now_us = 0xFFFFF000;
+    CHECK_STR(run("O\r"), "\r");
+
+    static const struct {
+        uint32_t advance_us;
+        const char* line;
+    } steps[] = {
+        { 1500, "t00000001\r" },
+        { 500, "t00000002\r" },
+        { 999, "t00000002\r" },
+        { 1, "t00000003\r" },
+        { 59997000, "t00000000\r" },
+        { 61234567, "t000004D2\r" },
+    };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        fake_can_now_us += steps[i].advance_us;
+        CAN_Message msg = make_frame(0x000, CANStandard, CANData, 0, "");
+        fake_can_receive(&msg);
+        CHECK_STR(run(""), steps[i].line);
+    }
+    CHECK_STR(run("C\rZ0\r"), "\r\r");
+}
+
+static void test_line_handling(void) {
+    setup();
+    CHECK_STR(run("O\r"), "\r");
+
+    /* Commands split across USB packets, with CR LF line ends */
+    CHECK_STR(run("t12"), "");
+    CHECK_STR(run("31AA"), "");
+    CHECK_STR(run("\r\nt1231BB\r\n\n"), "z\rz\r");
+    CHECK_STR(run("\nt1231CC\r"), "z\r");
+    CHECK_EQ(fake_can_tx_count, 3);
+    CHECK_EQ(fake_can_tx_log[2].data[0], 0xCC);
+
+    /* An overlong command is rejected once, however long it gets */
+    char line[200];
+    memset(line, '0', sizeof(line));
+    line[0] = 't';
+    line[sizeof(line) - 1] = '\0';
+    CHECK_STR(run(line), "");
+    CHECK_STR(run(line), "");
+    CHECK_STR(run("\rt1231DD\r"), "\az\r");
+    CHECK_EQ(fake_can_tx_count, 4);
+
+    /* Exactly the longest command still fits */
+    CHECK_STR(run("T1234567880011223344556677\r"), "Z\r");
+    CHECK_STR(run("V\rv\rN\r"), "V1111\rv11\rC254\r");
+    CHECK_STR(run("W1234\rW12\rX\r\r"), "\r\a\a\a");
+}
+
+/* A full CAN TX queue holds the command, and its reply, back */
+static void test_flow_control(void) {
+    setup();
+    CHECK_STR(run("O\r"), "\r");
+
+    fake_can_tx_full = true;
+    CHECK_STR(run("t1231AA\rV\r"), "");
+    CHECK_STR(run(""), "");
+    fake_can_tx_full = false;
+    CHECK_STR(run(""), "z\rV1111\r");
+    CHECK_EQ(fake_can_tx_count, 1);
+
+    /* Received frames wait for room in the VCDC TX buffer */
+    for (int i = 0; i < CAN_RX_BUFFER_SIZE; i++) {
+        CAN_Message msg = make_frame((uint32_t)i, CANExtended, CANData, 8, "ABCDEFGH");
+        CHECK(fake_can_receive(&msg));
+    }
+    CHECK(slcan_output_messages());
+    CHECK(!can_rx_buffer_empty());
+    CHECK(vcdc_send_buffer_space() < 1 + 8 + 1 + 16 + 1);
+    size_t total = vcdc_host_read(reply, sizeof(reply));
+    CHECK(slcan_output_messages());
+    total += vcdc_host_read(reply, sizeof(reply));
+    CHECK(can_rx_buffer_empty());
+    CHECK_EQ(total, CAN_RX_BUFFER_SIZE * (1 + 8 + 1 + 16 + 1));
+}
+
+static void test_status(void) {
+    setup();
+    CHECK_STR(run("F\r"), "F00\r");
+
+    fake_can_errors.fifo_overruns = 1;
+    fake_can_errors.bus_errors = 3;
+    fake_can_bus_state = CAN_BUS_ERROR_PASSIVE;
+    CHECK_STR(run("F\r"), "FAC\r");
+    CHECK_STR(run("F\r"), "F24\r");
+    CHECK_STR(run("e\r"), "e0000000100000000000000038000\r");
+
+    fake_can_bus_state = CAN_BUS_ERROR_ACTIVE;
+    fake_can_tx_full = true;
+    CHECK_STR(run("F\r"), "F02\r");
+    fake_can_tx_full = false;
+    CHECK_STR(run("F1\r"), "\a");
+}
+
+/* Statistics mode summarizes each interval instead of streaming */
+static void test_stats(void) {
+    setup();
+    CHECK_STR(run("S8\rO\rY0064\r"), "\r\r\r");
+    for (int i = 0; i < 10; i++) {
+        fake_can_now_us = (uint32_t)i * 10000;
+        CAN_Message msg = make_frame(0x123, CANStandard, CANData, 1, "\x42");
+        fake_can_receive(&msg);
+        CHECK_STR(run(""), "");
+    }
+    /* 55 bits per frame, 0.5% of 1 Mbit/s over 100ms */
+    fake_can_now_us = 100000;
+    CHECK_STR(run(""), "y1231" "0000000A" "00002710" "00002710" "00" "42\r"
+                       "u" "0005" "0000000A" "00000000\r");
+    CHECK_STR(run("Y0000\rC\r"), "\r\r");
+    CHECK_STR(run("Y000\r"), "\a");
+}
+
+/* Frames sent as commands come out of the parser bit for bit */
+static void test_round_trip(void) {
+    setup();
+    CHECK_STR(run("O\r"), "\r");
+    srand(1);
+
+    char line[64];
+    for (int i = 0; i < 5000; i++) {
+        CAN_Message msg = {
+            .format = (rand() & 1) ? CANExtended : CANStandard,
+            .type = (rand() % 4 == 0) ? CANRemote : CANData,
+            .len = (uint8_t)(rand() % 9),
+        };
+        msg.id = (uint32_t)rand() & ((msg.format == CANExtended) ? CAN_EXT_ID_MASK : CAN_STD_ID_MASK);
+        if (msg.type == CANData) {
+            for (int j = 0; j < msg.len; j++) {
+                msg.data[j] = (uint8_t)rand();
+            }
+        }
+
+        // What the probe would send for it must parse back to the same frame
+        size_t len = slcan_format_message(&msg, line);
+        CHECK_EQ(len, slcan_calc_message_length(&msg));
+        line[len] = '\0';
+
+        fake_can_tx_count = 0;
+        CHECK_STR(run(line), (msg.format == CANExtended) ? "Z\r" : "z\r");
+        CHECK_EQ(fake_can_tx_count, 1);
+        const CAN_Message* sent = &fake_can_tx_log[0];
+        CHECK(sent->id == msg.id && sent->format == msg.format
+              && sent->type == msg.type && sent->len == msg.len
+              && (msg.type == CANRemote || memcmp(sent->data, msg.data, msg.len) == 0));
+    }
+}
+
+int main(void) {
+    test_config();
+    test_transmit();
+    test_receive();
+    test_timestamps();
+    test_line_handling();
+    test_flow_control();
+    test_status();
+    test_stats();
+    test_round_trip();
+    return test_report("test_slcan");
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include "test.h"
+#include "swd_session.h"
+#include "DAP/CMSIS_DAP.c"
+#include "DAP/swd_shadow.c"
+
+#define SEEDS       40U
+#define COMMANDS    2000U
+
+static unsigned wait_seed;
+
+static void connect_plain(void) {
+    session_connect(0, 12, wait_seed);
+}
+
+static void connect_coalesce(void) {
+    session_connect(SWD_SHADOW_COALESCE, 12, wait_seed);
+}
+
+static bool coalesce_settled(void) {
+    return restore_pending == 0U;
+}
+
+static uint32_t session_coalesced(void) {
+    uint8_t request[2] = { ID_DAP_SWDShadow, SWD_SHADOW_READ_STATUS };
+    uint8_t response[16];
+    uint32_t runs;
+    SWD_shadow_vendor_command(request, response);
+    memcpy(&runs, &response[7], 4);
+    return runs;
+}
+
+/* Word accesses without auto-increment, the way the host sets them up */
+static void word_setup(uint32_t address) {
+    Packet packet;
+    transfer_begin(&packet);
+    transfer_add(&packet, REQ_DP_WRITE(DP_SELECT), 0);
+    transfer_add(&packet, REQ_AP_WRITE(AP_CSW), CSW_WORD);
+    transfer_add(&packet, REQ_AP_WRITE(AP_TAR), address);
+    session_send(&packet);
+}
+
+/* TAR write + DRW access pairs over count words from address */
+static void pairs_packet(Packet* packet, uint32_t address, uint32_t count, bool write) {
+    transfer_begin(packet);
+    for (uint32_t i = 0; i < count; i++) {
+        transfer_add(packet, REQ_AP_WRITE(AP_TAR), address + 4U * i);
+        if (write) {
+            transfer_add(packet, REQ_AP_WRITE(AP_DRW), 0x1000U + i);
+        } else {
+            transfer_add(packet, REQ_AP_READ(AP_DRW), 0);
+        }
+    }
+}
+
+static void test_read_run_coalesced(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_COALESCE, 0, 0);
+    for (uint32_t i = 0; i < 8; i++) {
+        fake_swd.ram[i] = 0x100U * i;
+    }
+    word_setup(FAKE_SWD_RAM_BASE);
+
+    pairs_packet(&packet, FAKE_SWD_RAM_BASE, 8, false);
+    uint32_t before = fake_swd_wire;
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+    CHECK_EQ(transfer_count(), 16);
+    for (uint32_t i = 0; i < 8; i++) {
+        CHECK_EQ(transfer_word(i), 0x100U * i);
+    }
+
+    /*
+     * CSW on, 8 posted DRW reads from where TAR already is and RDBUFF;
+     * 8 TAR writes and 8 DRW reads on top of one RDBUFF read without it.
+     * CSW and TAR wait for whatever the host does next.
+     */
+    CHECK_EQ(fake_swd_wire - before, 10);
+    CHECK_EQ(session_coalesced(), 1);
+    CHECK(!coalesce_settled());
+
+    transfer_begin(&packet);
+    transfer_add(&packet, REQ_AP_READ(AP_CSW), 0);
+    transfer_add(&packet, REQ_AP_READ(AP_TAR), 0);
+    transfer_add(&packet, REQ_DP_READ(DP_RDBUFF), 0);
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+    CHECK_EQ(transfer_word(0), CSW_WORD);
+    CHECK_EQ(transfer_word(1), FAKE_SWD_RAM_BASE + 28U);
+    CHECK(coalesce_settled());
+    CHECK_EQ(fake_swd.csw[0], CSW_WORD);
+}
+
+/*
+ * A host reading memory one full packet of pairs at a time: every
+ * packet after the first keeps auto-increment on, so it costs a DRW
+ * read per pair and one RDBUFF read.
+ */
+static void test_packets_keep_run(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_COALESCE, 0, 0);
+    for (uint32_t i = 0; i < 64; i++) {
+        fake_swd.ram[i] = 0x200U + i;
+    }
+    word_setup(FAKE_SWD_RAM_BASE);
+
+    /* Each pair takes a 5-byte TAR write and a 1-byte DRW read */
+    const uint32_t pairs = (DAP_PACKET_SIZE - 3U) / 6U;
+    uint32_t address = FAKE_SWD_RAM_BASE;
+    for (uint32_t n = 0; n < 4; n++) {
+        pairs_packet(&packet, address, pairs, false);
+        uint32_t before = fake_swd_wire;
+        session_send(&packet);
+        CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+        CHECK_EQ(transfer_count(), 2U * pairs);
+        for (uint32_t i = 0; i < pairs; i++) {
+            CHECK_EQ(transfer_word(i), 0x200U + (address - FAKE_SWD_RAM_BASE) / 4U + i);
+        }
+        /* Switching CSW on and back in every packet made this pairs + 5 */
+        CHECK_EQ(fake_swd_wire - before, pairs + (n == 0 ? 2U : 1U));
+        address += 4U * pairs;
+    }
+    CHECK_EQ(session_coalesced(), 4);
+
+    /* The host's own TAR write still ends the run */
+    word_setup(FAKE_SWD_RAM_BASE);
+    CHECK(coalesce_settled());
+    CHECK_EQ(fake_swd.csw[0], CSW_WORD);
+    CHECK_EQ(fake_swd.tar[0], FAKE_SWD_RAM_BASE);
+}
+
+static void test_short_run_left_alone(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_COALESCE, 0, 0);
+    word_setup(FAKE_SWD_RAM_BASE);
+
+    /* Write runs need more pairs to pay for the extra CSW writes */
+    pairs_packet(&packet, FAKE_SWD_RAM_BASE, COALESCE_MIN_WRITE_PAIRS - 1U, true);
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+    CHECK_EQ(session_coalesced(), 0);
+
+    pairs_packet(&packet, FAKE_SWD_RAM_BASE + 0x40U, COALESCE_MIN_WRITE_PAIRS, true);
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+    CHECK_EQ(session_coalesced(), 1);
+    for (uint32_t i = 0; i < COALESCE_MIN_WRITE_PAIRS; i++) {
+        CHECK_EQ(fake_swd.ram[0x10U + i], 0x1000U + i);
+    }
+}
+
+/* Auto-increment stops at the 1KB boundary; the TAR write there must go out */
+static void test_run_across_1k(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_COALESCE, 0, 0);
+    fake_swd.ram[254] = 0xAAAA0000;
+    fake_swd.ram[255] = 0xAAAA0001;
+    fake_swd.ram[256] = 0xBBBB0000;
+    fake_swd.ram[257] = 0xBBBB0001;
+    word_setup(FAKE_SWD_RAM_BASE);
+
+    pairs_packet(&packet, FAKE_SWD_RAM_BASE + 0x3F8U, 4, false);
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+    CHECK_EQ(transfer_word(0), 0xAAAA0000);
+    CHECK_EQ(transfer_word(1), 0xAAAA0001);
+    CHECK_EQ(transfer_word(2), 0xBBBB0000);
+    CHECK_EQ(transfer_word(3), 0xBBBB0001);
+    CHECK_EQ(session_coalesced(), 1);
+}
+
+/*
+ * A bus error in the middle of a run: the host gets its FAULT where it
+ * would have without coalescing, and after it clears the error, CSW
+ * must not have been left with auto-increment on.
+ */
+static void test_fault_in_run_restores_csw(void) {
+    Packet packet;
+    const uint8_t abort[] = { ID_DAP_WriteABORT, 0, ABORT_CLEAR_ALL, 0, 0, 0 };
+    for (uint8_t flags = 0; flags <= SWD_SHADOW_COALESCE; flags += SWD_SHADOW_COALESCE) {
+        session_connect(flags, 0, 0);
+        word_setup(FAKE_SWD_FLASH_BASE);
+
+        pairs_packet(&packet, FAKE_SWD_FLASH_BASE, COALESCE_MIN_WRITE_PAIRS, true);
+        session_send(&packet);
+        CHECK_EQ(transfer_status(), DAP_TRANSFER_FAULT);
+        CHECK_EQ(transfer_count(), 2);
+        CHECK_EQ(session_coalesced(), flags ? 1 : 0);
+
+        session_execute(abort);
+        transfer_begin(&packet);
+        transfer_add(&packet, REQ_AP_READ(AP_CSW), 0);
+        transfer_add(&packet, REQ_DP_READ(DP_RDBUFF), 0);
+        session_send(&packet);
+        CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+        CHECK_EQ(transfer_word(1), CSW_WORD);
+    }
+}
+
+static void test_sessions_match(void) {
+    uint64_t plain_wire = 0;
+    uint64_t coalesced_wire = 0;
+    uint32_t runs = 0;
+    session_settled = coalesce_settled;
+    for (unsigned seed = 1; seed <= SEEDS; seed++) {
+        uint32_t wire;
+        wait_seed = seed * 7919U;
+        SessionResult result = session_compare(seed, COMMANDS, connect_plain, connect_coalesce, &wire);
+        CHECK_EQ(result.mismatches, 0);
+        plain_wire += wire;
+        coalesced_wire += result.wire;
+        runs += session_coalesced();
+    }
+
+    CHECK(runs > SEEDS * 20);
+    CHECK(coalesced_wire < plain_wire);
+    printf("test_swd_coalesce: %llu wire transfers plain, %llu coalesced, %u runs\n",
+           (unsigned long long)plain_wire, (unsigned long long)coalesced_wire, runs);
+}
+
+int main(void) {
+    test_read_run_coalesced();
+    test_packets_keep_run();
+    test_short_run_left_alone();
+    test_run_across_1k();
+    test_fault_in_run_restores_csw();
+    test_sessions_match();
+    return test_report("test_swd_coalesce");
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2017, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include "test.h"
+#include "swd_session.h"
+#include "DAP/CMSIS_DAP.c"
+#include "DAP/swd_shadow.c"
+
+#define SEEDS       40U
+#define COMMANDS    2000U
+
+static unsigned wait_seed;
+
+static void connect_plain(void) {
+    session_connect(0, 12, wait_seed);
+}
+
+static void connect_elide(void) {
+    session_connect(SWD_SHADOW_ELIDE, 12, wait_seed);
+}
+
+/* Wire transfers taken by one request */
+static uint32_t wire_for(const Packet* packet) {
+    uint32_t before = fake_swd_wire;
+    session_send(packet);
+    return fake_swd_wire - before;
+}
+
+static void read_word_packet(Packet* packet, uint8_t ap, uint32_t address) {
+    transfer_begin(packet);
+    transfer_add(packet, REQ_DP_WRITE(DP_SELECT), (uint32_t)ap << 24);
+    transfer_add(packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+    transfer_add(packet, REQ_AP_WRITE(AP_TAR), address);
+    transfer_add(packet, REQ_AP_READ(AP_DRW), 0);
+}
+
+static void test_setup_writes_skipped(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_ELIDE, 0, 0);
+    fake_swd.ram[0] = 0x11111111;
+    fake_swd.ram[1] = 0x22222222;
+    fake_swd.ram[2] = 0x33333333;
+
+    /* SELECT, CSW, TAR, posted DRW read, RDBUFF */
+    read_word_packet(&packet, 0, FAKE_SWD_RAM_BASE);
+    CHECK_EQ(wire_for(&packet), 5);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_OK);
+    CHECK_EQ(transfer_word(0), 0x11111111);
+
+    /* Same SELECT and CSW; TAR has moved on, so it has to be written */
+    CHECK_EQ(wire_for(&packet), 3);
+    CHECK_EQ(transfer_word(0), 0x11111111);
+
+    /* Now TAR is where the host puts it as well */
+    read_word_packet(&packet, 0, FAKE_SWD_RAM_BASE + 4);
+    CHECK_EQ(wire_for(&packet), 2);
+    CHECK_EQ(transfer_word(0), 0x22222222);
+    CHECK_EQ(session_elided(), 5);
+
+    /* Without the shadow every write goes out */
+    session_connect(0, 0, 0);
+    read_word_packet(&packet, 0, FAKE_SWD_RAM_BASE);
+    CHECK_EQ(wire_for(&packet), 5);
+    CHECK_EQ(wire_for(&packet), 5);
+    CHECK_EQ(session_elided(), 0);
+}
+
+static void test_tar_prediction_stops_at_1k(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_ELIDE, 0, 0);
+    fake_swd.ram[255] = 0xAAAAAAAA;
+    fake_swd.ram[256] = 0xBBBBBBBB;
+
+    read_word_packet(&packet, 0, FAKE_SWD_RAM_BASE + 0x3FC);
+    session_send(&packet);
+    CHECK_EQ(transfer_word(0), 0xAAAAAAAA);
+
+    /* The simulated TAR wrapped back to 0x000; the write must go out */
+    read_word_packet(&packet, 0, FAKE_SWD_RAM_BASE + 0x400);
+    CHECK_EQ(wire_for(&packet), 3);
+    CHECK_EQ(transfer_word(0), 0xBBBBBBBB);
+}
+
+static void test_ap_change_drops_ap_shadows(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_ELIDE, 0, 0);
+    fake_swd.ram[0] = 0x12345678;
+    fake_swd.ap1_ram[0] = 0x87654321;
+
+    read_word_packet(&packet, 0, FAKE_SWD_RAM_BASE);
+    session_send(&packet);
+
+    /* CSW and TAR of AP 1 are unknown, whatever AP 0 holds */
+    read_word_packet(&packet, 1, FAKE_SWD_AP1_RAM_BASE);
+    CHECK_EQ(wire_for(&packet), 5);
+    CHECK_EQ(transfer_word(0), 0x87654321);
+    CHECK_EQ(fake_swd.csw[1], CSW_WORD_INC);
+
+    /* A bank switch on the same AP keeps them */
+    transfer_begin(&packet);
+    transfer_add(&packet, REQ_DP_WRITE(DP_SELECT), 0x01000010);
+    transfer_add(&packet, REQ_DP_WRITE(DP_SELECT), 0x01000000);
+    transfer_add(&packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+    CHECK_EQ(wire_for(&packet), 3);
+}
+
+static void test_fault_keeps_select_and_csw(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_ELIDE, 0, 0);
+
+    /* A read from nowhere: the posted read is fine, RDBUFF FAULTs */
+    read_word_packet(&packet, 0, 0x30000000);
+    session_send(&packet);
+    CHECK_EQ(transfer_status(), DAP_TRANSFER_FAULT);
+    CHECK_EQ(transfer_count(), 4);
+    CHECK(fake_swd.sticky);
+
+    const uint8_t abort[] = { ID_DAP_WriteABORT, 0, ABORT_CLEAR_ALL, 0, 0, 0 };
+    session_execute(abort);
+    CHECK(!fake_swd.sticky);
+
+    /* TAR is anyone's guess after the FAULT; SELECT and CSW are not */
+    read_word_packet(&packet, 0, 0x30000004);
+    CHECK_EQ(wire_for(&packet), 3);
+    CHECK_EQ(fake_swd.tar[0], 0x30000008);
+}
+
+static void test_line_reset_drops_shadows(void) {
+    Packet packet;
+    session_connect(SWD_SHADOW_ELIDE, 0, 0);
+    fake_swd.ap1_ram[3] = 0xCAFEF00D;
+
+    read_word_packet(&packet, 1, FAKE_SWD_AP1_RAM_BASE + 8);
+    session_send(&packet);
+
+    /* The reset sets the simulated SELECT back to AP 0 */
+    const uint8_t reset[] = { ID_DAP_SWJ_Sequence, 51, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    session_execute(reset);
+    read_word_packet(&packet, 1, FAKE_SWD_AP1_RAM_BASE + 12);
+    CHECK_EQ(wire_for(&packet), 5);
+    CHECK_EQ(transfer_word(0), 0xCAFEF00D);
+}
+
+/*
+ * A DRW write to flash fails without a FAULT of its own. The CSW write
+ * after it would have reported it; once that is skipped, the CTRL/STAT
+ * read or the ABORT must not go out before RDBUFF has been checked, and
+ * the FAULT is still reported on the CSW write.
+ */
+static void test_skipped_write_reports_posted_error(void) {
+    static const uint8_t exempt[] = { REQ_DP_READ(DP_CTRL_STAT), REQ_DP_WRITE(DP_ABORT) };
+    for (uint32_t i = 0; i < 2; i++) {
+        for (uint8_t flags = 0; flags <= SWD_SHADOW_ELIDE; flags++) {
+            Packet packet;
+            session_connect(flags, 0, 0);
+            transfer_begin(&packet);
+            transfer_add(&packet, REQ_DP_WRITE(DP_SELECT), 0);
+            transfer_add(&packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+            transfer_add(&packet, REQ_AP_WRITE(AP_TAR), FAKE_SWD_FLASH_BASE);
+            transfer_add(&packet, REQ_AP_WRITE(AP_DRW), 0);
+            transfer_add(&packet, REQ_AP_WRITE(AP_CSW), CSW_WORD_INC);
+            transfer_add(&packet, exempt[i], ABORT_CLEAR_ALL);
+            session_send(&packet);
+
+            CHECK_EQ(transfer_status(), DAP_TRANSFER_FAULT);
+            CHECK_EQ(transfer_count(), 4);
+            CHECK_EQ(session_response_length, 3);
+            CHECK(fake_swd.sticky);
+        }
+    }
+}
+
+static void test_sessions_match(void) {
+    uint64_t plain_wire = 0;
+    uint64_t elided_wire = 0;
+    uint32_t faults = 0;
+    for (unsigned seed = 1; seed <= SEEDS; seed++) {
+        uint32_t wire;
+        wait_seed = seed * 7919U;
+        SessionResult result = session_compare(seed, COMMANDS, connect_plain, connect_elide, &wire);
+        CHECK_EQ(result.mismatches, 0);
+        CHECK(result.wire < wire);
+        plain_wire += wire;
+        elided_wire += result.wire;
+        faults += result.faults;
+    }
+
+    /* The sessions run into errors often enough, and still save a good deal */
+    CHECK(faults > SEEDS * 50);
+    CHECK(elided_wire * 100 < plain_wire * 90);
+    printf("test_swd_shadow: %llu wire transfers plain, %llu with elision, %u faults\n",
+           (unsigned long long)plain_wire, (unsigned long long)elided_wire, faults);
+}
+
+int main(void) {
+    test_setup_writes_skipped();
+    test_tar_prediction_stops_at_1k();
+    test_ap_change_drops_ap_shadows();
+    test_fault_keeps_select_and_csw();
+    test_line_reset_drops_shadows();
+    test_skipped_write_reports_posted_error();
+    test_sessions_match();
+    return test_report("test_swd_shadow");
+}